@@ -0,0 +1,19 @@
+; Tight arithmetic loop, register to register ADD, AND and NOT
+        .ORIG x3000
+        LD R5, OUTER
+OLOOP   LD R4, INNER
+ILOOP   ADD R0, R0, R4
+        AND R1, R0, #15
+        NOT R2, R1
+        ADD R3, R2, R0
+        ADD R4, R4, #-1
+        BRp ILOOP
+        ADD R5, R5, #-1
+        BRp OLOOP
+        LEA R0, DONE
+        PUTS
+        HALT
+OUTER   .FILL #500
+INNER   .FILL #4000
+DONE    .STRINGZ "arith done\n"
+        .END
@@ -0,0 +1,22 @@
+; Keyboard polling loop, reads KBSR until a key arrives or the polls run out
+        .ORIG x3000
+        LD R3, ROUNDS
+OUTER   LD R1, POLLS
+POLL    LDI R2, KBSR
+        BRn KEY
+        ADD R1, R1, #-1
+        BRp POLL
+        ADD R3, R3, #-1
+        BRp OUTER
+        LEA R0, NOKEY
+        PUTS
+        HALT
+KEY     LDI R0, KBDR
+        OUT
+        HALT
+ROUNDS  .FILL #250
+POLLS   .FILL #10000
+KBSR    .FILL xFE00
+KBDR    .FILL xFE02
+NOKEY   .STRINGZ "kbpoll done\n"
+        .END
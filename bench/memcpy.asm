@@ -0,0 +1,44 @@
+; Memory copy of a block with LDR and STR, the block is filled once and
+; copied back and forth, the last copy is checked
+        .ORIG x3000
+        LD R0, SRC
+        LD R2, SIZE
+FILL    STR R2, R0, #0
+        ADD R0, R0, #1
+        ADD R2, R2, #-1
+        BRp FILL
+        LD R5, ROUNDS
+ROUND   LD R0, SRC
+        LD R1, DST
+        LD R2, SIZE
+COPY    LDR R3, R0, #0
+        STR R3, R1, #0
+        ADD R0, R0, #1
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp COPY
+        LD R0, DST
+        LD R1, SRC
+        ST R0, SRC
+        ST R1, DST
+        ADD R5, R5, #-1
+        BRp ROUND
+        LDI R3, SRC
+        LD R4, SIZE
+        NOT R4, R4
+        ADD R4, R4, #1
+        ADD R3, R3, R4
+        BRnp BAD
+        LEA R0, OK
+        PUTS
+        HALT
+BAD     LEA R0, WRONG
+        PUTS
+        HALT
+SRC     .FILL x4000
+DST     .FILL x6000
+SIZE    .FILL #4096
+ROUNDS  .FILL #400
+OK      .STRINGZ "memcpy ok\n"
+WRONG   .STRINGZ "memcpy wrong result\n"
+        .END
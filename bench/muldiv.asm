@@ -0,0 +1,85 @@
+; Software multiply (shift and add) and divide (shift and subtract)
+; Every round adds a * 7 / 13 for a = ITER..1 and checks the sum
+        .ORIG x3000
+        LD R2, ROUNDS
+        ST R2, RLEFT
+ROUND   AND R2, R2, #0
+        ST R2, SUM
+        LD R2, ITER
+        ST R2, LEFT
+LOOP    LD R1, LEFT
+        LD R2, FACTOR
+        JSR MUL
+        ADD R1, R0, #0
+        LD R2, DIVISOR
+        JSR DIV
+        LD R2, SUM
+        ADD R2, R2, R0
+        ST R2, SUM
+        LD R2, LEFT
+        ADD R2, R2, #-1
+        ST R2, LEFT
+        BRp LOOP
+        LD R2, RLEFT
+        ADD R2, R2, #-1
+        ST R2, RLEFT
+        BRp ROUND
+        LD R1, SUM
+        LD R2, EXPECT
+        NOT R2, R2
+        ADD R2, R2, #1
+        ADD R1, R1, R2
+        BRnp BAD
+        LEA R0, OK
+        PUTS
+        HALT
+BAD     LEA R0, WRONG
+        PUTS
+        HALT
+
+; R0 = R1 * R2, uses R3-R5
+MUL     AND R0, R0, #0
+        ADD R3, R1, #0
+        AND R4, R4, #0
+        ADD R4, R4, #1
+MLOOP   AND R5, R2, R4
+        BRz MSKIP
+        ADD R0, R0, R3
+MSKIP   ADD R3, R3, R3
+        ADD R4, R4, R4
+        BRnp MLOOP
+        RET
+
+; R0 = R1 / R2, R1 = R1 % R2, operands below x4000, uses R3-R6
+DIV     AND R0, R0, #0
+        AND R3, R3, #0
+        NOT R4, R2
+        ADD R4, R4, #1
+        LD R5, BITS
+DLOOP   ADD R3, R3, R3
+        ADD R1, R1, #0
+        BRzp DBIT
+        ADD R3, R3, #1
+DBIT    ADD R1, R1, R1
+        ADD R0, R0, R0
+        ADD R6, R3, R4
+        BRn DNEXT
+        ADD R3, R6, #0
+        ADD R0, R0, #1
+DNEXT   ADD R5, R5, #-1
+        BRp DLOOP
+        ADD R1, R3, #0
+        RET
+
+ROUNDS  .FILL #20
+ITER    .FILL #2000
+FACTOR  .FILL #7
+DIVISOR .FILL #13
+BITS    .FILL #16
+EXPECT  .FILL x6D3A
+RLEFT   .FILL #0
+LEFT    .FILL #0
+SUM     .FILL #0
+OK      .STRINGZ "muldiv ok\n"
+WRONG   .STRINGZ "muldiv wrong result\n"
+        .END
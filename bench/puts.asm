@@ -0,0 +1,48 @@
+; String output with PUTS and PUTSP, one line of each per iteration
+        .ORIG x3000
+        LD R5, LINES
+LOOP    LEA R0, TEXT
+        PUTS
+        LEA R0, PACKED
+        PUTSP
+        ADD R5, R5, #-1
+        BRp LOOP
+        HALT
+LINES   .FILL #20000
+TEXT    .STRINGZ "The quick brown fox jumps over the lazy dog, 0123456789 ABCDEFG\n"
+; Same line, two characters per word
+PACKED
+        .FILL x6854
+        .FILL x2065
+        .FILL x7571
+        .FILL x6369
+        .FILL x206B
+        .FILL x7262
+        .FILL x776F
+        .FILL x206E
+        .FILL x6F66
+        .FILL x2078
+        .FILL x756A
+        .FILL x706D
+        .FILL x2073
+        .FILL x766F
+        .FILL x7265
+        .FILL x7420
+        .FILL x6568
+        .FILL x6C20
+        .FILL x7A61
+        .FILL x2079
+        .FILL x6F64
+        .FILL x2C67
+        .FILL x3020
+        .FILL x3231
+        .FILL x3433
+        .FILL x3635
+        .FILL x3837
+        .FILL x2039
+        .FILL x4241
+        .FILL x4443
+        .FILL x4645
+        .FILL x0A47
+        .FILL x0000
+        .END
@@ -0,0 +1,48 @@
+; Recursive fibonacci with JSR/RET and a stack in memory
+        .ORIG x3000
+        LD R6, STACK
+        LD R5, ROUNDS
+ROUND   LD R1, N
+        JSR FIB
+        ADD R5, R5, #-1
+        BRp ROUND
+        LD R2, EXPECT
+        NOT R2, R2
+        ADD R2, R2, #1
+        ADD R0, R0, R2
+        BRnp BAD
+        LEA R0, OK
+        PUTS
+        HALT
+BAD     LEA R0, WRONG
+        PUTS
+        HALT
+
+; R0 = fib(R1), keeps R1-R6
+FIB     ADD R6, R6, #-3
+        STR R7, R6, #0
+        STR R1, R6, #1
+        STR R2, R6, #2
+        ADD R2, R1, #-2
+        BRzp FREC
+        ADD R0, R1, #0
+        BRnzp FRET
+FREC    ADD R1, R1, #-1
+        JSR FIB
+        ADD R2, R0, #0
+        ADD R1, R1, #-1
+        JSR FIB
+        ADD R0, R0, R2
+FRET    LDR R2, R6, #2
+        LDR R1, R6, #1
+        LDR R7, R6, #0
+        ADD R6, R6, #3
+        RET
+
+STACK   .FILL xFDFF
+ROUNDS  .FILL #3
+N       .FILL #24
+EXPECT  .FILL #46368
+OK      .STRINGZ "recursion ok\n"
+WRONG   .STRINGZ "recursion wrong result\n"
+        .END
@@ -0,0 +1,1008 @@
+#include "assembler.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "defs.h"
+#include "log.h"
+#include "utils.h"
+
+/**
+ * @brief Max tokens in a line, label, mnemonic and three operands
+ * 
+ */
+#define ASM_MAX_TOKENS 6
+
+/**
+ * @brief Operands taken by every mnemonic
+ * 
+ */
+typedef enum
+{
+    ASM_ARITH,     // DR, SR1, SR2 or imm5
+    ASM_NOT,       // DR, SR
+    ASM_PCOFFSET9, // R, label
+    ASM_BASE,      // R, BaseR, offset6
+    ASM_BRANCH,    // label
+    ASM_BASER,     // BaseR
+    ASM_JSR,       // label
+    ASM_TRAP,      // trapvect8
+    ASM_NONE       // no operands
+} Lc3AsmFormats_e;
+
+/**
+ * @brief Map between a mnemonic, their base encoding and their operands
+ * 
+ */
+typedef struct LC3AsmMnemonic_t
+{
+    const char *name;
+    uint16_t word;
+    uint8_t format;
+} LC3AsmMnemonic_t;
+
+static const LC3AsmMnemonic_t LC3AsmMnemonics[] =
+    {
+        {"ADD", 0x1000, ASM_ARITH},
+        {"AND", 0x5000, ASM_ARITH},
+        {"NOT", 0x903F, ASM_NOT},
+        {"LD", 0x2000, ASM_PCOFFSET9},
+        {"LDI", 0xA000, ASM_PCOFFSET9},
+        {"LEA", 0xE000, ASM_PCOFFSET9},
+        {"ST", 0x3000, ASM_PCOFFSET9},
+        {"STI", 0xB000, ASM_PCOFFSET9},
+        {"LDR", 0x6000, ASM_BASE},
+        {"STR", 0x7000, ASM_BASE},
+        {"BR", 0x0E00, ASM_BRANCH},
+        {"BRN", 0x0800, ASM_BRANCH},
+        {"BRZ", 0x0400, ASM_BRANCH},
+        {"BRP", 0x0200, ASM_BRANCH},
+        {"BRNZ", 0x0C00, ASM_BRANCH},
+        {"BRNP", 0x0A00, ASM_BRANCH},
+        {"BRZP", 0x0600, ASM_BRANCH},
+        {"BRNZP", 0x0E00, ASM_BRANCH},
+        {"JMP", 0xC000, ASM_BASER},
+        {"RET", 0xC1C0, ASM_NONE},
+        {"JSR", 0x4800, ASM_JSR},
+        {"JSRR", 0x4000, ASM_BASER},
+        {"RTI", 0x8000, ASM_NONE},
+        {"TRAP", 0xF000, ASM_TRAP},
+        {"GETC", 0xF000 | TRAP_GETC, ASM_NONE},
+        {"OUT", 0xF000 | TRAP_OUT, ASM_NONE},
+        {"PUTS", 0xF000 | TRAP_PUTS, ASM_NONE},
+        {"IN", 0xF000 | TRAP_IN, ASM_NONE},
+        {"PUTSP", 0xF000 | TRAP_PUTSP, ASM_NONE},
+        {"HALT", 0xF000 | TRAP_HALT, ASM_NONE}};
+
+#define ASM_MNEMONIC_COUNT (sizeof(LC3AsmMnemonics) / sizeof(LC3AsmMnemonics[0]))
+
+static const char *LC3AsmDirectives[] = {".ORIG", ".FILL", ".BLKW", ".STRINGZ", ".END"};
+
+#define ASM_DIRECTIVE_COUNT (sizeof(LC3AsmDirectives) / sizeof(LC3AsmDirectives[0]))
+
+/**
+ * @brief Progress of a pass over the source
+ * 
+ */
+typedef struct LC3AsmPass_t
+{
+    /**
+     * @brief 1 or 2, the first pass defines the labels and the second one
+     * writes the words
+     * 
+     */
+    uint8_t pass;
+    /**
+     * @brief source line being assembled
+     * 
+     */
+    uint32_t line;
+    /**
+     * @brief address of the next word, wider than an address to catch overflows
+     * 
+     */
+    uint32_t pc;
+    uint16_t orig;
+    uint8_t started;
+    uint8_t ended;
+    LC3Firmware_t *firmware;
+} LC3AsmPass_t;
+
+/**
+ * @brief Keeps the first error of the assembly
+ * 
+ * @param as assembler state
+ * @param line source line of the error
+ * @param format printf format of the message
+ * @param ... format arguments
+ * @return uint8_t EXIT_FAILURE
+ */
+static uint8_t LC3AsmError(LC3Asm_t *as, uint32_t line, const char *format, ...)
+{
+    if (!as->errorLine)
+    {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(as->error, sizeof(as->error), format, args);
+        va_end(args);
+        as->errorLine = line;
+    }
+    return EXIT_FAILURE;
+}
+
+/**
+ * @brief Searches a mnemonic, case insensitive
+ * 
+ * @param name token
+ * @return const LC3AsmMnemonic_t* NULL if it's not a mnemonic
+ */
+static const LC3AsmMnemonic_t *LC3AsmFindMnemonic(const char *name)
+{
+    for (uint32_t i = 0; i < ASM_MNEMONIC_COUNT; i++)
+    {
+        if (strcasecmp(LC3AsmMnemonics[i].name, name) == 0)
+        {
+            return &LC3AsmMnemonics[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Searches a directive, case insensitive
+ * 
+ * @param name token
+ * @return int index in LC3AsmDirectives, -1 if it's not a directive
+ */
+static int LC3AsmFindDirective(const char *name)
+{
+    for (uint32_t i = 0; i < ASM_DIRECTIVE_COUNT; i++)
+    {
+        if (strcasecmp(LC3AsmDirectives[i], name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Parses a register R0-R7
+ * 
+ * @param token operand
+ * @return int register, -1 if it's not a register
+ */
+static int LC3AsmRegister(const char *token)
+{
+    if ((token[0] == 'R' || token[0] == 'r') && token[1] >= '0' && token[1] <= '7' && !token[2])
+    {
+        return token[1] - '0';
+    }
+    return -1;
+}
+
+/**
+ * @brief Parses a number, #decimal, xhex, 0xhex or a plain decimal
+ * 
+ * @param token operand
+ * @param value output value
+ * @return uint8_t EXIT_FAILURE if it's not a number
+ */
+static uint8_t LC3AsmNumber(const char *token, int32_t *value)
+{
+    int base = 10;
+    if (token[0] == '#')
+    {
+        token++;
+    }
+    else if (token[0] == 'x' || token[0] == 'X')
+    {
+        token++;
+        base = 16;
+    }
+    else if (token[0] == '0' && (token[1] == 'x' || token[1] == 'X'))
+    {
+        token += 2;
+        base = 16;
+    }
+    else if (!isdigit((unsigned char)token[0]) && token[0] != '-')
+    {
+        return EXIT_FAILURE;
+    }
+    if (!*token)
+    {
+        return EXIT_FAILURE;
+    }
+    char *end;
+    long parsed = strtol(token, &end, base);
+    if (*end || parsed < INT16_MIN || parsed > UINT16_MAX)
+    {
+        return EXIT_FAILURE;
+    }
+    *value = parsed;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Checks the name of a label, letters, digits and underscores not
+ * starting by a digit, and not a register name
+ * 
+ * @param token label
+ * @return uint8_t 1 if it's valid
+ */
+static uint8_t LC3AsmIsLabel(const char *token)
+{
+    if (!isalpha((unsigned char)token[0]) && token[0] != '_')
+    {
+        return 0;
+    }
+    if (strlen(token) >= ASM_MAX_LABEL || LC3AsmRegister(token) >= 0)
+    {
+        return 0;
+    }
+    for (const char *c = token; *c; c++)
+    {
+        if (!isalnum((unsigned char)*c) && *c != '_')
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Splits a line in tokens, separated by spaces or commas. Strings keep
+ * their quotes and everything after a ';' is a comment.
+ * 
+ * @param as assembler state
+ * @param p pass in progress
+ * @param text line, modified to terminate the tokens
+ * @param tokens output tokens
+ * @param count output count of tokens
+ * @return uint8_t EXIT_FAILURE if the line has too many tokens or an
+ * unterminated string
+ */
+static uint8_t LC3AsmTokenize(LC3Asm_t *as, const LC3AsmPass_t *p, char *text, char **tokens, uint8_t *count)
+{
+    *count = 0;
+    char *c = text;
+    while (1)
+    {
+        while (*c == ' ' || *c == '\t' || *c == ',' || *c == '\r')
+        {
+            c++;
+        }
+        if (!*c || *c == ';')
+        {
+            return EXIT_SUCCESS;
+        }
+        if (*count == ASM_MAX_TOKENS)
+        {
+            return LC3AsmError(as, p->line, "too many operands");
+        }
+        tokens[(*count)++] = c;
+        if (*c == '"')
+        {
+            for (c++; *c && *c != '"'; c++)
+            {
+                if (*c == '\\' && c[1])
+                {
+                    c++;
+                }
+            }
+            if (!*c)
+            {
+                return LC3AsmError(as, p->line, "unterminated string");
+            }
+            c++;
+        }
+        else
+        {
+            while (*c && *c != ' ' && *c != '\t' && *c != ',' && *c != ';' && *c != '\r')
+            {
+                c++;
+            }
+        }
+        if (*c == ';')
+        {
+            *c = '\0';
+            return EXIT_SUCCESS;
+        }
+        if (*c)
+        {
+            *c++ = '\0';
+        }
+    }
+}
+
+/**
+ * @brief Decodes the escapes of a string token in place
+ * 
+ * @param token string with their quotes
+ * @return size_t length of the decoded string
+ */
+static size_t LC3AsmString(char *token)
+{
+    size_t length = 0;
+    for (char *c = token + 1; *c != '"'; c++)
+    {
+        if (*c == '\\')
+        {
+            c++;
+            switch (*c)
+            {
+            case 'n':
+                token[length++] = '\n';
+                break;
+            case 't':
+                token[length++] = '\t';
+                break;
+            case 'r':
+                token[length++] = '\r';
+                break;
+            case '0':
+                token[length++] = '\0';
+                break;
+            default:
+                token[length++] = *c;
+                break;
+            }
+        }
+        else
+        {
+            token[length++] = *c;
+        }
+    }
+    return length;
+}
+
+/**
+ * @brief Adds a label in the first pass
+ * 
+ * @param as assembler state
+ * @param p pass in progress
+ * @param name label
+ * @return uint8_t EXIT_FAILURE if there is no memory
+ */
+static uint8_t LC3AsmDefine(LC3Asm_t *as, const LC3AsmPass_t *p, const char *name)
+{
+    if (as->symbolCount == as->symbolCapacity)
+    {
+        uint32_t capacity = as->symbolCapacity ? as->symbolCapacity * 2U : 64U;
+        LC3AsmSymbol_t *symbols = realloc(as->symbols, capacity * sizeof(LC3AsmSymbol_t));
+        if (!symbols)
+        {
+            return LC3AsmError(as, p->line, "out of memory");
+        }
+        as->symbols = symbols;
+        as->symbolCapacity = capacity;
+    }
+    LC3AsmSymbol_t *symbol = &as->symbols[as->symbolCount++];
+    strcpy(symbol->name, name);
+    symbol->addr = p->pc;
+    symbol->line = p->line;
+    return EXIT_SUCCESS;
+}
+
+static int LC3AsmCompareSymbols(const void *a, const void *b)
+{
+    const LC3AsmSymbol_t *sa = *(const LC3AsmSymbol_t *const *)a;
+    const LC3AsmSymbol_t *sb = *(const LC3AsmSymbol_t *const *)b;
+    int order = strcmp(sa->name, sb->name);
+    return order ? order : (int)sa->line - (int)sb->line;
+}
+
+static int LC3AsmCompareName(const void *key, const void *element)
+{
+    return strcmp(key, (*(const LC3AsmSymbol_t *const *)element)->name);
+}
+
+/**
+ * @brief Sorts the symbols by name after the first pass
+ * 
+ * @param as assembler state
+ * @return uint8_t EXIT_FAILURE if a label is defined twice
+ */
+static uint8_t LC3AsmSortSymbols(LC3Asm_t *as)
+{
+    as->sorted = malloc((as->symbolCount ? as->symbolCount : 1U) * sizeof(*as->sorted));
+    if (!as->sorted)
+    {
+        return LC3AsmError(as, 0, "out of memory");
+    }
+    for (uint32_t i = 0; i < as->symbolCount; i++)
+    {
+        as->sorted[i] = &as->symbols[i];
+    }
+    qsort(as->sorted, as->symbolCount, sizeof(*as->sorted), LC3AsmCompareSymbols);
+    for (uint32_t i = 1; i < as->symbolCount; i++)
+    {
+        if (strcmp(as->sorted[i - 1]->name, as->sorted[i]->name) == 0)
+        {
+            return LC3AsmError(as, as->sorted[i]->line, "label %s already defined at line %u", as->sorted[i]->name,
+                               as->sorted[i - 1]->line);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Resolves a PC relative operand, a label or a number
+ * 
+ * @param as assembler state
+ * @param p pass in progress
+ * @param token operand
+ * @param bits width of the field
+ * @param field output field, masked to their width
+ * @return uint8_t EXIT_FAILURE if the label doesn't exist or is out of range
+ */
+static uint8_t LC3AsmOffset(LC3Asm_t *as, const LC3AsmPass_t *p, const char *token, uint8_t bits, uint16_t *field)
+{
+    int32_t value;
+    if (LC3AsmNumber(token, &value))
+    {
+        const LC3AsmSymbol_t *symbol = LC3AsmFindSymbol(as, token);
+        if (!symbol)
+        {
+            return LC3AsmError(as, p->line, "undefined label %s", token);
+        }
+        value = (int32_t)symbol->addr - (int32_t)(p->pc + 1U);
+    }
+    if (value < -(1 << (bits - 1)) || value >= (1 << (bits - 1)))
+    {
+        return LC3AsmError(as, p->line, "%s is out of range of a %u bits offset", token, bits);
+    }
+    *field = (uint16_t)value & ((1U << bits) - 1U);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Parses a signed immediate
+ * 
+ * @param as assembler state
+ * @param p pass in progress
+ * @param token operand
+ * @param bits width of the field
+ * @param field output field, masked to their width
+ * @return uint8_t EXIT_FAILURE if it's not a number or is out of range
+ */
+static uint8_t LC3AsmImmediate(LC3Asm_t *as, const LC3AsmPass_t *p, const char *token, uint8_t bits, uint16_t *field)
+{
+    int32_t value;
+    if (LC3AsmNumber(token, &value) || value < -(1 << (bits - 1)) || value >= (1 << (bits - 1)))
+    {
+        return LC3AsmError(as, p->line, "%s is not a %u bits immediate", token, bits);
+    }
+    *field = (uint16_t)value & ((1U << bits) - 1U);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Parses a register operand
+ * 
+ * @param as assembler state
+ * @param p pass in progress
+ * @param token operand
+ * @param shift position of the field
+ * @param field output field, already shifted
+ * @return uint8_t EXIT_FAILURE if it's not a register
+ */
+static uint8_t LC3AsmRegisterField(LC3Asm_t *as, const LC3AsmPass_t *p, const char *token, uint8_t shift,
+                                   uint16_t *field)
+{
+    int reg = LC3AsmRegister(token);
+    if (reg < 0)
+    {
+        return LC3AsmError(as, p->line, "%s is not a register", token);
+    }
+    *field = reg << shift;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reserves words, and writes them in the second pass
+ * 
+ * @param as assembler state
+ * @param p pass in progress
+ * @param words count of words
+ * @param data words to write, NULL for zeros
+ * @return uint8_t EXIT_FAILURE if the program doesn't fit in memory
+ */
+static uint8_t LC3AsmEmit(LC3Asm_t *as, LC3AsmPass_t *p, uint32_t words, const uint16_t *data)
+{
+    // Same limit as the objfile loader, the last word of memory is never loaded
+    if (p->pc + words > UINT16_MAX)
+    {
+        return LC3AsmError(as, p->line, "program doesn't fit in memory");
+    }
+    if (p->pass == 2)
+    {
+        for (uint32_t i = 0; i < words; i++)
+        {
+            uint16_t addr = p->pc + i;
+            if (LC3MemoryWrite(&p->firmware->memory, addr, data ? data[i] : 0))
+            {
+                return LC3AsmError(as, p->line, "out of memory");
+            }
+            LC3DecodedInst_t *decoded = p->firmware->decoded[addr >> MEMORY_PAGE_SHIFT];
+            if (decoded)
+            {
+                decoded[addr & MEMORY_PAGE_MASK].action = NULL;
+            }
+        }
+    }
+    p->pc += words;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Encodes an instruction, only called in the second pass
+ * 
+ * @param as assembler state
+ * @param p pass in progress
+ * @param mnemonic instruction
+ * @param operands operand tokens
+ * @param count count of operands
+ * @param word output instruction word
+ * @return uint8_t EXIT_FAILURE if the operands are not valid
+ */
+static uint8_t LC3AsmEncode(LC3Asm_t *as, const LC3AsmPass_t *p, const LC3AsmMnemonic_t *mnemonic, char **operands,
+                            uint8_t count, uint16_t *word)
+{
+    static const uint8_t expected[] = {[ASM_ARITH] = 3, [ASM_NOT] = 2, [ASM_PCOFFSET9] = 2, [ASM_BASE] = 3,
+                                       [ASM_BRANCH] = 1, [ASM_BASER] = 1, [ASM_JSR] = 1, [ASM_TRAP] = 1,
+                                       [ASM_NONE] = 0};
+    uint16_t a = 0, b = 0, c = 0;
+    if (count != expected[mnemonic->format])
+    {
+        return LC3AsmError(as, p->line, "%s takes %u operands", mnemonic->name, expected[mnemonic->format]);
+    }
+    switch (mnemonic->format)
+    {
+    case ASM_ARITH:
+        if (LC3AsmRegisterField(as, p, operands[0], 9U, &a) || LC3AsmRegisterField(as, p, operands[1], 6U, &b))
+        {
+            return EXIT_FAILURE;
+        }
+        if (LC3AsmRegister(operands[2]) >= 0)
+        {
+            c = LC3AsmRegister(operands[2]);
+        }
+        else if (LC3AsmImmediate(as, p, operands[2], 5U, &c))
+        {
+            return EXIT_FAILURE;
+        }
+        else
+        {
+            c |= 1U << 5;
+        }
+        break;
+    case ASM_NOT:
+        if (LC3AsmRegisterField(as, p, operands[0], 9U, &a) || LC3AsmRegisterField(as, p, operands[1], 6U, &b))
+        {
+            return EXIT_FAILURE;
+        }
+        break;
+    case ASM_PCOFFSET9:
+        if (LC3AsmRegisterField(as, p, operands[0], 9U, &a) || LC3AsmOffset(as, p, operands[1], 9U, &b))
+        {
+            return EXIT_FAILURE;
+        }
+        break;
+    case ASM_BASE:
+        if (LC3AsmRegisterField(as, p, operands[0], 9U, &a) || LC3AsmRegisterField(as, p, operands[1], 6U, &b) ||
+            LC3AsmImmediate(as, p, operands[2], 6U, &c))
+        {
+            return EXIT_FAILURE;
+        }
+        break;
+    case ASM_BRANCH:
+        if (LC3AsmOffset(as, p, operands[0], 9U, &a))
+        {
+            return EXIT_FAILURE;
+        }
+        break;
+    case ASM_BASER:
+        if (LC3AsmRegisterField(as, p, operands[0], 6U, &a))
+        {
+            return EXIT_FAILURE;
+        }
+        break;
+    case ASM_JSR:
+        if (LC3AsmOffset(as, p, operands[0], 11U, &a))
+        {
+            return EXIT_FAILURE;
+        }
+        break;
+    case ASM_TRAP:
+    {
+        int32_t vector;
+        if (LC3AsmNumber(operands[0], &vector) || vector < 0 || vector > UINT8_MAX)
+        {
+            return LC3AsmError(as, p->line, "%s is not a trap vector", operands[0]);
+        }
+        a = vector;
+        break;
+    }
+    }
+    *word = mnemonic->word | a | b | c;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Assembles a directive
+ * 
+ * @param as assembler state
+ * @param p pass in progress
+ * @param directive index in LC3AsmDirectives
+ * @param operands operand tokens
+ * @param count count of operands
+ * @return uint8_t EXIT_FAILURE if the directive is not valid
+ */
+static uint8_t LC3AsmDirective(LC3Asm_t *as, LC3AsmPass_t *p, int directive, char **operands, uint8_t count)
+{
+    const char *name = LC3AsmDirectives[directive];
+    int32_t value;
+    if (strcmp(name, ".END") == 0)
+    {
+        p->ended = 1;
+        return EXIT_SUCCESS;
+    }
+    if (count != 1)
+    {
+        return LC3AsmError(as, p->line, "%s takes 1 operand", name);
+    }
+    if (strcmp(name, ".ORIG") == 0)
+    {
+        if (p->started)
+        {
+            return LC3AsmError(as, p->line, "only one .ORIG is supported");
+        }
+        if (LC3AsmNumber(operands[0], &value) || value < 0)
+        {
+            return LC3AsmError(as, p->line, "%s is not an address", operands[0]);
+        }
+        p->started = 1;
+        p->orig = value;
+        p->pc = value;
+        return EXIT_SUCCESS;
+    }
+    if (strcmp(name, ".FILL") == 0)
+    {
+        uint16_t word = 0;
+        if (p->pass == 2 && LC3AsmNumber(operands[0], &value))
+        {
+            const LC3AsmSymbol_t *symbol = LC3AsmFindSymbol(as, operands[0]);
+            if (!symbol)
+            {
+                return LC3AsmError(as, p->line, "undefined label %s", operands[0]);
+            }
+            value = symbol->addr;
+        }
+        word = value;
+        return LC3AsmEmit(as, p, 1U, &word);
+    }
+    if (strcmp(name, ".BLKW") == 0)
+    {
+        if (LC3AsmNumber(operands[0], &value) || value <= 0)
+        {
+            return LC3AsmError(as, p->line, "%s is not a count of words", operands[0]);
+        }
+        return LC3AsmEmit(as, p, value, NULL);
+    }
+    // .STRINGZ
+    if (operands[0][0] != '"')
+    {
+        return LC3AsmError(as, p->line, "%s is not a string", operands[0]);
+    }
+    size_t length = LC3AsmString(operands[0]);
+    uint16_t words[ASM_MAX_LINE];
+    for (size_t i = 0; i < length; i++)
+    {
+        words[i] = (uint8_t)operands[0][i];
+    }
+    words[length] = 0;
+    return LC3AsmEmit(as, p, length + 1U, words);
+}
+
+/**
+ * @brief Assembles a line
+ * 
+ * @param as assembler state
+ * @param p pass in progress
+ * @param text line, modified by the tokenizer
+ * @return uint8_t EXIT_FAILURE if the line has errors
+ */
+static uint8_t LC3AsmLine(LC3Asm_t *as, LC3AsmPass_t *p, char *text)
+{
+    char *tokens[ASM_MAX_TOKENS];
+    uint8_t count;
+    if (LC3AsmTokenize(as, p, text, tokens, &count) || !count)
+    {
+        return as->errorLine ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    uint8_t first = 0;
+    const LC3AsmMnemonic_t *mnemonic = LC3AsmFindMnemonic(tokens[0]);
+    int directive = mnemonic ? -1 : LC3AsmFindDirective(tokens[0]);
+    if (!mnemonic && directive < 0)
+    {
+        if (!LC3AsmIsLabel(tokens[0]))
+        {
+            return LC3AsmError(as, p->line, "%s is not a valid label or instruction", tokens[0]);
+        }
+        if (!p->started)
+        {
+            return LC3AsmError(as, p->line, "label %s before .ORIG", tokens[0]);
+        }
+        if (p->pass == 1 && LC3AsmDefine(as, p, tokens[0]))
+        {
+            return EXIT_FAILURE;
+        }
+        if (count == 1)
+        {
+            return EXIT_SUCCESS;
+        }
+        first = 1;
+        mnemonic = LC3AsmFindMnemonic(tokens[1]);
+        directive = mnemonic ? -1 : LC3AsmFindDirective(tokens[1]);
+        if (!mnemonic && directive < 0)
+        {
+            return LC3AsmError(as, p->line, "%s is not an instruction", tokens[1]);
+        }
+    }
+    char **operands = &tokens[first + 1];
+    uint8_t operandCount = count - first - 1;
+    if (directive >= 0)
+    {
+        if (!p->started && strcasecmp(LC3AsmDirectives[directive], ".ORIG") != 0)
+        {
+            return LC3AsmError(as, p->line, "%s before .ORIG", tokens[first]);
+        }
+        return LC3AsmDirective(as, p, directive, operands, operandCount);
+    }
+    if (!p->started)
+    {
+        return LC3AsmError(as, p->line, "instruction before .ORIG");
+    }
+    uint16_t word = 0;
+    if (p->pass == 2 && LC3AsmEncode(as, p, mnemonic, operands, operandCount, &word))
+    {
+        return EXIT_FAILURE;
+    }
+    return LC3AsmEmit(as, p, 1U, &word);
+}
+
+/**
+ * @brief Runs a pass over the whole source
+ * 
+ * @param as assembler state
+ * @param p pass, with their number and firmware set
+ * @param source text of the program
+ * @param length length of the source in bytes
+ * @return uint8_t EXIT_FAILURE if a line has errors
+ */
+static uint8_t LC3AsmPass(LC3Asm_t *as, LC3AsmPass_t *p, const char *source, size_t length)
+{
+    char text[ASM_MAX_LINE];
+    size_t offset = 0;
+    while (offset < length && !p->ended)
+    {
+        const char *start = source + offset;
+        const char *newline = memchr(start, '\n', length - offset);
+        size_t lineLength = newline ? (size_t)(newline - start) : length - offset;
+        offset += lineLength + 1U;
+        p->line++;
+        if (lineLength >= ASM_MAX_LINE)
+        {
+            return LC3AsmError(as, p->line, "line longer than %u characters", ASM_MAX_LINE - 1U);
+        }
+        memcpy(text, start, lineLength);
+        text[lineLength] = '\0';
+        if (LC3AsmLine(as, p, text))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    if (!p->started)
+    {
+        return LC3AsmError(as, p->line, "missing .ORIG");
+    }
+    return EXIT_SUCCESS;
+}
+
+uint8_t LC3AsmAssemble(LC3Asm_t *as, const char *source, size_t length, LC3Firmware_t *firmware)
+{
+    memset(as, 0, sizeof(*as));
+    LC3AsmPass_t p = {1U, 0, 0, 0, 0, 0, firmware};
+    if (LC3AsmPass(as, &p, source, length) || LC3AsmSortSymbols(as))
+    {
+        return EXIT_FAILURE;
+    }
+    p = (LC3AsmPass_t){2U, 0, 0, 0, 0, 0, firmware};
+    if (LC3AsmPass(as, &p, source, length))
+    {
+        return EXIT_FAILURE;
+    }
+    firmware->memOrig = p.orig;
+    firmware->size = p.pc - p.orig;
+    LOG_LN("Assembled %u words at 0x%04X, %u labels", firmware->size, firmware->memOrig, as->symbolCount);
+    return EXIT_SUCCESS;
+}
+
+uint8_t LC3AsmAssembleFile(LC3Asm_t *as, const char *filename, LC3Firmware_t *firmware)
+{
+    memset(as, 0, sizeof(*as));
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        return LC3AsmError(as, 0, "can't open %s", filename);
+    }
+    char *source = NULL;
+    long length = -1;
+    if (fseek(f, 0, SEEK_END) == 0)
+    {
+        length = ftell(f);
+    }
+    if (length >= 0 && fseek(f, 0, SEEK_SET) == 0)
+    {
+        source = malloc(length + 1);
+    }
+    if (!source || fread(source, 1U, length, f) != (size_t)length)
+    {
+        free(source);
+        fclose(f);
+        return LC3AsmError(as, 0, "can't read %s", filename);
+    }
+    fclose(f);
+    LOG_LN("Assembling %s", filename);
+    firmware->filename = filename;
+    uint8_t status = LC3AsmAssemble(as, source, length, firmware);
+    free(source);
+    return status;
+}
+
+uint8_t LC3AsmWriteObj(const LC3Firmware_t *firmware, const char *filename)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+    {
+        return EXIT_FAILURE;
+    }
+    uint8_t ok = putc(firmware->memOrig >> 8, f) != EOF && putc(firmware->memOrig & 0xFF, f) != EOF;
+    for (uint32_t i = 0; ok && i < firmware->size; i++)
+    {
+        uint16_t word = MEMORY_READ(&firmware->memory, firmware->memOrig + i);
+        ok = putc(word >> 8, f) != EOF && putc(word & 0xFF, f) != EOF;
+    }
+    return (fclose(f) == 0 && ok) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+uint8_t LC3AsmWriteSym(const LC3Asm_t *as, const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    if (!f)
+    {
+        return EXIT_FAILURE;
+    }
+    fprintf(f, "// Symbol table\n");
+    fprintf(f, "// Scope level 0:\n");
+    fprintf(f, "//\tSymbol Name       Page Address\n");
+    fprintf(f, "//\t----------------  ------------\n");
+    for (uint32_t i = 0; i < as->symbolCount; i++)
+    {
+        fprintf(f, "//\t%-16s  %04X\n", as->symbols[i].name, as->symbols[i].addr);
+    }
+    fprintf(f, "\n");
+    return fclose(f) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+const LC3AsmSymbol_t *LC3AsmFindSymbol(const LC3Asm_t *as, const char *name)
+{
+    if (!as->sorted)
+    {
+        return NULL;
+    }
+    const LC3AsmSymbol_t **found = bsearch(name, as->sorted, as->symbolCount, sizeof(*as->sorted), LC3AsmCompareName);
+    return found ? *found : NULL;
+}
+
+void LC3AsmDisassemble(uint16_t pc, uint16_t word, char *text, size_t size)
+{
+    static const char *traps[] = {"GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT"};
+    uint16_t dr = (word >> 9) & 0x7;
+    uint16_t sr1 = (word >> 6) & 0x7;
+    uint16_t target9 = pc + 1U + sign_extend(word & 0x1FF, 9U);
+    int16_t offset6 = (int16_t)sign_extend(word & 0x3F, 6U);
+    switch (word >> 12)
+    {
+    case OP_BR:
+        if (!(word & 0x0E00))
+        {
+            snprintf(text, size, "NOP");
+            break;
+        }
+        snprintf(text, size, "BR%s%s%s x%04X", (word & 0x0800) ? "n" : "", (word & 0x0400) ? "z" : "",
+                 (word & 0x0200) ? "p" : "", target9);
+        break;
+    case OP_ADD:
+    case OP_AND:
+        if (word & 0x20)
+        {
+            snprintf(text, size, "%s R%u, R%u, #%d", (word >> 12) == OP_ADD ? "ADD" : "AND", dr, sr1,
+                     (int16_t)sign_extend(word & 0x1F, 5U));
+        }
+        else
+        {
+            snprintf(text, size, "%s R%u, R%u, R%u", (word >> 12) == OP_ADD ? "ADD" : "AND", dr, sr1, word & 0x7);
+        }
+        break;
+    case OP_LD:
+    case OP_ST:
+    case OP_LDI:
+    case OP_STI:
+    case OP_LEA:
+    {
+        const char *name = (word >> 12) == OP_LD ? "LD" : (word >> 12) == OP_ST ? "ST"
+                         : (word >> 12) == OP_LDI ? "LDI" : (word >> 12) == OP_STI ? "STI" : "LEA";
+        snprintf(text, size, "%s R%u, x%04X", name, dr, target9);
+        break;
+    }
+    case OP_LDR:
+    case OP_STR:
+        snprintf(text, size, "%s R%u, R%u, #%d", (word >> 12) == OP_LDR ? "LDR" : "STR", dr, sr1, offset6);
+        break;
+    case OP_JSR:
+        if (word & 0x0800)
+        {
+            snprintf(text, size, "JSR x%04X", (uint16_t)(pc + 1U + sign_extend(word & 0x7FF, 11U)));
+        }
+        else
+        {
+            snprintf(text, size, "JSRR R%u", sr1);
+        }
+        break;
+    case OP_NOT:
+        snprintf(text, size, "NOT R%u, R%u", dr, sr1);
+        break;
+    case OP_JMP:
+        if (sr1 == REG_R7)
+        {
+            snprintf(text, size, "RET");
+        }
+        else
+        {
+            snprintf(text, size, "JMP R%u", sr1);
+        }
+        break;
+    case OP_RTI:
+        snprintf(text, size, "RTI");
+        break;
+    case OP_TRAP:
+        if ((word & 0xFF) >= TRAP_GETC && (word & 0xFF) <= TRAP_HALT)
+        {
+            snprintf(text, size, "%s", traps[(word & 0xFF) - TRAP_GETC]);
+        }
+        else
+        {
+            snprintf(text, size, "TRAP x%02X", word & 0xFF);
+        }
+        break;
+    default:
+        snprintf(text, size, ".FILL x%04X", word);
+        break;
+    }
+}
+
+void LC3AsmFree(LC3Asm_t *as)
+{
+    free(as->symbols);
+    free(as->sorted);
+    as->symbols = NULL;
+    as->sorted = NULL;
+    as->symbolCount = 0;
+    as->symbolCapacity = 0;
+}
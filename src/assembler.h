@@ -0,0 +1,146 @@
+/**
+ * @file assembler.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief LC3 assembler, assembles source straight into a firmware so
+ * generated programs can run without writing an objfile. Supports labels,
+ * every instruction and trap alias, and the .ORIG, .FILL, .BLKW, .STRINGZ and
+ * .END directives, one .ORIG per program like the objfiles.
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__ASSEMBLER_H__)
+#define __ASSEMBLER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "firmware.h"
+
+/**
+ * @brief Max length of a label and of a source line
+ * 
+ */
+#define ASM_MAX_LABEL 64
+#define ASM_MAX_LINE 512
+
+/**
+ * @brief Extensions of the files written by the assembler
+ * 
+ */
+#define ASM_OBJ_EXT ".obj"
+#define ASM_SYM_EXT ".sym"
+
+/**
+ * @brief Label and the address where it's defined
+ * 
+ */
+typedef struct LC3AsmSymbol_t
+{
+    char name[ASM_MAX_LABEL];
+    uint16_t addr;
+    /**
+     * @brief source line of the definition
+     * 
+     */
+    uint32_t line;
+} LC3AsmSymbol_t;
+
+/**
+ * @brief State of an assembly, keeps the symbols and the first error
+ * 
+ */
+typedef struct LC3Asm_t
+{
+    /**
+     * @brief symbols in definition order
+     * 
+     */
+    LC3AsmSymbol_t *symbols;
+    uint32_t symbolCount;
+    uint32_t symbolCapacity;
+    /**
+     * @brief symbols sorted by name, built after the first pass
+     * 
+     */
+    const LC3AsmSymbol_t **sorted;
+    /**
+     * @brief source line of the first error, 0 if there is no error
+     * 
+     */
+    uint32_t errorLine;
+    char error[128];
+} LC3Asm_t;
+
+/**
+ * @brief Assembles a source into the memory of a firmware, on success the
+ * firmware is ready to be run like a loaded objfile
+ * 
+ * @param as assembler state, initialized here and released with LC3AsmFree
+ * @param source text of the program
+ * @param length length of the source in bytes
+ * @param firmware firmware that receives the program
+ * @return uint8_t EXIT_FAILURE if the source has errors, see errorLine and error
+ */
+uint8_t LC3AsmAssemble(LC3Asm_t *as, const char *source, size_t length, LC3Firmware_t *firmware);
+
+/**
+ * @brief Assembles a source file into the memory of a firmware
+ * 
+ * @param as assembler state, initialized here and released with LC3AsmFree
+ * @param filename path/filename of the source
+ * @param firmware firmware that receives the program
+ * @return uint8_t EXIT_FAILURE if the file can't be read or has errors
+ */
+uint8_t LC3AsmAssembleFile(LC3Asm_t *as, const char *filename, LC3Firmware_t *firmware);
+
+/**
+ * @brief Writes the program of a firmware as an objfile, big endian words
+ * starting with the origin
+ * 
+ * @param firmware firmware with a program
+ * @param filename path/filename of the objfile
+ * @return uint8_t EXIT_FAILURE if the file can't be written
+ */
+uint8_t LC3AsmWriteObj(const LC3Firmware_t *firmware, const char *filename);
+
+/**
+ * @brief Writes the symbol table in the format of the LC3 tools
+ * 
+ * @param as assembler state of a successful assembly
+ * @param filename path/filename of the symbol file
+ * @return uint8_t EXIT_FAILURE if the file can't be written
+ */
+uint8_t LC3AsmWriteSym(const LC3Asm_t *as, const char *filename);
+
+/**
+ * @brief Searches a symbol by name
+ * 
+ * @param as assembler state of a successful assembly
+ * @param name label to search
+ * @return const LC3AsmSymbol_t* NULL if it's not defined
+ */
+const LC3AsmSymbol_t *LC3AsmFindSymbol(const LC3Asm_t *as, const char *name);
+
+/**
+ * @brief Writes an instruction word as source, used to show the code of a
+ * memory range. Words that are not instructions are written as .FILL
+ * 
+ * @param pc address of the word, the targets of PC relative operands are
+ * shown as addresses
+ * @param word instruction word
+ * @param text output text
+ * @param size size of text
+ */
+void LC3AsmDisassemble(uint16_t pc, uint16_t word, char *text, size_t size);
+
+/**
+ * @brief Releases the symbols
+ * 
+ * @param as assembler state
+ */
+void LC3AsmFree(LC3Asm_t *as);
+
+#endif  // __ASSEMBLER_H__
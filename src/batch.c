@@ -0,0 +1,531 @@
+#include "batch.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lanes.h"
+#include "log.h"
+
+/**
+ * @brief Double ended queue of group indexes owned by a worker, the owner
+ * works on the tail and thieves on the head
+ * 
+ */
+typedef struct LC3BatchQueue_t
+{
+    pthread_mutex_t lock;
+    uint32_t *items;
+    uint32_t head;
+    uint32_t tail;
+} LC3BatchQueue_t;
+
+/**
+ * @brief Program loaded once and shared by the vms of every job that runs
+ * it, the vms only own the pages they write
+ * 
+ */
+typedef struct LC3BatchImage_t
+{
+    LC3Firmware_t firmware;
+    /**
+     * @brief EXIT_FAILURE if the objfile can't be loaded
+     * 
+     */
+    uint8_t status;
+} LC3BatchImage_t;
+
+/**
+ * @brief State shared by the workers
+ * 
+ */
+typedef struct LC3BatchPool_t
+{
+    LC3BatchJob_t *jobs;
+    LC3BatchQueue_t *queues;
+    uint32_t workers;
+    const LC3VmOptions_t *options;
+    /**
+     * @brief image of every job, jobs with the same objfile share it
+     * 
+     */
+    LC3BatchImage_t **images;
+    /**
+     * @brief jobs in the order they are grouped, the jobs of a group are
+     * consecutive
+     * 
+     */
+    uint32_t *order;
+    /**
+     * @brief first entry of order of every group, followed by the end of
+     * the last group. The queues hold groups.
+     * 
+     */
+    uint32_t *groups;
+} LC3BatchPool_t;
+
+/**
+ * @brief Files and vm of a job while it runs
+ * 
+ */
+typedef struct LC3BatchRunning_t
+{
+    FILE *in;
+    FILE *out;
+    LC3Vm_t *vm;
+} LC3BatchRunning_t;
+
+/**
+ * @brief Arguments of a worker thread
+ * 
+ */
+typedef struct LC3BatchWorker_t
+{
+    LC3BatchPool_t *pool;
+    uint32_t id;
+    pthread_t thread;
+} LC3BatchWorker_t;
+
+uint32_t LC3BatchDefaultWorkers()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (uint32_t)cores : 1U;
+}
+
+/**
+ * @brief Takes the newest group of the queue
+ * 
+ * @param q queue owned by the caller
+ * @param job output group index
+ * @return uint8_t 1 if a group was taken
+ */
+static uint8_t LC3BatchPop(LC3BatchQueue_t *q, uint32_t *job)
+{
+    uint8_t found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->head != q->tail)
+    {
+        *job = q->items[--q->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+/**
+ * @brief Takes the oldest group of the queue
+ * 
+ * @param q queue of other worker
+ * @param job output group index
+ * @return uint8_t 1 if a group was taken
+ */
+static uint8_t LC3BatchSteal(LC3BatchQueue_t *q, uint32_t *job)
+{
+    uint8_t found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->head != q->tail)
+    {
+        *job = q->items[q->head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+/**
+ * @brief Reads the whole content of a stream into a NUL terminated buffer
+ * 
+ * @param f stream to read, from the start
+ * @param size output bytes read
+ * @return char* buffer, NULL if there is no memory
+ */
+static char *LC3BatchReadAll(FILE *f, size_t *size)
+{
+    long length;
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buffer = malloc(length > 0 ? length + 1 : 1);
+    if (!buffer)
+    {
+        *size = 0;
+        return NULL;
+    }
+    *size = length > 0 ? fread(buffer, 1U, length, f) : 0;
+    buffer[*size] = '\0';
+    return buffer;
+}
+
+/**
+ * @brief Opens the files of a job and creates their vm
+ * 
+ * @param pool worker pool
+ * @param job job to start
+ * @param running output files and vm, the vm is NULL if it can't be created
+ */
+static void LC3BatchStartJob(LC3BatchPool_t *pool, LC3BatchJob_t *job, LC3BatchRunning_t *running)
+{
+    running->in = job->infile ? fopen(job->infile, "rb") : tmpfile();
+    running->out = tmpfile();
+    running->vm = NULL;
+    job->status = EXIT_FAILURE;
+    const LC3BatchImage_t *image = pool->images[job - pool->jobs];
+    if (running->in && running->out && !image->status)
+    {
+        running->vm = LC3VmCreateFromImage(&image->firmware, running->in, running->out, pool->options);
+    }
+}
+
+/**
+ * @brief Releases the vm of a job, collects their output and closes their
+ * files
+ * 
+ * @param job job that ran
+ * @param running files and vm from LC3BatchStartJob
+ */
+static void LC3BatchEndJob(LC3BatchJob_t *job, LC3BatchRunning_t *running)
+{
+    if (running->vm)
+    {
+        LC3VmDestroy(running->vm);
+        job->status = EXIT_SUCCESS;
+        fflush(running->out);
+        job->output = LC3BatchReadAll(running->out, &job->outputSize);
+    }
+    if (running->in)
+    {
+        fclose(running->in);
+    }
+    if (running->out)
+    {
+        fclose(running->out);
+    }
+}
+
+/**
+ * @brief Runs the jobs of a group, a single job with the engine of the
+ * options and bigger groups in lockstep
+ * 
+ * @param pool worker pool
+ * @param group group to run
+ * @param worker worker that runs it
+ */
+static void LC3BatchRunGroup(LC3BatchPool_t *pool, uint32_t group, uint32_t worker)
+{
+    LC3BatchRunning_t running[LANES_MAX];
+    LC3Vm_t *vms[LANES_MAX];
+    uint32_t first = pool->groups[group];
+    uint32_t size = pool->groups[group + 1U] - first;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        LC3BatchJob_t *job = &pool->jobs[pool->order[first + i]];
+        job->worker = worker;
+        LC3BatchStartJob(pool, job, &running[i]);
+        if (running[i].vm)
+        {
+            vms[count++] = running[i].vm;
+        }
+    }
+    if (count == 1U)
+    {
+        LC3VmRun(vms[0]);
+    }
+    else if (count)
+    {
+        LC3LanesRun(vms, count);
+    }
+    for (uint32_t i = 0; i < size; i++)
+    {
+        LC3BatchEndJob(&pool->jobs[pool->order[first + i]], &running[i]);
+    }
+}
+
+/**
+ * @brief Worker thread, runs until no queue has jobs left. All the jobs are
+ * queued before the workers start, so empty queues stay empty.
+ * 
+ * @param arg LC3BatchWorker_t of the thread
+ * @return void* NULL
+ */
+static void *LC3BatchWorker(void *arg)
+{
+    LC3BatchWorker_t *worker = arg;
+    LC3BatchPool_t *pool = worker->pool;
+    uint32_t group;
+
+    fileout = NULL;  // Jobs don't write the log
+    while (1)
+    {
+        uint8_t found = LC3BatchPop(&pool->queues[worker->id], &group);
+        for (uint32_t i = 1; !found && i < pool->workers; i++)
+        {
+            found = LC3BatchSteal(&pool->queues[(worker->id + i) % pool->workers], &group);
+        }
+        if (!found)
+        {
+            break;
+        }
+        LC3BatchRunGroup(pool, group, worker->id);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Releases the images once no vm uses them
+ * 
+ * @param pool worker pool
+ * @param images images from LC3BatchLoadImages, can be NULL
+ * @param count count of images
+ */
+static void LC3BatchReleaseImages(LC3BatchPool_t *pool, LC3BatchImage_t *images, uint32_t count)
+{
+    for (uint32_t i = 0; images && i < count; i++)
+    {
+        releaseFirmware(&images[i].firmware);
+    }
+    free(images);
+    free(pool->images);
+    free(pool->order);
+    pool->images = NULL;
+    pool->order = NULL;
+}
+
+static int LC3BatchCompareJobs(const void *a, const void *b)
+{
+    const LC3BatchJob_t *ja = *(LC3BatchJob_t *const *)a;
+    const LC3BatchJob_t *jb = *(LC3BatchJob_t *const *)b;
+    return strcmp(ja->objfile, jb->objfile);
+}
+
+/**
+ * @brief Loads every objfile once, sorted so the jobs of an objfile are
+ * together
+ * 
+ * @param pool worker pool, receives the images and the jobs sorted by
+ * objfile in order
+ * @param count count of jobs
+ * @param images output count of images
+ * @return LC3BatchImage_t* images, NULL if there is no memory for them
+ */
+static LC3BatchImage_t *LC3BatchLoadImages(LC3BatchPool_t *pool, uint32_t count, uint32_t *images)
+{
+    LC3BatchJob_t **sorted = malloc((count ? count : 1U) * sizeof(LC3BatchJob_t *));
+    pool->images = calloc(count ? count : 1U, sizeof(LC3BatchImage_t *));
+    pool->order = malloc((count ? count : 1U) * sizeof(uint32_t));
+    LC3BatchImage_t *loaded = NULL;
+    *images = 0;
+    if (sorted && pool->images && pool->order)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            sorted[i] = &pool->jobs[i];
+        }
+        qsort(sorted, count, sizeof(LC3BatchJob_t *), LC3BatchCompareJobs);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            *images += (i == 0 || strcmp(sorted[i - 1]->objfile, sorted[i]->objfile) != 0);
+        }
+        loaded = calloc(*images ? *images : 1U, sizeof(LC3BatchImage_t));
+    }
+    if (!loaded)
+    {
+        free(sorted);
+        free(pool->images);
+        free(pool->order);
+        pool->images = NULL;
+        pool->order = NULL;
+        return NULL;
+    }
+    LC3BatchImage_t *image = NULL;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (i == 0 || strcmp(sorted[i - 1]->objfile, sorted[i]->objfile) != 0)
+        {
+            image = image ? image + 1 : loaded;
+            initFirmware(&image->firmware);
+            image->status = LC3VmLoad(sorted[i]->objfile, &image->firmware, pool->options);
+        }
+        pool->images[sorted[i] - pool->jobs] = image;
+        pool->order[i] = sorted[i] - pool->jobs;
+    }
+    free(sorted);
+    LOG_LN("Loaded %u programs", *images);
+    return loaded;
+}
+
+/**
+ * @brief Splits the jobs in groups. Without lanes every job is a group in
+ * the order of the list, with lanes the consecutive jobs of an image are
+ * grouped up to lanes jobs.
+ * 
+ * @param pool worker pool with the images and the jobs sorted by objfile,
+ * receives the groups
+ * @param count count of jobs
+ * @param lanes max jobs of a group
+ * @return uint32_t count of groups
+ */
+static uint32_t LC3BatchGroupJobs(LC3BatchPool_t *pool, uint32_t count, uint32_t lanes)
+{
+    uint32_t groups = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (lanes < 2U)
+        {
+            pool->order[i] = i;
+        }
+        if (i == 0 || lanes < 2U || i - pool->groups[groups - 1U] == lanes ||
+            pool->images[pool->order[i]] != pool->images[pool->order[i - 1U]])
+        {
+            pool->groups[groups++] = i;
+        }
+    }
+    pool->groups[groups] = count;
+    return groups;
+}
+
+uint8_t LC3BatchRun(LC3BatchJob_t *jobs, uint32_t count, uint32_t workers, uint32_t lanes, const LC3VmOptions_t *options)
+{
+    LC3BatchPool_t pool = {jobs, NULL, workers ? workers : 1U, options, NULL, NULL, NULL};
+    uint32_t imageCount;
+    LC3BatchImage_t *images = LC3BatchLoadImages(&pool, count, &imageCount);
+    pool.groups = malloc((count + 1U) * sizeof(uint32_t));
+    uint32_t groups = 0;
+    if (images && pool.groups)
+    {
+        groups = LC3BatchGroupJobs(&pool, count, lanes < LANES_MAX ? lanes : LANES_MAX);
+    }
+    if (pool.workers > groups && groups)
+    {
+        pool.workers = groups;
+    }
+    LOG_LN("Running %u jobs in %u groups on %u workers", count, groups, pool.workers);
+
+    // Every queue gets a slice of items big enough for their share, the last ones can go past groups
+    uint32_t share = (groups + pool.workers - 1U) / pool.workers;
+    pool.queues = calloc(pool.workers, sizeof(LC3BatchQueue_t));
+    LC3BatchWorker_t *threads = calloc(pool.workers, sizeof(LC3BatchWorker_t));
+    uint32_t *items = calloc(share ? pool.workers * share : 1U, sizeof(uint32_t));
+    if (!images || !pool.groups || !pool.queues || !threads || !items)
+    {
+        LC3BatchReleaseImages(&pool, images, imageCount);
+        free(pool.groups);
+        free(pool.queues);
+        free(threads);
+        free(items);
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t w = 0; w < pool.workers; w++)
+    {
+        pthread_mutex_init(&pool.queues[w].lock, NULL);
+        pool.queues[w].items = items + w * share;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        jobs[i].output = NULL;
+        jobs[i].outputSize = 0;
+        jobs[i].status = EXIT_FAILURE;
+    }
+    for (uint32_t g = 0; g < groups; g++)
+    {
+        LC3BatchQueue_t *q = &pool.queues[g % pool.workers];
+        q->items[q->tail++] = g;
+    }
+
+    uint32_t started = 0;
+    for (; started < pool.workers; started++)
+    {
+        threads[started].pool = &pool;
+        threads[started].id = started;
+        if (pthread_create(&threads[started].thread, NULL, LC3BatchWorker, &threads[started]))
+        {
+            break;
+        }
+    }
+    if (!started)
+    {
+        // No threads at all, the jobs are run by the caller
+        LC3BatchWorker_t self = {&pool, 0};
+        FILE *log = fileout;
+        LC3BatchWorker(&self);
+        fileout = log;
+    }
+    for (uint32_t w = 0; w < started; w++)
+    {
+        pthread_join(threads[w].thread, NULL);
+    }
+    for (uint32_t w = 0; w < pool.workers; w++)
+    {
+        pthread_mutex_destroy(&pool.queues[w].lock);
+    }
+    LC3BatchReleaseImages(&pool, images, imageCount);
+    free(pool.groups);
+    free(pool.queues);
+    free(threads);
+    free(items);
+    return EXIT_SUCCESS;
+}
+
+LC3BatchJob_t *LC3BatchLoadList(const char *filename, uint32_t *count)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        return NULL;
+    }
+    size_t size;
+    char *text = LC3BatchReadAll(f, &size);
+    fclose(f);
+    if (!text)
+    {
+        return NULL;
+    }
+
+    uint32_t capacity = 1U;
+    for (size_t i = 0; i < size; i++)
+    {
+        capacity += text[i] == '\n';
+    }
+    // The strings of the jobs point into text, stored after the jobs
+    LC3BatchJob_t *jobs = calloc(1U, capacity * sizeof(LC3BatchJob_t) + size + 1U);
+    if (!jobs)
+    {
+        free(text);
+        return NULL;
+    }
+    char *copy = (char *)(jobs + capacity);
+    memcpy(copy, text, size + 1U);
+    free(text);
+
+    *count = 0;
+    char *save = NULL;
+    for (char *line = strtok_r(copy, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save))
+    {
+        char *field = NULL;
+        char *objfile = strtok_r(line, " \t", &field);
+        if (!objfile || objfile[0] == '#')
+        {
+            continue;
+        }
+        jobs[*count].objfile = objfile;
+        jobs[*count].infile = strtok_r(NULL, " \t", &field);
+        (*count)++;
+    }
+    return jobs;
+}
+
+void LC3BatchFree(LC3BatchJob_t *jobs, uint32_t count)
+{
+    if (!jobs)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        free(jobs[i].output);
+    }
+    free(jobs);
+}
@@ -0,0 +1,105 @@
+/**
+ * @file batch.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Runs many programs in one process, every job gets their own vm and
+ * the jobs are spread on a work stealing thread pool. Jobs of the same
+ * program can run in lockstep groups, see lanes.h
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__BATCH_H__)
+#define __BATCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+/**
+ * @brief Program to run and their results
+ * 
+ */
+typedef struct LC3BatchJob_t
+{
+    /**
+     * @brief path/filename to the objfile
+     * 
+     */
+    const char *objfile;
+    /**
+     * @brief path/filename of the keyboard input, NULL for no input
+     * 
+     */
+    const char *infile;
+    /**
+     * @brief display output captured while running, NUL terminated
+     * 
+     */
+    char *output;
+    /**
+     * @brief bytes of output
+     * 
+     */
+    size_t outputSize;
+    /**
+     * @brief EXIT_FAILURE if the objfile or the input can't be read
+     * 
+     */
+    uint8_t status;
+    /**
+     * @brief worker that ran the job
+     * 
+     */
+    uint32_t worker;
+} LC3BatchJob_t;
+
+/**
+ * @brief Count of workers to use by default, one per online core
+ * 
+ * @return uint32_t count of workers
+ */
+uint32_t LC3BatchDefaultWorkers();
+
+/**
+ * @brief Runs all the jobs and waits for them. Every objfile is loaded once
+ * and the vms of their jobs share their memory pages. Jobs are dealt round
+ * robin to the workers, a worker takes the newest job of their own queue and
+ * when it's empty steals the oldest one of another worker. With more than
+ * one lane the jobs of every objfile are dealt in groups of up to lanes jobs
+ * that run in lockstep.
+ * 
+ * @param jobs jobs to run, results are stored on them
+ * @param count count of jobs
+ * @param workers count of threads
+ * @param lanes jobs of a lockstep group, up to LANES_MAX. 1 runs every job
+ * with the engine of the options
+ * @param options settings of the vm of every job
+ * @return uint8_t EXIT_FAILURE if there is no memory for the queues or the
+ * images
+ */
+uint8_t LC3BatchRun(LC3BatchJob_t *jobs, uint32_t count, uint32_t workers, uint32_t lanes, const LC3VmOptions_t *options);
+
+/**
+ * @brief Reads a list of jobs, one per line with the objfile and optionally
+ * the file used as keyboard input. Empty lines and lines starting with # are
+ * ignored.
+ * 
+ * @param filename path/filename of the list
+ * @param count output count of jobs
+ * @return LC3BatchJob_t* jobs, NULL if the list can't be read. Released with
+ * LC3BatchFree
+ */
+LC3BatchJob_t *LC3BatchLoadList(const char *filename, uint32_t *count);
+
+/**
+ * @brief Releases the jobs and their captured output
+ * 
+ * @param jobs jobs to release, from LC3BatchLoadList
+ * @param count count of jobs
+ */
+void LC3BatchFree(LC3BatchJob_t *jobs, uint32_t count);
+
+#endif  // __BATCH_H__
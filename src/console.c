@@ -1,8 +1,17 @@
 #include "console.h"
 
+#include <errno.h>
+#include <time.h>
+
 // This keyboard platform specific implementation is based on
 // https://justinmeiners.github.io/lc3-vm/index.html
 
+/**
+ * @brief Console that owns the terminal, there is only one terminal per process
+ * 
+ */
+static LC3Console_t *terminalConsole = NULL;
+
 /**
  * @brief Interruption when the application is closed, to restore the terminal previous state.
  * 
@@ -10,26 +19,235 @@
  */
 static void HandleInterrupt(int signal)
 {
-    OSKeyboardRestoreBuffering();
+    if (terminalConsole)
+    {
+        OSKeyboardRestoreBuffering(terminalConsole);
+    }
     printf("\n");
     exit(-2);
 }
 
 #if __unix__
-struct termios original_tio;
-#elif _WIN32
-HANDLE hStdin = INVALID_HANDLE_VALUE;
-DWORD fdwMode, fdwOldMode;
+
+/**
+ * @brief Wakes up the cpu if it's waiting for a key, and raises their
+ * interrupt requests
+ * 
+ * @param console console instance
+ */
+static void OSKeyboardWakeUp(LC3Console_t *console)
+{
+    if (console->notify)
+    {
+        atomic_fetch_or(console->notify, 1U);
+    }
+    if (atomic_load(&console->waiting))
+    {
+        pthread_mutex_lock(&console->lock);
+        pthread_cond_signal(&console->ready);
+        pthread_mutex_unlock(&console->lock);
+    }
+}
+
+/**
+ * @brief Input thread, moves the input to the ring until it ends or the
+ * console stops
+ * 
+ * @param arg console instance
+ * @return void* NULL
+ */
+static void *OSKeyboardReader(void *arg)
+{
+    LC3Console_t *console = arg;
+    struct pollfd fds[2] = {{fileno(console->in), POLLIN, 0}, {console->stop[0], POLLIN, 0}};
+    while (1)
+    {
+        uint32_t head = atomic_load_explicit(&console->head, memory_order_relaxed);
+        uint32_t used = head - atomic_load_explicit(&console->tail, memory_order_acquire);
+        // Full ring, the cpu isn't reading keys, check again later
+        uint8_t full = (used == CONSOLE_RING_SIZE);
+        if (poll(full ? &fds[1] : fds, full ? 1U : 2U, full ? 1 : -1) < 0 && errno != EINTR)
+        {
+            break;
+        }
+        if (fds[1].revents)
+        {
+            return NULL;
+        }
+        if (full || !fds[0].revents)
+        {
+            continue;
+        }
+        uint32_t space = CONSOLE_RING_SIZE - used;
+        uint32_t contiguous = CONSOLE_RING_SIZE - (head & CONSOLE_RING_MASK);
+        ssize_t n = read(fds[0].fd, &console->ring[head & CONSOLE_RING_MASK], space < contiguous ? space : contiguous);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        atomic_store(&console->head, head + (uint32_t)n);
+        OSKeyboardWakeUp(console);
+    }
+    atomic_store(&console->eof, 1U);
+    OSKeyboardWakeUp(console);
+    return NULL;
+}
+
+/**
+ * @brief Starts the input thread, if it can't be started the console reads
+ * the stream directly
+ * 
+ * @param console console instance
+ */
+static void OSKeyboardStartReader(LC3Console_t *console)
+{
+    atomic_init(&console->head, 0U);
+    atomic_init(&console->tail, 0U);
+    atomic_init(&console->eof, 0U);
+    atomic_init(&console->waiting, 0U);
+    if (pipe(console->stop) != 0)
+    {
+        return;
+    }
+    pthread_mutex_init(&console->lock, NULL);
+    pthread_cond_init(&console->ready, NULL);
+    if (pthread_create(&console->reader, NULL, OSKeyboardReader, console) != 0)
+    {
+        pthread_mutex_destroy(&console->lock);
+        pthread_cond_destroy(&console->ready);
+        close(console->stop[0]);
+        close(console->stop[1]);
+        return;
+    }
+    console->async = 1;
+}
+
+/**
+ * @brief Stops the input thread, the keys not read are lost
+ * 
+ * @param console console instance
+ */
+static void OSKeyboardStopReader(LC3Console_t *console)
+{
+    if (!console->async)
+    {
+        return;
+    }
+    if (write(console->stop[1], "", 1U) == 1)
+    {
+        pthread_join(console->reader, NULL);
+    }
+    pthread_mutex_destroy(&console->lock);
+    pthread_cond_destroy(&console->ready);
+    close(console->stop[0]);
+    close(console->stop[1]);
+    console->async = 0;
+}
+
 #endif
 
-void OSKeyboardInit()
+const char *OSDisplayFlushPolicies[FLUSH_COUNT] = {"newline", "input", "full"};
+
+void OSDisplayFlushBeforeInput(LC3Console_t *console)
+{
+    if (console->outputLength && console->flush <= FLUSH_INPUT)
+    {
+        OSDisplayFlush(console);
+    }
+}
+
+void OSKeyboardInit(LC3Console_t *console, FILE *in, FILE *out)
 {
-    signal(SIGINT, HandleInterrupt);
-    OSKeyboardDisableBuffering();
+    console->in = in;
+    console->out = out;
+    console->outputLength = 0;
+    console->terminal = (in == stdin) && !console->headless;
+#if __unix__
+    console->async = 0;
+    console->peeked = 0;
+    struct stat st;
+    console->pipe = !console->terminal && fstat(fileno(in), &st) == 0 && !S_ISREG(st.st_mode);
+    if (console->pipe)
+    {
+        // Buffered data would be hidden from the poll
+        setvbuf(in, NULL, _IONBF, 0);
+    }
+#endif
+    if (console->terminal)
+    {
+        terminalConsole = console;
+        signal(SIGINT, HandleInterrupt);
+        OSKeyboardDisableBuffering(console);
+#if __unix__
+        OSKeyboardStartReader(console);
+#endif
+    }
 }
 
-uint16_t OSKeyboardIsKeyPressed()
+void OSKeyboardEnd(LC3Console_t *console)
 {
+    OSDisplayFlush(console);
+#if __unix__
+    OSKeyboardStopReader(console);
+#endif
+    if (console->terminal)
+    {
+        OSKeyboardRestoreBuffering(console);
+        console->terminal = 0;
+        terminalConsole = NULL;
+    }
+}
+
+uint16_t OSKeyboardIsKeyPressed(LC3Console_t *console)
+{
+#if __unix__
+    if (console->async)
+    {
+        if (atomic_load_explicit(&console->head, memory_order_acquire) !=
+            atomic_load_explicit(&console->tail, memory_order_relaxed))
+        {
+            return 1;
+        }
+        // The guest is polling for a key, show it what it printed
+        OSDisplayFlushBeforeInput(console);
+        return 0;
+    }
+#endif
+    if (!console->terminal)
+    {
+        // Files and pipes have a key while there is data left
+#if __unix__
+        if (console->peeked)
+        {
+            return 1;
+        }
+        // Pipes are only read when the data arrived, polling never waits
+        struct pollfd fds = {fileno(console->in), POLLIN, 0};
+        if (console->pipe && poll(&fds, 1, 0) <= 0)
+        {
+            OSDisplayFlushBeforeInput(console);
+            return 0;
+        }
+#elif _WIN32
+        OSDisplayFlushBeforeInput(console);
+#endif
+        int c = getc(console->in);
+        if (c == EOF)
+        {
+            OSDisplayFlushBeforeInput(console);
+            return 0;
+        }
+        ungetc(c, console->in);
+#if __unix__
+        console->peeked = 1;
+#endif
+        return 1;
+    }
+    OSDisplayFlushBeforeInput(console);
 #if __unix__
     fd_set readfds;
     FD_ZERO(&readfds);
@@ -39,32 +257,203 @@ uint16_t OSKeyboardIsKeyPressed()
     timeout.tv_usec = 0;
     return select(1, &readfds, NULL, NULL, &timeout) != 0;
 #elif _WIN32
-    return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
+    return WaitForSingleObject(console->hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
+#endif
+}
+
+void OSKeyboardWait(LC3Console_t *console, uint32_t milliseconds)
+{
+#if __unix__
+    if (console->async)
+    {
+        struct timespec deadline;
+        timespec_get(&deadline, TIME_UTC);
+        deadline.tv_sec += milliseconds / 1000U;
+        deadline.tv_nsec += (long)(milliseconds % 1000U) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        uint32_t tail = atomic_load_explicit(&console->tail, memory_order_relaxed);
+        pthread_mutex_lock(&console->lock);
+        atomic_store(&console->waiting, 1U);
+        int status = 0;
+        while (atomic_load(&console->head) == tail && !atomic_load(&console->eof) && status != ETIMEDOUT)
+        {
+            status = pthread_cond_timedwait(&console->ready, &console->lock, &deadline);
+        }
+        atomic_store(&console->waiting, 0U);
+        pthread_mutex_unlock(&console->lock);
+        if (atomic_load(&console->head) != tail || status == ETIMEDOUT)
+        {
+            return;
+        }
+    }
+    else if (console->terminal)
+    {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(STDIN_FILENO, &readfds);
+        struct timeval timeout = {milliseconds / 1000U, (milliseconds % 1000U) * 1000U};
+        select(1, &readfds, NULL, NULL, &timeout);
+        return;
+    }
+    else if (!feof(console->in))
+    {
+        if (console->pipe && !console->peeked)
+        {
+            struct pollfd fds = {fileno(console->in), POLLIN, 0};
+            poll(&fds, 1, (int)milliseconds);
+        }
+        return;
+    }
+    // The input ended, no key will come
+    struct timespec idle = {milliseconds / 1000U, (long)(milliseconds % 1000U) * 1000000L};
+    nanosleep(&idle, NULL);
+#elif _WIN32
+    if (console->terminal)
+    {
+        WaitForSingleObject(console->hStdin, milliseconds);
+    }
+    else if (feof(console->in))
+    {
+        Sleep(milliseconds);
+    }
+#endif
+}
+
+int OSKeyboardGetChar(LC3Console_t *console)
+{
+#if __unix__
+    if (console->async)
+    {
+        uint32_t tail = atomic_load_explicit(&console->tail, memory_order_relaxed);
+        if (atomic_load_explicit(&console->head, memory_order_acquire) == tail)
+        {
+            OSDisplayFlushBeforeInput(console);
+            pthread_mutex_lock(&console->lock);
+            atomic_store(&console->waiting, 1U);
+            while (atomic_load(&console->head) == tail && !atomic_load(&console->eof))
+            {
+                pthread_cond_wait(&console->ready, &console->lock);
+            }
+            atomic_store(&console->waiting, 0U);
+            pthread_mutex_unlock(&console->lock);
+            if (atomic_load(&console->head) == tail)
+            {
+                return EOF;
+            }
+        }
+        int c = console->ring[tail & CONSOLE_RING_MASK];
+        atomic_store_explicit(&console->tail, tail + 1U, memory_order_release);
+        return c;
+    }
+    console->peeked = 0;
+#endif
+    OSDisplayFlushBeforeInput(console);
+    return getc(console->in);
+}
+
+uint8_t OSDisplayFindFlush(const char *name)
+{
+    uint8_t policy;
+    for (policy = 0; policy < FLUSH_COUNT; policy++)
+    {
+        if (strcmp(OSDisplayFlushPolicies[policy], name) == 0)
+        {
+            break;
+        }
+    }
+    return policy;
+}
+
+void OSDisplayPutChar(LC3Console_t *console, char c)
+{
+    console->output[console->outputLength++] = c;
+    if (console->outputLength == CONSOLE_OUTPUT_SIZE || (c == '\n' && console->flush == FLUSH_NEWLINE))
+    {
+        OSDisplayFlush(console);
+    }
+}
+
+void OSDisplayWrite(LC3Console_t *console, const char *data, uint32_t length)
+{
+    uint8_t flush = console->flush == FLUSH_NEWLINE && memchr(data, '\n', length);
+    while (length)
+    {
+        uint32_t chunk = CONSOLE_OUTPUT_SIZE - console->outputLength;
+        chunk = chunk < length ? chunk : length;
+        memcpy(console->output + console->outputLength, data, chunk);
+        console->outputLength += chunk;
+        data += chunk;
+        length -= chunk;
+        if (console->outputLength == CONSOLE_OUTPUT_SIZE)
+        {
+            OSDisplayFlush(console);
+        }
+    }
+    if (flush)
+    {
+        OSDisplayFlush(console);
+    }
+}
+
+void OSDisplayFlush(LC3Console_t *console)
+{
+    if (!console->outputLength)
+    {
+        return;
+    }
+#if __unix__
+    // Anything the host printed through the stream goes first
+    fflush(console->out);
+    int fd = fileno(console->out);
+    const char *data = console->output;
+    size_t left = console->outputLength;
+    while (left)
+    {
+        ssize_t n = write(fd, data, left);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        data += n;
+        left -= n;
+    }
+#elif _WIN32
+    fwrite(console->output, 1U, console->outputLength, console->out);
+    fflush(console->out);
 #endif
+    console->outputLength = 0;
 }
 
-void OSKeyboardDisableBuffering()
+void OSKeyboardDisableBuffering(LC3Console_t *console)
 {
 #if __unix__
-    tcgetattr(STDIN_FILENO, &original_tio);
-    struct termios new_tio = original_tio;
+    tcgetattr(STDIN_FILENO, &console->original_tio);
+    struct termios new_tio = console->original_tio;
     new_tio.c_lflag &= ~ICANON & ~ECHO;
     tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
 #elif _WIN32
-    hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    GetConsoleMode(hStdin, &fdwOldMode);
-    fdwMode = fdwOldMode ^ ENABLE_ECHO_INPUT
-              ^ ENABLE_LINE_INPUT;
-    SetConsoleMode(hStdin, fdwMode);
-    FlushConsoleInputBuffer(hStdin);
+    console->hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    GetConsoleMode(console->hStdin, &console->fdwOldMode);
+    console->fdwMode = console->fdwOldMode ^ ENABLE_ECHO_INPUT
+                       ^ ENABLE_LINE_INPUT;
+    SetConsoleMode(console->hStdin, console->fdwMode);
+    FlushConsoleInputBuffer(console->hStdin);
 #endif
 }
 
-void OSKeyboardRestoreBuffering()
+void OSKeyboardRestoreBuffering(LC3Console_t *console)
 {
 #if __unix__
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    tcsetattr(STDIN_FILENO, TCSANOW, &console->original_tio);
 #elif _WIN32
-    SetConsoleMode(hStdin, fdwOldMode);
+    SetConsoleMode(console->hStdin, console->fdwOldMode);
 #endif
 }
@@ -16,9 +16,13 @@
 #include <stdint.h>
 #include <string.h>
 #include <signal.h>
+#include <stdatomic.h>
 #if __unix__
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/termios.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -31,28 +35,240 @@
 #endif
 
 /**
- * @brief Initialize the keyboard configuration
+ * @brief Keys buffered by the input thread, power of two
  * 
  */
-void OSKeyboardInit();
+#define CONSOLE_RING_SIZE 4096U
+#define CONSOLE_RING_MASK (CONSOLE_RING_SIZE - 1U)
+
+/**
+ * @brief Bytes of guest output collected before they are written
+ * 
+ */
+#define CONSOLE_OUTPUT_SIZE 4096U
+
+/**
+ * @brief When the guest output is written, the buffer is also written when
+ * it's full and when the console ends
+ * 
+ */
+typedef enum
+{
+    FLUSH_NEWLINE,  // On every newline, and before waiting for input
+    FLUSH_INPUT,    // Before waiting for input
+    FLUSH_FULL,     // Only when the buffer is full
+    FLUSH_COUNT
+} Lc3DisplayFlush_e;
+
+/**
+ * @brief Keyboard and display of a vm instance
+ * 
+ */
+typedef struct LC3Console_t
+{
+    /**
+     * @brief stream read by the keyboard
+     * 
+     */
+    FILE *in;
+    /**
+     * @brief stream written by the display
+     * 
+     */
+    FILE *out;
+    /**
+     * @brief flag indicating if the console owns the terminal, their settings
+     * are restored when the console ends or the program is interrupted
+     * 
+     */
+    uint8_t terminal;
+    /**
+     * @brief Lc3DisplayFlush_e policy of the output, set by the owner of the
+     * console and kept when it's initialized again
+     * 
+     */
+    uint8_t flush;
+    /**
+     * @brief flag indicating if the console never takes the terminal, stdin
+     * is read like any other stream. Set by the owner like flush.
+     * 
+     */
+    uint8_t headless;
+    /**
+     * @brief flag word where bit 0 is raised when keys arrive, the pending
+     * word of the cpu, so interrupt driven programs don't need to poll. Set
+     * by the owner like flush, NULL if nobody listens.
+     * 
+     */
+    _Atomic uint16_t *notify;
+    /**
+     * @brief guest output not written yet
+     * 
+     */
+    uint32_t outputLength;
+    char output[CONSOLE_OUTPUT_SIZE];
+#if __unix__
+    /**
+     * @brief terminal settings before the console started
+     * 
+     */
+    struct termios original_tio;
+    /**
+     * @brief flag indicating if the terminal is read by the input thread
+     * 
+     */
+    uint8_t async;
+    /**
+     * @brief flag indicating if in is a pipe or any stream whose data arrives
+     * over time, it's read unbuffered and polled before a key is peeked
+     * 
+     */
+    uint8_t pipe;
+    /**
+     * @brief flag indicating if the next key of in was peeked and pushed back
+     * 
+     */
+    uint8_t peeked;
+    /**
+     * @brief keys read by the input thread. The thread is the only writer of
+     * head and the cpu the only writer of tail, so no lock is needed
+     * 
+     */
+    uint8_t ring[CONSOLE_RING_SIZE];
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    /**
+     * @brief flag set by the input thread when the input ended
+     * 
+     */
+    _Atomic uint8_t eof;
+    /**
+     * @brief flag set by the cpu while it sleeps waiting for a key, only
+     * then the input thread takes the lock to wake it up
+     * 
+     */
+    _Atomic uint8_t waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    /**
+     * @brief input thread and the pipe that stops it
+     * 
+     */
+    pthread_t reader;
+    int stop[2];
+#elif _WIN32
+    HANDLE hStdin;
+    DWORD fdwMode, fdwOldMode;
+#endif
+} LC3Console_t;
+
+/**
+ * @brief Initialize the keyboard configuration, when in is stdin and the
+ * console is not headless it takes the terminal and starts a thread that
+ * reads it
+ * 
+ * @param console console instance
+ * @param in stream read by the keyboard
+ * @param out stream written by the display
+ */
+void OSKeyboardInit(LC3Console_t *console, FILE *in, FILE *out);
+
+/**
+ * @brief Writes the pending output, stops the input thread and restores the
+ * terminal if the console owns it
+ * 
+ * @param console console instance
+ */
+void OSKeyboardEnd(LC3Console_t *console);
 
 /**
  * @brief Restores restore the terminal settings back to normal.
  * 
+ * @param console console instance
  */
-void OSKeyboardRestoreBuffering();
+void OSKeyboardRestoreBuffering(LC3Console_t *console);
 
 /**
  * @brief Modify the terminal to allow the Lc3 input behave nicely
  * 
+ * @param console console instance
  */
-void OSKeyboardDisableBuffering();
+void OSKeyboardDisableBuffering(LC3Console_t *console);
 
 /**
- * @brief Checks for a polling state to check if a key was pressed
+ * @brief Checks for a polling state to check if a key was pressed, with the
+ * input thread it's a read of the ring and doesn't enter the kernel
  * 
+ * @param console console instance
  * @return uint16_t 0x1 if a key was pressed, or 0x0 if not
  */
-uint16_t OSKeyboardIsKeyPressed();
+uint16_t OSKeyboardIsKeyPressed(LC3Console_t *console);
+
+/**
+ * @brief Sleeps until a key arrives or the time runs out, used when the
+ * guest polls in a loop that only a key can end. Returns at once for
+ * streams with data left, their polls already wait for it.
+ * 
+ * @param console console instance
+ * @param milliseconds longest time to sleep
+ */
+void OSKeyboardWait(LC3Console_t *console, uint32_t milliseconds);
+
+/**
+ * @brief Reads a key, waits until there is one
+ * 
+ * @param console console instance
+ * @return int key read, EOF when the input ended
+ */
+int OSKeyboardGetChar(LC3Console_t *console);
+
+/**
+ * @brief Names of the flush policies
+ * 
+ */
+extern const char *OSDisplayFlushPolicies[FLUSH_COUNT];
+
+/**
+ * @brief Search a flush policy by their name
+ * 
+ * @param name name of the policy
+ * @return uint8_t policy, FLUSH_COUNT if it doesn't exists
+ */
+uint8_t OSDisplayFindFlush(const char *name);
+
+/**
+ * @brief Adds a character to the output, writes the output if the policy asks
+ * for it
+ * 
+ * @param console console instance
+ * @param c character printed by the guest
+ */
+void OSDisplayPutChar(LC3Console_t *console, char c);
+
+/**
+ * @brief Adds a block of characters to the output, the output is written
+ * when the buffer fills up and once after the block if the policy asks for
+ * it
+ * 
+ * @param console console instance
+ * @param data characters printed by the guest
+ * @param length count of characters
+ */
+void OSDisplayWrite(LC3Console_t *console, const char *data, uint32_t length);
+
+/**
+ * @brief Writes the output if the policy asks for it before the guest waits
+ * for a key
+ * 
+ * @param console console instance
+ */
+void OSDisplayFlushBeforeInput(LC3Console_t *console);
+
+/**
+ * @brief Writes the collected output to the stream with a single write
+ * 
+ * @param console console instance
+ */
+void OSDisplayFlush(LC3Console_t *console);
 
 #endif  // __CONSOLE_H__
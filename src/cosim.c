@@ -0,0 +1,452 @@
+#include "cosim.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "defs.h"
+#include "vm.h"
+
+/**
+ * @brief Index of the reference and of the compared engine in a pair
+ * 
+ */
+#define COSIM_REFERENCE 0
+#define COSIM_CANDIDATE 1
+
+/**
+ * @brief Handler of the exceptions of the random images, a single RTI
+ * 
+ */
+#define COSIM_HANDLER_ADDRESS (PC_START_ADDRESS - 1U)
+#define COSIM_HANDLER_WORD 0x8000
+
+/**
+ * @brief The two vms compared and their streams
+ * 
+ */
+typedef struct LC3CosimPair_t
+{
+    LC3Vm_t *vms[2];
+    FILE *in[2];
+    FILE *out[2];
+    /**
+     * @brief pages written by every vm since the last equal checkpoint
+     * 
+     */
+    uint8_t dirty[2][CPU_DIRTY_PAGES];
+} LC3CosimPair_t;
+
+/**
+ * @brief Releases the vms of a pair and their streams
+ * 
+ * @param pair vms to release
+ */
+static void LC3CosimClose(LC3CosimPair_t *pair)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        LC3VmDestroy(pair->vms[i]);
+        if (pair->in[i])
+        {
+            fclose(pair->in[i]);
+        }
+        if (pair->out[i])
+        {
+            fclose(pair->out[i]);
+        }
+    }
+    memset(pair, 0, sizeof(*pair));
+}
+
+/**
+ * @brief Creates the reference and the compared vm from the image, every
+ * one with their own keyboard and display
+ * 
+ * @param cosim co-simulation settings
+ * @param pair output vms
+ * @return uint8_t EXIT_FAILURE if they can't be created
+ */
+static uint8_t LC3CosimOpen(const LC3Cosim_t *cosim, LC3CosimPair_t *pair)
+{
+    // The budget is given on every step, the limit only makes the engines count it
+    LC3VmOptions_t options = {
+        .engine = ENGINE_TABLE,
+        .flush = FLUSH_FULL,
+        .headless = 1,
+        .maxInstructions = 1,
+    };
+    memset(pair, 0, sizeof(*pair));
+    for (int i = 0; i < 2; i++)
+    {
+        options.engine = (i == COSIM_REFERENCE) ? ENGINE_TABLE : cosim->engine;
+        pair->in[i] = cosim->input ? fopen(cosim->input, "rb") : tmpfile();
+        pair->out[i] = tmpfile();
+        if (pair->in[i] && pair->out[i])
+        {
+            pair->vms[i] = LC3VmCreateFromImage(cosim->image, pair->in[i], pair->out[i], &options);
+        }
+        if (!pair->vms[i])
+        {
+            LC3CosimClose(pair);
+            return EXIT_FAILURE;
+        }
+        pair->vms[i]->cpu.dirty = pair->dirty[i];
+    }
+    // Limited runs turn the superinstructions off, LC3CosimAdvance counts them instead
+    pair->vms[COSIM_CANDIDATE]->cpu.stat.fusion = cosim->fusion;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Instructions the superinstructions run by a cpu replaced beyond
+ * the one charged to their budget
+ * 
+ * @param cpu pointer to the cpu instance
+ * @return uint64_t count of instructions
+ */
+static uint64_t LC3CosimFused(const LC3Cpu_t *cpu)
+{
+    uint64_t extra = 0;
+    for (uint8_t fusion = 0; fusion < FUSION_COUNT; fusion++)
+    {
+        extra += cpu->fusions[fusion] * (LC3Fusions[fusion].length - 1U);
+    }
+    return extra;
+}
+
+/**
+ * @brief Runs a vm with an exact budget. A superinstruction is charged as one
+ * instruction, with them the budget is given in parts small enough to not go
+ * past count, but the last one can end after it.
+ * 
+ * @param vm vm instance
+ * @param count instructions to run
+ * @return uint64_t instructions run, less than count if the cpu stopped
+ */
+static uint64_t LC3CosimAdvance(LC3Vm_t *vm, uint64_t count)
+{
+    uint64_t ran = 0;
+    while (ran < count && vm->cpu.stat.running)
+    {
+        uint64_t fused = LC3CosimFused(&vm->cpu);
+        uint64_t budget = count - ran;
+        if (vm->cpu.stat.fusion && budget >= FUSION_MAX_LENGTH)
+        {
+            budget /= FUSION_MAX_LENGTH;
+        }
+        else if (vm->cpu.stat.fusion)
+        {
+            budget = 1U;
+        }
+        vm->cpu.budget = (int64_t)budget;
+        LC3Engines[vm->options.engine].execute(&vm->cpu);
+        ran += budget - (uint64_t)vm->cpu.budget + LC3CosimFused(&vm->cpu) - fused;
+        if (vm->cpu.budget)
+        {
+            break;
+        }
+    }
+    return ran;
+}
+
+/**
+ * @brief Compares a field of the state
+ * 
+ * @param out stream where the difference is written, NULL to only compare
+ * @param name name of the field
+ * @param reference value of the reference
+ * @param candidate value of the compared engine
+ * @return uint32_t 1 if they differ
+ */
+static uint32_t LC3CosimField(FILE *out, const char *name, uint32_t reference, uint32_t candidate)
+{
+    if (reference == candidate)
+    {
+        return 0;
+    }
+    if (out)
+    {
+        fprintf(out, "  %-10s 0x%04X     0x%04X\n", name, reference, candidate);
+    }
+    return 1U;
+}
+
+/**
+ * @brief Compares the architectural state of the pair: PC, registers,
+ * condition codes, PSR, stack pointers, devices, output and the memory
+ * pages written by any of them
+ * 
+ * @param pair vms to compare
+ * @param out stream where the differences are written, NULL to only count
+ * them
+ * @return uint32_t count of differences, memory words counted one by one
+ */
+static uint32_t LC3CosimDiff(LC3CosimPair_t *pair, FILE *out)
+{
+    static const char *regs[] = {"R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7"};
+    const LC3Cpu_t *ref = &pair->vms[COSIM_REFERENCE]->cpu;
+    const LC3Cpu_t *cand = &pair->vms[COSIM_CANDIDATE]->cpu;
+    uint32_t diffs = LC3CosimField(out, "PC", ref->PC, cand->PC);
+    for (int i = 0; i < 8; i++)
+    {
+        diffs += LC3CosimField(out, regs[i], ref->regs[i], cand->regs[i]);
+    }
+    diffs += LC3CosimField(out, "CC", ref->CC, cand->CC);
+    diffs += LC3CosimField(out, "PSR", ref->psr, cand->psr);
+    diffs += LC3CosimField(out, "SavedSSP", ref->savedSSP, cand->savedSSP);
+    diffs += LC3CosimField(out, "SavedUSP", ref->savedUSP, cand->savedUSP);
+    diffs += LC3CosimField(out, "running", ref->stat.running, cand->stat.running);
+    diffs += LC3CosimField(out, "KBSR", ref->devices.kbsr, cand->devices.kbsr);
+    diffs += LC3CosimField(out, "KBDR", ref->devices.kbdr, cand->devices.kbdr);
+    diffs += LC3CosimField(out, "MCR", ref->devices.mcr, cand->devices.mcr);
+    // Output is compared by length, the bytes are compared when the program ends
+    for (int i = 0; i < 2; i++)
+    {
+        OSDisplayFlush(&pair->vms[i]->console);
+    }
+    diffs += LC3CosimField(out, "output", ftell(pair->out[COSIM_REFERENCE]), ftell(pair->out[COSIM_CANDIDATE]));
+
+    // Both start from the same image, only the written pages can differ, and pages still shared can't
+    uint32_t words = 0;
+    for (uint32_t page = 0; page < CPU_DIRTY_PAGES; page++)
+    {
+        const uint16_t *refWords = ref->firmware->memory.pages[page]->words;
+        const uint16_t *candWords = cand->firmware->memory.pages[page]->words;
+        if ((!pair->dirty[COSIM_REFERENCE][page] && !pair->dirty[COSIM_CANDIDATE][page]) || refWords == candWords ||
+            memcmp(refWords, candWords, CPU_DIRTY_PAGE_WORDS * sizeof(uint16_t)) == 0)
+        {
+            continue;
+        }
+        for (uint32_t i = 0; i < CPU_DIRTY_PAGE_WORDS; i++)
+        {
+            if (refWords[i] == candWords[i])
+            {
+                continue;
+            }
+            if (out && words < COSIM_MAX_MEMORY_DIFFS)
+            {
+                char name[8];
+                snprintf(name, sizeof(name), "x%04X", (page << CPU_DIRTY_PAGE_SHIFT) | i);
+                LC3CosimField(out, name, refWords[i], candWords[i]);
+            }
+            words++;
+        }
+    }
+    if (out && words > COSIM_MAX_MEMORY_DIFFS)
+    {
+        fprintf(out, "  ... and %u more words\n", words - COSIM_MAX_MEMORY_DIFFS);
+    }
+    return diffs + words;
+}
+
+/**
+ * @brief Compares the bytes written by both vms
+ * 
+ * @param pair vms to compare
+ * @return uint8_t 1 if the output is the same
+ */
+static uint8_t LC3CosimSameOutput(LC3CosimPair_t *pair)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        OSDisplayFlush(&pair->vms[i]->console);
+        rewind(pair->out[i]);
+    }
+    int a, b;
+    do
+    {
+        a = getc(pair->out[COSIM_REFERENCE]);
+        b = getc(pair->out[COSIM_CANDIDATE]);
+    } while (a == b && a != EOF);
+    return a == b;
+}
+
+uint8_t LC3CosimRun(LC3Cosim_t *cosim)
+{
+    cosim->instructions = 0;
+    cosim->diverged = 0;
+    cosim->divergedAt = 0;
+    cosim->divergedCount = 0;
+    LC3CosimPair_t pair;
+    if (LC3CosimOpen(cosim, &pair))
+    {
+        return EXIT_FAILURE;
+    }
+    uint64_t interval = cosim->interval ? cosim->interval : 1U;
+    uint64_t done = 0;
+    while (done < cosim->maxInstructions && pair.vms[COSIM_CANDIDATE]->cpu.stat.running)
+    {
+        uint64_t count = cosim->maxInstructions - done < interval ? cosim->maxInstructions - done : interval;
+        uint64_t ran = LC3CosimAdvance(pair.vms[COSIM_CANDIDATE], count);
+        // The reference follows the engine, an engine that stops early shows up as a difference
+        uint64_t ranReference = LC3CosimAdvance(pair.vms[COSIM_REFERENCE], ran);
+        if (ranReference == ran && !LC3CosimDiff(&pair, NULL))
+        {
+            memset(pair.dirty, 0, sizeof(pair.dirty));
+            done += ran;
+            if (cosim->diverged && done >= cosim->divergedAt + cosim->divergedCount)
+            {
+                // Smaller intervals don't reproduce it, keep the smallest range that did
+                break;
+            }
+            continue;
+        }
+        cosim->diverged = 1;
+        cosim->divergedAt = done;
+        cosim->divergedCount = ran ? ran : 1U;
+        // A superinstruction is the smallest range the engine can run
+        if (ran <= 1U || count == 1U)
+        {
+            break;
+        }
+        // Runs are deterministic, both run again to the last equal checkpoint and the rest is split in halves
+        LC3CosimClose(&pair);
+        if (LC3CosimOpen(cosim, &pair))
+        {
+            return EXIT_FAILURE;
+        }
+        LC3CosimAdvance(pair.vms[COSIM_CANDIDATE], done);
+        LC3CosimAdvance(pair.vms[COSIM_REFERENCE], done);
+        if (LC3CosimDiff(&pair, NULL))
+        {
+            // Only reproduced with the original slices, keep the range
+            break;
+        }
+        interval = (ran + 1U) / 2U;
+    }
+    cosim->instructions = done;
+    if (!cosim->diverged && !LC3CosimSameOutput(&pair))
+    {
+        cosim->diverged = 1;
+        cosim->divergedAt = done;
+    }
+    LC3CosimClose(&pair);
+    return cosim->diverged ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void LC3CosimReport(LC3Cosim_t *cosim, FILE *out)
+{
+    const char *reference = LC3Engines[ENGINE_TABLE].name;
+    const char *candidate = LC3Engines[cosim->engine].name;
+    if (!cosim->diverged)
+    {
+        return;
+    }
+    if (!cosim->divergedCount)
+    {
+        fprintf(out, "%s wrote a different output than %s, both ran %llu instructions\n", candidate, reference,
+                (unsigned long long)cosim->divergedAt);
+        return;
+    }
+    LC3CosimPair_t pair;
+    if (LC3CosimOpen(cosim, &pair))
+    {
+        fprintf(out, "Can't create the vms\n");
+        return;
+    }
+    LC3Vm_t *ref = pair.vms[COSIM_REFERENCE];
+    LC3Vm_t *cand = pair.vms[COSIM_CANDIDATE];
+    LC3CosimAdvance(cand, cosim->divergedAt);
+    uint64_t ran = LC3CosimAdvance(cand, cosim->divergedCount);
+
+    // The reference runs one by one from a few instructions before the range to keep the first ones
+    uint64_t context = cosim->divergedAt < COSIM_CONTEXT ? cosim->divergedAt : COSIM_CONTEXT;
+    LC3CosimAdvance(ref, cosim->divergedAt - context);
+    uint16_t pcs[COSIM_HISTORY];
+    uint16_t words[COSIM_HISTORY];
+    uint64_t steps = 0;
+    while (steps < context + cosim->divergedCount && ref->cpu.stat.running)
+    {
+        if (steps < COSIM_HISTORY)
+        {
+            pcs[steps] = ref->cpu.PC;
+            words[steps] = MEMORY_READ(&ref->firmware.memory, ref->cpu.PC);
+        }
+        LC3CosimAdvance(ref, 1U);
+        steps++;
+    }
+
+    if (cosim->divergedCount == 1U)
+    {
+        fprintf(out, "%s diverged from %s at instruction %llu\n", candidate, reference,
+                (unsigned long long)cosim->divergedAt + 1U);
+    }
+    else
+    {
+        fprintf(out, "%s diverged from %s between instructions %llu and %llu\n", candidate, reference,
+                (unsigned long long)cosim->divergedAt + 1U,
+                (unsigned long long)(cosim->divergedAt + cosim->divergedCount));
+    }
+    fprintf(out, "  %-10s %-10s %s\n", "", reference, candidate);
+    if (steps - context != ran)
+    {
+        // The state can be the same, one of them stopped or couldn't stop at the end of the range
+        fprintf(out, "  %-10s %-10llu %llu\n", "retired", (unsigned long long)(steps - context),
+                (unsigned long long)ran);
+        fprintf(out, "  %-10s %-10s %s\n", "stopped", ref->cpu.stat.running ? "no" : "yes",
+                cand->cpu.stat.running ? "no" : "yes");
+    }
+    if (!LC3CosimDiff(&pair, out) && steps - context == ran)
+    {
+        fprintf(out, "  the state only differed when run with the checkpoints of the comparison\n");
+    }
+    fprintf(out, "Instructions run by %s, the diverged range is marked with >\n", reference);
+    for (uint64_t i = 0; i < steps && i < COSIM_HISTORY; i++)
+    {
+        char text[32];
+        LC3AsmDisassemble(pcs[i], words[i], text, sizeof(text));
+        fprintf(out, "%c x%04X  %04X  %s\n", i < context ? ' ' : '>', pcs[i], words[i], text);
+    }
+    if (steps > COSIM_HISTORY)
+    {
+        fprintf(out, "  ... %llu more\n", (unsigned long long)(steps - COSIM_HISTORY));
+    }
+    LC3CosimClose(&pair);
+}
+
+/**
+ * @brief xorshift32 generator, the same sequence on every host
+ * 
+ * @param state state of the generator, not 0
+ * @return uint32_t next number
+ */
+static uint32_t LC3CosimRandom(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+uint8_t LC3CosimRandomImage(LC3Firmware_t *image, uint32_t seed, uint16_t words)
+{
+    static const uint8_t vectors[] = {TRAP_GETC, TRAP_OUT, TRAP_PUTS, TRAP_IN, TRAP_PUTSP};
+    uint32_t state = seed ? seed : 1U;
+    uint8_t status = EXIT_SUCCESS;
+    if (words > IO_PAGE_ADDRESS - PC_START_ADDRESS)
+    {
+        words = IO_PAGE_ADDRESS - PC_START_ADDRESS;
+    }
+    releaseFirmware(image);
+    for (uint32_t i = 0; i < words; i++)
+    {
+        uint16_t word = (uint16_t)LC3CosimRandom(&state);
+        if ((word >> 12) == OP_TRAP)
+        {
+            // HALT would end most programs in a few instructions
+            word = 0xF000 | vectors[LC3CosimRandom(&state) % sizeof(vectors)];
+        }
+        status |= LC3MemoryWrite(&image->memory, PC_START_ADDRESS + i, word);
+    }
+    // Exceptions return to the next instruction, so RTI in user mode and the reserved opcode don't end the run
+    status |= LC3MemoryWrite(&image->memory, COSIM_HANDLER_ADDRESS, COSIM_HANDLER_WORD);
+    status |= LC3MemoryWrite(&image->memory, INT_VECTOR_TABLE + INT_PRIVILEGE, COSIM_HANDLER_ADDRESS);
+    status |= LC3MemoryWrite(&image->memory, INT_VECTOR_TABLE + INT_ILLEGAL, COSIM_HANDLER_ADDRESS);
+    image->filename = "<random>";
+    image->memOrig = PC_START_ADDRESS;
+    image->size = words;
+    image->isLoaded = 1;
+    return status;
+}
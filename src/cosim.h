@@ -0,0 +1,145 @@
+/**
+ * @file cosim.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Lockstep co-simulation of an engine against the reference table
+ * engine. Both run the same image with exact instruction budgets and their
+ * state is compared at every checkpoint, a divergence is narrowed down by
+ * running both again from the start with smaller intervals.
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__COSIM_H__)
+#define __COSIM_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "defs.h"
+#include "firmware.h"
+
+/**
+ * @brief Instructions between two checkpoints by default, bigger than a jit
+ * block so the blocks run compiled
+ * 
+ */
+#define COSIM_DEFAULT_INTERVAL 4096
+
+/**
+ * @brief Instructions compared by default before giving up on a program
+ * that doesn't halt
+ * 
+ */
+#define COSIM_DEFAULT_MAX_INSTRUCTIONS 100000000ULL
+
+/**
+ * @brief Instructions of the reference shown in a divergence report, the
+ * ones before the divergence and the first ones of their range
+ * 
+ */
+#define COSIM_CONTEXT 8
+#define COSIM_HISTORY 24
+
+/**
+ * @brief Memory words listed in a divergence report
+ * 
+ */
+#define COSIM_MAX_MEMORY_DIFFS 8
+
+/**
+ * @brief Words of a random image by default, all the memory from the
+ * program start to the IO page so most jumps land on random code
+ * 
+ */
+#define COSIM_DEFAULT_RANDOM_WORDS (IO_PAGE_ADDRESS - PC_START_ADDRESS)
+
+/**
+ * @brief Co-simulation of an image
+ * 
+ */
+typedef struct LC3Cosim_t
+{
+    /**
+     * @brief loaded program, every run starts from a copy of it
+     * 
+     */
+    const LC3Firmware_t *image;
+    /**
+     * @brief path/filename of the keyboard input, NULL for an empty keyboard
+     * 
+     */
+    const char *input;
+    /**
+     * @brief Lc3Engines_e compared against the table engine
+     * 
+     */
+    uint8_t engine;
+    /**
+     * @brief flag indicating if the compared engine runs superinstructions,
+     * only the table engine has them. A superinstruction is counted by the
+     * instructions it replaces and can't be split, so the checkpoints fall
+     * between them.
+     * 
+     */
+    uint8_t fusion;
+    /**
+     * @brief instructions between two checkpoints
+     * 
+     */
+    uint64_t interval;
+    /**
+     * @brief instructions compared before stopping, the run is considered
+     * equal if it doesn't halt before
+     * 
+     */
+    uint64_t maxInstructions;
+    /**
+     * @brief instructions compared by the last run
+     * 
+     */
+    uint64_t instructions;
+    /**
+     * @brief flag indicating if the last run diverged, the divergence is
+     * somewhere in the divergedCount instructions after divergedAt, exactly
+     * at divergedAt if divergedCount is 1 and only on the output if it's 0
+     * 
+     */
+    uint8_t diverged;
+    uint64_t divergedAt;
+    uint64_t divergedCount;
+} LC3Cosim_t;
+
+/**
+ * @brief Runs the engine and the reference in lockstep until both halt,
+ * maxInstructions is reached or they diverge
+ * 
+ * @param cosim co-simulation settings, receives the result
+ * @return uint8_t EXIT_FAILURE if they diverged or the vms can't be created
+ */
+uint8_t LC3CosimRun(LC3Cosim_t *cosim);
+
+/**
+ * @brief Runs again the diverged instructions and writes the state that
+ * differs and the disassembly of the last instructions of the reference
+ * 
+ * @param cosim co-simulation with a divergence
+ * @param out output stream
+ */
+void LC3CosimReport(LC3Cosim_t *cosim, FILE *out);
+
+/**
+ * @brief Fills an image with random instruction words at PC_START_ADDRESS.
+ * Every opcode and encoding can appear, traps use the service vectors but
+ * HALT, and the exception vectors point to a handler that returns.
+ * 
+ * @param image firmware that receives the program, prepared by initFirmware.
+ * What it had is released.
+ * @param seed seed of the generator, the same seed gives the same image
+ * @param words count of random words
+ * @return uint8_t EXIT_FAILURE if there is no memory for the image
+ */
+uint8_t LC3CosimRandomImage(LC3Firmware_t *image, uint32_t seed, uint16_t words);
+
+#endif  // __COSIM_H__
@@ -2,10 +2,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "console.h"
 #include "firmware.h"
+#include "jit.h"
 #include "log.h"
+#include "profile.h"
+#include "threaded.h"
 #include "utils.h"
 
 LC3OpcodeAction_t LC3Opcodes[OP_COUNT] =
@@ -18,45 +26,133 @@ LC3OpcodeAction_t LC3Opcodes[OP_COUNT] =
         {"AND ", OP_AND, LC3Inst_and},
         {"LDR ", OP_LDR, LC3Inst_ldr},
         {"STR ", OP_STR, LC3Inst_str},
-        {"JSRR", OP_JSRR, LC3Inst_jsr},
+        {"RTI ", OP_RTI, LC3Inst_rti},
         {"NOT ", OP_NOT, LC3Inst_not},
         {"LDI ", OP_LDI, LC3Inst_ldi},
         {"STI ", OP_STI, LC3Inst_sti},
         {"JMP ", OP_JMP, LC3Inst_jmp},
-        {"RES ", OP_RES, NULL},
+        {"RES ", OP_RES, LC3Inst_res},
         {"LEA ", OP_LEA, LC3Inst_lea},
         {"TRAP", OP_TRAP, LC3Inst_trap}};
 
-uint8_t LC3CpuInit(LC3Cpu_t *cpu, LC3Firmware_t *firmware)
+LC3EngineAction_t LC3Engines[ENGINE_COUNT] =
+    {
+        {"table", ENGINE_TABLE, LC3CpuExecute},
+        {"threaded", ENGINE_THREADED, LC3CpuExecuteThreaded},
+        {"jit", ENGINE_JIT, LC3CpuExecuteJit}};
+
+uint8_t LC3CpuInit(LC3Cpu_t *cpu, LC3Firmware_t *firmware, LC3Console_t *console)
 {
-    LOG_LN("Initializing CPU");
+    LOG_DEBUG("Initializing CPU");
     cpu->PC = PC_START_ADDRESS;
-    cpu->CC = 0b000;
+    cpu->CC = CC_Z;
     cpu->stat.incrementPC = 0b1;
     cpu->stat.running = 0b1;
+    cpu->stat.fusion = 0b1;
+    cpu->stat.limited = 0b0;
+    cpu->stat.idle = 0b0;
+    cpu->boundary = 0;
+    cpu->budget = 0;
+    cpu->psr = 0;
+    cpu->savedSSP = SUPERVISOR_STACK_ADDRESS;
+    cpu->savedUSP = 0;
+    // Keys can arrive before the cpu starts, the first block that ends looks at them
+    atomic_init(&cpu->pending, CPU_PENDING_INTERRUPT);
+    cpu->profile = NULL;
+    cpu->replay = NULL;
+    cpu->jit = NULL;
+    cpu->dirty = NULL;
+    cpu->stats = NULL;
+    LC3DevicesInit(&cpu->devices);
+    memset(cpu->fusions, 0, sizeof(cpu->fusions));
     if (!firmware)
     {
         return EXIT_FAILURE;
     }
     cpu->firmware = firmware;
+    cpu->console = console;
     return EXIT_SUCCESS;
 }
 
 void LC3CpuExecute(LC3Cpu_t *cpu)
 {
+    LC3DecodedInst_t uncached;
+    // Raised by another engine that already looked at the pending word
+    cpu->boundary = 0;
     while (cpu->stat.running)
     {
-        LC3Instruction_t inst = LC3CpuReadInstruction(cpu);
-        LOG(" PC: 0x%04X [0x%04X] -> %s ",
-            cpu->PC,
-            LC3CpuReadMemory(cpu, cpu->PC),
-            LC3Opcodes[inst.opcode].name);
-        LC3Opcodes[inst.opcode].action(cpu, inst);
+        if (cpu->stat.limited)
+        {
+            if (!cpu->budget)
+            {
+                return;
+            }
+            cpu->budget--;
+        }
+        LC3DecodedInst_t *inst = LC3CpuFetch(cpu, &uncached);
+        if (cpu->trace.level)
+        {
+            LC3TraceBegin(&cpu->trace, cpu->PC, inst->word);
+        }
+        STATS_RETIRE(cpu->stats, inst);
+        inst->action(cpu, inst);
         if (cpu->stat.incrementPC)
         {
             cpu->PC++;
         }
+        if (cpu->boundary)
+        {
+            cpu->boundary = 0;
+            if (cpu->stat.running && atomic_load_explicit(&cpu->pending, memory_order_relaxed))
+            {
+                LC3CpuCheckPending(cpu);
+            }
+        }
+    }
+}
+
+uint8_t LC3CpuFindEngine(const char *name)
+{
+    uint8_t engine;
+    for (engine = 0; engine < ENGINE_COUNT; engine++)
+    {
+        if (strcmp(LC3Engines[engine].name, name) == 0)
+        {
+            break;
+        }
+    }
+    return engine;
+}
+
+LC3DecodedInst_t *LC3CpuFetch(LC3Cpu_t *cpu, LC3DecodedInst_t *uncached)
+{
+    LC3DecodedInst_t *inst;
+    LC3DecodedInst_t *page = cpu->firmware->decoded[cpu->PC >> MEMORY_PAGE_SHIFT];
+    // The cache of a page is allocated the first time it runs, the IO page never has one
+    if (!page && cpu->PC < IO_PAGE_ADDRESS)
+    {
+        page = allocDecodedPage(cpu->firmware, cpu->PC);
+    }
+    if (page)
+    {
+        inst = &page[cpu->PC & MEMORY_PAGE_MASK];
+        if (!inst->action)
+        {
+            LC3CpuDecode(LC3CpuReadInstruction(cpu), inst);
+            if (cpu->stat.fusion && !cpu->trace.level)
+            {
+                LC3FusionApply(cpu, cpu->PC);
+            }
+        }
+    }
+    else
+    {
+        // Words on the IO page are never cached, reading them has side effects. Pages
+        // without memory for their cache are decoded every time too
+        inst = uncached;
+        LC3CpuDecode(LC3CpuReadInstruction(cpu), inst);
     }
+    return inst;
 }
 
 LC3Instruction_t LC3CpuReadInstruction(LC3Cpu_t *cpu)
@@ -66,26 +162,283 @@ LC3Instruction_t LC3CpuReadInstruction(LC3Cpu_t *cpu)
     return *c;
 }
 
+void LC3CpuDecode(LC3Instruction_t inst, LC3DecodedInst_t *decoded)
+{
+    decoded->action = LC3Opcodes[inst.opcode].action;
+    decoded->word = (inst.opcode << 12) | inst.body;
+    decoded->dr = READ_3BITS(inst.body, 9U);
+    decoded->sr1 = READ_3BITS(inst.body, 6U);
+    decoded->sr2 = READ_3BITS(inst.body, 0U);
+    decoded->flags = 0;
+    decoded->offset = 0;
+    switch (inst.opcode)
+    {
+    case OP_BR:
+        decoded->flags = READ_3BITS(inst.body, 9U);  // nzp, same layout as CC
+        decoded->offset = sign_extend(inst.body & 0x1FF, 9U);
+        break;
+    case OP_ADD:
+    case OP_AND:
+        decoded->flags = READ_BIT(inst.body, 5U);
+        decoded->offset = sign_extend(inst.body & 0x1F, 5U);
+        break;
+    case OP_LD:
+    case OP_ST:
+    case OP_LDI:
+    case OP_STI:
+    case OP_LEA:
+        decoded->offset = sign_extend(inst.body & 0x1FF, 9U);
+        break;
+    case OP_JSR:
+        decoded->flags = READ_BIT(inst.body, 11U);
+        decoded->offset = sign_extend(inst.body & 0x7FF, 11U);
+        break;
+    case OP_LDR:
+    case OP_STR:
+        decoded->offset = sign_extend(inst.body & 0x3F, 6U);
+        break;
+    case OP_TRAP:
+        decoded->offset = inst.body & 0xFF;
+        break;
+    }
+}
+
 uint16_t LC3CpuReadMemory(LC3Cpu_t *cpu, uint16_t addr)
 {
-    if (addr == MMR_KBSR)
+    // RAM pages have no entry, only the IO page pays for the device lookup
+    const LC3DevicePage_t *page = cpu->devices.pages[addr >> DEVICE_PAGE_SHIFT];
+    if (!page)
+    {
+        return MEMORY_READ(&cpu->firmware->memory, addr);
+    }
+    return LC3DeviceRead(cpu, page, addr);
+}
+
+void LC3CpuWriteMemory(LC3Cpu_t *cpu, uint16_t addr, uint16_t value)
+{
+    if (cpu->dirty)
+    {
+        cpu->dirty[addr >> CPU_DIRTY_PAGE_SHIFT] = 1;
+    }
+    const LC3DevicePage_t *page = cpu->devices.pages[addr >> DEVICE_PAGE_SHIFT];
+    if (page)
+    {
+        // Device pages are never decoded, see LC3CpuFetch
+        LC3DeviceWrite(cpu, page, addr, value);
+        return;
+    }
+    if (LC3MemoryWrite(&cpu->firmware->memory, addr, value))
     {
-        if (OSKeyboardIsKeyPressed())
+        LOG_ERROR("Can't copy the page of 0x%04X, stopping the cpu", addr);
+        cpu->stat.running = 0;
+        return;
+    }
+    // Self modifying code, decode it again with the superinstructions that include it
+    LC3DecodedInst_t *decoded = cpu->firmware->decoded[addr >> MEMORY_PAGE_SHIFT];
+    for (uint16_t i = 0; decoded && i < FUSION_MAX_LENGTH && i <= (addr & MEMORY_PAGE_MASK); i++)
+    {
+        decoded[(addr & MEMORY_PAGE_MASK) - i].action = NULL;
+    }
+    if (cpu->jit)
+    {
+        LC3JitInvalidate(cpu->jit, addr);
+    }
+}
+
+uint16_t LC3CpuGetPSR(LC3Cpu_t *cpu)
+{
+    return cpu->psr | cpu->CC;
+}
+
+void LC3CpuSetPSR(LC3Cpu_t *cpu, uint16_t value)
+{
+    cpu->psr = value & (PSR_USER | PSR_PRIORITY_MASK);
+    cpu->CC = value & (CC_N | CC_Z | CC_P);
+    LC3CpuRequestInterrupt(cpu);
+}
+
+void LC3CpuRequestInterrupt(LC3Cpu_t *cpu)
+{
+    atomic_fetch_or(&cpu->pending, CPU_PENDING_INTERRUPT);
+}
+
+/**
+ * @brief Reads a word for LC3CpuIsIdle without the side effects of the
+ * devices, KBSR is the only device word it can read
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param addr address to read
+ * @param value output value of the word
+ * @param polled set to 1 if the word is KBSR
+ * @return uint8_t EXIT_FAILURE if the word is another device or IO word
+ */
+static uint8_t LC3CpuPeekMemory(const LC3Cpu_t *cpu, uint16_t addr, uint16_t *value, uint8_t *polled)
+{
+    if (addr < IO_PAGE_ADDRESS)
+    {
+        *value = MEMORY_READ(&cpu->firmware->memory, addr);
+        return EXIT_SUCCESS;
+    }
+    if (addr != MMR_KBSR || cpu->devices.io.words[addr & DEVICE_PAGE_MASK] != &LC3KeyboardDevice)
+    {
+        return EXIT_FAILURE;
+    }
+    *value = cpu->devices.kbsr;
+    *polled = 1;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Checks if the program is in a loop that only a key can end: the
+ * loop at PC polls KBSR, only reads memory and registers, and one turn of it
+ * leaves the registers and condition codes as they were. Every turn until a
+ * key arrives would do the same, so the cpu can sleep instead of running
+ * them. The loop runs on a copy of the registers.
+ * 
+ * @param cpu pointer to the cpu instance
+ * @return uint8_t 1 if the loop is idle
+ */
+static uint8_t LC3CpuIsIdle(const LC3Cpu_t *cpu)
+{
+    if (cpu->devices.kbsr & DEVICE_STATUS_READY)
+    {
+        return 0;
+    }
+    uint16_t regs[REG_COUNT];
+    memcpy(regs, cpu->regs, sizeof(regs));
+    uint16_t cc = cpu->CC;
+    uint16_t pc = cpu->PC;
+    uint8_t polled = 0;
+    for (uint8_t i = 0; i < CPU_IDLE_LOOP_MAX; i++)
+    {
+        if (pc >= IO_PAGE_ADDRESS)
         {
-            cpu->firmware->memory[MMR_KBSR] = (1 << 15);
-            cpu->firmware->memory[MMR_KBDR] = getchar();
+            return 0;
         }
-        else
+        uint16_t word = MEMORY_READ(&cpu->firmware->memory, pc);
+        LC3Instruction_t *c = (LC3Instruction_t *)&word;
+        LC3DecodedInst_t inst;
+        LC3CpuDecode(*c, &inst);
+        pc++;
+        uint16_t addr;
+        uint16_t value;
+        switch (word >> 12)
         {
-            cpu->firmware->memory[MMR_KBSR] = 0;
+        case OP_BR:
+            if (inst.flags & cc)
+            {
+                pc += inst.offset;
+            }
+            break;
+        case OP_ADD:
+        case OP_AND:
+            value = inst.flags ? inst.offset : regs[inst.sr2];
+            regs[inst.dr] = (word >> 12) == OP_ADD ? regs[inst.sr1] + value : regs[inst.sr1] & value;
+            break;
+        case OP_NOT:
+            regs[inst.dr] = ~regs[inst.sr1];
+            break;
+        case OP_LEA:
+            regs[inst.dr] = pc + inst.offset;
+            break;
+        case OP_LD:
+            if (LC3CpuPeekMemory(cpu, pc + inst.offset, &regs[inst.dr], &polled))
+            {
+                return 0;
+            }
+            break;
+        case OP_LDR:
+            if (LC3CpuPeekMemory(cpu, regs[inst.sr1] + inst.offset, &regs[inst.dr], &polled))
+            {
+                return 0;
+            }
+            break;
+        case OP_LDI:
+            if (LC3CpuPeekMemory(cpu, pc + inst.offset, &addr, &polled) ||
+                LC3CpuPeekMemory(cpu, addr, &regs[inst.dr], &polled))
+            {
+                return 0;
+            }
+            break;
+        default:
+            // Stores, jumps and traps can change what the next turn does
+            return 0;
+        }
+        if ((word >> 12) != OP_BR)
+        {
+            value = regs[inst.dr];
+            cc = !value ? CC_Z : (value >> 15) ? CC_N : CC_P;
+        }
+        if (pc == cpu->PC)
+        {
+            return polled && cc == cpu->CC && !memcmp(regs, cpu->regs, sizeof(regs));
         }
     }
-    return cpu->firmware->memory[addr];
+    return 0;
 }
 
-void LC3CpuWriteMemory(LC3Cpu_t *cpu, uint16_t addr, uint16_t value)
+void LC3CpuCheckPending(LC3Cpu_t *cpu)
 {
-    cpu->firmware->memory[addr] = value;
+    // Cleared before looking at the devices, a request raised meanwhile is seen at the next boundary
+    uint16_t pending = atomic_exchange(&cpu->pending, 0);
+    if ((pending & CPU_PENDING_SAMPLE) && cpu->profile)
+    {
+        LC3ProfileSample(cpu->profile, cpu->PC);
+    }
+    if (pending & CPU_PENDING_INTERRUPT)
+    {
+        uint8_t vector;
+        uint8_t priority = LC3DeviceRequest(cpu, &vector);
+        if (priority > (cpu->psr & PSR_PRIORITY_MASK) >> PSR_PRIORITY_SHIFT)
+        {
+            LC3CpuInterrupt(cpu, vector, priority);
+            return;
+        }
+    }
+    if ((pending & CPU_PENDING_IDLE) && LC3CpuIsIdle(cpu))
+    {
+        // The next poll takes the key, or finds the loop idle again
+        OSKeyboardWait(cpu->console, CPU_IDLE_WAIT_MS);
+    }
+}
+
+uint8_t LC3CpuInterrupt(LC3Cpu_t *cpu, uint8_t vector, uint8_t priority)
+{
+    uint16_t handler = LC3CpuReadMemory(cpu, INT_VECTOR_TABLE + vector);
+    if (!handler)
+    {
+        // There is no OS image, an empty vector means nobody installed a handler
+        LOG_WARN("No handler for vector 0x%02X at 0x%04X, stopping", vector, cpu->PC);
+        cpu->stat.running = 0b0;
+        return EXIT_FAILURE;
+    }
+    uint16_t psr = LC3CpuGetPSR(cpu);
+    if (psr & PSR_USER)
+    {
+        cpu->savedUSP = cpu->regs[REG_R6];
+        cpu->regs[REG_R6] = cpu->savedSSP;
+    }
+    cpu->regs[REG_R6] -= 2U;
+    LC3CpuWriteMemory(cpu, cpu->regs[REG_R6] + 1U, psr);
+    LC3CpuWriteMemory(cpu, cpu->regs[REG_R6], cpu->PC);
+    cpu->psr = (uint16_t)priority << PSR_PRIORITY_SHIFT;
+    cpu->PC = handler;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Raises an exception from the handler of an instruction, returns to
+ * the next instruction
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param vector exception vector
+ */
+static void LC3CpuException(LC3Cpu_t *cpu, uint8_t vector)
+{
+    cpu->PC++;
+    LC3CpuInterrupt(cpu, vector, (cpu->psr & PSR_PRIORITY_MASK) >> PSR_PRIORITY_SHIFT);
+    // Because we increment PC finishing the instruction, we need to decrement by 1 the PC register now
+    cpu->PC--;
 }
 
 void LC3CpuUpdateCCReg(LC3Cpu_t *cpu, uint16_t reg)
@@ -105,27 +458,26 @@ void LC3CpuUpdateCCReg(LC3Cpu_t *cpu, uint16_t reg)
     }
 }
 
-void LC3Inst_br(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_br(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |   BR OPCODE   |   |   |   |           |
     // +---+---+---+---+---+---+---+-----------+
     // | 0 | 0 | 0 | 0 | n | z | p | PCOffset9 |
     // +---+---+---+---+---+---+---+-----------+
-    uint8_t br = READ_BIT(inst.body, 11U) && cpu->CC_N;
-    br |= READ_BIT(inst.body, 10U) && cpu->CC_Z;
-    br |= READ_BIT(inst.body, 9U) && cpu->CC_P;
-    if (br)
+    if (inst->flags & cpu->CC)
     {
-        cpu->PC += sign_extend(inst.body & 0x1FF, 9U);
-        LOG_TXT("# BR $0x%04X\n", cpu->PC);
+        cpu->PC += inst->offset;
+        TRACE(&cpu->trace, cpu->PC + 1U, 1U);
+        STATS(cpu->stats, brTaken);
     }
     else
     {
-        LOG_TXT("# BR $0x%04X xxx\n", cpu->PC);
+        STATS(cpu->stats, brNotTaken);
     }
+    cpu->boundary = 1;
 }
 
-void LC3Inst_add(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_add(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |   ADD OPCODE  | dr | sr1 | in|    param    |
     // +---+---+---+---+----+-----+---+---+---+-----+
@@ -134,52 +486,45 @@ void LC3Inst_add(LC3Cpu_t *cpu, LC3Instruction_t inst)
     // | 0 | 0 | 0 | 1 | DR | SR1 | 1 |  Inmediate  |
     // +---+---+---+---+----+-----+---+---+---+-----+
     // If in (inmediate) flag is active then the param value is directly added
-    uint16_t dr = READ_3BITS(inst.body, 9U);
-    uint16_t sr = READ_3BITS(inst.body, 6U);
-    uint16_t v = cpu->regs[sr];
-    if ((inst.body >> 5) & 0x1)  // bit inmediate
+    uint16_t v = cpu->regs[inst->sr1];
+    if (inst->flags)  // bit inmediate
     {
-        uint16_t p = sign_extend(inst.body & 0x1F, 5);
-        cpu->regs[dr] = v + p;
-        LOG_TXT("# R%u <- R%u + 0x%04X = 0x%04X\n", dr, sr, p, cpu->regs[dr]);
+        cpu->regs[inst->dr] = v + inst->offset;
     }
     else
     {
-        uint16_t p = cpu->regs[inst.body & 0x7];
-        cpu->regs[dr] = v + p;
-        LOG_TXT("# R%u <- R%u + R%u = 0x%04X\n", dr, sr, p, cpu->regs[dr]);
+        cpu->regs[inst->dr] = v + cpu->regs[inst->sr2];
     }
-    LC3CpuUpdateCCReg(cpu, dr);
+    TRACE(&cpu->trace, 0, cpu->regs[inst->dr]);
+    LC3CpuUpdateCCReg(cpu, inst->dr);
 }
 
-void LC3Inst_ld(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_ld(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |    LD OPCODE  |    |           |
     // +---+---+---+---+----+-----------+
-    // | 1 | 0 | 1 | 0 | DR | PCOffset9 |
+    // | 0 | 0 | 1 | 0 | DR | PCOffset9 |
     // +---+---+---+---+----+-----------+
-    uint8_t reg = READ_3BITS(inst.body, 9U);
-    uint16_t addr = sign_extend(inst.body & 0x1FF, 9U) + cpu->PC + 1U;
+    uint16_t addr = inst->offset + cpu->PC + 1U;
     uint16_t mem = LC3CpuReadMemory(cpu, addr);
-    cpu->regs[reg] = mem;
-    LOG_TXT("# R%u <- $0x%04X = 0x%04X\n", reg, addr, mem);
-    LC3CpuUpdateCCReg(cpu, reg);
+    cpu->regs[inst->dr] = mem;
+    TRACE(&cpu->trace, addr, mem);
+    LC3CpuUpdateCCReg(cpu, inst->dr);
 }
 
-void LC3Inst_st(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_st(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |   ST OPCODE   | sr |           |
     // +---+---+---+---+----+---+---+---+
-    // | 1 | 0 | 0 | 1 | SR | PCoffset9 |
+    // | 0 | 0 | 1 | 1 | SR | PCoffset9 |
     // +---+---+---+---+----+---+---+---+
-    uint16_t reg = READ_3BITS(inst.body, 9U);
-    uint16_t pc_offset = sign_extend(inst.body & 0x1FF, 9U) + cpu->PC + 1u;
-    uint16_t mem = cpu->regs[reg];
+    uint16_t pc_offset = inst->offset + cpu->PC + 1U;
+    uint16_t mem = cpu->regs[inst->dr];
     LC3CpuWriteMemory(cpu, pc_offset, mem);
-    LOG_TXT("# (R%u + offset) -> $0x%04X = 0x%04X\n", reg, pc_offset, mem);
+    TRACE(&cpu->trace, pc_offset, mem);
 }
 
-void LC3Inst_jsr(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_jsr(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |  JSR OPCODE   | J |       |       |                       |
     // +---+---+---+---+---+---+---+-------+---+---+---+---+---+---+
@@ -187,20 +532,23 @@ void LC3Inst_jsr(LC3Cpu_t *cpu, LC3Instruction_t inst)
     // +---+---+---+---+---+---+---+-------+---+---+---+---+---+---+
     // | 0 | 1 | 0 | 0 | 0 | 0 | 0 | BaseR | 0 | 0 | 0 | 0 | 0 | 0 |
     // +---+---+---+---+---+---+---+-------+---+---+---+---+---+---+
-    cpu->regs[REG_R7] = cpu->PC;
+    uint16_t base = cpu->regs[inst->sr1];  // Read before R7 is overwritten, JSRR R7 is valid
+    cpu->regs[REG_R7] = cpu->PC + 1U;
 
-    if (READ_BIT(inst.body, 11U))  // bit 11 | 0 = JSRR | 1 = JSR
+    if (inst->flags)  // bit 11 | 0 = JSRR | 1 = JSR
     {
-        cpu->PC += sign_extend(inst.body & 0x3FF, 11U);
+        cpu->PC += inst->offset;
     }
     else
     {
-        cpu->PC = READ_3BITS(inst.body, 6);
+        // Because we increment PC finishing this function, we need to decrement by 1 the PC register now
+        cpu->PC = base - 1U;
     }
-    LOG_TXT("# PC <- $0x%04X, R7 <- $0x%04X\n", cpu->PC + 1U, cpu->regs[REG_R7]);
+    TRACE(&cpu->trace, cpu->PC + 1U, cpu->regs[REG_R7]);
+    cpu->boundary = 1;
 }
 
-void LC3Inst_and(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_and(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |   AND OPCODE  | dr | sr1 | in|    param    |
     // +---+---+---+---+----+-----+---+---+---+-----+
@@ -209,98 +557,82 @@ void LC3Inst_and(LC3Cpu_t *cpu, LC3Instruction_t inst)
     // | 0 | 1 | 0 | 1 | DR | SR1 | 1 |  Inmediate  |
     // +---+---+---+---+----+-----+---+---+---+-----+
     // If in (inmediate) flag is active then the param value is directly added
-
-    uint16_t dr = READ_3BITS(inst.body, 9U);
-    uint16_t sr = READ_3BITS(inst.body, 6U);
-    uint16_t v = cpu->regs[sr];
-    if (READ_BIT(inst.body, 5))  // bit inmediate
+    uint16_t v = cpu->regs[inst->sr1];
+    if (inst->flags)  // bit inmediate
     {
-        uint16_t p = sign_extend(inst.body & 0x1F, 5);
-        cpu->regs[dr] = v & p;
-        LOG_TXT("# R%u <- R%u & 0x%04X = 0x%04X\n", dr, sr, p, cpu->regs[dr]);
+        cpu->regs[inst->dr] = v & inst->offset;
     }
     else
     {
-        uint16_t p = cpu->regs[READ_3BITS(inst.body, 0)];
-        cpu->regs[dr] = v & p;
-        LOG_TXT("# R%u <- R%u & R%u = 0x%04X\n", dr, sr, READ_3BITS(inst.body, 0), cpu->regs[dr]);
+        cpu->regs[inst->dr] = v & cpu->regs[inst->sr2];
     }
-    LC3CpuUpdateCCReg(cpu, dr);
+    TRACE(&cpu->trace, 0, cpu->regs[inst->dr]);
+    LC3CpuUpdateCCReg(cpu, inst->dr);
 }
 
-void LC3Inst_ldr(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_ldr(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |   LDR OPCODE  |    |       |         |
     // +---+---+---+---+----+-----------------+
     // | 0 | 1 | 1 | 0 | DR | BaseR | Offset6 |
     // +---+---+---+---+----+-----------------+
-    uint16_t reg = READ_3BITS(inst.body, 9U);
-    uint16_t base = READ_3BITS(inst.body, 6U);
-
-    uint8_t offset = sign_extend(inst.body & 0x3F, 6U);
-    uint16_t addr = cpu->regs[base] + offset;
+    uint16_t addr = cpu->regs[inst->sr1] + inst->offset;
     uint16_t mem = LC3CpuReadMemory(cpu, addr);
-    cpu->regs[reg] = mem;
-    LOG_TXT("# R%u <- $0x%04X = 0x%04X\n", reg, addr, mem);
-    LC3CpuUpdateCCReg(cpu, reg);
+    cpu->regs[inst->dr] = mem;
+    TRACE(&cpu->trace, addr, mem);
+    LC3CpuUpdateCCReg(cpu, inst->dr);
 }
 
-void LC3Inst_str(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_str(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |  STR OPCODE   |    |       |           |
     // +---+---+---+---+----+---+---+---+---+---+
     // | 0 | 1 | 1 | 1 | SR | BaseR | offset6   |
     // +---+---+---+---+----+---+---+---+---+---+
-    uint16_t sr = READ_3BITS(inst.body, 9U);
-    uint16_t addr = cpu->regs[READ_3BITS(inst.body, 6U)];
-    addr += sign_extend(inst.body & 0x3F, 6U);
-    LC3CpuWriteMemory(cpu, addr, cpu->regs[sr]);
-    LOG_TXT("# R%u -> $0x%04X = 0x%04X\n", sr, addr, cpu->regs[sr]);
+    uint16_t addr = cpu->regs[inst->sr1] + inst->offset;
+    LC3CpuWriteMemory(cpu, addr, cpu->regs[inst->dr]);
+    TRACE(&cpu->trace, addr, cpu->regs[inst->dr]);
 }
 
-void LC3Inst_not(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_not(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |   NOT OPCODE  | dr | sr |               |
     // +---+---+---+---+----+----+---+---+---+---+
     // | 1 | 0 | 0 | 1 | DR | SR | 1 | 1 | 1 | 1 |
     // +---+---+---+---+----+----+---+---+---+---+
-    uint16_t dr = READ_3BITS(inst.body, 9U);
-    uint16_t sr = READ_3BITS(inst.body, 6U);
-    cpu->regs[dr] = ~cpu->regs[sr];
-    LOG_TXT("# R%u <- 0x%04X\n", dr, cpu->regs[dr]);
-    LC3CpuUpdateCCReg(cpu, dr);
+    cpu->regs[inst->dr] = ~cpu->regs[inst->sr1];
+    TRACE(&cpu->trace, 0, cpu->regs[inst->dr]);
+    LC3CpuUpdateCCReg(cpu, inst->dr);
 }
 
-void LC3Inst_ldi(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_ldi(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |   LDI OPCODE  |    |           |
     // +---+---+---+---+----+-----------+
     // | 1 | 0 | 1 | 0 | DR | PCOffset9 |
     // +---+---+---+---+----+-----------+
-    uint8_t reg = READ_3BITS(inst.body, 9U);
-    uint16_t addr = sign_extend(inst.body & 0xFF, 8U) + cpu->PC + 1U;
+    uint16_t addr = inst->offset + cpu->PC + 1U;
     uint16_t i_mem = LC3CpuReadMemory(cpu, addr);
     uint16_t mem = LC3CpuReadMemory(cpu, i_mem);
-    cpu->regs[reg] = mem;
-    LOG_TXT("# R%u <- $0x%04X (0x%04X)\n", reg, i_mem, mem);
-    LC3CpuUpdateCCReg(cpu, reg);
+    cpu->regs[inst->dr] = mem;
+    TRACE(&cpu->trace, i_mem, mem);
+    LC3CpuUpdateCCReg(cpu, inst->dr);
 }
 
-void LC3Inst_sti(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_sti(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |  STI OPCODE   | sr |           |
     // +---+---+---+---+----+---+---+---+
     // | 1 | 0 | 1 | 1 | SR | PCoffset9 |
     // +---+---+---+---+----+---+---+---+
-    uint16_t sr = READ_3BITS(inst.body, 9U);
-    uint16_t pc_offset = sign_extend(inst.body & 0x1FF, 9U) + cpu->PC;
-    uint16_t mem = cpu->regs[sr];
+    uint16_t pc_offset = inst->offset + cpu->PC + 1U;
+    uint16_t mem = cpu->regs[inst->dr];
     uint16_t mem_target = LC3CpuReadMemory(cpu, pc_offset);
     LC3CpuWriteMemory(cpu, mem_target, mem);
-    LOG_TXT("# (R%u + 0x%04X) -> $0x%04X = 0x%04X\n", sr, pc_offset, mem_target, mem);
+    TRACE(&cpu->trace, mem_target, mem);
 }
 
-void LC3Inst_jmp(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_jmp(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |  JMP OPCODE   |           |           |                       |
     // +---+---+---+---+---+---+---+-----------+---+---+---+---+---+---+
@@ -308,99 +640,203 @@ void LC3Inst_jmp(LC3Cpu_t *cpu, LC3Instruction_t inst)
     // +---+---+---+---+---+---+---+-----------+---+---+---+---+---+---+
     // | 1 | 1 | 0 | 0 | 0 | 0 | 0 | 1 | 1 | 1 | 0 | 0 | 0 | 0 | 0 | 0 | -> RET
     // +---+---+---+---+---+---+---+-----------+---+---+---+---+---+---+
-    uint16_t reg = READ_3BITS(inst.body, 6U);
-    cpu->PC = cpu->regs[reg];
-    if (reg == 0x7)  // In case RET opcode,
+    cpu->PC = cpu->regs[inst->sr1];
+    TRACE(&cpu->trace, cpu->PC, 0);
+    // Because we increment PC finishing this function, we need to decrement by 1 the PC register now
+    cpu->PC--;
+    cpu->boundary = 1;
+}
+
+void LC3Inst_rti(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
+{
+    // |  RTI OPCODE   |                                               |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 1 | 0 | 0 | 0 | 0 | 0 | 0 | 0 | 0 | 0 | 0 | 0 | 0 | 0 | 0 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    cpu->boundary = 1;
+    if (cpu->psr & PSR_USER)
     {
-        LOG_TXT("# PC <- $0x%04X <- R7\n", cpu->PC);
+        LC3CpuException(cpu, INT_PRIVILEGE);
+        return;
     }
-    else
+    uint16_t pc = LC3CpuReadMemory(cpu, cpu->regs[REG_R6]);
+    uint16_t psr = LC3CpuReadMemory(cpu, cpu->regs[REG_R6] + 1U);
+    cpu->regs[REG_R6] += 2U;
+    if (psr & PSR_USER)
     {
-        // Because we increment PC finishing this function, we need to decrement by 1 the PC register now
-        LOG_TXT("# PC <- $0x%04X\n", cpu->PC);
-        cpu->PC--;
+        cpu->savedSSP = cpu->regs[REG_R6];
+        cpu->regs[REG_R6] = cpu->savedUSP;
     }
+    // The priority goes down, a waiting interrupt can be taken now
+    LC3CpuSetPSR(cpu, psr);
+    cpu->PC = pc;
+    TRACE(&cpu->trace, cpu->PC, psr);
+    // Because we increment PC finishing this function, we need to decrement by 1 the PC register now
+    cpu->PC--;
+}
+
+void LC3Inst_res(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
+{
+    cpu->boundary = 1;
+    LC3CpuException(cpu, INT_ILLEGAL);
 }
 
-void LC3Inst_lea(LC3Cpu_t *cpu, LC3Instruction_t inst)
+void LC3Inst_lea(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |   LEA OPCODE  |    |           |
     // +---+---+---+---+----+-----------+
     // | 1 | 1 | 1 | 0 | DR | PCOffset9 |
     // +---+---+---+---+----+-----------+
-    uint8_t reg = READ_3BITS(inst.body, 9U);
-    uint8_t offset = sign_extend(inst.body & 0xFF, 8U);
-    cpu->regs[reg] = offset + cpu->PC + 1U;
-    LOG_TXT("# R%u <- 0x%04X\n", reg, cpu->regs[reg]);
-    LC3CpuUpdateCCReg(cpu, reg);
+    cpu->regs[inst->dr] = inst->offset + cpu->PC + 1U;
+    TRACE(&cpu->trace, 0, cpu->regs[inst->dr]);
+    LC3CpuUpdateCCReg(cpu, inst->dr);
 }
 
-void LC3Inst_trap(LC3Cpu_t *cpu, LC3Instruction_t inst)
+/**
+ * @brief Converts the words of a string of PUTS or PUTSP into chars up to
+ * their terminator, 8 words at once when the host has SSE2. PUTS prints the
+ * low byte of every word, PUTSP the low byte and then the high byte, the
+ * string ends with the first zero char.
+ * 
+ * @param words words of the string, they must be RAM
+ * @param count count of words that can be read
+ * @param packed 1 for PUTSP, two chars by word
+ * @param chars output chars, room for 2 * count of them
+ * @param length output count of chars before the terminator
+ * @return uint8_t 1 if the terminator was found
+ */
+static uint8_t LC3CpuStringChars(const uint16_t *words, uint32_t count, uint8_t packed, char *chars, uint32_t *length)
+{
+    uint32_t i = 0;
+    uint32_t n = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi16(0xFF);
+    for (; i + 8U <= count; i += 8U)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(words + i));
+        uint32_t zeros;
+        if (packed)
+        {
+            // Guest words are little endian in the host, the bytes are already in order
+            _mm_storeu_si128((__m128i *)(chars + n), v);
+            zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+            if (zeros)
+            {
+                *length = n + __builtin_ctz(zeros);
+                return 1;
+            }
+            n += 16U;
+        }
+        else
+        {
+            v = _mm_and_si128(v, low);
+            _mm_storel_epi64((__m128i *)(chars + n), _mm_packus_epi16(v, v));
+            zeros = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero));
+            if (zeros)
+            {
+                *length = n + __builtin_ctz(zeros) / 2U;
+                return 1;
+            }
+            n += 8U;
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        uint16_t mem = words[i];
+        if (!(mem & 0xFF))
+        {
+            *length = n;
+            return 1;
+        }
+        chars[n++] = (char)(mem & 0xFF);
+        if (packed)
+        {
+            if (!(mem >> 8))
+            {
+                *length = n;
+                return 1;
+            }
+            chars[n++] = (char)(mem >> 8);
+        }
+    }
+    *length = n;
+    return 0;
+}
+
+/**
+ * @brief Prints the string of PUTS or PUTSP. The string is converted a page
+ * at a time and written to the console as a block, only the words on pages
+ * with devices are read one by one.
+ * 
+ * @param cpu cpu instance
+ * @param addr address of the first word
+ * @param packed 1 for PUTSP, two chars by word
+ */
+static void LC3CpuPutString(LC3Cpu_t *cpu, uint16_t addr, uint8_t packed)
+{
+    char chars[MEMORY_PAGE_WORDS * 2U];
+    uint32_t length;
+    while (!cpu->devices.pages[addr >> DEVICE_PAGE_SHIFT])
+    {
+        uint32_t count = MEMORY_PAGE_WORDS - (addr & MEMORY_PAGE_MASK);
+        uint8_t found = LC3CpuStringChars(&MEMORY_READ(&cpu->firmware->memory, addr), count, packed, chars, &length);
+        OSDisplayWrite(cpu->console, chars, length);
+        if (found)
+        {
+            return;
+        }
+        addr += count;
+    }
+    while (1)
+    {
+        uint16_t mem = LC3CpuReadMemory(cpu, addr);
+        if (LC3CpuStringChars(&mem, 1U, packed, chars, &length))
+        {
+            OSDisplayWrite(cpu->console, chars, length);
+            return;
+        }
+        OSDisplayWrite(cpu->console, chars, length);
+        addr++;
+    }
+}
+
+void LC3Inst_trap(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
 {
     // |  TRAP OPCODE  |               | trap vector |
     // +---+---+---+---+---+---+---+---+-------------+
     // | 1 | 1 | 1 | 1 | 0 | 0 | 0 | 0 |   vector8   |
     // +---+---+---+---+---+---+---+---+-------------+
-    uint16_t _vector = inst.body & 0xFF;
-    uint16_t tmp;
+    uint16_t _vector = inst->offset;
 
     // First load PC incremented to R7
-    cpu->regs[REG_R7] = cpu->PC;
+    cpu->regs[REG_R7] = cpu->PC + 1U;
+    cpu->boundary = 1;
+    STATS(cpu->stats, traps[_vector]);
     switch (_vector)
     {
     case TRAP_GETC:
-        cpu->regs[REG_R0] = getchar();
-        LOG_TXT("# GETC key: %u\n", cpu->regs[REG_R0]);
+        cpu->regs[REG_R0] = LC3DeviceGetChar(cpu);
         break;
     case TRAP_OUT:
-        LOG_TXT("# OUT key: %u\n", cpu->regs[REG_R0]);
-        putc((char)cpu->regs[REG_R0], stdout);
+        OSDisplayPutChar(cpu->console, (char)cpu->regs[REG_R0]);
         break;
     case TRAP_PUTS:
-        tmp = cpu->regs[REG_R0];
-        LOG_TXT("# PUTS: ");
-        while (1)
-        {
-            char mem = LC3CpuReadMemory(cpu, tmp);
-            if (mem == 0x00)
-            {
-                break;
-            }
-            putc(mem, stdout);
-            putc(mem, fileout);  // log
-            tmp++;
-        }
-        LOG_TXT("\n");
+        LC3CpuPutString(cpu, cpu->regs[REG_R0], 0);
         break;
     case TRAP_IN:
-        cpu->regs[REG_R0] = getchar();
-        putc(cpu->regs[REG_R0], stdout);
-        LOG_TXT("# IN key: %u\n", cpu->regs[REG_R0]);
+        cpu->regs[REG_R0] = LC3DeviceGetChar(cpu);
+        OSDisplayPutChar(cpu->console, (char)cpu->regs[REG_R0]);
         break;
     case TRAP_PUTSP:
-        tmp = cpu->regs[REG_R0];
-        LOG_TXT("# PUTSP: ");
-        while (1)
-        {
-            uint16_t mem = LC3CpuReadMemory(cpu, tmp);
-            if (((mem & 0xFF) == 0x00) || ((mem >> 8) == 0x00))
-            {
-                break;
-            }
-            putc((char)(mem & 0xFF), stdout);
-            putc((char)(mem >> 8), stdout);
-
-            putc((char)(mem & 0xFF), fileout);  // log
-            putc((char)(mem >> 8), fileout);    // log
-            tmp++;
-        }
-        LOG_TXT("\n");
+        LC3CpuPutString(cpu, cpu->regs[REG_R0], 1);
         break;
     case TRAP_HALT:
         cpu->stat.running = 0b0;
-        LOG_TXT("# HALT\n");
         break;
     }
-    fflush(stdout);
-    cpu->PC = cpu->regs[REG_R7];
+    // Key read or printed, or address of the printed string
+    TRACE(&cpu->trace, cpu->regs[REG_R0], cpu->regs[REG_R0]);
+    cpu->PC = cpu->regs[REG_R7] - 1U;
 }
@@ -12,8 +12,46 @@
 #if !defined(__CPU_H__)
 #define __CPU_H__
 
+#include <stdatomic.h>
+
 #include "defs.h"
+#include "devices.h"
 #include "firmware.h"
+#include "fusion.h"
+#include "stats.h"
+#include "trace.h"
+
+/**
+ * @brief Flags of the pending word of the cpu
+ * 
+ */
+#define CPU_PENDING_INTERRUPT (1U << 0)
+#define CPU_PENDING_SAMPLE    (1U << 1)
+#define CPU_PENDING_IDLE      (1U << 2)
+
+/**
+ * @brief Instructions after which the engines look at the pending word
+ * 
+ */
+#define CPU_ENDS_BLOCK(__opcode)                                                                      \
+    ((__opcode) == OP_BR || (__opcode) == OP_JMP || (__opcode) == OP_JSR || (__opcode) == OP_TRAP || \
+     (__opcode) == OP_RTI || (__opcode) == OP_RES)
+
+/**
+ * @brief Longest polling loop, in instructions, that can be found idle, and
+ * milliseconds the cpu sleeps in it before looking at the loop again
+ * 
+ */
+#define CPU_IDLE_LOOP_MAX 8U
+#define CPU_IDLE_WAIT_MS 100U
+
+/**
+ * @brief Size of the pages tracked by the dirty flags, the memory pages
+ * 
+ */
+#define CPU_DIRTY_PAGE_SHIFT MEMORY_PAGE_SHIFT
+#define CPU_DIRTY_PAGE_WORDS (1U << CPU_DIRTY_PAGE_SHIFT)
+#define CPU_DIRTY_PAGES ((UINT16_MAX + 1U) >> CPU_DIRTY_PAGE_SHIFT)
 
 /**
  * @brief Struct to manage the state of the CPU
@@ -71,19 +109,138 @@ typedef struct LC3Cpu_t
          * 
          */
         uint8_t incrementPC : 1;
+        /**
+         * @brief flag indicating if common sequences are decoded as
+         * superinstructions, ignored while tracing
+         * 
+         */
+        uint8_t fusion : 1;
+        /**
+         * @brief flag indicating if the engines return when the budget runs
+         * out, the jit only emits the budget checks when it's set
+         * 
+         */
+        uint8_t limited : 1;
+        /**
+         * @brief flag indicating if the cpu can sleep in polling loops that
+         * can't end without a key, cleared when the instructions are counted
+         * or the vm shares their thread
+         * 
+         */
+        uint8_t idle : 1;
     } stat;
 
+    /**
+     * @brief Set by the actions of the instructions that end a block, the
+     * superinstructions that end with one too. The table engine looks at the
+     * pending word when it's set, the other engines know their opcodes and
+     * ignore it. A whole byte, so the actions only store it.
+     * 
+     */
+    uint8_t boundary;
+
+    /**
+     * @brief Privilege and priority fields of the PSR, the condition codes
+     * are kept in CC
+     * 
+     */
+    uint16_t psr;
+
+    /**
+     * @brief Stack pointer of the mode that is not running, R6 is swapped
+     * with them when the privilege changes
+     * 
+     */
+    uint16_t savedSSP;
+    uint16_t savedUSP;
+
+    /**
+     * @brief Events not handled yet: interrupt requests raised by the
+     * devices, the input thread and the priority changes, the samples of
+     * the profiler and the keyboard polls that may be idle. Every engine
+     * looks at it at the same points, right after each instruction that ends
+     * a block: BR, JMP, JSR, TRAP, RTI and the reserved opcode. The same
+     * program and input take their interrupts at the same instructions in
+     * all of them, and the hot loops only pay a load per block.
+     * 
+     */
+    _Atomic uint16_t pending;
+
+    /**
+     * @brief Sampling profiler, NULL when the run isn't profiled
+     * 
+     */
+    struct LC3Profile_t *profile;
+
+    /**
+     * @brief Recorder or player of the keyboard input, NULL when the keys are
+     * read from the console
+     * 
+     */
+    struct LC3Replay_t *replay;
+
+    /**
+     * @brief Instructions the engines can run before returning, used when
+     * the run is limited so the vm can check their limits between slices
+     * 
+     */
+    int64_t budget;
+
     /**
      * @brief Pointer to the firmware instance to execute
      * 
      */
     LC3Firmware_t *firmware;
 
+    /**
+     * @brief Pointer to the keyboard and display used by the traps
+     * 
+     */
+    struct LC3Console_t *console;
+
     /**
      * @brief Array of the directy accessible registers [R0...Rn]
      * 
      */
     uint16_t regs[REG_COUNT];
+
+    /**
+     * @brief Memory mapped devices of the IO page
+     * 
+     */
+    LC3Devices_t devices;
+
+    /**
+     * @brief Execution tracer, records the instructions run by the table engine
+     * 
+     */
+    LC3Trace_t trace;
+
+    /**
+     * @brief Compiled code of the jit engine, created the first time it runs
+     * 
+     */
+    struct LC3Jit_t *jit;
+
+    /**
+     * @brief Flag per page of CPU_DIRTY_PAGE_WORDS words raised by every
+     * write, NULL if writes are not tracked. Used by the co-simulation to
+     * compare only the memory that changed.
+     * 
+     */
+    uint8_t *dirty;
+
+    /**
+     * @brief Count of executions of every superinstruction
+     * 
+     */
+    uint64_t fusions[FUSION_COUNT];
+
+    /**
+     * @brief Execution statistics, NULL if they are not counted
+     * 
+     */
+    LC3Stats_t *stats;
 } LC3Cpu_t;
 
 /**
@@ -108,7 +265,7 @@ typedef struct LC3OpcodeAction_t
      * @brief ptr to the action
      * 
      */
-    void (*action)(LC3Cpu_t *cpu, LC3Instruction_t inst);
+    void (*action)(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 } LC3OpcodeAction_t;
 
 /**
@@ -117,14 +274,58 @@ typedef struct LC3OpcodeAction_t
  */
 extern LC3OpcodeAction_t LC3Opcodes[OP_COUNT];
 
+/**
+ * @brief Available execution engines, all of them have the same semantics
+ * 
+ */
+typedef enum
+{
+    ENGINE_TABLE,     // Reference loop, dispatch through LC3Opcodes
+    ENGINE_THREADED,  // Threaded dispatch with the cpu state in locals
+    ENGINE_JIT,       // Basic blocks compiled to host code
+    ENGINE_COUNT
+} Lc3Engines_e;
+
+/**
+ * @brief Map between engine and their execution loop
+ * 
+ */
+typedef struct LC3EngineAction_t
+{
+    /**
+     * @brief string name of the engine, used to select it at startup
+     * 
+     */
+    const char *name;
+
+    /**
+     * @brief engine value
+     * 
+     */
+    uint8_t engine;
+
+    /**
+     * @brief ptr to the loop, runs until the cpu stops
+     * 
+     */
+    void (*execute)(LC3Cpu_t *cpu);
+} LC3EngineAction_t;
+
+/**
+ * @brief Array of engines and their loops ordered
+ * 
+ */
+extern LC3EngineAction_t LC3Engines[ENGINE_COUNT];
+
 /**
  * @brief 
  * 
  * @param cpu pointer to the cpu instance
  * @param firmware firmware to attach to the cpu
+ * @param console keyboard and display of the cpu
  * @return uint8_t success value
  */
-uint8_t LC3CpuInit(LC3Cpu_t *cpu, LC3Firmware_t *firmware);
+uint8_t LC3CpuInit(LC3Cpu_t *cpu, LC3Firmware_t *firmware, struct LC3Console_t *console);
 
 /**
  * @brief 
@@ -133,6 +334,24 @@ uint8_t LC3CpuInit(LC3Cpu_t *cpu, LC3Firmware_t *firmware);
  */
 void LC3CpuExecute(LC3Cpu_t *cpu);
 
+/**
+ * @brief Search an engine by their name
+ * 
+ * @param name name of the engine
+ * @return uint8_t engine value, ENGINE_COUNT if it doesn't exists
+ */
+uint8_t LC3CpuFindEngine(const char *name);
+
+/**
+ * @brief Gets the decoded instruction addressed by the PC register, decoding
+ * it if it's not in the cache
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param uncached storage used when the instruction can't be cached
+ * @return LC3DecodedInst_t* decoded instruction
+ */
+LC3DecodedInst_t *LC3CpuFetch(LC3Cpu_t *cpu, LC3DecodedInst_t *uncached);
+
 /**
  * @brief Reads the memory addressed by the PC register and return it casted
  * to LC3Instruction_t struct
@@ -142,6 +361,15 @@ void LC3CpuExecute(LC3Cpu_t *cpu);
  */
 LC3Instruction_t LC3CpuReadInstruction(LC3Cpu_t *cpu);
 
+/**
+ * @brief Extracts the registers, flags and sign extended offset of an
+ * instruction and resolves their action from LC3Opcodes
+ * 
+ * @param inst instruction to decode
+ * @param decoded output decoded instruction
+ */
+void LC3CpuDecode(LC3Instruction_t inst, LC3DecodedInst_t *decoded);
+
 /**
  * @brief Write to the memory of the CPU
  * 
@@ -161,6 +389,55 @@ uint16_t LC3CpuReadMemory(LC3Cpu_t *cpu, uint16_t addr);
  */
 void LC3CpuWriteMemory(LC3Cpu_t *cpu, uint16_t addr, uint16_t value);
 
+/**
+ * @brief Processor status register, privilege, priority and condition codes
+ * 
+ * @param cpu pointer to the cpu instance
+ * @return uint16_t PSR value
+ */
+uint16_t LC3CpuGetPSR(LC3Cpu_t *cpu);
+
+/**
+ * @brief Writes the processor status register, a lower priority can let a
+ * waiting interrupt in
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param value PSR value
+ */
+void LC3CpuSetPSR(LC3Cpu_t *cpu, uint16_t value);
+
+/**
+ * @brief Asks the engines to evaluate the interrupt requests at the next
+ * block boundary, sets CPU_PENDING_INTERRUPT
+ * 
+ * @param cpu pointer to the cpu instance
+ */
+void LC3CpuRequestInterrupt(LC3Cpu_t *cpu);
+
+/**
+ * @brief Handles the pending events, called by the engines when pending is
+ * set after an instruction that ends a block, with PC pointing to the next
+ * instruction: records a profiler sample,
+ * takes the highest device request if their priority is higher than the
+ * priority of the program, and sleeps until a key arrives if the program is
+ * in a polling loop that only a key can end
+ * 
+ * @param cpu pointer to the cpu instance
+ */
+void LC3CpuCheckPending(LC3Cpu_t *cpu);
+
+/**
+ * @brief Enters an interrupt or exception handler: switches to the
+ * supervisor stack, pushes PSR and PC and jumps to the handler of the
+ * vector table. PC must point to the instruction to return to.
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param vector interrupt or exception vector
+ * @param priority priority level of the handler
+ * @return uint8_t EXIT_FAILURE if the vector has no handler, the cpu stops
+ */
+uint8_t LC3CpuInterrupt(LC3Cpu_t *cpu, uint8_t vector, uint8_t priority);
+
 /**
  * @brief Updates the conditional control register of the cpu by a register
  * 
@@ -175,7 +452,7 @@ void LC3CpuUpdateCCReg(LC3Cpu_t *cpu, uint16_t reg);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_br(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_br(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode ADD
@@ -183,7 +460,7 @@ void LC3Inst_br(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_add(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_add(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode LD
@@ -191,7 +468,7 @@ void LC3Inst_add(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_ld(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_ld(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode ST
@@ -199,7 +476,7 @@ void LC3Inst_ld(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_st(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_st(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode JSR
@@ -207,7 +484,7 @@ void LC3Inst_st(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_jsr(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_jsr(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode AND
@@ -215,7 +492,7 @@ void LC3Inst_jsr(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_and(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_and(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode LDR
@@ -223,7 +500,7 @@ void LC3Inst_and(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_ldr(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_ldr(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode STR
@@ -231,7 +508,7 @@ void LC3Inst_ldr(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_str(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_str(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode NOT
@@ -239,7 +516,7 @@ void LC3Inst_str(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_not(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_not(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode LDI
@@ -247,7 +524,7 @@ void LC3Inst_not(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_ldi(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_ldi(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode STI
@@ -255,7 +532,7 @@ void LC3Inst_ldi(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_sti(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_sti(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode JMP
@@ -263,7 +540,24 @@ void LC3Inst_sti(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_jmp(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_jmp(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
+
+/**
+ * @brief Executes the opcode RTI, raises the privilege exception in user
+ * mode
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param inst parameters for add instruction
+ */
+void LC3Inst_rti(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
+
+/**
+ * @brief Executes the reserved opcode, raises the illegal opcode exception
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param inst parameters for add instruction
+ */
+void LC3Inst_res(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode LEA
@@ -271,7 +565,7 @@ void LC3Inst_jmp(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @param cpu pointer to the cpu instance
  * @param inst parameters for add instruction
  */
-void LC3Inst_lea(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_lea(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 /**
  * @brief Executes the opcode TRAP
@@ -281,6 +575,6 @@ void LC3Inst_lea(LC3Cpu_t *cpu, LC3Instruction_t inst);
  * @return uint8_t because this opcode can stop the execution
  * returns 1 if execution can still run, eiter 0.
  */
-void LC3Inst_trap(LC3Cpu_t *cpu, LC3Instruction_t inst);
+void LC3Inst_trap(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
 
 #endif  // __CPU_H__
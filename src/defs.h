@@ -31,6 +31,25 @@ typedef uint16_t MemSize_t;
  */
 #define PC_START_ADDRESS 0x3000
 
+/**
+ * @brief Start of the page reserved for the memory mapped registers
+ * 
+ */
+#define IO_PAGE_ADDRESS 0xFE00
+
+/**
+ * @brief Start of the interrupt vector table, the handler of a vector is
+ * read from INT_VECTOR_TABLE + vector
+ * 
+ */
+#define INT_VECTOR_TABLE 0x0100
+
+/**
+ * @brief Initial supervisor stack, it grows down from the user space
+ * 
+ */
+#define SUPERVISOR_STACK_ADDRESS 0x3000
+
 /**
  * This enum is ordered by the current opcode (4bit) values.
  * 
@@ -45,12 +64,12 @@ typedef enum
     OP_AND,   // And
     OP_LDR,   // Load Register
     OP_STR,   // Store Register
-    OP_JSRR,  // Jump register Indirect
+    OP_RTI,   // Return from interrupt
     OP_NOT,   // Not
     OP_LDI,   // Load Indirect
     OP_STI,   // Store Indirect
     OP_JMP,   // Jump
-    OP_RES,   // Not Used
+    OP_RES,   // Reserved, raises the illegal opcode exception
     OP_LEA,   // Load effective address
     OP_TRAP,   // Trap
     OP_COUNT
@@ -109,7 +128,34 @@ typedef enum
     MMR_KBDR = 0XFE02, // Keyboard data register
     MMR_DSR = 0xFE04,  // Display status register
     MMR_DDR = 0xFE06,  // Display data register
+    MMR_PSR = 0xFFFC,  // Processor status register
     MMR_MRC = 0xFFFE   // Machine control register
 } Lc3MMRCodes_e;
 
+/**
+ * @brief Fields of the processor status register, the condition codes are
+ * the low bits like CC
+ * 
+ */
+#define PSR_USER (1U << 15)
+#define PSR_PRIORITY_SHIFT 8
+#define PSR_PRIORITY_MASK (7U << PSR_PRIORITY_SHIFT)
+
+/**
+ * @brief Interrupt and exception vectors
+ * 
+ */
+typedef enum
+{
+    INT_PRIVILEGE = 0x00,  // RTI in user mode
+    INT_ILLEGAL = 0x01,    // Reserved opcode
+    INT_KEYBOARD = 0x80    // Key ready with interrupts enabled in KBSR
+} Lc3InterruptVectors_e;
+
+/**
+ * @brief Priority level of the keyboard interrupt
+ * 
+ */
+#define INT_KEYBOARD_PRIORITY 4
+
 #endif  // __DEFS_H__
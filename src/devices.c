@@ -0,0 +1,214 @@
+#include "devices.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "cpu.h"
+#include "replay.h"
+
+/**
+ * @brief Checks if the keyboard has a key, recorded and replayed runs ask the
+ * queue of their replay
+ * 
+ * @param cpu pointer to the cpu instance
+ * @return uint16_t 1 if there is a key
+ */
+static uint16_t LC3KeyboardIsKeyPressed(LC3Cpu_t *cpu)
+{
+    if (cpu->replay)
+    {
+        return LC3ReplayIsKeyPressed(cpu->replay, cpu->console);
+    }
+    return OSKeyboardIsKeyPressed(cpu->console);
+}
+
+/**
+ * @brief Takes a key from the keyboard, waits if there is none
+ * 
+ * @param cpu pointer to the cpu instance
+ * @return uint16_t key
+ */
+static uint16_t LC3KeyboardGetChar(LC3Cpu_t *cpu)
+{
+    if (cpu->replay)
+    {
+        return LC3ReplayGetChar(cpu->replay, cpu->console);
+    }
+    return OSKeyboardGetChar(cpu->console);
+}
+
+/**
+ * @brief Latches a key in KBDR if there is one and the last one was read
+ * 
+ * @param cpu pointer to the cpu instance
+ */
+static void LC3KeyboardPoll(LC3Cpu_t *cpu)
+{
+    LC3Devices_t *devices = &cpu->devices;
+    // The key stays in KBDR until it's read, polling again doesn't lose it
+    if (!(devices->kbsr & DEVICE_STATUS_READY) && LC3KeyboardIsKeyPressed(cpu))
+    {
+        devices->kbdr = LC3KeyboardGetChar(cpu);
+        devices->kbsr |= DEVICE_STATUS_READY;
+    }
+}
+
+static uint16_t LC3KeyboardRead(LC3Cpu_t *cpu, uint16_t addr)
+{
+    LC3Devices_t *devices = &cpu->devices;
+    if (addr == MMR_KBDR)
+    {
+        devices->kbsr &= ~DEVICE_STATUS_READY;
+        // The next key can interrupt as soon as this one is taken
+        if (devices->kbsr & DEVICE_STATUS_IE)
+        {
+            LC3CpuRequestInterrupt(cpu);
+        }
+        return devices->kbdr;
+    }
+    LC3KeyboardPoll(cpu);
+    if (devices->kbsr & DEVICE_STATUS_READY)
+    {
+        devices->polls = 0;
+    }
+    else if (cpu->stat.idle && ++devices->polls == DEVICE_IDLE_POLLS)
+    {
+        // The cpu looks at the loop at the next boundary, where their state is synced
+        devices->polls = 0;
+        atomic_fetch_or(&cpu->pending, CPU_PENDING_IDLE);
+    }
+    return devices->kbsr;
+}
+
+static void LC3KeyboardWrite(LC3Cpu_t *cpu, uint16_t addr, uint16_t value)
+{
+    if (addr == MMR_KBSR)
+    {
+        // Ready is owned by the keyboard, the other bits are settings
+        LC3Devices_t *devices = &cpu->devices;
+        devices->kbsr = (devices->kbsr & DEVICE_STATUS_READY) | (value & ~DEVICE_STATUS_READY);
+        if (devices->kbsr & DEVICE_STATUS_IE)
+        {
+            LC3CpuRequestInterrupt(cpu);
+        }
+    }
+}
+
+static uint16_t LC3DisplayRead(LC3Cpu_t *cpu, uint16_t addr)
+{
+    // The console takes every character at once, the display is always ready
+    return addr == MMR_DSR ? DEVICE_STATUS_READY : 0;
+}
+
+static void LC3DisplayWrite(LC3Cpu_t *cpu, uint16_t addr, uint16_t value)
+{
+    if (addr == MMR_DDR)
+    {
+        OSDisplayPutChar(cpu->console, (char)value);
+    }
+}
+
+static uint16_t LC3PsrRead(LC3Cpu_t *cpu, uint16_t addr)
+{
+    return LC3CpuGetPSR(cpu);
+}
+
+static void LC3PsrWrite(LC3Cpu_t *cpu, uint16_t addr, uint16_t value)
+{
+    LC3CpuSetPSR(cpu, value);
+}
+
+static uint16_t LC3MachineRead(LC3Cpu_t *cpu, uint16_t addr)
+{
+    return cpu->devices.mcr;
+}
+
+static void LC3MachineWrite(LC3Cpu_t *cpu, uint16_t addr, uint16_t value)
+{
+    cpu->devices.mcr = value;
+    if (!(value & DEVICE_MCR_CLOCK))
+    {
+        cpu->stat.running = 0b0;
+    }
+}
+
+const LC3Device_t LC3KeyboardDevice = {"keyboard", LC3KeyboardRead, LC3KeyboardWrite};
+const LC3Device_t LC3DisplayDevice = {"display", LC3DisplayRead, LC3DisplayWrite};
+const LC3Device_t LC3PsrDevice = {"psr", LC3PsrRead, LC3PsrWrite};
+const LC3Device_t LC3MachineDevice = {"machine", LC3MachineRead, LC3MachineWrite};
+
+void LC3DevicesInit(LC3Devices_t *devices)
+{
+    memset(devices, 0, sizeof(*devices));
+    devices->pages[IO_PAGE_ADDRESS >> DEVICE_PAGE_SHIFT] = &devices->io;
+    devices->mcr = DEVICE_MCR_CLOCK;
+    LC3DeviceMap(devices, MMR_KBSR, &LC3KeyboardDevice);
+    LC3DeviceMap(devices, MMR_KBDR, &LC3KeyboardDevice);
+    LC3DeviceMap(devices, MMR_DSR, &LC3DisplayDevice);
+    LC3DeviceMap(devices, MMR_DDR, &LC3DisplayDevice);
+    LC3DeviceMap(devices, MMR_PSR, &LC3PsrDevice);
+    LC3DeviceMap(devices, MMR_MRC, &LC3MachineDevice);
+}
+
+uint8_t LC3DeviceMap(LC3Devices_t *devices, uint16_t addr, const LC3Device_t *device)
+{
+    if (addr < IO_PAGE_ADDRESS)
+    {
+        return EXIT_FAILURE;
+    }
+    devices->io.words[addr & DEVICE_PAGE_MASK] = device;
+    return EXIT_SUCCESS;
+}
+
+uint16_t LC3DeviceRead(LC3Cpu_t *cpu, const LC3DevicePage_t *page, uint16_t addr)
+{
+    const LC3Device_t *device = page->words[addr & DEVICE_PAGE_MASK];
+    if (!device)
+    {
+        return MEMORY_READ(&cpu->firmware->memory, addr);
+    }
+    return device->read(cpu, addr);
+}
+
+void LC3DeviceWrite(LC3Cpu_t *cpu, const LC3DevicePage_t *page, uint16_t addr, uint16_t value)
+{
+    const LC3Device_t *device = page->words[addr & DEVICE_PAGE_MASK];
+    if (!device)
+    {
+        if (LC3MemoryWrite(&cpu->firmware->memory, addr, value))
+        {
+            cpu->stat.running = 0;
+        }
+        return;
+    }
+    device->write(cpu, addr, value);
+}
+
+uint16_t LC3DeviceGetChar(LC3Cpu_t *cpu)
+{
+    LC3Devices_t *devices = &cpu->devices;
+    if (devices->kbsr & DEVICE_STATUS_READY)
+    {
+        devices->kbsr &= ~DEVICE_STATUS_READY;
+        return devices->kbdr;
+    }
+    return LC3KeyboardGetChar(cpu);
+}
+
+uint8_t LC3DeviceRequest(LC3Cpu_t *cpu, uint8_t *vector)
+{
+    LC3Devices_t *devices = &cpu->devices;
+    if (!(devices->kbsr & DEVICE_STATUS_IE))
+    {
+        return 0;
+    }
+    LC3KeyboardPoll(cpu);
+    if (!(devices->kbsr & DEVICE_STATUS_READY))
+    {
+        return 0;
+    }
+    *vector = INT_KEYBOARD;
+    return INT_KEYBOARD_PRIORITY;
+}
@@ -0,0 +1,197 @@
+/**
+ * @file devices.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Memory mapped devices. Memory is split in pages, only pages with
+ * devices have an entry in the page map, so RAM accesses only check that
+ * their page is empty. Inside a device page every word can have a device
+ * that handles their reads and writes, words without device are plain memory.
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__DEVICES_H__)
+#define __DEVICES_H__
+
+#include <stdint.h>
+
+#include "defs.h"
+
+/**
+ * @brief Words per page, the IO page is a whole page
+ * 
+ */
+#define DEVICE_PAGE_SHIFT 9
+#define DEVICE_PAGE_WORDS (1U << DEVICE_PAGE_SHIFT)
+#define DEVICE_PAGE_MASK (DEVICE_PAGE_WORDS - 1U)
+#define DEVICE_PAGES ((UINT16_MAX + 1U) >> DEVICE_PAGE_SHIFT)
+
+/**
+ * @brief Bits of the status registers and the machine control register
+ * 
+ */
+#define DEVICE_STATUS_READY (1U << 15)
+#define DEVICE_STATUS_IE (1U << 14)
+#define DEVICE_MCR_CLOCK (1U << 15)
+
+/**
+ * @brief Empty polls of KBSR in a row after which the cpu looks for an idle
+ * polling loop, loops that also do work are looked at once per this many
+ * 
+ */
+#define DEVICE_IDLE_POLLS 1024U
+
+struct LC3Cpu_t;
+
+/**
+ * @brief Memory mapped device, handles one or more words of a device page
+ * 
+ */
+typedef struct LC3Device_t
+{
+    /**
+     * @brief string name of the device, used by the log
+     * 
+     */
+    const char *name;
+    /**
+     * @brief ptr to the read handler
+     * 
+     */
+    uint16_t (*read)(struct LC3Cpu_t *cpu, uint16_t addr);
+    /**
+     * @brief ptr to the write handler
+     * 
+     */
+    void (*write)(struct LC3Cpu_t *cpu, uint16_t addr, uint16_t value);
+} LC3Device_t;
+
+/**
+ * @brief Devices of every word of a page
+ * 
+ */
+typedef struct LC3DevicePage_t
+{
+    const LC3Device_t *words[DEVICE_PAGE_WORDS];
+} LC3DevicePage_t;
+
+/**
+ * @brief Page map and state of the builtin devices
+ * 
+ */
+typedef struct LC3Devices_t
+{
+    /**
+     * @brief device page of every page, NULL for RAM pages
+     * 
+     */
+    LC3DevicePage_t *pages[DEVICE_PAGES];
+    /**
+     * @brief devices of the IO page, the only page that can have devices
+     * 
+     */
+    LC3DevicePage_t io;
+    /**
+     * @brief keyboard status register
+     * 
+     */
+    uint16_t kbsr;
+    /**
+     * @brief keyboard data register, last key read
+     * 
+     */
+    uint16_t kbdr;
+    /**
+     * @brief empty polls of KBSR since the last key or idle request
+     * 
+     */
+    uint16_t polls;
+    /**
+     * @brief machine control register
+     * 
+     */
+    uint16_t mcr;
+} LC3Devices_t;
+
+/**
+ * @brief Keyboard status and data registers
+ * 
+ */
+extern const LC3Device_t LC3KeyboardDevice;
+
+/**
+ * @brief Display status and data registers
+ * 
+ */
+extern const LC3Device_t LC3DisplayDevice;
+
+/**
+ * @brief Processor status register of the cpu
+ * 
+ */
+extern const LC3Device_t LC3PsrDevice;
+
+/**
+ * @brief Machine control register, clearing the clock bit halts the cpu
+ * 
+ */
+extern const LC3Device_t LC3MachineDevice;
+
+/**
+ * @brief Clears the page map and registers the builtin devices
+ * 
+ * @param devices devices of a cpu
+ */
+void LC3DevicesInit(LC3Devices_t *devices);
+
+/**
+ * @brief Maps a device to a word of the IO page
+ * 
+ * @param devices devices of a cpu
+ * @param addr address handled by the device
+ * @param device device to map, NULL turns the word into plain memory
+ * @return uint8_t EXIT_FAILURE if the address is not in the IO page
+ */
+uint8_t LC3DeviceMap(LC3Devices_t *devices, uint16_t addr, const LC3Device_t *device);
+
+/**
+ * @brief Reads a word of a device page, slow path of LC3CpuReadMemory
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param page device page of the address
+ * @param addr address to read
+ * @return uint16_t value of the device register, or of memory if the word
+ * has no device
+ */
+uint16_t LC3DeviceRead(struct LC3Cpu_t *cpu, const LC3DevicePage_t *page, uint16_t addr);
+
+/**
+ * @brief Writes a word of a device page, slow path of LC3CpuWriteMemory
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param page device page of the address
+ * @param addr address to write
+ * @param value value to write
+ */
+void LC3DeviceWrite(struct LC3Cpu_t *cpu, const LC3DevicePage_t *page, uint16_t addr, uint16_t value);
+
+/**
+ * @brief Reads a key, the one polled through KBSR if it's pending
+ * 
+ * @param cpu pointer to the cpu instance
+ * @return uint16_t key read
+ */
+uint16_t LC3DeviceGetChar(struct LC3Cpu_t *cpu);
+
+/**
+ * @brief Highest interrupt request of the devices, the keyboard requests
+ * when it has a key and interrupts are enabled in KBSR
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param vector output vector of the request
+ * @return uint8_t priority level of the request, 0 if there is no request
+ */
+uint8_t LC3DeviceRequest(struct LC3Cpu_t *cpu, uint8_t *vector);
+
+#endif  // __DEVICES_H__
@@ -2,46 +2,281 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+
+#if __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "log.h"
 #include "utils.h"
 
 /**
- * @brief Loads a objfile from a filename and build a instance of LC3Firmware_t
+ * @brief Header of a native image, followed by the program words in host
+ * endianness. The objfile it was converted from is identified by their
+ * device and inode, size and modification time in nanoseconds, an objfile
+ * written again in the same second with the same size still makes the
+ * image stale.
+ * 
+ */
+typedef struct LC3FirmwareImage_t
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t memOrig;
+    uint16_t size;
+    uint16_t reserved;
+    uint64_t objSize;
+    int64_t objTime;
+    int64_t objTimeNsec;
+    uint64_t objDev;
+    uint64_t objIno;
+} LC3FirmwareImage_t;
+
+/**
+ * @brief Fills the fields of an image header that identify their objfile
+ * 
+ * @param header image header
+ * @param st status of the objfile
+ */
+static void describeObjFile(LC3FirmwareImage_t *header, const struct stat *st)
+{
+    header->objSize = (uint64_t)st->st_size;
+    header->objTime = (int64_t)st->st_mtime;
+#if __unix__
+    header->objTimeNsec = (int64_t)st->st_mtim.tv_nsec;
+#else
+    header->objTimeNsec = 0;
+#endif
+    header->objDev = (uint64_t)st->st_dev;
+    header->objIno = (uint64_t)st->st_ino;
+}
+
+/**
+ * @brief Maps a whole file in memory for reading, on hosts without mmap the
+ * file is read into a buffer
  * 
- * @param filename path/filename to the objfile
- * @param firmware Instance to build
- * @return uint8_t success flag
+ * @param filename path/filename of the file
+ * @param length output size of the file in bytes
+ * @return const uint8_t* content of the file, NULL if it can't be read or
+ * it's empty
  */
+static const uint8_t *mapFile(const char *filename, size_t *length)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0 || st.st_size <= 0)
+    {
+        return NULL;
+    }
+    *length = st.st_size;
+#if __unix__
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    void *data = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+#else
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        return NULL;
+    }
+    uint8_t *data = malloc(*length);
+    if (data && fread(data, 1U, *length, f) != *length)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+#endif
+}
+
+/**
+ * @brief Releases a file from mapFile
+ * 
+ * @param data content of the file
+ * @param length size of the file in bytes
+ */
+static void unmapFile(const uint8_t *data, size_t length)
+{
+#if __unix__
+    munmap((void *)data, length);
+#else
+    free((void *)data);
+#endif
+}
+
+void initFirmware(LC3Firmware_t *firmware)
+{
+    memset(firmware, 0, sizeof(*firmware));
+    LC3MemoryInit(&firmware->memory);
+}
+
+void releaseFirmware(LC3Firmware_t *firmware)
+{
+    LC3MemoryRelease(&firmware->memory);
+    for (uint32_t i = 0; i < MEMORY_PAGES; i++)
+    {
+        free(firmware->decoded[i]);
+    }
+    initFirmware(firmware);
+}
+
+LC3DecodedInst_t *allocDecodedPage(LC3Firmware_t *firmware, uint16_t addr)
+{
+    LC3DecodedInst_t **page = &firmware->decoded[addr >> MEMORY_PAGE_SHIFT];
+    if (!*page)
+    {
+        *page = calloc(MEMORY_PAGE_WORDS, sizeof(LC3DecodedInst_t));
+    }
+    return *page;
+}
+
 uint8_t loadFirmwareFromFile(const char *filename, LC3Firmware_t *firmware)
 {
+    size_t length;
     firmware->filename = filename;
     LOG_LN("Reading objfile %s", filename);
-    FILE *f = fopen(filename, "rb");
+    const uint8_t *data = mapFile(filename, &length);
     // In case of error loading the file return 0
-    if (!f)
+    if (!data)
     {
         return EXIT_FAILURE;
     }
-    // Read where the memory is going to be located
-    uint16_t rWords = fread(&firmware->memOrig, sizeof(uint16_t), 1U, f);
-    if (rWords != 1U)
+    if (length < sizeof(uint16_t))
     {
-        fclose(f);
+        unmapFile(data, length);
         return EXIT_FAILURE;
     }
-    firmware->memOrig = swap_16(firmware->memOrig);
-    LOG_LN("Memory start region: 0x%04X", firmware->memOrig);
-    // Now read from file the program data by memory offset
-    size_t progSize = fread(firmware->memory + firmware->memOrig, sizeof(uint16_t), UINT16_MAX - firmware->memOrig, f);
+    // Read where the memory is going to be located
+    firmware->memOrig = (data[0] << 8) | data[1];
+    LOG_DEBUG("Memory start region: 0x%04X", firmware->memOrig);
+    // Only the program words are swapped, the rest of memory stays untouched
+    size_t progSize = (length - sizeof(uint16_t)) / sizeof(uint16_t);
+    if (progSize > (size_t)(UINT16_MAX - firmware->memOrig))
+    {
+        progSize = UINT16_MAX - firmware->memOrig;
+    }
+    // Swapped page by page straight into their private copy
+    for (size_t done = 0; done < progSize;)
+    {
+        uint16_t addr = firmware->memOrig + done;
+        size_t chunk = MEMORY_PAGE_WORDS - (addr & MEMORY_PAGE_MASK);
+        chunk = chunk < progSize - done ? chunk : progSize - done;
+        uint16_t *words = LC3MemoryWritable(&firmware->memory, addr);
+        if (!words)
+        {
+            unmapFile(data, length);
+            return EXIT_FAILURE;
+        }
+        swap_16_block(words, data + sizeof(uint16_t) * (1U + done), chunk);
+        done += chunk;
+    }
     firmware->size = progSize;
-    LOG_LN("Program size: %u words", firmware->size);
-    for (uint16_t x = 0; x < UINT16_MAX; x++)
+    LOG_DEBUG("Program size: %u words", firmware->size);
+    unmapFile(data, length);
+    LOG_DEBUG("Lc3 VM memory loaded!");
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Writes the native image of a loaded firmware, the image is written
+ * with a temporary name and renamed so readers never see a partial image
+ * 
+ * @param path path/filename of the image
+ * @param firmware loaded firmware
+ * @param st status of the objfile
+ */
+static void saveFirmwareImage(const char *path, LC3Firmware_t *firmware, const struct stat *st)
+{
+    char tmp[FILENAME_MAX + 48];
+#if __unix__
+    long pid = getpid();
+#else
+    long pid = 0;
+#endif
+    LC3FirmwareImage_t header = {FIRMWARE_IMAGE_MAGIC, FIRMWARE_IMAGE_VERSION, firmware->memOrig, firmware->size};
+    describeObjFile(&header, st);
+    snprintf(tmp, sizeof(tmp), "%s.%ld.%p", path, pid, (void *)firmware);
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
     {
-        firmware->memory[x] = swap_16(firmware->memory[x]);
+        return;
     }
-    LOG_LN("Lc3 VM memory loaded!");
-    fclose(f);
+    uint8_t ok = fwrite(&header, sizeof(header), 1U, f) == 1U;
+    for (uint32_t done = 0; ok && done < firmware->size;)
+    {
+        uint16_t addr = firmware->memOrig + done;
+        uint32_t chunk = MEMORY_PAGE_WORDS - (addr & MEMORY_PAGE_MASK);
+        chunk = chunk < firmware->size - done ? chunk : firmware->size - done;
+        ok = fwrite(&MEMORY_READ(&firmware->memory, addr), sizeof(uint16_t), chunk, f) == chunk;
+        done += chunk;
+    }
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp, path) != 0)
+    {
+        remove(tmp);
+        return;
+    }
+    LOG_LN("Native image written to %s", path);
+}
+
+uint8_t loadFirmwareCached(const char *filename, LC3Firmware_t *firmware)
+{
+    char path[FILENAME_MAX];
+    struct stat st;
+    size_t length;
+    if (stat(filename, &st) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    if (snprintf(path, sizeof(path), "%s%s", filename, FIRMWARE_IMAGE_EXT) >= (int)sizeof(path))
+    {
+        return loadFirmwareFromFile(filename, firmware);
+    }
+    const uint8_t *data = mapFile(path, &length);
+    if (data)
+    {
+        LC3FirmwareImage_t header = {{0}};
+        LC3FirmwareImage_t obj = {{0}};
+        if (length >= sizeof(header))
+        {
+            memcpy(&header, data, sizeof(header));
+        }
+        describeObjFile(&obj, &st);
+        if (memcmp(header.magic, FIRMWARE_IMAGE_MAGIC, 4U) == 0 && header.version == FIRMWARE_IMAGE_VERSION &&
+            header.objSize == obj.objSize && header.objTime == obj.objTime &&
+            header.objTimeNsec == obj.objTimeNsec && header.objDev == obj.objDev && header.objIno == obj.objIno &&
+            header.memOrig + header.size <= UINT16_MAX && length == sizeof(header) + header.size * sizeof(uint16_t))
+        {
+            firmware->filename = filename;
+            firmware->memOrig = header.memOrig;
+            firmware->size = header.size;
+            // The header keeps the words aligned, mapFile returns page or malloc aligned data
+            uint8_t status = LC3MemoryWriteBlock(&firmware->memory, header.memOrig,
+                                                 (const uint16_t *)(data + sizeof(header)), header.size);
+            unmapFile(data, length);
+            if (status)
+            {
+                return EXIT_FAILURE;
+            }
+            LOG_LN("Native image %s loaded, %u words at 0x%04X", path, firmware->size, firmware->memOrig);
+            return EXIT_SUCCESS;
+        }
+        unmapFile(data, length);
+        LOG_LN("Native image %s is stale", path);
+    }
+    if (loadFirmwareFromFile(filename, firmware))
+    {
+        return EXIT_FAILURE;
+    }
+    saveFirmwareImage(path, firmware, &st);
     return EXIT_SUCCESS;
 }
 
@@ -52,6 +287,10 @@ uint8_t loadFirmwareFromFile(const char *filename, LC3Firmware_t *firmware)
  */
 void dumpFirmware(LC3Firmware_t *firmware)
 {
+    if (!fileout)
+    {
+        return;
+    }
     LOG_LN("================================= Program memory ==================================");
     LOG_TXT("            0     1     2     3     4     5     6     7     8     9     A     B     C     D     E     F\n");
     for (uint16_t i = firmware->memOrig; i < (firmware->memOrig + firmware->size); i += 0x10)
@@ -64,7 +303,7 @@ void dumpFirmware(LC3Firmware_t *firmware)
             {
                 break;
             }
-            LOG_TXT(" %04X ", firmware->memory[i + x]);
+            LOG_TXT(" %04X ", MEMORY_READ(&firmware->memory, i + x));
         }
         LOG_TXT("\n");
     }
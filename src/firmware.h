@@ -14,6 +14,69 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "memory.h"
+
+/**
+ * @brief Extension appended to the objfile name for their native image
+ * 
+ */
+#define FIRMWARE_IMAGE_EXT ".lc3img"
+
+/**
+ * @brief Signature and version of native images
+ * 
+ */
+#define FIRMWARE_IMAGE_MAGIC "LC3I"
+#define FIRMWARE_IMAGE_VERSION 2
+
+struct LC3Cpu_t;
+
+/**
+ * @brief Instruction with all their fields already extracted, used as cache
+ * entry so the cpu doesn't need to decode the same word on every execution
+ * 
+ */
+typedef struct LC3DecodedInst_t
+{
+    /**
+     * @brief ptr to the action resolved from LC3Opcodes, NULL when the entry
+     * is not decoded yet or was invalidated by a write
+     * 
+     */
+    void (*action)(struct LC3Cpu_t *cpu, const struct LC3DecodedInst_t *inst);
+    /**
+     * @brief raw instruction word
+     * 
+     */
+    uint16_t word;
+    /**
+     * @brief offset, immediate or trap vector already sign extended
+     * 
+     */
+    uint16_t offset;
+    /**
+     * @brief destination register, or source register for stores
+     * 
+     */
+    uint8_t dr;
+    /**
+     * @brief first source register or base register
+     * 
+     */
+    uint8_t sr1;
+    /**
+     * @brief second source register
+     * 
+     */
+    uint8_t sr2;
+    /**
+     * @brief depends on the opcode, BR: nzp mask, ADD/AND: inmediate mode,
+     * JSR: PCOffset11 mode
+     * 
+     */
+    uint8_t flags;
+} LC3DecodedInst_t;
+
 /**
  * @brief 
  * 
@@ -41,10 +104,18 @@ typedef struct LC3Firmware_t
      */
     uint16_t memOrig;
     /**
-     * @brief array memory
+     * @brief paged memory, shared with the firmwares created from it until
+     * written
      * 
      */
-    uint16_t memory[UINT16_MAX];
+    LC3Memory_t memory;
+    /**
+     * @brief predecoded instructions, one entry per memory word, allocated
+     * by page the first time the page runs. Superinstructions never cross
+     * a page. The IO page is never decoded.
+     * 
+     */
+    LC3DecodedInst_t *decoded[MEMORY_PAGES];
 } LC3Firmware_t;
 
 typedef struct LC3Instruction_t
@@ -53,6 +124,32 @@ typedef struct LC3Instruction_t
     uint16_t opcode : 4;
 } LC3Instruction_t;
 
+/**
+ * @brief Prepares an empty firmware, all the memory reads as zero
+ * 
+ * @param firmware Instance to prepare
+ */
+extern void initFirmware(LC3Firmware_t *firmware);
+
+/**
+ * @brief Releases the memory pages and the decoded instructions of a
+ * firmware, it's left empty as after initFirmware
+ * 
+ * @param firmware Instance to release
+ */
+extern void releaseFirmware(LC3Firmware_t *firmware);
+
+/**
+ * @brief Gives the page of decoded instructions that contains an address,
+ * it's allocated empty the first time
+ * 
+ * @param firmware Firmware instance
+ * @param addr address of an instruction, not in the IO page
+ * @return LC3DecodedInst_t* first entry of the page, NULL if it can't be
+ * allocated
+ */
+extern LC3DecodedInst_t *allocDecodedPage(LC3Firmware_t *firmware, uint16_t addr);
+
 /**
  * @brief Loads a objfile from a filename and build a instance of LC3Firmware_t
  * 
@@ -62,6 +159,17 @@ typedef struct LC3Instruction_t
  */
 extern uint8_t loadFirmwareFromFile(const char *filename, LC3Firmware_t *firmware);
 
+/**
+ * @brief Loads a objfile from their native image, an image with the program
+ * already in host endianness. When the image doesn't exist or the objfile
+ * changed, the objfile is loaded and the image is written again.
+ * 
+ * @param filename path/filename to the objfile
+ * @param firmware Instance to build
+ * @return uint8_t success flag
+ */
+extern uint8_t loadFirmwareCached(const char *filename, LC3Firmware_t *firmware);
+
 /**
  * @brief Prints fancy program bytes to the log file
  * 
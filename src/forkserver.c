@@ -0,0 +1,254 @@
+#include "forkserver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if __unix__
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "console.h"
+#include "log.h"
+
+uint8_t LC3ForkServerWarmUp(LC3Vm_t *vm, uint16_t marker)
+{
+    LC3Cpu_t *cpu = &vm->cpu;
+    LC3DecodedInst_t uncached;
+    // A superinstruction could step over the marker
+    uint8_t fusion = cpu->stat.fusion;
+    cpu->stat.fusion = 0;
+    while (cpu->stat.running && cpu->PC != marker)
+    {
+        LC3DecodedInst_t *inst = LC3CpuFetch(cpu, &uncached);
+        inst->action(cpu, inst);
+        if (cpu->stat.incrementPC)
+        {
+            cpu->PC++;
+        }
+    }
+    cpu->stat.fusion = fusion;
+    // The output of the warm up belongs to the server, not to every child
+    OSDisplayFlush(cpu->console);
+    LOG_LN("Snapshot at 0x%04X", cpu->PC);
+    return cpu->stat.running ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#if __unix__
+
+/**
+ * @brief Fills the address of a unix socket
+ * 
+ * @param addr output address
+ * @param path path of the socket
+ * @return uint8_t EXIT_FAILURE if the path is too long
+ */
+static uint8_t LC3ForkServerAddress(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        return EXIT_FAILURE;
+    }
+    strcpy(addr->sun_path, path);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Receives the request and their descriptors
+ * 
+ * @param conn client connection
+ * @param fds output stdin and stdout of the client
+ * @return uint8_t EXIT_FAILURE if the request is not valid
+ */
+static uint8_t LC3ForkServerReceive(int conn, int fds[2])
+{
+    char byte;
+    union
+    {
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {&byte, 1U};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1U;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    if (recvmsg(conn, &msg, 0) != 1)
+    {
+        return EXIT_FAILURE;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+    {
+        return EXIT_FAILURE;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Runs the program from the snapshot in a forked child, never returns
+ * 
+ * @param vm vm instance with the snapshot
+ * @param conn client connection, receives the exit status
+ * @param fds stdin and stdout of the client
+ */
+static void LC3ForkServerChild(LC3Vm_t *vm, int conn, int fds[2])
+{
+    fileout = NULL;  // The log belongs to the server
+    dup2(fds[0], STDIN_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    for (uint8_t i = 0; i < 2U; i++)
+    {
+        if (fds[i] != STDIN_FILENO && fds[i] != STDOUT_FILENO)
+        {
+            close(fds[i]);
+        }
+    }
+    OSKeyboardInit(&vm->console, stdin, stdout);
+    // Limited runs go through their slices like any other run
+    LC3VmRun(vm);
+    OSKeyboardEnd(&vm->console);
+    fflush(stdout);
+    int32_t status = LC3VmExitStatus(vm);
+    if (write(conn, &status, sizeof(status)) != sizeof(status))
+    {
+        status = EXIT_FAILURE;
+    }
+    _exit(status);
+}
+
+uint8_t LC3ForkServerRun(LC3Vm_t *vm, const char *path)
+{
+    struct sockaddr_un addr;
+    if (LC3ForkServerAddress(&addr, path))
+    {
+        return EXIT_FAILURE;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, SOMAXCONN) != 0)
+    {
+        close(sock);
+        return EXIT_FAILURE;
+    }
+    // Children are never waited, the status goes to the client
+    signal(SIGCHLD, SIG_IGN);
+    LOG_LN("Fork server listening on %s", path);
+
+    while (1)
+    {
+        int fds[2];
+        // Nothing buffered can be inherited, the children would write it again
+        fflush(NULL);
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (LC3ForkServerReceive(conn, fds))
+        {
+            close(conn);
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(sock);
+            LC3ForkServerChild(vm, conn, fds);
+        }
+        if (pid < 0)
+        {
+            LOG_ERROR("Can't fork: %s", strerror(errno));
+        }
+        close(fds[0]);
+        close(fds[1]);
+        close(conn);
+    }
+    close(sock);
+    return EXIT_FAILURE;
+}
+
+int LC3ForkServerRequest(const char *path)
+{
+    struct sockaddr_un addr;
+    if (LC3ForkServerAddress(&addr, path))
+    {
+        return EXIT_FAILURE;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    int fds[2] = {STDIN_FILENO, STDOUT_FILENO};
+    char byte = 0;
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {&byte, 1U};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1U;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    fflush(stdout);
+    if (sendmsg(sock, &msg, 0) != 1)
+    {
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    int32_t status;
+    ssize_t n;
+    do
+    {
+        n = read(sock, &status, sizeof(status));
+    } while (n < 0 && errno == EINTR);
+    close(sock);
+    return n == sizeof(status) ? status : EXIT_FAILURE;
+}
+
+#else
+
+uint8_t LC3ForkServerRun(LC3Vm_t *vm, const char *path)
+{
+    LOG_LN("Fork server is not supported on this host");
+    return EXIT_FAILURE;
+}
+
+int LC3ForkServerRequest(const char *path)
+{
+    return EXIT_FAILURE;
+}
+
+#endif
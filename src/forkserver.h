@@ -0,0 +1,57 @@
+/**
+ * @file forkserver.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Fork server, keeps a vm loaded and initialized and forks a child
+ * from it for every run, so the children skip the log, the loading and the
+ * startup code of the program.
+ * 
+ * Protocol over a unix stream socket: the client sends one byte with their
+ * stdin and stdout descriptors attached (SCM_RIGHTS). The child uses them as
+ * keyboard and display, and when the program halts writes back the exit
+ * status as an int32. The connection is closed without status if the child
+ * dies.
+ * 
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__FORKSERVER_H__)
+#define __FORKSERVER_H__
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/**
+ * @brief Runs the vm with the table engine until the PC reaches the marker,
+ * the state at that point is the snapshot shared by all the children
+ * 
+ * @param vm vm instance
+ * @param marker address where the snapshot is taken
+ * @return uint8_t EXIT_FAILURE if the cpu halted before the marker
+ */
+uint8_t LC3ForkServerWarmUp(LC3Vm_t *vm, uint16_t marker);
+
+/**
+ * @brief Listens on the socket and forks a child per request, only returns
+ * on error
+ * 
+ * @param vm vm instance with the snapshot
+ * @param path path of the unix socket, replaced if it exists
+ * @return uint8_t EXIT_FAILURE
+ */
+uint8_t LC3ForkServerRun(LC3Vm_t *vm, const char *path);
+
+/**
+ * @brief Sends a request with the stdin and stdout of the caller and waits
+ * for the program to halt
+ * 
+ * @param path path of the unix socket
+ * @return int exit status of the run, EXIT_FAILURE if the server can't be
+ * reached or the child died
+ */
+int LC3ForkServerRequest(const char *path);
+
+#endif  // __FORKSERVER_H__
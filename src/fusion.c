@@ -0,0 +1,134 @@
+#include "fusion.h"
+
+#include <string.h>
+
+#include "cpu.h"
+#include "defs.h"
+
+LC3FusionAction_t LC3Fusions[FUSION_COUNT] =
+    {
+        {"AND+ADD     ", FUSION_LOAD_IMM, 2, LC3Fused_loadImm},
+        {"ADD+BR      ", FUSION_ADD_BR, 2, LC3Fused_addBr},
+        {"LEA+TRAP    ", FUSION_LEA_TRAP, 2, LC3Fused_leaTrap},
+        {"NOT+ADD+ADD ", FUSION_SUB, 3, LC3Fused_sub}};
+
+/**
+ * @brief Finds the superinstruction that starts with the given instructions
+ *
+ * @param seq decoded instructions, FUSION_MAX_LENGTH of them
+ * @param available count of instructions of seq that can be used
+ * @return uint8_t superinstruction, FUSION_COUNT if none matches
+ */
+static uint8_t LC3FusionMatch(const LC3DecodedInst_t *seq, uint8_t available)
+{
+    uint8_t op0 = seq[0].word >> 12;
+    uint8_t op1 = seq[1].word >> 12;
+    uint8_t op2 = seq[2].word >> 12;
+
+    if (available < 2)
+    {
+        return FUSION_COUNT;
+    }
+    if (available >= 3 && op0 == OP_NOT && seq[0].dr == seq[0].sr1 &&
+        op1 == OP_ADD && seq[1].flags && seq[1].offset == 1 && seq[1].dr == seq[0].dr && seq[1].sr1 == seq[0].dr &&
+        op2 == OP_ADD && !seq[2].flags && (seq[2].sr1 == seq[0].dr || seq[2].sr2 == seq[0].dr))
+    {
+        return FUSION_SUB;
+    }
+    if (op0 == OP_AND && seq[0].flags && seq[0].offset == 0 &&
+        op1 == OP_ADD && seq[1].flags && seq[1].dr == seq[0].dr && seq[1].sr1 == seq[0].dr)
+    {
+        return FUSION_LOAD_IMM;
+    }
+    if (op0 == OP_ADD && op1 == OP_BR)
+    {
+        return FUSION_ADD_BR;
+    }
+    if (op0 == OP_LEA && op1 == OP_TRAP)
+    {
+        return FUSION_LEA_TRAP;
+    }
+    return FUSION_COUNT;
+}
+
+void LC3FusionApply(LC3Cpu_t *cpu, uint16_t addr)
+{
+    LC3DecodedInst_t seq[FUSION_MAX_LENGTH];
+    LC3DecodedInst_t *decoded = cpu->firmware->decoded[addr >> MEMORY_PAGE_SHIFT];
+    uint16_t offset = addr & MEMORY_PAGE_MASK;
+    uint8_t available = 0;
+
+    // Only words of the same cache page can be part of a sequence, the action reads them after the first
+    // one and the IO page is never cached
+    while (available < FUSION_MAX_LENGTH && offset + available < MEMORY_PAGE_WORDS)
+    {
+        uint16_t word = MEMORY_READ(&cpu->firmware->memory, addr + available);
+        LC3Instruction_t raw;
+        memcpy(&raw, &word, sizeof(raw));
+        LC3CpuDecode(raw, &seq[available]);
+        available++;
+    }
+    for (uint8_t i = available; i < FUSION_MAX_LENGTH; i++)
+    {
+        seq[i].word = OP_RES << 12;
+    }
+
+    uint8_t fusion = LC3FusionMatch(seq, available);
+    if (fusion == FUSION_COUNT)
+    {
+        return;
+    }
+    // The action reads the rest of the sequence from the cache
+    for (uint8_t i = 1; i < LC3Fusions[fusion].length; i++)
+    {
+        if (!decoded[offset + i].action)
+        {
+            decoded[offset + i] = seq[i];
+        }
+    }
+    decoded[offset].action = LC3Fusions[fusion].action;
+}
+
+void LC3FusionDump(const LC3Cpu_t *cpu, FILE *out)
+{
+    fprintf(out, "Superinstructions executed:\n");
+    for (uint8_t fusion = 0; fusion < FUSION_COUNT; fusion++)
+    {
+        fprintf(out, "  %s %12llu\n", LC3Fusions[fusion].name, (unsigned long long)cpu->fusions[fusion]);
+    }
+}
+
+void LC3Fused_loadImm(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
+{
+    // The AND result is overwritten, only the ADD updates CC
+    cpu->regs[inst[1].dr] = inst[1].offset;
+    LC3CpuUpdateCCReg(cpu, inst[1].dr);
+    cpu->PC++;
+    cpu->fusions[FUSION_LOAD_IMM]++;
+}
+
+void LC3Fused_addBr(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
+{
+    LC3Inst_add(cpu, inst);
+    cpu->PC++;
+    LC3Inst_br(cpu, inst + 1);
+    cpu->fusions[FUSION_ADD_BR]++;
+}
+
+void LC3Fused_leaTrap(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
+{
+    LC3Inst_lea(cpu, inst);
+    cpu->PC++;
+    LC3Inst_trap(cpu, inst + 1);
+    cpu->fusions[FUSION_LEA_TRAP]++;
+}
+
+void LC3Fused_sub(LC3Cpu_t *cpu, const LC3DecodedInst_t *inst)
+{
+    // Rx = -Rx, the intermediate CC of NOT and ADD are overwritten
+    cpu->regs[inst[0].dr] = ~cpu->regs[inst[0].sr1] + 1U;
+    cpu->regs[inst[2].dr] = cpu->regs[inst[2].sr1] + cpu->regs[inst[2].sr2];
+    LC3CpuUpdateCCReg(cpu, inst[2].dr);
+    cpu->PC += 2U;
+    cpu->fusions[FUSION_SUB]++;
+}
@@ -0,0 +1,127 @@
+/**
+ * @file fusion.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Superinstructions, common sequences of instructions recognized when
+ * they are decoded and executed by a single action of the table engine
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__FUSION_H__)
+#define __FUSION_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "firmware.h"
+
+/**
+ * @brief Max instructions covered by a superinstruction, a write to memory
+ * invalidates the entries of this many previous addresses
+ * 
+ */
+#define FUSION_MAX_LENGTH 3
+
+/**
+ * @brief Superinstructions
+ * 
+ */
+typedef enum
+{
+    FUSION_LOAD_IMM,  // AND Rx,Ry,#0 ; ADD Rx,Rx,#imm
+    FUSION_ADD_BR,    // ADD ; BR
+    FUSION_LEA_TRAP,  // LEA ; TRAP
+    FUSION_SUB,       // NOT Rx,Rx ; ADD Rx,Rx,#1 ; ADD Rd,Ry,Rx
+    FUSION_COUNT
+} Lc3Fusions_e;
+
+/**
+ * @brief Map between superinstruction and their action
+ * 
+ */
+typedef struct LC3FusionAction_t
+{
+    /**
+     * @brief string name of the sequence, used by the statistics
+     * 
+     */
+    const char *name;
+
+    /**
+     * @brief superinstruction value
+     * 
+     */
+    uint8_t fusion;
+
+    /**
+     * @brief count of instructions replaced
+     * 
+     */
+    uint8_t length;
+
+    /**
+     * @brief ptr to the action, receives the decoded entry of the first
+     * instruction, the next ones follow it in the cache
+     * 
+     */
+    void (*action)(struct LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
+} LC3FusionAction_t;
+
+/**
+ * @brief Array of superinstructions and their actions ordered
+ * 
+ */
+extern LC3FusionAction_t LC3Fusions[FUSION_COUNT];
+
+/**
+ * @brief Replaces the action of a just decoded entry when it starts a known
+ * sequence, the rest of the sequence is decoded into the cache too
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param addr address of the decoded entry
+ */
+void LC3FusionApply(struct LC3Cpu_t *cpu, uint16_t addr);
+
+/**
+ * @brief Writes how many times every superinstruction was executed
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param out output file
+ */
+void LC3FusionDump(const struct LC3Cpu_t *cpu, FILE *out);
+
+/**
+ * @brief Executes AND Rx,Ry,#0 ; ADD Rx,Rx,#imm
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param inst first instruction of the sequence
+ */
+void LC3Fused_loadImm(struct LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
+
+/**
+ * @brief Executes ADD ; BR
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param inst first instruction of the sequence
+ */
+void LC3Fused_addBr(struct LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
+
+/**
+ * @brief Executes LEA ; TRAP
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param inst first instruction of the sequence
+ */
+void LC3Fused_leaTrap(struct LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
+
+/**
+ * @brief Executes NOT Rx,Rx ; ADD Rx,Rx,#1 ; ADD Rd,Ry,Rx
+ * 
+ * @param cpu pointer to the cpu instance
+ * @param inst first instruction of the sequence
+ */
+void LC3Fused_sub(struct LC3Cpu_t *cpu, const LC3DecodedInst_t *inst);
+
+#endif  // __FUSION_H__
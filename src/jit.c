@@ -0,0 +1,1009 @@
+#include "jit.h"
+
+#include "threaded.h"
+
+#if LC3_JIT_SUPPORTED
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "firmware.h"
+#include "log.h"
+
+/**
+ * @brief Size of the executable memory, when it's full all the blocks are
+ * discarded
+ *
+ */
+#define JIT_ARENA_SIZE (4U << 20)
+
+/**
+ * @brief Max instructions in a block
+ *
+ */
+#define JIT_MAX_BLOCK 64
+
+/**
+ * @brief Bytes needed to emit the biggest block
+ *
+ */
+#define JIT_BLOCK_RESERVE 0x3000
+
+/**
+ * @brief Max exits waiting for their target block to be compiled
+ *
+ */
+#define JIT_MAX_PATCHES 0x1000
+
+/**
+ * @brief Offsets of the cpu state, generated code keeps the cpu in rbx
+ *
+ */
+#define CPU_PC offsetof(LC3Cpu_t, PC)
+#define CPU_CC offsetof(LC3Cpu_t, CC)
+#define CPU_BUDGET offsetof(LC3Cpu_t, budget)
+#define CPU_PENDING offsetof(LC3Cpu_t, pending)
+#define CPU_REG(__r) (offsetof(LC3Cpu_t, regs) + (__r) * sizeof(uint16_t))
+
+/**
+ * @brief Host registers used as operands of the emitted instructions
+ *
+ */
+typedef enum
+{
+    HOST_EAX = 0,
+    HOST_ECX = 1,
+    HOST_EDX = 2,
+} Lc3JitHostRegs_e;
+
+/**
+ * @brief Signature of the enter stub, saves the host registers, loads the
+ * cpu pointers and jumps to the block
+ *
+ */
+typedef void (*LC3JitEnter_f)(LC3Cpu_t *cpu, void *block);
+
+/**
+ * @brief Jit state, one per cpu
+ *
+ */
+typedef struct LC3Jit_t
+{
+    /**
+     * @brief host code of the block that starts at each pc, NULL if it's not
+     * compiled. Must be the first field, generated code indexes it from r13
+     *
+     */
+    void *map[UINT16_MAX + 1];
+    /**
+     * @brief 1 when the address is part of a compiled block
+     *
+     */
+    uint8_t code[UINT16_MAX + 1];
+    /**
+     * @brief executable memory
+     *
+     */
+    uint8_t *arena;
+    /**
+     * @brief first free byte of the arena
+     *
+     */
+    uint8_t *next;
+    /**
+     * @brief first byte after the stubs, where blocks start
+     *
+     */
+    uint8_t *blocks;
+    /**
+     * @brief stub that restores the host registers and returns to C
+     *
+     */
+    uint8_t *exit;
+    /**
+     * @brief stub called from C to run a block
+     *
+     */
+    LC3JitEnter_f enter;
+    /**
+     * @brief jumps to exit that will be patched to jump directly to their
+     * target block once it's compiled
+     *
+     */
+    struct
+    {
+        uint8_t *site;
+        uint16_t target;
+    } patches[JIT_MAX_PATCHES];
+    /**
+     * @brief count of patches
+     *
+     */
+    uint32_t patchCount;
+    /**
+     * @brief set when the compiled code was discarded
+     *
+     */
+    uint8_t flushed;
+    /**
+     * @brief 1 while the arena can be written, it's never writable and
+     * executable at once
+     *
+     */
+    uint8_t writable;
+} LC3Jit_t;
+
+/**
+ * @brief Stores the bytes of the code being emitted
+ *
+ */
+typedef struct LC3JitEmitter_t
+{
+    uint8_t *p;
+} LC3JitEmitter_t;
+
+static void Emit8(LC3JitEmitter_t *e, uint8_t v)
+{
+    *e->p++ = v;
+}
+
+static void Emit16(LC3JitEmitter_t *e, uint16_t v)
+{
+    memcpy(e->p, &v, sizeof(v));
+    e->p += sizeof(v);
+}
+
+static void Emit32(LC3JitEmitter_t *e, uint32_t v)
+{
+    memcpy(e->p, &v, sizeof(v));
+    e->p += sizeof(v);
+}
+
+static void Emit64(LC3JitEmitter_t *e, uint64_t v)
+{
+    memcpy(e->p, &v, sizeof(v));
+    e->p += sizeof(v);
+}
+
+/**
+ * @brief Writes the rel32 of a jump so it lands on target
+ *
+ * @param site address of the rel32
+ * @param target destination of the jump
+ */
+static void PatchRel32(uint8_t *site, const uint8_t *target)
+{
+    int32_t rel = (int32_t)(target - (site + 4));
+    memcpy(site, &rel, sizeof(rel));
+}
+
+/**
+ * @brief movzx host, word [rbx + CPU_REG(reg)]
+ *
+ */
+static void EmitLoadReg(LC3JitEmitter_t *e, uint8_t host, uint8_t reg)
+{
+    Emit8(e, 0x0F);
+    Emit8(e, 0xB7);
+    Emit8(e, 0x83 | (host << 3));
+    Emit32(e, CPU_REG(reg));
+}
+
+/**
+ * @brief mov word [rbx + CPU_REG(reg)], host
+ *
+ */
+static void EmitStoreReg(LC3JitEmitter_t *e, uint8_t host, uint8_t reg)
+{
+    Emit8(e, 0x66);
+    Emit8(e, 0x89);
+    Emit8(e, 0x83 | (host << 3));
+    Emit32(e, CPU_REG(reg));
+}
+
+/**
+ * @brief mov word [rbx + offset], imm16
+ *
+ */
+static void EmitStoreImm(LC3JitEmitter_t *e, uint32_t offset, uint16_t v)
+{
+    Emit8(e, 0x66);
+    Emit8(e, 0xC7);
+    Emit8(e, 0x83);
+    Emit32(e, offset);
+    Emit16(e, v);
+}
+
+/**
+ * @brief Updates CC with the value in ax
+ *
+ */
+static void EmitUpdateCC(LC3JitEmitter_t *e)
+{
+    Emit8(e, 0xB9);  // mov ecx, CC_Z
+    Emit32(e, CC_Z);
+    Emit8(e, 0x66);  // test ax, ax
+    Emit8(e, 0x85);
+    Emit8(e, 0xC0);
+    Emit8(e, 0x74);  // je done
+    Emit8(e, 12);
+    Emit8(e, 0xB9);  // mov ecx, CC_P
+    Emit32(e, CC_P);
+    Emit8(e, 0x79);  // jns done
+    Emit8(e, 5);
+    Emit8(e, 0xB9);  // mov ecx, CC_N
+    Emit32(e, CC_N);
+    Emit8(e, 0x66);  // done: mov word [rbx + CPU_CC], cx
+    Emit8(e, 0x89);
+    Emit8(e, 0x8B);
+    Emit32(e, CPU_CC);
+}
+
+/**
+ * @brief mov rdi, rbx; mov rax, fn; call rax
+ *
+ */
+static void EmitCall(LC3JitEmitter_t *e, const void *fn)
+{
+    Emit8(e, 0x48);
+    Emit8(e, 0x89);
+    Emit8(e, 0xDF);
+    Emit8(e, 0x48);
+    Emit8(e, 0xB8);
+    Emit64(e, (uint64_t)(uintptr_t)fn);
+    Emit8(e, 0xFF);
+    Emit8(e, 0xD0);
+}
+
+/**
+ * @brief Increments a 64 bits counter of the stats, uses rax
+ *
+ */
+static void EmitCount(LC3JitEmitter_t *e, uint64_t *counter)
+{
+    Emit8(e, 0x48);  // mov rax, counter
+    Emit8(e, 0xB8);
+    Emit64(e, (uint64_t)(uintptr_t)counter);
+    Emit8(e, 0x48);  // inc qword [rax]
+    Emit8(e, 0xFF);
+    Emit8(e, 0x00);
+}
+
+/**
+ * @brief eax <- memory[eax], the IO page is read by LC3CpuReadMemory. The
+ * page is looked up on every load, a write can replace it with a copy
+ *
+ */
+static void EmitLoadDynamic(LC3JitEmitter_t *e)
+{
+    Emit8(e, 0x3D);  // cmp eax, IO_PAGE_ADDRESS
+    Emit32(e, IO_PAGE_ADDRESS);
+    Emit8(e, 0x73);  // jae slow
+    Emit8(e, 20);
+    Emit8(e, 0x89);  // mov ecx, eax
+    Emit8(e, 0xC1);
+    Emit8(e, 0xC1);  // shr ecx, MEMORY_PAGE_SHIFT
+    Emit8(e, 0xE9);
+    Emit8(e, MEMORY_PAGE_SHIFT);
+    Emit8(e, 0x49);  // mov rcx, [r12 + rcx * 8]
+    Emit8(e, 0x8B);
+    Emit8(e, 0x0C);
+    Emit8(e, 0xCC);
+    Emit8(e, 0x25);  // and eax, MEMORY_PAGE_MASK
+    Emit32(e, MEMORY_PAGE_MASK);
+    Emit8(e, 0x0F);  // movzx eax, word [rcx + rax * 2]
+    Emit8(e, 0xB7);
+    Emit8(e, 0x04);
+    Emit8(e, 0x41);
+    Emit8(e, 0xEB);  // jmp done
+    Emit8(e, 20);
+    Emit8(e, 0x89);  // slow: mov esi, eax
+    Emit8(e, 0xC6);
+    EmitCall(e, (const void *)LC3CpuReadMemory);
+    Emit8(e, 0x0F);  // movzx eax, ax
+    Emit8(e, 0xB7);
+    Emit8(e, 0xC0);
+}
+
+/**
+ * @brief eax <- memory[addr] for an address known when compiling
+ *
+ */
+static void EmitLoadConst(LC3JitEmitter_t *e, uint16_t addr)
+{
+    if (addr < IO_PAGE_ADDRESS)
+    {
+        Emit8(e, 0x49);  // mov rax, [r12 + page * 8]
+        Emit8(e, 0x8B);
+        Emit8(e, 0x84);
+        Emit8(e, 0x24);
+        Emit32(e, (addr >> MEMORY_PAGE_SHIFT) * sizeof(LC3MemoryPage_t *));
+        Emit8(e, 0x0F);  // movzx eax, word [rax + offset * 2]
+        Emit8(e, 0xB7);
+        Emit8(e, 0x80);
+        Emit32(e, (addr & MEMORY_PAGE_MASK) * sizeof(uint16_t));
+    }
+    else
+    {
+        Emit8(e, 0xBE);  // mov esi, addr
+        Emit32(e, addr);
+        EmitCall(e, (const void *)LC3CpuReadMemory);
+        Emit8(e, 0x0F);  // movzx eax, ax
+        Emit8(e, 0xB7);
+        Emit8(e, 0xC0);
+    }
+}
+
+/**
+ * @brief eax <- reg + offset, wrapped to 16 bits
+ *
+ */
+static void EmitAddress(LC3JitEmitter_t *e, uint8_t reg, uint16_t offset)
+{
+    EmitLoadReg(e, HOST_EAX, reg);
+    Emit8(e, 0x05);  // add eax, offset
+    Emit32(e, offset);
+    Emit8(e, 0x0F);  // movzx eax, ax
+    Emit8(e, 0xB7);
+    Emit8(e, 0xC0);
+}
+
+/**
+ * @brief Handles the pending events after an instruction that ends a block,
+ * with PC already set. Returns to C if there was any, an interrupt could have
+ * moved PC. Doesn't touch eax if there was none.
+ *
+ */
+static void EmitCheckPending(LC3Jit_t *jit, LC3JitEmitter_t *e)
+{
+    Emit8(e, 0x66);  // cmp word [rbx + CPU_PENDING], 0
+    Emit8(e, 0x83);
+    Emit8(e, 0xBB);
+    Emit32(e, CPU_PENDING);
+    Emit8(e, 0);
+    Emit8(e, 0x74);  // je continue
+    uint8_t *skip = e->p;
+    Emit8(e, 0);
+    EmitCall(e, (const void *)LC3CpuCheckPending);
+    Emit8(e, 0xE9);  // jmp exit
+    Emit32(e, 0);
+    PatchRel32(e->p - 4, jit->exit);
+    *skip = (uint8_t)(e->p - skip - 1);
+}
+
+/**
+ * @brief Sets PC and jumps to the block of target, or to the exit stub until
+ * that block is compiled. The edges of the instructions that end a block
+ * look at the pending events first, the fall through of a long block doesn't
+ *
+ */
+static void EmitExitConst(LC3Jit_t *jit, LC3JitEmitter_t *e, uint16_t target, uint8_t ends)
+{
+    EmitStoreImm(e, CPU_PC, target);
+    if (ends)
+    {
+        EmitCheckPending(jit, e);
+    }
+    Emit8(e, 0xE9);  // jmp rel32
+    uint8_t *site = e->p;
+    Emit32(e, 0);
+    if (jit->map[target])
+    {
+        PatchRel32(site, jit->map[target]);
+        return;
+    }
+    PatchRel32(site, jit->exit);
+    if (jit->patchCount < JIT_MAX_PATCHES)
+    {
+        jit->patches[jit->patchCount].site = site;
+        jit->patches[jit->patchCount].target = target;
+        jit->patchCount++;
+    }
+}
+
+/**
+ * @brief Sets PC to ax, looks at the pending events and jumps to their block
+ * if it's compiled, if not returns to C
+ *
+ */
+static void EmitExitDynamic(LC3Jit_t *jit, LC3JitEmitter_t *e)
+{
+    Emit8(e, 0x66);  // mov word [rbx + CPU_PC], ax
+    Emit8(e, 0x89);
+    Emit8(e, 0x83);
+    Emit32(e, CPU_PC);
+    EmitCheckPending(jit, e);
+    Emit8(e, 0x49);  // mov rax, [r13 + rax * 8]
+    Emit8(e, 0x8B);
+    Emit8(e, 0x44);
+    Emit8(e, 0xC5);
+    Emit8(e, 0x00);
+    Emit8(e, 0x48);  // test rax, rax
+    Emit8(e, 0x85);
+    Emit8(e, 0xC0);
+    Emit8(e, 0x0F);  // jz exit
+    Emit8(e, 0x84);
+    Emit32(e, 0);
+    PatchRel32(e->p - 4, jit->exit);
+    Emit8(e, 0xFF);  // jmp rax
+    Emit8(e, 0xE0);
+}
+
+/**
+ * @brief Writes memory[eax] <- reg through LC3CpuWriteMemory, if the write
+ * discarded the compiled code or stopped the cpu the block exits before the
+ * next instruction and gives back to the budget the instructions that
+ * were charged but not run
+ *
+ */
+static void EmitStore(LC3Jit_t *jit, LC3JitEmitter_t *e, uint8_t reg, uint16_t next, uint8_t refund);
+
+/**
+ * @brief Called by the generated code for every store
+ *
+ * @param cpu pointer to the cpu instance
+ * @param addr address to write
+ * @param value value to write
+ * @return uint8_t 1 if the compiled code was discarded by the write or the
+ * write stopped the cpu
+ */
+static uint8_t LC3JitWrite(LC3Cpu_t *cpu, uint16_t addr, uint16_t value)
+{
+    cpu->jit->flushed = 0;
+    LC3CpuWriteMemory(cpu, addr, value);
+    return cpu->jit->flushed || !cpu->stat.running;
+}
+
+/**
+ * @brief Called by the generated code to execute a trap, with PC pointing
+ * to the trap instruction. Leaves PC in the next instruction, or in the
+ * handler of an interrupt taken after the trap.
+ *
+ * @param cpu pointer to the cpu instance
+ * @param word trap instruction
+ */
+static void LC3JitTrap(LC3Cpu_t *cpu, uint16_t word)
+{
+    LC3DecodedInst_t inst;
+    LC3Instruction_t raw;
+    memcpy(&raw, &word, sizeof(raw));
+    LC3CpuDecode(raw, &inst);
+    inst.action(cpu, &inst);
+    if (cpu->stat.incrementPC)
+    {
+        cpu->PC++;
+    }
+    if (cpu->stat.running && atomic_load_explicit(&cpu->pending, memory_order_relaxed))
+    {
+        LC3CpuCheckPending(cpu);
+    }
+}
+
+static void EmitStore(LC3Jit_t *jit, LC3JitEmitter_t *e, uint8_t reg, uint16_t next, uint8_t refund)
+{
+    EmitLoadReg(e, HOST_EDX, reg);
+    Emit8(e, 0x89);  // mov esi, eax
+    Emit8(e, 0xC6);
+    EmitCall(e, (const void *)LC3JitWrite);
+    Emit8(e, 0x84);  // test al, al
+    Emit8(e, 0xC0);
+    Emit8(e, 0x74);  // jz continue
+    Emit8(e, refund ? 22 : 14);
+    if (refund)
+    {
+        Emit8(e, 0x48);  // add qword [rbx + CPU_BUDGET], refund
+        Emit8(e, 0x83);
+        Emit8(e, 0x83);
+        Emit32(e, CPU_BUDGET);
+        Emit8(e, refund);
+    }
+    EmitStoreImm(e, CPU_PC, next);
+    Emit8(e, 0xE9);  // jmp exit
+    Emit32(e, 0);
+    PatchRel32(e->p - 4, jit->exit);
+}
+
+/**
+ * @brief Discards all the compiled blocks
+ *
+ * @param jit jit instance
+ */
+static void LC3JitFlush(LC3Jit_t *jit)
+{
+    memset(jit->map, 0, sizeof(jit->map));
+    memset(jit->code, 0, sizeof(jit->code));
+    jit->patchCount = 0;
+    jit->next = jit->blocks;
+    jit->flushed = 1;
+}
+
+/**
+ * @brief Makes the arena writable to emit code, or executable to run it
+ *
+ * @param jit jit instance
+ * @param writable 1 to write the arena, 0 to run it
+ * @return uint8_t EXIT_FAILURE if the protection can't be changed
+ */
+static uint8_t LC3JitProtect(LC3Jit_t *jit, uint8_t writable)
+{
+    if (jit->writable == writable)
+    {
+        return EXIT_SUCCESS;
+    }
+    if (mprotect(jit->arena, JIT_ARENA_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0)
+    {
+        LOG_ERROR("Can't change the protection of the jit arena");
+        return EXIT_FAILURE;
+    }
+    jit->writable = writable;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Allocates the arena and emits the enter and exit stubs
+ *
+ * @return LC3Jit_t* NULL if the executable memory can't be allocated
+ */
+static LC3Jit_t *LC3JitCreate()
+{
+    LC3Jit_t *jit = calloc(1U, sizeof(LC3Jit_t));
+    if (!jit)
+    {
+        return NULL;
+    }
+    // Writable until the first block runs, LC3JitProtect flips it
+    jit->arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->arena == MAP_FAILED)
+    {
+        free(jit);
+        return NULL;
+    }
+    jit->writable = 1;
+    LC3JitEmitter_t e = {jit->arena};
+
+    jit->enter = (LC3JitEnter_f)(void *)e.p;
+    Emit8(&e, 0x53);  // push rbx
+    Emit8(&e, 0x41);  // push r12
+    Emit8(&e, 0x54);
+    Emit8(&e, 0x41);  // push r13
+    Emit8(&e, 0x55);
+    Emit8(&e, 0x48);  // mov rbx, rdi
+    Emit8(&e, 0x89);
+    Emit8(&e, 0xFB);
+    Emit8(&e, 0x4C);  // mov r12, [rdi + firmware]
+    Emit8(&e, 0x8B);
+    Emit8(&e, 0xA7);
+    Emit32(&e, offsetof(LC3Cpu_t, firmware));
+    Emit8(&e, 0x49);  // add r12, memory pages
+    Emit8(&e, 0x81);
+    Emit8(&e, 0xC4);
+    Emit32(&e, offsetof(LC3Firmware_t, memory) + offsetof(LC3Memory_t, pages));
+    Emit8(&e, 0x4C);  // mov r13, [rdi + jit]
+    Emit8(&e, 0x8B);
+    Emit8(&e, 0xAF);
+    Emit32(&e, offsetof(LC3Cpu_t, jit));
+    Emit8(&e, 0xFF);  // jmp rsi
+    Emit8(&e, 0xE6);
+
+    jit->exit = e.p;
+    Emit8(&e, 0x41);  // pop r13
+    Emit8(&e, 0x5D);
+    Emit8(&e, 0x41);  // pop r12
+    Emit8(&e, 0x5C);
+    Emit8(&e, 0x5B);  // pop rbx
+    Emit8(&e, 0xC3);  // ret
+
+    jit->blocks = e.p;
+    LC3JitFlush(jit);
+    LOG_DEBUG("Jit arena of %u bytes at %p", JIT_ARENA_SIZE, (void *)jit->arena);
+    return jit;
+}
+
+void LC3JitDestroy(LC3Jit_t *jit)
+{
+    if (jit)
+    {
+        munmap(jit->arena, JIT_ARENA_SIZE);
+        free(jit);
+    }
+}
+
+void LC3JitInvalidate(LC3Jit_t *jit, uint16_t addr)
+{
+    if (jit->code[addr])
+    {
+        LC3JitFlush(jit);
+    }
+}
+
+/**
+ * @brief Opcodes compiled to native code, the rest are run by LC3Opcodes
+ *
+ */
+static uint8_t LC3JitIsSupported(uint8_t opcode)
+{
+    return opcode != OP_RTI && opcode != OP_RES;
+}
+
+/**
+ * @brief Opcodes that end a basic block
+ *
+ */
+static uint8_t LC3JitIsTerminator(uint8_t opcode)
+{
+    return opcode == OP_BR || opcode == OP_JMP || opcode == OP_JSR || opcode == OP_TRAP;
+}
+
+/**
+ * @brief Opcodes that update CC
+ *
+ */
+static uint8_t LC3JitSetsCC(uint8_t opcode)
+{
+    return opcode == OP_ADD || opcode == OP_AND || opcode == OP_NOT || opcode == OP_LD ||
+           opcode == OP_LDR || opcode == OP_LDI || opcode == OP_LEA;
+}
+
+/**
+ * @brief Instructions that need CC up to date, stores can leave the block
+ * and loads from the IO page can read it through PSR
+ *
+ */
+static uint8_t LC3JitReadsCC(const LC3DecodedInst_t *inst, uint16_t pc)
+{
+    uint8_t opcode = inst->word >> 12;
+    if (opcode == OP_LD)
+    {
+        return (uint16_t)(pc + 1U + inst->offset) >= IO_PAGE_ADDRESS;
+    }
+    return opcode == OP_BR || opcode == OP_ST || opcode == OP_STR || opcode == OP_STI || opcode == OP_TRAP ||
+           opcode == OP_LDR || opcode == OP_LDI;
+}
+
+/**
+ * @brief Compiles the basic block that starts at pc
+ *
+ * @param jit jit instance
+ * @param cpu pointer to the cpu instance
+ * @param start address of the first instruction
+ * @return void* host code, NULL if the first instruction can't be compiled
+ */
+static void *LC3JitCompile(LC3Jit_t *jit, LC3Cpu_t *cpu, uint16_t start)
+{
+    LC3DecodedInst_t insts[JIT_MAX_BLOCK];
+    uint8_t needCC[JIT_MAX_BLOCK];
+    uint8_t count = 0;
+    uint16_t pc;
+
+    if (start >= IO_PAGE_ADDRESS)
+    {
+        return NULL;
+    }
+    for (pc = start; count < JIT_MAX_BLOCK && pc < IO_PAGE_ADDRESS; pc++)
+    {
+        uint16_t word = MEMORY_READ(&cpu->firmware->memory, pc);
+        LC3Instruction_t raw;
+        memcpy(&raw, &word, sizeof(raw));
+        if (!LC3JitIsSupported(raw.opcode))
+        {
+            break;
+        }
+        LC3CpuDecode(raw, &insts[count++]);
+        if (LC3JitIsTerminator(raw.opcode))
+        {
+            break;
+        }
+    }
+    if (!count)
+    {
+        return NULL;
+    }
+
+    // CC is only written when something can read it before the next update
+    uint8_t live = 1;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        uint8_t opcode = insts[i].word >> 12;
+        needCC[i] = live;
+        if (LC3JitSetsCC(opcode))
+        {
+            live = 0;
+        }
+        if (LC3JitReadsCC(&insts[i], start + i))
+        {
+            live = 1;
+        }
+    }
+
+    if (jit->next + JIT_BLOCK_RESERVE > jit->arena + JIT_ARENA_SIZE)
+    {
+        LC3JitFlush(jit);
+    }
+    if (LC3JitProtect(jit, 1))
+    {
+        return NULL;
+    }
+
+    uint8_t *block = jit->next;
+    LC3JitEmitter_t e = {block};
+    // Registered before emitting so a block can chain to itself
+    jit->map[start] = block;
+    if (cpu->stat.limited)
+    {
+        // The whole block is charged when it starts, the last instructions of
+        // a slice run one by one from LC3CpuExecuteJit
+        Emit8(&e, 0x48);  // cmp qword [rbx + CPU_BUDGET], count
+        Emit8(&e, 0x83);
+        Emit8(&e, 0xBB);
+        Emit32(&e, CPU_BUDGET);
+        Emit8(&e, count);
+        Emit8(&e, 0x0F);  // jl exit
+        Emit8(&e, 0x8C);
+        Emit32(&e, 0);
+        PatchRel32(e.p - 4, jit->exit);
+        Emit8(&e, 0x48);  // sub qword [rbx + CPU_BUDGET], count
+        Emit8(&e, 0x83);
+        Emit8(&e, 0xAB);
+        Emit32(&e, CPU_BUDGET);
+        Emit8(&e, count);
+    }
+    // A PSR write can leave CC without flags, BRnzp only skips the test after an instruction of the block set it
+    uint8_t ccSet = 0;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        const LC3DecodedInst_t *inst = &insts[i];
+        pc = start + i;
+        uint16_t next = pc + 1U;
+        jit->code[pc] = 1;
+        // Counters are only emitted when the stats are on, blocks cost nothing more without them
+        LC3Stats_t *stats = LC3_STATS ? cpu->stats : NULL;
+        if (stats)
+        {
+            EmitCount(&e, &stats->opcodes[inst->word >> 12]);
+        }
+        switch (inst->word >> 12)
+        {
+        case OP_BR:
+            if ((inst->flags & (CC_N | CC_Z | CC_P)) == (CC_N | CC_Z | CC_P) && ccSet)
+            {
+                if (stats)
+                {
+                    EmitCount(&e, &stats->brTaken);
+                }
+                EmitExitConst(jit, &e, next + inst->offset, 1U);
+            }
+            else
+            {
+                Emit8(&e, 0x66);  // test word [rbx + CPU_CC], nzp
+                Emit8(&e, 0xF7);
+                Emit8(&e, 0x83);
+                Emit32(&e, CPU_CC);
+                Emit16(&e, inst->flags);
+                Emit8(&e, 0x74);  // jz not_taken
+                uint8_t *skip = e.p;
+                Emit8(&e, 0);
+                if (stats)
+                {
+                    EmitCount(&e, &stats->brTaken);
+                }
+                EmitExitConst(jit, &e, next + inst->offset, 1U);
+                *skip = (uint8_t)(e.p - skip - 1);
+                if (stats)
+                {
+                    EmitCount(&e, &stats->brNotTaken);
+                }
+                EmitExitConst(jit, &e, next, 1U);
+            }
+            break;
+        case OP_ADD:
+        case OP_AND:
+            EmitLoadReg(&e, HOST_EAX, inst->sr1);
+            if (inst->flags)
+            {
+                Emit8(&e, (inst->word >> 12) == OP_ADD ? 0x05 : 0x25);  // add/and eax, imm
+                Emit32(&e, (uint32_t)(int32_t)(int16_t)inst->offset);
+            }
+            else
+            {
+                EmitLoadReg(&e, HOST_ECX, inst->sr2);
+                Emit8(&e, (inst->word >> 12) == OP_ADD ? 0x01 : 0x21);  // add/and eax, ecx
+                Emit8(&e, 0xC8);
+            }
+            EmitStoreReg(&e, HOST_EAX, inst->dr);
+            if (needCC[i])
+            {
+                EmitUpdateCC(&e);
+            }
+            break;
+        case OP_NOT:
+            EmitLoadReg(&e, HOST_EAX, inst->sr1);
+            Emit8(&e, 0xF7);  // not eax
+            Emit8(&e, 0xD0);
+            EmitStoreReg(&e, HOST_EAX, inst->dr);
+            if (needCC[i])
+            {
+                EmitUpdateCC(&e);
+            }
+            break;
+        case OP_LD:
+        case OP_LDR:
+        case OP_LDI:
+            if ((inst->word >> 12) == OP_LDR)
+            {
+                EmitAddress(&e, inst->sr1, inst->offset);
+                EmitLoadDynamic(&e);
+            }
+            else
+            {
+                EmitLoadConst(&e, next + inst->offset);
+                if ((inst->word >> 12) == OP_LDI)
+                {
+                    EmitLoadDynamic(&e);
+                }
+            }
+            EmitStoreReg(&e, HOST_EAX, inst->dr);
+            if (needCC[i])
+            {
+                EmitUpdateCC(&e);
+            }
+            break;
+        case OP_ST:
+        case OP_STR:
+        case OP_STI:
+            if ((inst->word >> 12) == OP_ST)
+            {
+                Emit8(&e, 0xB8);  // mov eax, addr
+                Emit32(&e, (uint16_t)(next + inst->offset));
+            }
+            else if ((inst->word >> 12) == OP_STR)
+            {
+                EmitAddress(&e, inst->sr1, inst->offset);
+            }
+            else
+            {
+                EmitLoadConst(&e, next + inst->offset);
+            }
+            // The whole block was charged, a store that leaves it gives back the rest
+            EmitStore(jit, &e, inst->dr, next, cpu->stat.limited ? count - i - 1U : 0);
+            ccSet = 0;
+            break;
+        case OP_LEA:
+        {
+            uint16_t v = next + inst->offset;
+            EmitStoreImm(&e, CPU_REG(inst->dr), v);
+            if (needCC[i])
+            {
+                EmitStoreImm(&e, CPU_CC, v == 0 ? CC_Z : ((v >> 15) ? CC_N : CC_P));
+            }
+            break;
+        }
+        case OP_JMP:
+            EmitLoadReg(&e, HOST_EAX, inst->sr1);
+            EmitExitDynamic(jit, &e);
+            break;
+        case OP_JSR:
+            if (inst->flags)
+            {
+                EmitStoreImm(&e, CPU_REG(REG_R7), next);
+                EmitExitConst(jit, &e, next + inst->offset, 1U);
+            }
+            else
+            {
+                EmitLoadReg(&e, HOST_EAX, inst->sr1);  // Read before R7 is overwritten
+                EmitStoreImm(&e, CPU_REG(REG_R7), next);
+                EmitExitDynamic(jit, &e);
+            }
+            break;
+        case OP_TRAP:
+            EmitStoreImm(&e, CPU_PC, pc);
+            Emit8(&e, 0xBE);  // mov esi, word
+            Emit32(&e, inst->word);
+            EmitCall(&e, (const void *)LC3JitTrap);
+            Emit8(&e, 0xE9);  // jmp exit, the trap can stop the cpu
+            Emit32(&e, 0);
+            PatchRel32(e.p - 4, jit->exit);
+            break;
+        }
+        if (LC3JitSetsCC(inst->word >> 12))
+        {
+            ccSet = 1;
+        }
+    }
+    if (!LC3JitIsTerminator(insts[count - 1].word >> 12))
+    {
+        EmitExitConst(jit, &e, start + count, 0);
+    }
+    jit->next = e.p;
+
+    // Exits of other blocks waiting for this one can jump here directly now
+    for (uint32_t i = 0; i < jit->patchCount;)
+    {
+        if (jit->patches[i].target == start)
+        {
+            PatchRel32(jit->patches[i].site, block);
+            jit->patches[i] = jit->patches[--jit->patchCount];
+        }
+        else
+        {
+            i++;
+        }
+    }
+    return block;
+}
+
+void LC3CpuExecuteJit(LC3Cpu_t *cpu)
+{
+    if (!cpu->jit)
+    {
+        cpu->jit = LC3JitCreate();
+        if (!cpu->jit)
+        {
+            LOG_WARN("Can't allocate jit arena, running threaded engine");
+            LC3CpuExecuteThreaded(cpu);
+            return;
+        }
+    }
+    LC3Jit_t *jit = cpu->jit;
+    LC3DecodedInst_t uncached;
+    while (cpu->stat.running)
+    {
+        void *block = NULL;
+        // A block can't start if the budget left may be smaller than it
+        if (!cpu->stat.limited || cpu->budget >= JIT_MAX_BLOCK)
+        {
+            block = jit->map[cpu->PC];
+            if (!block)
+            {
+                block = LC3JitCompile(jit, cpu, cpu->PC);
+            }
+        }
+        if (block && !LC3JitProtect(jit, 0))
+        {
+            jit->enter(cpu, block);
+        }
+        else
+        {
+            if (cpu->stat.limited)
+            {
+                if (!cpu->budget)
+                {
+                    return;
+                }
+                cpu->budget--;
+            }
+            // Not compiled, the IO page, opcodes without native code or the end of a slice
+            LC3DecodedInst_t *inst = LC3CpuFetch(cpu, &uncached);
+            STATS_RETIRE(cpu->stats, inst);
+            inst->action(cpu, inst);
+            if (cpu->stat.incrementPC)
+            {
+                cpu->PC++;
+            }
+            // Blocks look at the pending events in their exits, the instructions run here do it after them
+            if (CPU_ENDS_BLOCK(inst->word >> 12) && cpu->stat.running &&
+                atomic_load_explicit(&cpu->pending, memory_order_relaxed))
+            {
+                LC3CpuCheckPending(cpu);
+            }
+        }
+    }
+}
+
+#else
+
+void LC3CpuExecuteJit(LC3Cpu_t *cpu)
+{
+    LC3CpuExecuteThreaded(cpu);
+}
+
+void LC3JitInvalidate(struct LC3Jit_t *jit, uint16_t addr)
+{
+}
+
+void LC3JitDestroy(struct LC3Jit_t *jit)
+{
+}
+
+#endif
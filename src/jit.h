@@ -0,0 +1,52 @@
+/**
+ * @file jit.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Basic block compiler to x86-64, blocks end at BR/JMP/JSR/TRAP and
+ * are chained directly between them. On other architectures the engine runs
+ * the threaded engine instead.
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__JIT_H__)
+#define __JIT_H__
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define LC3_JIT_SUPPORTED 1
+#else
+#define LC3_JIT_SUPPORTED 0
+#endif
+
+struct LC3Jit_t;
+
+/**
+ * @brief Executes the cpu until it stops, compiling every basic block the
+ * first time it's reached. Has the same semantics than LC3CpuExecute.
+ * 
+ * @param cpu pointer to the cpu instance
+ */
+void LC3CpuExecuteJit(LC3Cpu_t *cpu);
+
+/**
+ * @brief Called on every memory write, if the address is part of a compiled
+ * block all the compiled code is discarded
+ * 
+ * @param jit jit instance of the cpu
+ * @param addr written address
+ */
+void LC3JitInvalidate(struct LC3Jit_t *jit, uint16_t addr);
+
+/**
+ * @brief Releases the executable memory and the jit instance
+ * 
+ * @param jit jit instance of the cpu
+ */
+void LC3JitDestroy(struct LC3Jit_t *jit);
+
+#endif  // __JIT_H__
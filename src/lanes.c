@@ -0,0 +1,611 @@
+#include "lanes.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * @brief State of the lanes, register N of lane L is regs[N][L] so a
+ * register of all the lanes is a single vector
+ * 
+ */
+typedef struct LC3Lanes_t
+{
+    uint16_t regs[REG_COUNT][LANES_MAX];
+    uint16_t PC[LANES_MAX];
+    uint16_t CC[LANES_MAX];
+    LC3Vm_t *vms[LANES_MAX];
+    uint32_t count;
+    /**
+     * @brief bit per lane still running
+     * 
+     */
+    uint32_t live;
+} LC3Lanes_t;
+
+/**
+ * @brief Iterates the lanes of a mask, lowest first
+ * 
+ */
+#define FOR_EACH_LANE(__lane, __mask) \
+    for (uint32_t __bits = (__mask), __lane = 0; __bits && ((__lane = __builtin_ctz(__bits)), 1); __bits &= __bits - 1U)
+
+#if defined(__SSE2__)
+typedef __m128i LC3LaneVec_t;
+#define VEC_LOAD(__p) _mm_loadu_si128((const __m128i *)(__p))
+#define VEC_STORE(__p, __v) _mm_storeu_si128((__m128i *)(__p), (__v))
+#define VEC_SET(__x) _mm_set1_epi16((short)(__x))
+#define VEC_ADD(__a, __b) _mm_add_epi16((__a), (__b))
+#define VEC_AND(__a, __b) _mm_and_si128((__a), (__b))
+#define VEC_NOT(__a) _mm_xor_si128((__a), _mm_set1_epi16(-1))
+#define VEC_EQ(__a, __b) _mm_cmpeq_epi16((__a), (__b))
+#define VEC_NEG(__a) _mm_srai_epi16((__a), 15)
+#define VEC_SELECT(__m, __a, __b) _mm_or_si128(_mm_and_si128((__m), (__a)), _mm_andnot_si128((__m), (__b)))
+#else
+/**
+ * @brief Without SSE2 the vectors are arrays and every operation a loop
+ * 
+ */
+typedef struct LC3LaneVec_t
+{
+    uint16_t v[LANES_MAX];
+} LC3LaneVec_t;
+
+static LC3LaneVec_t LC3LaneLoad(const uint16_t *p)
+{
+    LC3LaneVec_t r;
+    memcpy(r.v, p, sizeof(r.v));
+    return r;
+}
+
+static LC3LaneVec_t LC3LaneSet(uint16_t x)
+{
+    LC3LaneVec_t r;
+    for (uint32_t l = 0; l < LANES_MAX; l++)
+    {
+        r.v[l] = x;
+    }
+    return r;
+}
+
+static LC3LaneVec_t LC3LaneAdd(LC3LaneVec_t a, LC3LaneVec_t b)
+{
+    for (uint32_t l = 0; l < LANES_MAX; l++)
+    {
+        a.v[l] += b.v[l];
+    }
+    return a;
+}
+
+static LC3LaneVec_t LC3LaneAnd(LC3LaneVec_t a, LC3LaneVec_t b)
+{
+    for (uint32_t l = 0; l < LANES_MAX; l++)
+    {
+        a.v[l] &= b.v[l];
+    }
+    return a;
+}
+
+static LC3LaneVec_t LC3LaneNot(LC3LaneVec_t a)
+{
+    for (uint32_t l = 0; l < LANES_MAX; l++)
+    {
+        a.v[l] = ~a.v[l];
+    }
+    return a;
+}
+
+static LC3LaneVec_t LC3LaneEq(LC3LaneVec_t a, LC3LaneVec_t b)
+{
+    for (uint32_t l = 0; l < LANES_MAX; l++)
+    {
+        a.v[l] = a.v[l] == b.v[l] ? 0xFFFF : 0;
+    }
+    return a;
+}
+
+static LC3LaneVec_t LC3LaneNeg(LC3LaneVec_t a)
+{
+    for (uint32_t l = 0; l < LANES_MAX; l++)
+    {
+        a.v[l] = (a.v[l] >> 15) ? 0xFFFF : 0;
+    }
+    return a;
+}
+
+static LC3LaneVec_t LC3LaneSelect(LC3LaneVec_t m, LC3LaneVec_t a, LC3LaneVec_t b)
+{
+    for (uint32_t l = 0; l < LANES_MAX; l++)
+    {
+        a.v[l] = (a.v[l] & m.v[l]) | (b.v[l] & ~m.v[l]);
+    }
+    return a;
+}
+
+#define VEC_LOAD(__p) LC3LaneLoad(__p)
+#define VEC_STORE(__p, __v) memcpy((__p), (__v).v, sizeof((__v).v))
+#define VEC_SET(__x) LC3LaneSet(__x)
+#define VEC_ADD(__a, __b) LC3LaneAdd((__a), (__b))
+#define VEC_AND(__a, __b) LC3LaneAnd((__a), (__b))
+#define VEC_NOT(__a) LC3LaneNot(__a)
+#define VEC_EQ(__a, __b) LC3LaneEq((__a), (__b))
+#define VEC_NEG(__a) LC3LaneNeg(__a)
+#define VEC_SELECT(__m, __a, __b) LC3LaneSelect((__m), (__a), (__b))
+#endif
+
+/**
+ * @brief Vector with all the bits of the lanes set in a mask
+ * 
+ * @param bits bit per lane
+ * @return LC3LaneVec_t 0xFFFF on the lanes of the mask, 0 on the rest
+ */
+static LC3LaneVec_t LC3LanesMask(uint32_t bits)
+{
+#if defined(__SSE2__)
+    const __m128i lane = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+    return _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16((short)bits), lane), lane);
+#else
+    LC3LaneVec_t r;
+    for (uint32_t l = 0; l < LANES_MAX; l++)
+    {
+        r.v[l] = (bits >> l) & 1U ? 0xFFFF : 0;
+    }
+    return r;
+#endif
+}
+
+/**
+ * @brief Finds the lanes to run next, the running ones with the lowest PC.
+ * Lanes that left the group by a branch forward wait there for the rest,
+ * lanes that stay longer in a loop run alone until they leave it.
+ * 
+ * @param lanes lanes instance, with some lane running
+ * @param pc output PC of the lanes
+ * @return uint32_t bit per lane at that PC
+ */
+static uint32_t LC3LanesSchedule(const LC3Lanes_t *lanes, uint16_t *pc)
+{
+#if defined(__SSE2__)
+    __m128i live = LC3LanesMask(lanes->live);
+    __m128i pcs = VEC_LOAD(lanes->PC);
+    // The unsigned min through the signed one, stopped lanes never go below a running one
+    __m128i keys = VEC_SELECT(live, _mm_xor_si128(pcs, VEC_SET(0x8000)), VEC_SET(0x7FFF));
+    keys = _mm_min_epi16(keys, _mm_shuffle_epi32(keys, _MM_SHUFFLE(1, 0, 3, 2)));
+    keys = _mm_min_epi16(keys, _mm_shuffle_epi32(keys, _MM_SHUFFLE(2, 3, 0, 1)));
+    keys = _mm_min_epi16(keys, _mm_srli_epi32(keys, 16));
+    *pc = (uint16_t)_mm_cvtsi128_si32(keys) ^ 0x8000;
+    __m128i at = _mm_and_si128(live, _mm_cmpeq_epi16(pcs, VEC_SET(*pc)));
+    return _mm_movemask_epi8(_mm_packs_epi16(at, _mm_setzero_si128())) & 0xFF;
+#else
+    uint32_t mask = 0;
+    for (uint32_t l = 0; l < lanes->count; l++)
+    {
+        if (!(lanes->live & (1U << l)))
+        {
+            continue;
+        }
+        if (!mask || lanes->PC[l] < *pc)
+        {
+            *pc = lanes->PC[l];
+            mask = 0;
+        }
+        if (lanes->PC[l] == *pc)
+        {
+            mask |= 1U << l;
+        }
+    }
+    return mask;
+#endif
+}
+
+/**
+ * @brief Copies the state of a lane to their cpu
+ * 
+ * @param lanes lanes instance
+ * @param lane lane to copy
+ */
+static void LC3LanesSyncOut(LC3Lanes_t *lanes, uint32_t lane)
+{
+    LC3Cpu_t *cpu = &lanes->vms[lane]->cpu;
+    for (uint32_t r = 0; r < REG_COUNT; r++)
+    {
+        cpu->regs[r] = lanes->regs[r][lane];
+    }
+    cpu->PC = lanes->PC[lane];
+    cpu->CC = lanes->CC[lane];
+}
+
+/**
+ * @brief Copies the state of the cpu of a lane to the lane, it stops
+ * running if the cpu stopped
+ * 
+ * @param lanes lanes instance
+ * @param lane lane to copy
+ */
+static void LC3LanesSyncIn(LC3Lanes_t *lanes, uint32_t lane)
+{
+    LC3Cpu_t *cpu = &lanes->vms[lane]->cpu;
+    for (uint32_t r = 0; r < REG_COUNT; r++)
+    {
+        lanes->regs[r][lane] = cpu->regs[r];
+    }
+    lanes->PC[lane] = cpu->PC;
+    lanes->CC[lane] = cpu->CC;
+    if (!cpu->stat.running)
+    {
+        lanes->live &= ~(1U << lane);
+    }
+}
+
+/**
+ * @brief Runs an instruction on the cpu of a lane with the handler of
+ * LC3Opcodes, the same way LC3CpuExecute does
+ * 
+ * @param lanes lanes instance
+ * @param lane lane that runs the instruction
+ * @param inst decoded instruction
+ */
+static void LC3LanesScalar(LC3Lanes_t *lanes, uint32_t lane, const LC3DecodedInst_t *inst)
+{
+    LC3Cpu_t *cpu = &lanes->vms[lane]->cpu;
+    LC3LanesSyncOut(lanes, lane);
+    LC3Opcodes[inst->word >> 12].action(cpu, inst);
+    if (cpu->stat.incrementPC)
+    {
+        cpu->PC++;
+    }
+    LC3LanesSyncIn(lanes, lane);
+}
+
+/**
+ * @brief Handles the interrupt requests and profiler samples of the lanes,
+ * called after the instructions that end a block like the other engines
+ * 
+ * @param lanes lanes instance
+ * @param mask lanes to check
+ */
+static void LC3LanesCheckPending(LC3Lanes_t *lanes, uint32_t mask)
+{
+    FOR_EACH_LANE(l, mask & lanes->live)
+    {
+        LC3Cpu_t *cpu = &lanes->vms[l]->cpu;
+        if (atomic_load_explicit(&cpu->pending, memory_order_relaxed))
+        {
+            LC3LanesSyncOut(lanes, l);
+            LC3CpuCheckPending(cpu);
+            LC3LanesSyncIn(lanes, l);
+        }
+    }
+}
+
+/**
+ * @brief Writes the result of an instruction to a register of some lanes
+ * and updates their condition codes
+ * 
+ * @param lanes lanes instance
+ * @param m lanes that write the result
+ * @param dr destination register
+ * @param value value of every lane
+ */
+static void LC3LanesResult(LC3Lanes_t *lanes, LC3LaneVec_t m, uint8_t dr, LC3LaneVec_t value)
+{
+    LC3LaneVec_t zero = VEC_EQ(value, VEC_SET(0));
+    LC3LaneVec_t cc = VEC_SELECT(zero, VEC_SET(CC_Z), VEC_SELECT(VEC_NEG(value), VEC_SET(CC_N), VEC_SET(CC_P)));
+    VEC_STORE(lanes->regs[dr], VEC_SELECT(m, value, VEC_LOAD(lanes->regs[dr])));
+    VEC_STORE(lanes->CC, VEC_SELECT(m, cc, VEC_LOAD(lanes->CC)));
+}
+
+/**
+ * @brief Address of the memory accessed by a LD, LDR, LDI, ST, STR or STI
+ * of a lane. Device registers can depend on the whole cpu state, like PSR,
+ * so the lanes that access them run the instruction on their cpu.
+ * 
+ * @param lanes lanes instance
+ * @param lane lane that runs the instruction
+ * @param inst decoded instruction
+ * @param pc address of the instruction
+ * @param addr output address of the word
+ * @return uint8_t EXIT_FAILURE if it's a device register
+ */
+static uint8_t LC3LanesAddress(const LC3Lanes_t *lanes, uint32_t lane, const LC3DecodedInst_t *inst, uint16_t pc, uint16_t *addr)
+{
+    const LC3Cpu_t *cpu = &lanes->vms[lane]->cpu;
+    uint8_t opcode = inst->word >> 12;
+    *addr = pc + 1U + inst->offset;
+    if (opcode == OP_LDR || opcode == OP_STR)
+    {
+        *addr = lanes->regs[inst->sr1][lane] + inst->offset;
+    }
+    if (cpu->devices.pages[*addr >> DEVICE_PAGE_SHIFT])
+    {
+        return EXIT_FAILURE;
+    }
+    if (opcode == OP_LDI || opcode == OP_STI)
+    {
+        *addr = MEMORY_READ(&cpu->firmware->memory, *addr);
+        if (cpu->devices.pages[*addr >> DEVICE_PAGE_SHIFT])
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Runs an instruction on the lanes at the same PC
+ * 
+ * @param lanes lanes instance
+ * @param pc PC of the lanes
+ * @param mask lanes at that PC
+ * @return uint32_t lanes that ran the instruction, the ones whose memory
+ * has other instruction at PC run later
+ */
+static uint32_t LC3LanesStep(LC3Lanes_t *lanes, uint16_t pc, uint32_t mask)
+{
+    uint32_t first = __builtin_ctz(mask);
+    LC3Cpu_t *cpu = &lanes->vms[first]->cpu;
+    LC3DecodedInst_t uncached;
+    const LC3DecodedInst_t *page = cpu->firmware->decoded[pc >> MEMORY_PAGE_SHIFT];
+    const LC3DecodedInst_t *entry = page ? &page[pc & MEMORY_PAGE_MASK] : NULL;
+    if (!entry || !entry->action)
+    {
+        cpu->PC = pc;
+        entry = LC3CpuFetch(cpu, &uncached);
+    }
+    // Copied, the stores of the lanes can invalidate the entry
+    const LC3DecodedInst_t inst = *entry;
+    if (pc >= IO_PAGE_ADDRESS)
+    {
+        // Fetching from the devices has side effects, only one lane reads them at once
+        mask = 1U << first;
+    }
+    else
+    {
+        // Lanes that still share the page have the same word, self modifying code can give another one
+        const LC3MemoryPage_t *words = cpu->firmware->memory.pages[pc >> MEMORY_PAGE_SHIFT];
+        FOR_EACH_LANE(l, mask & (mask - 1U))
+        {
+            const LC3MemoryPage_t *other = lanes->vms[l]->firmware.memory.pages[pc >> MEMORY_PAGE_SHIFT];
+            if (other != words && other->words[pc & MEMORY_PAGE_MASK] != inst.word)
+            {
+                mask &= ~(1U << l);
+            }
+        }
+    }
+
+    LC3LaneVec_t m = LC3LanesMask(mask);
+    LC3LaneVec_t next = VEC_SET(pc + 1U);
+    uint16_t target = pc + 1U + inst.offset;
+    // Lanes that ran the instruction on their cpu, their PC is already updated
+    uint32_t scalar = 0;
+    uint16_t addr;
+    switch (inst.word >> 12)
+    {
+    case OP_BR:
+        // Lanes that don't agree on the condition split here
+        next = VEC_SELECT(VEC_EQ(VEC_AND(VEC_LOAD(lanes->CC), VEC_SET(inst.flags)), VEC_SET(0)), next, VEC_SET(target));
+        break;
+    case OP_ADD:
+        LC3LanesResult(lanes, m, inst.dr, VEC_ADD(VEC_LOAD(lanes->regs[inst.sr1]), inst.flags ? VEC_SET(inst.offset) : VEC_LOAD(lanes->regs[inst.sr2])));
+        break;
+    case OP_AND:
+        LC3LanesResult(lanes, m, inst.dr, VEC_AND(VEC_LOAD(lanes->regs[inst.sr1]), inst.flags ? VEC_SET(inst.offset) : VEC_LOAD(lanes->regs[inst.sr2])));
+        break;
+    case OP_NOT:
+        LC3LanesResult(lanes, m, inst.dr, VEC_NOT(VEC_LOAD(lanes->regs[inst.sr1])));
+        break;
+    case OP_LEA:
+        LC3LanesResult(lanes, m, inst.dr, VEC_SET(target));
+        break;
+    case OP_JMP:
+        next = VEC_LOAD(lanes->regs[inst.sr1]);
+        break;
+    case OP_JSR:
+        // The base is read before R7 is written, JSRR R7 is valid
+        next = inst.flags ? VEC_SET(target) : VEC_LOAD(lanes->regs[inst.sr1]);
+        VEC_STORE(lanes->regs[REG_R7], VEC_SELECT(m, VEC_SET(pc + 1U), VEC_LOAD(lanes->regs[REG_R7])));
+        break;
+    case OP_LD:
+    case OP_LDR:
+    case OP_LDI:
+        FOR_EACH_LANE(l, mask)
+        {
+            if (LC3LanesAddress(lanes, l, &inst, pc, &addr))
+            {
+                scalar |= 1U << l;
+                continue;
+            }
+            lanes->regs[inst.dr][l] = MEMORY_READ(&lanes->vms[l]->firmware.memory, addr);
+        }
+        LC3LanesResult(lanes, LC3LanesMask(mask & ~scalar), inst.dr, VEC_LOAD(lanes->regs[inst.dr]));
+        break;
+    case OP_ST:
+    case OP_STR:
+    case OP_STI:
+        FOR_EACH_LANE(l, mask)
+        {
+            if (LC3LanesAddress(lanes, l, &inst, pc, &addr))
+            {
+                scalar |= 1U << l;
+                continue;
+            }
+            LC3CpuWriteMemory(&lanes->vms[l]->cpu, addr, lanes->regs[inst.dr][l]);
+            if (!lanes->vms[l]->cpu.stat.running)
+            {
+                lanes->live &= ~(1U << l);
+            }
+        }
+        break;
+    default:
+        // TRAP, RTI and the reserved opcode
+        scalar = mask;
+        break;
+    }
+    FOR_EACH_LANE(l, scalar)
+    {
+        LC3LanesScalar(lanes, l, &inst);
+    }
+    m = LC3LanesMask(mask & ~scalar);
+    VEC_STORE(lanes->PC, VEC_SELECT(m, next, VEC_LOAD(lanes->PC)));
+
+    if (CPU_ENDS_BLOCK(inst.word >> 12))
+    {
+        LC3LanesCheckPending(lanes, mask);
+    }
+    return mask;
+}
+
+/**
+ * @brief Counts the instructions of the lanes that ran one and stops the
+ * lanes that reach their limit
+ * 
+ * @param lanes lanes instance
+ * @param mask lanes that ran an instruction
+ */
+static void LC3LanesCount(LC3Lanes_t *lanes, uint32_t mask)
+{
+    FOR_EACH_LANE(l, mask)
+    {
+        LC3Vm_t *vm = lanes->vms[l];
+        vm->instructions++;
+        // A lane that halts with their last instruction halted
+        if (vm->options.maxInstructions && vm->instructions >= vm->options.maxInstructions && (lanes->live & (1U << l)))
+        {
+            vm->stop = VM_STOP_INSTRUCTIONS;
+            lanes->live &= ~(1U << l);
+        }
+    }
+}
+
+/**
+ * @brief Seconds since the start of the run
+ * 
+ * @param start start time of the run
+ * @return double elapsed seconds
+ */
+static double LC3LanesElapsed(const struct timespec *start)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Stops the lanes that ran out of time
+ * 
+ * @param lanes lanes instance
+ * @param start start time of the run
+ */
+static void LC3LanesCheckTime(LC3Lanes_t *lanes, const struct timespec *start)
+{
+    double elapsed = LC3LanesElapsed(start);
+    for (uint32_t l = 0; l < lanes->count; l++)
+    {
+        LC3Vm_t *vm = lanes->vms[l];
+        if ((lanes->live & (1U << l)) && vm->options.timeLimit > 0 && elapsed >= vm->options.timeLimit)
+        {
+            vm->stop = VM_STOP_TIMEOUT;
+            lanes->live &= ~(1U << l);
+        }
+    }
+}
+
+/**
+ * @brief Runs the rest of a lane alone with the engine of their options and
+ * what is left of their limits
+ * 
+ * @param vm vm of the lane, their cpu has the state of the lane
+ * @param start start time of the run
+ */
+static void LC3LanesAlone(LC3Vm_t *vm, const struct timespec *start)
+{
+    LC3VmOptions_t options = vm->options;
+    uint64_t instructions = vm->instructions;
+    double elapsed = LC3LanesElapsed(start);
+    // A lane at their instruction limit already stopped, there is always something left
+    vm->options.maxInstructions -= instructions;
+    if (options.timeLimit > 0)
+    {
+        vm->options.timeLimit = options.timeLimit > elapsed ? options.timeLimit - elapsed : 1e-9;
+    }
+    vm->cpu.stat.fusion = options.fusion && !vm->cpu.stat.limited;
+    vm->cpu.stat.idle = !vm->cpu.stat.limited;
+    LC3VmRun(vm);
+    vm->instructions += instructions;
+    vm->options = options;
+}
+
+void LC3LanesRun(LC3Vm_t *const *vms, uint32_t count)
+{
+    LC3Lanes_t lanes;
+    uint8_t limited = 0;
+    memset(&lanes, 0, sizeof(lanes));
+    lanes.count = count < LANES_MAX ? count : LANES_MAX;
+    for (uint32_t l = 0; l < lanes.count; l++)
+    {
+        lanes.vms[l] = vms[l];
+        vms[l]->stop = VM_STOP_HALT;
+        vms[l]->instructions = 0;
+        // Superinstructions change the decoded entries, the lanes decode plain instructions
+        vms[l]->cpu.stat.fusion = 0;
+        // A lane sleeping in a polling loop would stop the others
+        vms[l]->cpu.stat.idle = 0;
+        limited |= vms[l]->cpu.stat.limited;
+        lanes.live |= 1U << l;
+        LC3LanesSyncIn(&lanes, l);
+    }
+    LOG_LN("Running %u lanes in lockstep", lanes.count);
+
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    uint64_t steps = 0;
+    uint64_t retired = 0;
+    uint64_t window = 0;
+    // A single lane is faster with their engine
+    while (lanes.live & (lanes.live - 1U))
+    {
+        uint16_t pc = 0;
+        uint32_t mask = LC3LanesSchedule(&lanes, &pc);
+        mask = LC3LanesStep(&lanes, pc, mask);
+        steps++;
+        // Bits set in the 8 bits of the mask, the builtin is a call without popcnt
+        uint32_t ran = mask - ((mask >> 1) & 0x55U);
+        ran = (ran & 0x33U) + ((ran >> 2) & 0x33U);
+        retired += (ran + (ran >> 4)) & 0x0FU;
+        if (limited)
+        {
+            LC3LanesCount(&lanes, mask);
+            if (!(steps & (VM_SLICE_INSTRUCTIONS - 1)))
+            {
+                LC3LanesCheckTime(&lanes, &start);
+            }
+        }
+        if (!(steps & (LANES_WINDOW - 1)))
+        {
+            if (retired - window < (uint64_t)LANES_WINDOW * LANES_MIN_OCCUPANCY)
+            {
+                break;
+            }
+            window = retired;
+        }
+    }
+    for (uint32_t l = 0; l < lanes.count; l++)
+    {
+        LC3LanesSyncOut(&lanes, l);
+    }
+    LOG_LN("%llu steps ran %llu instructions, %.2f lanes per step", (unsigned long long)steps,
+           (unsigned long long)retired, steps ? (double)retired / (double)steps : 0.0);
+    for (uint32_t l = 0; l < lanes.count; l++)
+    {
+        if (lanes.live & (1U << l))
+        {
+            LOG_LN("Lane %u runs alone from 0x%04X", l, lanes.PC[l]);
+            LC3LanesAlone(lanes.vms[l], &start);
+        }
+    }
+}
@@ -0,0 +1,52 @@
+/**
+ * @file lanes.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Lockstep interpreter of many vms running the same program with
+ * different inputs. Registers, PC and CC of every vm are kept as structure
+ * of arrays, one lane per vm, and the lanes at the same PC run each
+ * instruction together with vector operations. Lanes that take other paths
+ * wait, the lanes with the lowest PC always run first so the paths meet
+ * again after the branches.
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__LANES_H__)
+#define __LANES_H__
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/**
+ * @brief Max vms run in lockstep, a register of all the lanes fills a SSE2
+ * vector of 16 bit elements
+ * 
+ */
+#define LANES_MAX 8
+
+/**
+ * @brief Steps between two checks of the mean of lanes that run every
+ * instruction. When it's below LANES_MIN_OCCUPANCY the lanes don't run
+ * together anymore and every one of them runs the rest alone with their
+ * engine.
+ * 
+ */
+#define LANES_WINDOW (1 << 16)
+#define LANES_MIN_OCCUPANCY 2
+
+/**
+ * @brief Runs vms created from the same image until all of them stop or
+ * reach a limit of their options. Loads, stores and traps run on the cpu of
+ * every lane, and lanes that split for good or are left alone finish with
+ * the engine of their options. The state of every cpu is updated at the end
+ * as if it had run alone.
+ * 
+ * @param vms vms to run, created and not run yet
+ * @param count count of vms, up to LANES_MAX
+ */
+void LC3LanesRun(LC3Vm_t *const *vms, uint32_t count);
+
+#endif  // __LANES_H__
@@ -0,0 +1,115 @@
+/**
+ * @file lc3as.c
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Assembles a source file into an objfile and their symbol table
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "assembler.h"
+
+/**
+ * @brief Builds the name of an output file replacing the extension of the
+ * source
+ * 
+ * @param source path/filename of the source
+ * @param ext extension of the output, with the dot
+ * @param output output path/filename
+ * @param size size of the output buffer
+ * @return uint8_t EXIT_FAILURE if the name doesn't fit
+ */
+static uint8_t OutputName(const char *source, const char *ext, char *output, size_t size)
+{
+    size_t length = strlen(source);
+    const char *dot = strrchr(source, '.');
+    const char *slash = strrchr(source, '/');
+    if (dot && (!slash || dot > slash))
+    {
+        length = dot - source;
+    }
+    if (length + strlen(ext) >= size)
+    {
+        return EXIT_FAILURE;
+    }
+    memcpy(output, source, length);
+    strcpy(output + length, ext);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char const *argv[])
+{
+    const char *source = NULL;
+    const char *objfile = NULL;
+    uint8_t writeSym = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            objfile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--no-sym") == 0)
+        {
+            writeSym = 0;
+        }
+        else if (!source)
+        {
+            source = argv[i];
+        }
+        else
+        {
+            source = NULL;
+            break;
+        }
+    }
+    if (!source)
+    {
+        printf("Usage: lc3as [-o obj-file] [--no-sym] asm-file\n");
+        return 1;
+    }
+
+    char objname[FILENAME_MAX];
+    char symname[FILENAME_MAX];
+    if ((!objfile && OutputName(source, ASM_OBJ_EXT, objname, sizeof(objname))) ||
+        OutputName(objfile ? objfile : source, ASM_SYM_EXT, symname, sizeof(symname)))
+    {
+        fprintf(stderr, "%s: filename too long\n", source);
+        return 1;
+    }
+    objfile = objfile ? objfile : objname;
+
+    LC3Firmware_t *firmware = calloc(1U, sizeof(LC3Firmware_t));
+    if (!firmware)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    initFirmware(firmware);
+    LC3Asm_t as;
+    int status = EXIT_SUCCESS;
+    if (LC3AsmAssembleFile(&as, source, firmware))
+    {
+        fprintf(stderr, "%s:%u: %s\n", source, as.errorLine, as.error);
+        status = EXIT_FAILURE;
+    }
+    else if (LC3AsmWriteObj(firmware, objfile))
+    {
+        fprintf(stderr, "Can't write %s\n", objfile);
+        status = EXIT_FAILURE;
+    }
+    else if (writeSym && LC3AsmWriteSym(&as, symname))
+    {
+        fprintf(stderr, "Can't write %s\n", symname);
+        status = EXIT_FAILURE;
+    }
+    LC3AsmFree(&as);
+    releaseFirmware(firmware);
+    free(firmware);
+    return status;
+}
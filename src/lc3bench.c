@@ -0,0 +1,223 @@
+/**
+ * @file lc3bench.c
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Runs programs headless many times and reports the guest MIPS of an
+ * engine, the programs of the bench directory are the reference corpus
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu.h"
+#include "vm.h"
+
+#if _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+/**
+ * @brief Runs measured by default for every program
+ * 
+ */
+#define BENCH_DEFAULT_RUNS 5
+
+/**
+ * @brief Result of the runs of a program
+ * 
+ */
+typedef struct LC3BenchResult_t
+{
+    /**
+     * @brief instructions retired by one run
+     * 
+     */
+    uint64_t instructions;
+    /**
+     * @brief MIPS of every run, mean and sample standard deviation
+     * 
+     */
+    double mean;
+    double stddev;
+    double min;
+    double max;
+} LC3BenchResult_t;
+
+/**
+ * @brief Runs a program once, with empty keyboard and discarded display
+ * 
+ * @param objfile path/filename to the objfile
+ * @param options settings of the vm
+ * @param stats output statistics of the run, counted if options ask for them
+ * @return uint8_t EXIT_FAILURE if the program can't be loaded
+ */
+static uint8_t RunOnce(const char *objfile, const LC3VmOptions_t *options, LC3Stats_t *stats)
+{
+    FILE *in = tmpfile();
+    FILE *out = fopen(NULL_DEVICE, "w");
+    LC3Vm_t *vm = (in && out) ? LC3VmCreate(objfile, in, out, options) : NULL;
+    uint8_t status = EXIT_FAILURE;
+    if (vm)
+    {
+        struct timespec start;
+        timespec_get(&start, TIME_UTC);
+        LC3VmRun(vm);
+        struct timespec end;
+        timespec_get(&end, TIME_UTC);
+        if (options->stats)
+        {
+            *stats = vm->stats;
+        }
+        stats->seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+        LC3VmDestroy(vm);
+        status = EXIT_SUCCESS;
+    }
+    if (in)
+    {
+        fclose(in);
+    }
+    if (out)
+    {
+        fclose(out);
+    }
+    return status;
+}
+
+/**
+ * @brief Counts the instructions of a program and measures their runs, the
+ * measured runs don't count statistics so they run at full speed
+ * 
+ * @param objfile path/filename to the objfile
+ * @param options settings of the vm
+ * @param runs count of measured runs
+ * @param result output result
+ * @return uint8_t EXIT_FAILURE if the program can't be loaded
+ */
+static uint8_t Bench(const char *objfile, const LC3VmOptions_t *options, uint32_t runs, LC3BenchResult_t *result)
+{
+    LC3VmOptions_t counting = *options;
+    LC3Stats_t stats;
+    counting.stats = 1;
+    if (RunOnce(objfile, &counting, &stats))
+    {
+        return EXIT_FAILURE;
+    }
+    result->instructions = LC3StatsInstructions(&stats);
+
+    double sum = 0;
+    double squares = 0;
+    result->min = INFINITY;
+    result->max = 0;
+    for (uint32_t run = 0; run < runs; run++)
+    {
+        if (RunOnce(objfile, options, &stats))
+        {
+            return EXIT_FAILURE;
+        }
+        double mips = stats.seconds > 0 ? result->instructions / stats.seconds / 1e6 : 0;
+        sum += mips;
+        squares += mips * mips;
+        result->min = mips < result->min ? mips : result->min;
+        result->max = mips > result->max ? mips : result->max;
+    }
+    result->mean = sum / runs;
+    result->stddev = runs > 1 ? sqrt(fmax(0, (squares - sum * sum / runs) / (runs - 1U))) : 0;
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char const *argv[])
+{
+    LC3VmOptions_t options = {ENGINE_TABLE, 1, 0, FLUSH_FULL, 0, 1, 0, 0};
+    uint32_t runs = BENCH_DEFAULT_RUNS;
+    uint8_t json = 0;
+    int first = argc;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+        {
+            options.engine = LC3CpuFindEngine(argv[++i]);
+            if (options.engine == ENGINE_COUNT)
+            {
+                printf("Unknown engine %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+        {
+            runs = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--no-fusion") == 0)
+        {
+            options.fusion = 0;
+        }
+        else if (strcmp(argv[i], "--json") == 0)
+        {
+            json = 1;
+        }
+        else
+        {
+            first = i;
+            break;
+        }
+    }
+    if (first == argc || !runs)
+    {
+        printf("Usage: lc3bench [--engine table|threaded|jit] [--no-fusion] [--runs n] [--json]\n"
+               "                obj-file...\n");
+        return 1;
+    }
+    if (!LC3_STATS)
+    {
+        printf("Instructions can't be counted, statistics are not available in this build\n");
+        return 1;
+    }
+
+    int status = EXIT_SUCCESS;
+    const char *separator = "";
+    if (json)
+    {
+        printf("{\"engine\": \"%s\", \"runs\": %u, \"programs\": [", LC3Engines[options.engine].name, runs);
+    }
+    else
+    {
+        printf("Engine %s, %u runs\n", LC3Engines[options.engine].name, runs);
+        printf("%-24s %14s %10s %10s %10s %10s\n", "program", "instructions", "MIPS", "stddev", "min", "max");
+    }
+    for (int i = first; i < argc; i++)
+    {
+        LC3BenchResult_t result;
+        if (Bench(argv[i], &options, runs, &result))
+        {
+            fprintf(stderr, "Can't load objfile %s\n", argv[i]);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (json)
+        {
+            printf("%s\n  {\"program\": \"%s\", \"instructions\": %llu, \"mips\": %.2f, \"stddev\": %.2f, "
+                   "\"min\": %.2f, \"max\": %.2f}",
+                   separator, argv[i], (unsigned long long)result.instructions, result.mean, result.stddev,
+                   result.min, result.max);
+            separator = ",";
+        }
+        else
+        {
+            printf("%-24s %14llu %10.2f %10.2f %10.2f %10.2f\n", argv[i], (unsigned long long)result.instructions,
+                   result.mean, result.stddev, result.min, result.max);
+        }
+        fflush(stdout);
+    }
+    if (json)
+    {
+        printf("\n]}\n");
+    }
+    return status;
+}
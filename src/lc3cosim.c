@@ -0,0 +1,215 @@
+/**
+ * @file lc3cosim.c
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Runs programs, or random images, with an engine and with the
+ * reference table engine in lockstep and reports the first divergence
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "assembler.h"
+#include "cosim.h"
+#include "cpu.h"
+
+/**
+ * @brief Instructions compared by default on every random image
+ * 
+ */
+#define COSIM_RANDOM_MAX_INSTRUCTIONS 100000ULL
+
+/**
+ * @brief Loads an objfile, or assembles a source, into the image
+ * 
+ * @param filename path/filename of the objfile or source
+ * @param image firmware that receives the program
+ * @return uint8_t EXIT_FAILURE if it can't be loaded
+ */
+static uint8_t LoadImage(const char *filename, LC3Firmware_t *image)
+{
+    size_t length = strlen(filename);
+    if (length <= 4U || strcasecmp(filename + length - 4U, ".asm") != 0)
+    {
+        return loadFirmwareFromFile(filename, image);
+    }
+    LC3Asm_t as;
+    uint8_t status = LC3AsmAssembleFile(&as, filename, image);
+    if (status)
+    {
+        fprintf(stderr, "%s:%u: %s\n", filename, as.errorLine, as.error);
+    }
+    LC3AsmFree(&as);
+    return status;
+}
+
+/**
+ * @brief Prints the command line options
+ * 
+ */
+static void PrintUsage()
+{
+    printf("Usage: lc3cosim [--engine table|threaded|jit] [--fusion] [--interval n] [--max-instructions n]\n"
+           "                [--input file] obj-file|asm-file...\n"
+           "       lc3cosim [--engine table|threaded|jit] [--fusion] [--interval n] [--max-instructions n]\n"
+           "                [--seed n] [--words n] --random count\n");
+}
+
+int main(int argc, char const *argv[])
+{
+    LC3Cosim_t cosim = {.engine = ENGINE_JIT, .interval = COSIM_DEFAULT_INTERVAL};
+    uint32_t randomCount = 0;
+    uint32_t seed = 1;
+    uint32_t words = COSIM_DEFAULT_RANDOM_WORDS;
+    int first = argc;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+        {
+            cosim.engine = LC3CpuFindEngine(argv[++i]);
+            if (cosim.engine == ENGINE_COUNT)
+            {
+                printf("Unknown engine %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--fusion") == 0)
+        {
+            cosim.fusion = 1;
+        }
+        else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc)
+        {
+            cosim.interval = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc)
+        {
+            cosim.maxInstructions = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+        {
+            cosim.input = argv[++i];
+        }
+        else if (strcmp(argv[i], "--random") == 0 && i + 1 < argc)
+        {
+            randomCount = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            seed = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--words") == 0 && i + 1 < argc)
+        {
+            words = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0)
+        {
+            PrintUsage();
+            return 0;
+        }
+        else if (argv[i][0] == '-')
+        {
+            // Options without their value end here too, they are never files
+            printf("Unknown option or missing value %s\n", argv[i]);
+            PrintUsage();
+            return 1;
+        }
+        else
+        {
+            first = i;
+            break;
+        }
+    }
+
+    for (int i = first; i < argc; i++)
+    {
+        if (argv[i][0] == '-')
+        {
+            printf("Options go before the files, %s is not a file\n", argv[i]);
+            return 1;
+        }
+    }
+    if (first == argc && !randomCount)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    LC3Firmware_t *image = calloc(1U, sizeof(LC3Firmware_t));
+    if (!image)
+    {
+        printf("Can't allocate the image\n");
+        return 1;
+    }
+    initFirmware(image);
+    cosim.image = image;
+    int status = EXIT_SUCCESS;
+    uint32_t diverged = 0;
+    if (randomCount)
+    {
+        if (!cosim.maxInstructions)
+        {
+            cosim.maxInstructions = COSIM_RANDOM_MAX_INSTRUCTIONS;
+        }
+        uint64_t instructions = 0;
+        for (uint32_t i = 0; i < randomCount; i++)
+        {
+            if (LC3CosimRandomImage(image, seed + i, words > UINT16_MAX ? UINT16_MAX : words) ||
+                (LC3CosimRun(&cosim) && !cosim.diverged))
+            {
+                printf("Can't create the vms\n");
+                status = EXIT_FAILURE;
+                break;
+            }
+            instructions += cosim.instructions;
+            if (cosim.diverged)
+            {
+                printf("==> seed %u <==\n", seed + i);
+                LC3CosimReport(&cosim, stdout);
+                diverged++;
+            }
+        }
+        printf("%u random images, %llu instructions, %u diverged\n", randomCount,
+               (unsigned long long)instructions, diverged);
+    }
+    else
+    {
+        if (!cosim.maxInstructions)
+        {
+            cosim.maxInstructions = COSIM_DEFAULT_MAX_INSTRUCTIONS;
+        }
+        for (int i = first; i < argc; i++)
+        {
+            releaseFirmware(image);
+            if (LoadImage(argv[i], image))
+            {
+                printf("Can't load objfile %s\n", argv[i]);
+                status = EXIT_FAILURE;
+                continue;
+            }
+            if (LC3CosimRun(&cosim) && !cosim.diverged)
+            {
+                printf("Can't create the vms\n");
+                status = EXIT_FAILURE;
+                continue;
+            }
+            if (cosim.diverged)
+            {
+                printf("==> %s <==\n", argv[i]);
+                LC3CosimReport(&cosim, stdout);
+                diverged++;
+            }
+            else
+            {
+                printf("%s: %llu instructions match\n", argv[i], (unsigned long long)cosim.instructions);
+            }
+        }
+    }
+    releaseFirmware(image);
+    free(image);
+    return diverged ? EXIT_FAILURE : status;
+}
@@ -0,0 +1,143 @@
+/**
+ * @file lc3trace.c
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Decodes binary trace files written by lc3vm --trace-file
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cpu.h"
+#include "tracefile.h"
+
+/**
+ * @brief Compares an opcode name of LC3Opcodes, that are padded with spaces,
+ * against a name without padding
+ * 
+ * @param padded name from LC3Opcodes
+ * @param name name to compare, case insensitive
+ * @return uint8_t 1 if are equal
+ */
+static uint8_t OpcodeNameEquals(const char *padded, const char *name)
+{
+    size_t len = strlen(name);
+    if (strncasecmp(padded, name, len) != 0)
+    {
+        return 0;
+    }
+    for (padded += len; *padded; padded++)
+    {
+        if (*padded != ' ')
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char const *argv[])
+{
+    const char *filename = NULL;
+    uint16_t pcMin = 0x0000;
+    uint16_t pcMax = 0xFFFF;
+    int opcode = -1;
+    uint8_t summary = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--pc-min") == 0 && i + 1 < argc)
+        {
+            pcMin = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--pc-max") == 0 && i + 1 < argc)
+        {
+            pcMax = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--opcode") == 0 && i + 1 < argc)
+        {
+            i++;
+            for (opcode = 0; opcode < OP_COUNT; opcode++)
+            {
+                if (OpcodeNameEquals(LC3Opcodes[opcode].name, argv[i]))
+                {
+                    break;
+                }
+            }
+            if (opcode == OP_COUNT)
+            {
+                printf("Unknown opcode %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--summary") == 0)
+        {
+            summary = 1;
+        }
+        else
+        {
+            filename = argv[i];
+        }
+    }
+
+    if (!filename)
+    {
+        printf("Usage: lc3trace [--pc-min addr] [--pc-max addr] [--opcode name] [--summary] [trace-file]\n");
+        return 1;
+    }
+
+    LC3TraceFile_t *tf = LC3TraceFileOpen(filename);
+    if (!tf)
+    {
+        printf("Can't read trace file %s\n", filename);
+        return 1;
+    }
+
+    LC3TraceFileEntry_t entry;
+    uint64_t total = 0;
+    uint64_t shown = 0;
+    uint64_t counts[OP_COUNT] = {0};
+    while (LC3TraceFileRead(tf, &entry))
+    {
+        uint8_t op = entry.word >> 12;
+        total++;
+        if (entry.pc < pcMin || entry.pc > pcMax || (opcode >= 0 && op != opcode))
+        {
+            continue;
+        }
+        shown++;
+        counts[op]++;
+        if (summary)
+        {
+            continue;
+        }
+        printf("0x%04X [0x%04X] %s", entry.pc, entry.word, LC3Opcodes[op].name);
+        for (uint8_t r = 0; r < entry.regCount; r++)
+        {
+            printf(" R%u <- 0x%04X", entry.reg[r], entry.regValue[r]);
+        }
+        if (entry.memWrite)
+        {
+            printf(" $0x%04X <- 0x%04X", entry.memAddr, entry.memValue);
+        }
+        printf("\n");
+    }
+    LC3TraceFileClose(tf);
+
+    if (summary)
+    {
+        printf("Instructions: %llu, matching: %llu\n", (unsigned long long)total, (unsigned long long)shown);
+        for (uint8_t op = 0; op < OP_COUNT; op++)
+        {
+            if (counts[op])
+            {
+                printf("  %s %12llu\n", LC3Opcodes[op].name, (unsigned long long)counts[op]);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
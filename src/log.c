@@ -1,9 +1,386 @@
 #include "log.h"
 
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-int LOG_OK = 0x00;
-FILE *fileout = NULL;
+_Thread_local int LOG_OK = 0x00;
+_Thread_local FILE *fileout = NULL;
+
+/**
+ * @brief Types of the arguments, as printf reads them
+ * 
+ */
+typedef enum
+{
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_POINTER,
+    LOG_ARG_STRING,  // Copied to the text of the record, the value is their offset
+    LOG_ARG_COUNT
+} LogArg_e;
+
+/**
+ * @brief Argument of a message
+ * 
+ */
+typedef union LogArg_t
+{
+    int i;
+    long l;
+    long long ll;
+    size_t z;
+    double d;
+    const void *p;
+} LogArg_t;
+
+/**
+ * @brief Message waiting for the writer
+ * 
+ */
+typedef struct LogRecord_t
+{
+    /**
+     * @brief position of the queue the slot is ready for, the producer that
+     * claims the position fills it and the writer gives it back for the
+     * next round
+     * 
+     */
+    _Atomic uint32_t sequence;
+    /**
+     * @brief call site with their format and argument types
+     * 
+     */
+    const LogSite_t *site;
+    /**
+     * @brief fileout of the thread that queued it
+     * 
+     */
+    FILE *out;
+    /**
+     * @brief set if the message is already formatted in text
+     * 
+     */
+    uint8_t formatted;
+    LogArg_t args[LOG_RECORD_ARGS];
+    char text[LOG_RECORD_TEXT];
+} LogRecord_t;
+
+/**
+ * @brief Queue of messages, bounded and lock free for many producers and
+ * the writer as single consumer
+ * 
+ */
+static LogRecord_t logQueue[LOG_QUEUE_SIZE];
+static _Atomic uint32_t logHead;
+static _Atomic uint32_t logTail;
+static _Atomic uint32_t logDropped;
+
+/**
+ * @brief Writer thread and their log file
+ * 
+ */
+static FILE *logFile = NULL;
+static pthread_t logWriter;
+static _Atomic uint8_t logStop;
+static uint8_t logStarted = 0;
+
+/**
+ * @brief The writer sleeps on logReady while the queue is empty, the
+ * producers only take the lock to wake it up when logSleeping is set
+ * 
+ */
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logReady = PTHREAD_COND_INITIALIZER;
+static _Atomic uint8_t logSleeping;
+
+/**
+ * @brief Reads the types of the arguments from the format of a site
+ * 
+ * @param site call site to fill
+ * @return uint8_t EXIT_FAILURE if the format has conversions that can't be
+ * deferred, or too many arguments
+ */
+static uint8_t Log_parseFormat(LogSite_t *site)
+{
+    site->count = 0;
+    for (const char *c = site->format; *c; c++)
+    {
+        if (*c != '%')
+        {
+            continue;
+        }
+        c++;
+        if (*c == '%')
+        {
+            continue;
+        }
+        while (*c && strchr("-+ #0123456789.", *c))
+        {
+            c++;
+        }
+        uint8_t type = LOG_ARG_INT;
+        if (*c == 'l' && c[1] == 'l')
+        {
+            type = LOG_ARG_LLONG;
+            c += 2;
+        }
+        else if (*c == 'l')
+        {
+            type = LOG_ARG_LONG;
+            c++;
+        }
+        else if (*c == 'z')
+        {
+            type = LOG_ARG_SIZE;
+            c++;
+        }
+        else
+        {
+            while (*c == 'h')
+            {
+                c++;
+            }
+        }
+        if (!*c || site->count == LOG_RECORD_ARGS)
+        {
+            return EXIT_FAILURE;
+        }
+        if (type == LOG_ARG_INT && strchr("fFeEgGaA", *c))
+        {
+            type = LOG_ARG_DOUBLE;
+        }
+        else if (type == LOG_ARG_INT && *c == 'p')
+        {
+            type = LOG_ARG_POINTER;
+        }
+        else if (type == LOG_ARG_INT && *c == 's')
+        {
+            type = LOG_ARG_STRING;
+        }
+        else if (!strchr("diouxXc", *c))
+        {
+            // Star widths, long doubles, %n...
+            return EXIT_FAILURE;
+        }
+        site->types[site->count++] = type;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Parses the format of a site the first time it's called, a call
+ * that finds another thread parsing it formats their message as text
+ * 
+ * @param site call site
+ * @return uint8_t LOG_SITE_TYPED if the types of the site can be used
+ */
+static uint8_t Log_typeSite(LogSite_t *site)
+{
+    uint8_t state = atomic_load_explicit(&site->state, memory_order_acquire);
+    if (state == LOG_SITE_NEW &&
+        atomic_compare_exchange_strong_explicit(&site->state, &state, LOG_SITE_PARSING, memory_order_acquire,
+                                                memory_order_acquire))
+    {
+        state = Log_parseFormat(site) ? LOG_SITE_TEXT : LOG_SITE_TYPED;
+        atomic_store_explicit(&site->state, state, memory_order_release);
+    }
+    return state;
+}
+
+/**
+ * @brief Reads the arguments of a call into a record by the types of their
+ * site, their strings are copied to the text of the record
+ * 
+ * @param rec record to fill
+ * @param site typed call site
+ * @param args arguments of the call
+ * @return uint8_t EXIT_FAILURE if the strings don't fit in the text
+ */
+static uint8_t Log_readArgs(LogRecord_t *rec, const LogSite_t *site, va_list args)
+{
+    size_t text = 0;
+    for (uint8_t i = 0; i < site->count; i++)
+    {
+        LogArg_t *arg = &rec->args[i];
+        switch (site->types[i])
+        {
+        case LOG_ARG_LLONG:
+            arg->ll = va_arg(args, long long);
+            break;
+        case LOG_ARG_LONG:
+            arg->l = va_arg(args, long);
+            break;
+        case LOG_ARG_SIZE:
+            arg->z = va_arg(args, size_t);
+            break;
+        case LOG_ARG_DOUBLE:
+            arg->d = va_arg(args, double);
+            break;
+        case LOG_ARG_POINTER:
+            arg->p = va_arg(args, void *);
+            break;
+        case LOG_ARG_STRING:
+        {
+            const char *s = va_arg(args, const char *);
+            size_t length = strlen(s ? s : "(null)") + 1U;
+            if (text + length > LOG_RECORD_TEXT)
+            {
+                return EXIT_FAILURE;
+            }
+            memcpy(rec->text + text, s ? s : "(null)", length);
+            arg->z = text;
+            text += length;
+            break;
+        }
+        default:
+            arg->i = va_arg(args, int);
+            break;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Writes a record with their format, one conversion at a time
+ * 
+ * @param rec record to write
+ * @param out log file
+ */
+static void Log_format(const LogRecord_t *rec, FILE *out)
+{
+    const LogSite_t *site = rec->site;
+    if (site->file)
+    {
+        const char *name = strrchr(site->file, '/');
+        fprintf(out, " -> [%s:%d] ", name ? name + 1 : site->file, site->line);
+    }
+    if (rec->formatted)
+    {
+        fputs(rec->text, out);
+        return;
+    }
+    uint8_t next = 0;
+    const char *c = site->format;
+    while (*c)
+    {
+        const char *start = c;
+        while (*c && *c != '%')
+        {
+            c++;
+        }
+        fwrite(start, 1U, c - start, out);
+        if (!*c)
+        {
+            break;
+        }
+        if (c[1] == '%')
+        {
+            putc('%', out);
+            c += 2;
+            continue;
+        }
+        // The conversion goes up to their letter, Log_parseFormat already checked it
+        char spec[32];
+        size_t length = strcspn(c + 1, "diouxXcfFeEgGaAps") + 2U;
+        if (length >= sizeof(spec))
+        {
+            break;
+        }
+        memcpy(spec, c, length);
+        spec[length] = '\0';
+        c += length;
+        const LogArg_t *arg = &rec->args[next];
+        switch (site->types[next++])
+        {
+        case LOG_ARG_INT:
+            fprintf(out, spec, arg->i);
+            break;
+        case LOG_ARG_LONG:
+            fprintf(out, spec, arg->l);
+            break;
+        case LOG_ARG_LLONG:
+            fprintf(out, spec, arg->ll);
+            break;
+        case LOG_ARG_SIZE:
+            fprintf(out, spec, arg->z);
+            break;
+        case LOG_ARG_DOUBLE:
+            fprintf(out, spec, arg->d);
+            break;
+        case LOG_ARG_POINTER:
+            fprintf(out, spec, arg->p);
+            break;
+        case LOG_ARG_STRING:
+            fprintf(out, spec, rec->text + arg->z);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Writes the queued records until Log_end stops it
+ * 
+ * @param arg unused
+ * @return void* NULL
+ */
+static void *Log_writer(void *arg)
+{
+    uint32_t tail = atomic_load_explicit(&logTail, memory_order_relaxed);
+    // Besides the log file, the last file of a thread written
+    FILE *written = NULL;
+    while (1)
+    {
+        LogRecord_t *rec = &logQueue[tail & LOG_QUEUE_MASK];
+        if (atomic_load_explicit(&rec->sequence, memory_order_acquire) != tail + 1U)
+        {
+            uint32_t dropped = atomic_exchange_explicit(&logDropped, 0U, memory_order_relaxed);
+            if (dropped)
+            {
+                fprintf(logFile, " -> [log] %u messages dropped, the queue was full\n", dropped);
+            }
+            if (atomic_load_explicit(&logStop, memory_order_acquire))
+            {
+                break;
+            }
+            fflush(logFile);
+            if (written && written != logFile)
+            {
+                fflush(written);
+            }
+            written = NULL;
+            // A producer that publishes after the fence sees logSleeping, one that did before is seen here
+            pthread_mutex_lock(&logLock);
+            atomic_store(&logSleeping, 1U);
+            atomic_thread_fence(memory_order_seq_cst);
+            while (atomic_load_explicit(&rec->sequence, memory_order_acquire) != tail + 1U &&
+                   !atomic_load_explicit(&logStop, memory_order_acquire))
+            {
+                pthread_cond_wait(&logReady, &logLock);
+            }
+            atomic_store(&logSleeping, 0U);
+            pthread_mutex_unlock(&logLock);
+            continue;
+        }
+        if (written && written != rec->out)
+        {
+            fflush(written);
+        }
+        written = rec->out;
+        Log_format(rec, written);
+        atomic_store_explicit(&rec->sequence, tail + LOG_QUEUE_SIZE, memory_order_release);
+        atomic_store_explicit(&logTail, ++tail, memory_order_release);
+    }
+    return NULL;
+}
 
 void Log_init(const char *filename)
 {
@@ -17,13 +394,122 @@ void Log_init(const char *filename)
     {
         LOG_OK = 0x1;
     }
+    logFile = fileout;
+    for (uint32_t i = 0; i < LOG_QUEUE_SIZE; i++)
+    {
+        atomic_init(&logQueue[i].sequence, i);
+    }
+    atomic_init(&logHead, 0U);
+    atomic_init(&logTail, 0U);
+    atomic_init(&logDropped, 0U);
+    atomic_init(&logStop, 0U);
+    atomic_init(&logSleeping, 0U);
+    // Without writer the messages are written by the callers
+    logStarted = pthread_create(&logWriter, NULL, Log_writer, NULL) == 0;
     atexit(Log_end);
 }
 
+void Log_write(LogSite_t *site, ...)
+{
+    va_list args;
+    if (!logStarted)
+    {
+        if (site->file)
+        {
+            const char *name = strrchr(site->file, '/');
+            fprintf(fileout, " -> [%s:%d] ", name ? name + 1 : site->file, site->line);
+        }
+        va_start(args, site);
+        vfprintf(fileout, site->format, args);
+        va_end(args);
+        return;
+    }
+    uint8_t state = Log_typeSite(site);
+    uint32_t head = atomic_load_explicit(&logHead, memory_order_relaxed);
+    LogRecord_t *rec;
+    while (1)
+    {
+        rec = &logQueue[head & LOG_QUEUE_MASK];
+        int32_t diff = (int32_t)(atomic_load_explicit(&rec->sequence, memory_order_acquire) - head);
+        if (!diff)
+        {
+            if (atomic_compare_exchange_weak_explicit(&logHead, &head, head + 1U, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // The writer is behind, the caller never waits for it
+            atomic_fetch_add_explicit(&logDropped, 1U, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            head = atomic_load_explicit(&logHead, memory_order_relaxed);
+        }
+    }
+    rec->site = site;
+    rec->out = fileout;
+    rec->formatted = 1U;
+    if (state == LOG_SITE_TYPED)
+    {
+        va_start(args, site);
+        rec->formatted = Log_readArgs(rec, site, args);
+        va_end(args);
+    }
+    if (rec->formatted)
+    {
+        const char *format = site->format;
+        va_start(args, site);
+        int length = vsnprintf(rec->text, sizeof(rec->text), format, args);
+        va_end(args);
+        // A cut message keeps their line end
+        size_t last = strlen(format);
+        if (length >= (int)sizeof(rec->text) && last && format[last - 1U] == '\n')
+        {
+            rec->text[sizeof(rec->text) - 2U] = '\n';
+        }
+    }
+    atomic_store_explicit(&rec->sequence, head + 1U, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&logSleeping, memory_order_relaxed))
+    {
+        pthread_mutex_lock(&logLock);
+        pthread_cond_signal(&logReady);
+        pthread_mutex_unlock(&logLock);
+    }
+}
+
+void Log_flush()
+{
+    if (!logStarted)
+    {
+        return;
+    }
+    uint32_t head = atomic_load_explicit(&logHead, memory_order_acquire);
+    while ((int32_t)(atomic_load_explicit(&logTail, memory_order_acquire) - head) < 0)
+    {
+        struct timespec wait = {0, LOG_FLUSH_WAIT_NS};
+        nanosleep(&wait, NULL);
+    }
+}
+
 void Log_end()
 {
-    if (fileout)
+    if (logStarted)
     {
-        fclose(fileout);
+        atomic_store_explicit(&logStop, 1U, memory_order_release);
+        pthread_mutex_lock(&logLock);
+        pthread_cond_signal(&logReady);
+        pthread_mutex_unlock(&logLock);
+        pthread_join(logWriter, NULL);
+        logStarted = 0;
     }
-}
\ No newline at end of file
+    if (logFile)
+    {
+        fclose(logFile);
+        logFile = NULL;
+    }
+}
@@ -1,7 +1,9 @@
 /**
  * @file log.h
  * @author Daniel Polanco (jdanypa@gmail.com)
- * @brief Log utility functions
+ * @brief Log utility functions. The calls only copy their format and
+ * arguments to a lock free queue, a background thread formats them and
+ * writes the log file, so logging doesn't wait for the disk.
  * @version 1.0
  * @date 2021-01-27
  * 
@@ -11,50 +13,155 @@
 #if !defined(__LOG_H__)
 #define __LOG_H__
 
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 
 /**
- * @brief Gets the filename where is called LOG macros
+ * @brief Severity levels, the calls below LOG_LEVEL are removed when
+ * compiling. The build chooses it, debug builds keep every call.
  * 
  */
-#define __FILENAME__ (__builtin_strrchr(__FILE__, '/') ? __builtin_strrchr(__FILE__, '/') + 1 : __FILE__)
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+#if !defined(LOG_LEVEL)
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+/**
+ * @brief Records queued for the writer, calls are dropped while it's full
+ * 
+ */
+#define LOG_QUEUE_SIZE 1024U
+#define LOG_QUEUE_MASK (LOG_QUEUE_SIZE - 1U)
+
+/**
+ * @brief Max arguments of a call and bytes of their strings, calls with more
+ * are formatted by the caller and queued as text
+ * 
+ */
+#define LOG_RECORD_ARGS 8U
+#define LOG_RECORD_TEXT 128U
+
+/**
+ * @brief Nanoseconds Log_flush sleeps between their checks of the writer,
+ * the writer itself sleeps until a message arrives
+ * 
+ */
+#define LOG_FLUSH_WAIT_NS 100000L
+
+/**
+ * @brief States of a call site, the first call parses the format
+ * 
+ */
+#define LOG_SITE_NEW 0U
+#define LOG_SITE_PARSING 1U
+#define LOG_SITE_TYPED 2U
+#define LOG_SITE_TEXT 3U
+
+/**
+ * @brief Call site of a LOG macro, the first call reads the types of the
+ * arguments from the format and the next ones only copy them
+ * 
+ */
+typedef struct LogSite_t
+{
+    const char *file;
+    int line;
+    const char *format;
+    /**
+     * @brief LOG_SITE_TYPED once the types are read, LOG_SITE_TEXT if the
+     * format can't be deferred and every call formats it
+     * 
+     */
+    _Atomic uint8_t state;
+    uint8_t count;
+    uint8_t types[LOG_RECORD_ARGS];
+} LogSite_t;
+
+/**
+ * @brief Queues a message if their level is enabled, the level is a constant
+ * so disabled calls are removed with their arguments
+ * 
+ */
+#define LOG_IF(__level, __file, __line, format, ...)                   \
+    do                                                                 \
+    {                                                                  \
+        if ((__level) >= LOG_LEVEL && fileout)                         \
+        {                                                              \
+            static LogSite_t __logSite = {__file, __line, format};     \
+            Log_write(&__logSite, ##__VA_ARGS__);                      \
+        }                                                              \
+    } while (0)
 
 /**
  * @brief Logs a text, without start format
  * Common use is to add log messages to a previous message
  * 
  */
-#define LOG_TXT(format, ...) fprintf(fileout, format, ## __VA_ARGS__)
+#define LOG_TXT(format, ...) LOG_IF(LOG_LEVEL_INFO, NULL, 0, format, ##__VA_ARGS__)
 /**
  * @brief Logs a message with start format but not new line
  * 
  */
-#define LOG(format, ...) fprintf(fileout, " -> [%s:%d] " format, __FILENAME__, __LINE__, ##__VA_ARGS__)
+#define LOG(format, ...) LOG_IF(LOG_LEVEL_INFO, __FILE__, __LINE__, format, ##__VA_ARGS__)
 /**
  * @brief Logs a message with start format and new line
  * 
  */
-#define LOG_LN(format, ...) fprintf(fileout, " -> [%s:%d] " format "\n", __FILENAME__, __LINE__, ##__VA_ARGS__)
+#define LOG_LN(format, ...) LOG_IF(LOG_LEVEL_INFO, __FILE__, __LINE__, format "\n", ##__VA_ARGS__)
+/**
+ * @brief Logs a message with start format and new line with their severity
+ * 
+ */
+#define LOG_DEBUG(format, ...) LOG_IF(LOG_LEVEL_DEBUG, __FILE__, __LINE__, format "\n", ##__VA_ARGS__)
+#define LOG_WARN(format, ...) LOG_IF(LOG_LEVEL_WARN, __FILE__, __LINE__, format "\n", ##__VA_ARGS__)
+#define LOG_ERROR(format, ...) LOG_IF(LOG_LEVEL_ERROR, __FILE__, __LINE__, format "\n", ##__VA_ARGS__)
 
 /**
  * @brief LOG_OK flag used to indicate if log file was successfully opened
  * 
  */
-extern int LOG_OK;
+extern _Thread_local int LOG_OK;
 
 /**
- * @brief File pointer to the log file
+ * @brief File pointer to the log of the thread, every thread has their own
+ * so vm instances running in other threads don't mix their logs. NULL
+ * disables the log of the thread. The messages keep the file of the thread
+ * that queued them, anything written directly to it, or closing it, must
+ * call Log_flush first.
  * 
  */
-extern FILE *fileout;
+extern _Thread_local FILE *fileout;
 
 /**
- * @brief Initializes the log output, in case can't be opened exits the program
+ * @brief Initializes the log output and starts their writer, in case can't
+ * be opened exits the program
  * 
  * @param filename path/filename to the log file
  */
 void Log_init(const char *filename);
 
+/**
+ * @brief Queues a message to fileout for the writer, used by the LOG macros.
+ * The strings of the arguments are copied, the site must live until the
+ * message is written.
+ * 
+ * @param site call site with the source file, NULL to write only the
+ * message, their line and printf format
+ */
+void Log_write(LogSite_t *site, ...);
+
+/**
+ * @brief Waits until the writer wrote every message queued before
+ * 
+ */
+void Log_flush();
+
 /**
  * @brief This is not called directly, it is used by atexit function
  * 
@@ -9,11 +9,16 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "console.h"
+#include "batch.h"
 #include "cpu.h"
-#include "firmware.h"
+#include "forkserver.h"
+#include "lanes.h"
 #include "log.h"
+#include "profile.h"
+#include "replay.h"
+#include "vm.h"
 
 /**
  * @brief Mame of the log output file
@@ -23,29 +28,514 @@
 
 #define VERSION_STR "v" __VM_VERSION__ "." __TIME__ "." __DATE__
 
-LC3Firmware_t firmware;
-LC3Cpu_t cpu;
+/**
+ * @brief Vm run from the command line, it's released at exit so the trace is
+ * dumped also when the program is interrupted
+ * 
+ */
+static LC3Vm_t *vm = NULL;
+
+/**
+ * @brief Path of the JSON statistics report, NULL if it's not written
+ * 
+ */
+static const char *statsJson = NULL;
+
+/**
+ * @brief Samples of the profiler and the path of their folded stacks file,
+ * NULL if the run isn't profiled
+ * 
+ */
+static LC3Profile_t *profile = NULL;
+static const char *profileFile = NULL;
+
+/**
+ * @brief Recorder or player of the keyboard input, their file is NULL if the
+ * input isn't recorded or replayed
+ * 
+ */
+static LC3Replay_t replay;
+
+/**
+ * @brief Prints the statistics of the run, and writes the JSON report
+ * 
+ */
+static void ReportStats()
+{
+    fprintf(stderr, "\n");
+    LC3StatsPrint(vm->cpu.stats, stderr);
+    if (statsJson)
+    {
+        FILE *f = fopen(statsJson, "w");
+        if (!f)
+        {
+            fprintf(stderr, "Can't create %s\n", statsJson);
+            return;
+        }
+        LC3StatsPrintJson(vm->cpu.stats, f);
+        fclose(f);
+    }
+}
+
+/**
+ * @brief Stops the profiler and writes their samples as folded stacks
+ * 
+ */
+static void ReportProfile()
+{
+    LC3ProfileStop(profile);
+    FILE *f = fopen(profileFile, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Can't create %s\n", profileFile);
+    }
+    else
+    {
+        LC3ProfileWriteFolded(profile, f);
+        fclose(f);
+        LOG_LN("Profile: %llu samples written to %s", (unsigned long long)profile->samples, profileFile);
+    }
+    LC3ProfileEnd(profile);
+    free(profile);
+    profile = NULL;
+}
+
+/**
+ * @brief Writes the trace ring buffer and the superinstruction counters to
+ * the log, reports the statistics and the profile and releases the vm,
+ * called at exit
+ * 
+ */
+static void EndVm()
+{
+    if (profile)
+    {
+        ReportProfile();
+    }
+    LC3ReplayClose(&replay);
+    // The trace and the counters are written directly after the queued messages
+    Log_flush();
+    LC3TraceFormat(&vm->cpu, fileout);
+    LC3FusionDump(&vm->cpu, fileout);
+    if (vm->cpu.stats)
+    {
+        // The guest output goes first
+        OSDisplayFlush(&vm->console);
+        ReportStats();
+    }
+    LC3VmDestroy(vm);
+    vm = NULL;
+}
+
+/**
+ * @brief Loads the labels of the program and starts sampling the cpu
+ * 
+ * @param objfile path/filename of the objfile or the source
+ * @param symfile path/filename of the symbol file, NULL to use the one next
+ * to the objfile
+ * @param hz samples per second
+ * @return int EXIT_FAILURE if the profiler can't be started
+ */
+static int StartProfile(const char *objfile, const char *symfile, uint32_t hz)
+{
+    profile = calloc(1U, sizeof(LC3Profile_t));
+    if (!profile)
+    {
+        printf("Can't allocate the profiler\n");
+        return EXIT_FAILURE;
+    }
+    char defaultSym[FILENAME_MAX];
+    if (!symfile)
+    {
+        // program.obj or program.asm -> program.sym
+        const char *dot = strrchr(objfile, '.');
+        int length = dot && !strchr(dot, '/') ? (int)(dot - objfile) : (int)strlen(objfile);
+        snprintf(defaultSym, sizeof(defaultSym), "%.*s.sym", length, objfile);
+        symfile = defaultSym;
+    }
+    if (LC3ProfileLoadSymbols(profile, symfile))
+    {
+        LOG_LN("Can't read symbols %s, samples are reported by address", symfile);
+    }
+    vm->cpu.profile = profile;
+    if (LC3ProfileStart(profile, &vm->cpu.pending, CPU_PENDING_SAMPLE, hz))
+    {
+        printf("Can't start the profiler\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Runs a list of jobs and prints the output of every job in the order
+ * of the list
+ * 
+ * @param listfile path/filename of the list of jobs
+ * @param workers count of threads
+ * @param lanes jobs of the same objfile run in lockstep
+ * @param options settings of the vm of every job
+ * @return int EXIT_FAILURE if any job failed
+ */
+static int RunBatch(const char *listfile, uint32_t workers, uint32_t lanes, const LC3VmOptions_t *options)
+{
+    uint32_t count = 0;
+    LC3BatchJob_t *jobs = LC3BatchLoadList(listfile, &count);
+    if (!jobs)
+    {
+        printf("Can't read job list %s\n", listfile);
+        return EXIT_FAILURE;
+    }
+    if (LC3BatchRun(jobs, count, workers, lanes, options))
+    {
+        printf("Can't start the workers\n");
+        LC3BatchFree(jobs, count);
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (jobs[i].status)
+        {
+            printf("==> %s <== can't be loaded\n", jobs[i].objfile);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        printf("==> %s <==\n", jobs[i].objfile);
+        fwrite(jobs[i].output, 1U, jobs[i].outputSize, stdout);
+        if (jobs[i].outputSize && jobs[i].output[jobs[i].outputSize - 1U] != '\n')
+        {
+            printf("\n");
+        }
+    }
+    LC3BatchFree(jobs, count);
+    return status;
+}
+
+/**
+ * @brief Loads the program, runs it to the snapshot marker and serves runs
+ * forked from that state
+ * 
+ * @param objfile path/filename to the objfile
+ * @param socket path of the unix socket
+ * @param snapshotAt marker address, -1 to take the snapshot before the first
+ * instruction
+ * @param options settings of the vm
+ * @return int EXIT_FAILURE, the server only ends on error
+ */
+static int RunForkServer(const char *objfile, const char *socket, int snapshotAt, const LC3VmOptions_t *options)
+{
+    // The keyboard of every run is given by their client
+    FILE *in = tmpfile();
+    LC3Vm_t *server = in ? LC3VmCreate(objfile, in, stdout, options) : NULL;
+    if (!server)
+    {
+        printf("Can't load objfile %s\n", objfile);
+        return EXIT_FAILURE;
+    }
+    if (snapshotAt >= 0 && LC3ForkServerWarmUp(server, snapshotAt))
+    {
+        printf("Program halted before reaching 0x%04X\n", snapshotAt);
+        return EXIT_FAILURE;
+    }
+    printf("Serving %s on %s\n", objfile, socket);
+    LC3ForkServerRun(server, socket);
+    printf("Can't serve on %s\n", socket);
+    return EXIT_FAILURE;
+}
+
+/**
+ * @brief Prints the command line of the vm
+ * 
+ */
+static void PrintUsage()
+{
+    printf("Usage: lc3vm [--engine table|threaded|jit] [--trace off|sampled|full]\n"
+           "             [--trace-records n] [--trace-sample n] [--trace-file file]\n"
+           "             [--no-fusion] [--image-cache] [--flush newline|input|full]\n"
+           "             [--stats] [--stats-json file] [--headless] [--input file]\n"
+           "             [--max-instructions n] [--timeout seconds] [--profile file]\n"
+           "             [--profile-hz n] [--profile-sym file]\n"
+           "             [--record file|--replay file] [obj-file|asm-file]\n"
+           "       lc3vm [--engine table|threaded|jit] [--no-fusion] [--image-cache]\n"
+           "             [--flush newline|input|full] [--jobs n] [--lanes n]\n"
+           "             --batch job-list\n"
+           "       lc3vm [--engine table|threaded|jit] [--no-fusion] [--image-cache]\n"
+           "             [--flush newline|input|full] [--headless] [--max-instructions n]\n"
+           "             [--timeout seconds] [--snapshot-at addr]\n"
+           "             --fork-server socket obj-file\n"
+           "       lc3vm --fork-client socket\n"
+           "       lc3vm --help\n");
+}
 
 int main(int argc, char const *argv[])
 {
-    printf("Little Machine 3 - Virtual machine %s\n", VERSION_STR);
+    const char *objfile = NULL;
+    LC3VmOptions_t options = {.engine = ENGINE_TABLE, .fusion = 1, .flush = FLUSH_NEWLINE};
+    uint8_t flushSet = 0;
+    const char *inputFile = NULL;
+    uint8_t traceLevel = TRACE_OFF;
+    uint32_t traceRecords = TRACE_DEFAULT_RECORDS;
+    uint32_t traceSample = TRACE_DEFAULT_SAMPLE_RATE;
+    const char *traceFile = NULL;
+    const char *batchList = NULL;
+    uint32_t workers = 0;
+    uint32_t lanes = 1;
+    const char *forkServer = NULL;
+    const char *forkClient = NULL;
+    int snapshotAt = -1;
+    uint32_t profileHz = PROFILE_DEFAULT_HZ;
+    const char *profileSym = NULL;
+    const char *replayFile = NULL;
+    uint8_t replayMode = REPLAY_COUNT;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+        {
+            options.engine = LC3CpuFindEngine(argv[++i]);
+            if (options.engine == ENGINE_COUNT)
+            {
+                printf("Unknown engine %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            traceLevel = LC3TraceFindLevel(argv[++i]);
+            if (traceLevel == TRACE_COUNT)
+            {
+                printf("Unknown trace level %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--trace-records") == 0 && i + 1 < argc)
+        {
+            traceRecords = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--trace-sample") == 0 && i + 1 < argc)
+        {
+            traceSample = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc)
+        {
+            traceFile = argv[++i];
+            traceLevel = TRACE_FULL;
+        }
+        else if (strcmp(argv[i], "--no-fusion") == 0)
+        {
+            options.fusion = 0;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            options.stats = 1;
+        }
+        else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc)
+        {
+            statsJson = argv[++i];
+            options.stats = 1;
+        }
+        else if (strcmp(argv[i], "--image-cache") == 0)
+        {
+            options.imageCache = 1;
+        }
+        else if (strcmp(argv[i], "--flush") == 0 && i + 1 < argc)
+        {
+            options.flush = OSDisplayFindFlush(argv[++i]);
+            if (options.flush == FLUSH_COUNT)
+            {
+                printf("Unknown flush policy %s\n", argv[i]);
+                return 1;
+            }
+            flushSet = 1;
+        }
+        else if (strcmp(argv[i], "--headless") == 0)
+        {
+            options.headless = 1;
+        }
+        else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+        {
+            inputFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc)
+        {
+            options.maxInstructions = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc)
+        {
+            options.timeLimit = strtod(argv[++i], NULL);
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+        {
+            profileFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--profile-hz") == 0 && i + 1 < argc)
+        {
+            profileHz = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--profile-sym") == 0 && i + 1 < argc)
+        {
+            profileSym = argv[++i];
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+        {
+            replayFile = argv[++i];
+            replayMode = REPLAY_RECORD;
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            replayFile = argv[++i];
+            replayMode = REPLAY_PLAY;
+        }
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+        {
+            batchList = argv[++i];
+        }
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+        {
+            workers = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--lanes") == 0 && i + 1 < argc)
+        {
+            lanes = strtoul(argv[++i], NULL, 0);
+            if (lanes < 1 || lanes > LANES_MAX)
+            {
+                printf("Lanes must be between 1 and %u\n", LANES_MAX);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--fork-server") == 0 && i + 1 < argc)
+        {
+            forkServer = argv[++i];
+        }
+        else if (strcmp(argv[i], "--snapshot-at") == 0 && i + 1 < argc)
+        {
+            snapshotAt = strtoul(argv[++i], NULL, 0) & 0xFFFF;
+        }
+        else if (strcmp(argv[i], "--fork-client") == 0 && i + 1 < argc)
+        {
+            forkClient = argv[++i];
+        }
+        else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0)
+        {
+            PrintUsage();
+            return 0;
+        }
+        else if (argv[i][0] == '-')
+        {
+            // Options without their value end here too, they are never files
+            printf("Unknown option or missing value %s\n", argv[i]);
+            PrintUsage();
+            return 1;
+        }
+        else if (objfile)
+        {
+            printf("Only one program runs at a time, %s is extra\n", argv[i]);
+            return 1;
+        }
+        else
+        {
+            objfile = argv[i];
+        }
+    }
 
-    if (argc < 2)
+    if (options.stats && !LC3_STATS)
     {
-        printf("Usage: lc3vm [obj-file]\n");
+        printf("Statistics are not available in this build\n");
+        return 1;
+    }
+
+    // Only the table engine calls the tracer, the ring of the others would stay empty
+    if (traceLevel != TRACE_OFF && !traceFile && options.engine != ENGINE_TABLE)
+    {
+        printf("The %s engine can't be traced, use --engine table\n", LC3Engines[options.engine].name);
+        return 1;
+    }
+    if (traceFile && options.engine != ENGINE_TABLE)
+    {
+        printf("The %s engine can't write a trace file, use --engine table\n", LC3Engines[options.engine].name);
+        return 1;
+    }
+
+    if (replayMode == REPLAY_PLAY && inputFile)
+    {
+        printf("The input of a replay is their log\n");
+        return 1;
+    }
+
+    // Runs of the fork server only print the program output
+    if (forkClient)
+    {
+        return LC3ForkServerRequest(forkClient);
+    }
+
+    // Headless runs only print the program output
+    if (!options.headless)
+    {
+        printf("Little Machine 3 - Virtual machine %s\n", VERSION_STR);
+    }
+    else if (!flushSet)
+    {
+        options.flush = FLUSH_FULL;
+    }
+
+    if (!objfile && !batchList)
+    {
+        PrintUsage();
         return 1;
     }
 
     Log_init(LOG_OUTPUT_FILENAME);
 
-    OSKeyboardInit();
+    if (batchList)
+    {
+        return RunBatch(batchList, workers ? workers : LC3BatchDefaultWorkers(), lanes, &options);
+    }
 
-    loadFirmwareFromFile(argv[1], &firmware);
-    dumpFirmware(&firmware);
+    if (forkServer)
+    {
+        return RunForkServer(objfile, forkServer, snapshotAt, &options);
+    }
 
-    LC3CpuInit(&cpu, &firmware);
+    // Replays never read the keyboard, it's an empty stream so the terminal isn't taken
+    FILE *in = replayMode == REPLAY_PLAY ? tmpfile() : inputFile ? fopen(inputFile, "rb") : stdin;
+    if (!in)
+    {
+        printf("Can't open input %s\n", inputFile ? inputFile : "stream");
+        return 1;
+    }
+    vm = LC3VmCreate(objfile, in, stdout, &options);
+    if (!vm)
+    {
+        printf("Can't load objfile %s\n", objfile);
+        return 1;
+    }
+    atexit(EndVm);
+
+    if (LC3TraceInit(&vm->cpu.trace, traceLevel, traceRecords, traceSample))
+    {
+        printf("Can't allocate trace buffer\n");
+        return 1;
+    }
+    if (traceFile && LC3TraceOpenFile(&vm->cpu.trace, traceFile, vm->cpu.regs))
+    {
+        printf("Can't create trace file %s\n", traceFile);
+        return 1;
+    }
+
+    if (profileFile && StartProfile(objfile, profileSym, profileHz))
+    {
+        return 1;
+    }
 
-    LC3CpuExecute(&cpu);
+    if (replayFile)
+    {
+        if (LC3ReplayOpen(&replay, replayFile, replayMode))
+        {
+            printf("Can't open input log %s\n", replayFile);
+            return 1;
+        }
+        LC3VmSetReplay(vm, &replay);
+    }
 
-    return EXIT_SUCCESS;
+    LC3VmRun(vm);
+    return LC3VmExitStatus(vm);
 }
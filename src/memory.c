@@ -0,0 +1,136 @@
+#include "memory.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Page mapped by every untouched range, it's never written and their
+ * references are not counted
+ * 
+ */
+static LC3MemoryPage_t LC3MemoryZeroPage;
+
+/**
+ * @brief Drops a reference of a page and frees it with the last one
+ * 
+ * @param page page to release
+ */
+static void LC3MemoryPut(LC3MemoryPage_t *page)
+{
+    if (page != &LC3MemoryZeroPage && atomic_fetch_sub_explicit(&page->refs, 1U, memory_order_acq_rel) == 1U)
+    {
+        free(page);
+    }
+}
+
+void LC3MemoryInit(LC3Memory_t *memory)
+{
+    for (uint32_t i = 0; i < MEMORY_PAGES; i++)
+    {
+        memory->pages[i] = &LC3MemoryZeroPage;
+    }
+}
+
+void LC3MemoryRelease(LC3Memory_t *memory)
+{
+    for (uint32_t i = 0; i < MEMORY_PAGES; i++)
+    {
+        LC3MemoryPut(memory->pages[i]);
+        memory->pages[i] = &LC3MemoryZeroPage;
+    }
+}
+
+void LC3MemoryShare(LC3Memory_t *memory, const LC3Memory_t *source)
+{
+    for (uint32_t i = 0; i < MEMORY_PAGES; i++)
+    {
+        LC3MemoryPage_t *page = source->pages[i];
+        if (page != &LC3MemoryZeroPage)
+        {
+            atomic_fetch_add_explicit(&page->refs, 1U, memory_order_relaxed);
+        }
+        LC3MemoryPut(memory->pages[i]);
+        memory->pages[i] = page;
+    }
+}
+
+uint16_t *LC3MemoryWritable(LC3Memory_t *memory, uint16_t addr)
+{
+    LC3MemoryPage_t *page = memory->pages[addr >> MEMORY_PAGE_SHIFT];
+    // Acquire pairs with the release of the last sharer, their copy is done before this one writes
+    if (page == &LC3MemoryZeroPage || atomic_load_explicit(&page->refs, memory_order_acquire) != 1U)
+    {
+        LC3MemoryPage_t *copy = malloc(sizeof(LC3MemoryPage_t));
+        if (!copy)
+        {
+            return NULL;
+        }
+        memcpy(copy->words, page->words, sizeof(copy->words));
+        atomic_init(&copy->refs, 1U);
+        LC3MemoryPut(page);
+        memory->pages[addr >> MEMORY_PAGE_SHIFT] = copy;
+        page = copy;
+    }
+    return &page->words[addr & MEMORY_PAGE_MASK];
+}
+
+uint8_t LC3MemoryWrite(LC3Memory_t *memory, uint16_t addr, uint16_t value)
+{
+    LC3MemoryPage_t *page = memory->pages[addr >> MEMORY_PAGE_SHIFT];
+    uint16_t *word = &page->words[addr & MEMORY_PAGE_MASK];
+    // Writing what the page already has doesn't need a copy, clearing zeroed memory keeps it shared
+    if (*word == value)
+    {
+        return EXIT_SUCCESS;
+    }
+    if (page == &LC3MemoryZeroPage || atomic_load_explicit(&page->refs, memory_order_acquire) != 1U)
+    {
+        word = LC3MemoryWritable(memory, addr);
+        if (!word)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    *word = value;
+    return EXIT_SUCCESS;
+}
+
+uint8_t LC3MemoryWriteBlock(LC3Memory_t *memory, uint16_t addr, const uint16_t *words, uint32_t count)
+{
+    uint32_t next = addr;
+    while (count)
+    {
+        uint32_t chunk = MEMORY_PAGE_WORDS - (next & MEMORY_PAGE_MASK);
+        chunk = chunk < count ? chunk : count;
+        uint16_t *dst = LC3MemoryWritable(memory, next);
+        if (!dst)
+        {
+            return EXIT_FAILURE;
+        }
+        memcpy(dst, words, chunk * sizeof(uint16_t));
+        words += chunk;
+        next += chunk;
+        count -= chunk;
+    }
+    return EXIT_SUCCESS;
+}
+
+uint32_t LC3MemoryCountPages(const LC3Memory_t *memory, uint32_t *owned)
+{
+    uint32_t mapped = 0;
+    uint32_t own = 0;
+    for (uint32_t i = 0; i < MEMORY_PAGES; i++)
+    {
+        LC3MemoryPage_t *page = memory->pages[i];
+        if (page != &LC3MemoryZeroPage)
+        {
+            mapped++;
+            own += atomic_load_explicit(&page->refs, memory_order_relaxed) == 1U;
+        }
+    }
+    if (owned)
+    {
+        *owned = own;
+    }
+    return mapped;
+}
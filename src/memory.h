@@ -0,0 +1,136 @@
+/**
+ * @file memory.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Paged guest memory. The address space is a table of pages of
+ * MEMORY_PAGE_WORDS words, pages are reference counted and shared between
+ * memories until one of them writes them, untouched pages point to a single
+ * zero page. Many vms running the same program only own the pages they
+ * write.
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__MEMORY_H__)
+#define __MEMORY_H__
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * @brief Size of a page, the same than the pages of the devices
+ * 
+ */
+#define MEMORY_PAGE_SHIFT 8
+#define MEMORY_PAGE_WORDS (1U << MEMORY_PAGE_SHIFT)
+#define MEMORY_PAGE_MASK (MEMORY_PAGE_WORDS - 1U)
+#define MEMORY_PAGES ((UINT16_MAX + 1U) >> MEMORY_PAGE_SHIFT)
+
+/**
+ * @brief Reads a word, pages are always mapped so it's two loads
+ * 
+ */
+#define MEMORY_READ(__memory, __addr) \
+    ((__memory)->pages[(uint16_t)(__addr) >> MEMORY_PAGE_SHIFT]->words[(__addr) & MEMORY_PAGE_MASK])
+
+/**
+ * @brief Page of memory
+ * 
+ */
+typedef struct LC3MemoryPage_t
+{
+    /**
+     * @brief words of the page, must be the first field, the jit reads them
+     * from the page pointer
+     * 
+     */
+    uint16_t words[MEMORY_PAGE_WORDS];
+    /**
+     * @brief count of memories that map the page, it can be written in
+     * place only when it's 1
+     * 
+     */
+    _Atomic uint32_t refs;
+} LC3MemoryPage_t;
+
+/**
+ * @brief Address space of a vm
+ * 
+ */
+typedef struct LC3Memory_t
+{
+    /**
+     * @brief page of every range of MEMORY_PAGE_WORDS words, never NULL. Must
+     * be the first field, the jit indexes it from the memory pointer
+     * 
+     */
+    LC3MemoryPage_t *pages[MEMORY_PAGES];
+} LC3Memory_t;
+
+/**
+ * @brief Maps every page to the zero page
+ * 
+ * @param memory memory instance
+ */
+void LC3MemoryInit(LC3Memory_t *memory);
+
+/**
+ * @brief Releases the pages, the memory is left as after LC3MemoryInit
+ * 
+ * @param memory memory instance
+ */
+void LC3MemoryRelease(LC3Memory_t *memory);
+
+/**
+ * @brief Maps the pages of another memory, they are copied by the first
+ * write of any of them. The source must not be written meanwhile from
+ * another thread.
+ * 
+ * @param memory memory instance, their pages are released
+ * @param source memory to share
+ */
+void LC3MemoryShare(LC3Memory_t *memory, const LC3Memory_t *source);
+
+/**
+ * @brief Gives a word that can be written, the page is copied if it's shared
+ * 
+ * @param memory memory instance
+ * @param addr address of the word
+ * @return uint16_t* the word, the rest of their page follows it. NULL if the
+ * page can't be copied
+ */
+uint16_t *LC3MemoryWritable(LC3Memory_t *memory, uint16_t addr);
+
+/**
+ * @brief Writes a word, the page is only copied if the value changes
+ * 
+ * @param memory memory instance
+ * @param addr address of the word
+ * @param value value to write
+ * @return uint8_t EXIT_FAILURE if their page can't be copied
+ */
+uint8_t LC3MemoryWrite(LC3Memory_t *memory, uint16_t addr, uint16_t value);
+
+/**
+ * @brief Writes consecutive words, the block can't go beyond the last word
+ * 
+ * @param memory memory instance
+ * @param addr address of the first word
+ * @param words words to write
+ * @param count count of words
+ * @return uint8_t EXIT_FAILURE if a page can't be copied
+ */
+uint8_t LC3MemoryWriteBlock(LC3Memory_t *memory, uint16_t addr, const uint16_t *words, uint32_t count);
+
+/**
+ * @brief Counts the pages that are not the zero page and the ones that are
+ * only mapped by this memory
+ * 
+ * @param memory memory instance
+ * @param owned output count of pages only mapped by this memory, can be NULL
+ * @return uint32_t count of pages with data
+ */
+uint32_t LC3MemoryCountPages(const LC3Memory_t *memory, uint32_t *owned);
+
+#endif  // __MEMORY_H__
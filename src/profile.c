@@ -0,0 +1,156 @@
+#include "profile.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+static int LC3ProfileCompareSymbols(const void *a, const void *b)
+{
+    const LC3ProfileSymbol_t *sa = a;
+    const LC3ProfileSymbol_t *sb = b;
+    return (int)sa->addr - (int)sb->addr;
+}
+
+/**
+ * @brief Searches the label that contains an address, the last one defined
+ * at or before it
+ * 
+ * @param profile profile instance
+ * @param addr address
+ * @return const LC3ProfileSymbol_t* NULL if no label is before the address
+ */
+static const LC3ProfileSymbol_t *LC3ProfileFindSymbol(const LC3Profile_t *profile, uint16_t addr)
+{
+    uint32_t low = 0;
+    uint32_t high = profile->symbolCount;
+    while (low < high)
+    {
+        uint32_t mid = (low + high) / 2U;
+        if (profile->symbols[mid].addr <= addr)
+        {
+            low = mid + 1U;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low ? &profile->symbols[low - 1U] : NULL;
+}
+
+/**
+ * @brief Sampler thread, raises the sample flag until it's stopped
+ * 
+ * @param arg profile instance
+ * @return void* NULL
+ */
+static void *LC3ProfileSampler(void *arg)
+{
+    LC3Profile_t *profile = arg;
+    struct timespec interval = {profile->interval / 1000000000L, profile->interval % 1000000000L};
+    while (!atomic_load(&profile->stop))
+    {
+        nanosleep(&interval, NULL);
+        atomic_fetch_or(profile->pending, profile->mask);
+    }
+    return NULL;
+}
+
+uint8_t LC3ProfileLoadSymbols(LC3Profile_t *profile, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f)
+    {
+        return EXIT_FAILURE;
+    }
+    char line[ASM_MAX_LINE];
+    uint32_t capacity = profile->symbolCount;
+    while (fgets(line, sizeof(line), f))
+    {
+        // Label lines are "//<tab>NAME  ADDR", the headers don't have a hex address
+        char name[ASM_MAX_LABEL];
+        unsigned int addr;
+        if (sscanf(line, "//%*[ \t]%63s %x", name, &addr) != 2 || addr > UINT16_MAX)
+        {
+            continue;
+        }
+        if (profile->symbolCount == capacity)
+        {
+            capacity = capacity ? capacity * 2U : 64U;
+            LC3ProfileSymbol_t *symbols = realloc(profile->symbols, capacity * sizeof(LC3ProfileSymbol_t));
+            if (!symbols)
+            {
+                break;
+            }
+            profile->symbols = symbols;
+        }
+        LC3ProfileSymbol_t *symbol = &profile->symbols[profile->symbolCount++];
+        strcpy(symbol->name, name);
+        symbol->addr = addr;
+    }
+    fclose(f);
+    qsort(profile->symbols, profile->symbolCount, sizeof(LC3ProfileSymbol_t), LC3ProfileCompareSymbols);
+    LOG_LN("Loaded %u symbols from %s", profile->symbolCount, filename);
+    return EXIT_SUCCESS;
+}
+
+uint8_t LC3ProfileStart(LC3Profile_t *profile, _Atomic uint16_t *pending, uint16_t mask, uint32_t hz)
+{
+    profile->pending = pending;
+    profile->mask = mask;
+    profile->interval = 1000000000L / (hz ? hz : PROFILE_DEFAULT_HZ);
+    atomic_init(&profile->stop, 0U);
+    if (pthread_create(&profile->sampler, NULL, LC3ProfileSampler, profile) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    profile->started = 1;
+    return EXIT_SUCCESS;
+}
+
+void LC3ProfileStop(LC3Profile_t *profile)
+{
+    if (!profile->started)
+    {
+        return;
+    }
+    atomic_store(&profile->stop, 1U);
+    pthread_join(profile->sampler, NULL);
+    profile->started = 0;
+}
+
+void LC3ProfileSample(LC3Profile_t *profile, uint16_t pc)
+{
+    profile->counts[pc]++;
+    profile->samples++;
+}
+
+void LC3ProfileWriteFolded(const LC3Profile_t *profile, FILE *out)
+{
+    for (uint32_t addr = 0; addr <= UINT16_MAX; addr++)
+    {
+        if (!profile->counts[addr])
+        {
+            continue;
+        }
+        const LC3ProfileSymbol_t *symbol = LC3ProfileFindSymbol(profile, addr);
+        if (symbol)
+        {
+            fprintf(out, "%s;%s+%u %u\n", symbol->name, symbol->name, addr - symbol->addr, profile->counts[addr]);
+        }
+        else
+        {
+            fprintf(out, "[unknown];x%04X %u\n", addr, profile->counts[addr]);
+        }
+    }
+}
+
+void LC3ProfileEnd(LC3Profile_t *profile)
+{
+    LC3ProfileStop(profile);
+    free(profile->symbols);
+    profile->symbols = NULL;
+    profile->symbolCount = 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * @file profile.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Sampling profiler of the guest PC. A sampler thread raises a flag in
+ * the pending word of the cpu at a fixed rate and the engines record their
+ * PC at the next block boundary, so nothing is counted per instruction.
+ * Samples are written as folded stacks for flamegraph tools.
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__PROFILE_H__)
+#define __PROFILE_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "assembler.h"
+
+/**
+ * @brief Samples per second by default
+ * 
+ */
+#define PROFILE_DEFAULT_HZ 1000
+
+/**
+ * @brief Label of a symbol file
+ * 
+ */
+typedef struct LC3ProfileSymbol_t
+{
+    char name[ASM_MAX_LABEL];
+    uint16_t addr;
+} LC3ProfileSymbol_t;
+
+/**
+ * @brief Profiler state, one per cpu
+ * 
+ */
+typedef struct LC3Profile_t
+{
+    /**
+     * @brief samples of every address
+     * 
+     */
+    uint32_t counts[UINT16_MAX + 1];
+    uint64_t samples;
+    /**
+     * @brief labels sorted by address
+     * 
+     */
+    LC3ProfileSymbol_t *symbols;
+    uint32_t symbolCount;
+    /**
+     * @brief nanoseconds between samples
+     * 
+     */
+    long interval;
+    /**
+     * @brief flag word raised on every sample, the pending word of the cpu
+     * 
+     */
+    _Atomic uint16_t *pending;
+    uint16_t mask;
+    /**
+     * @brief sampler thread and the flag that stops it
+     * 
+     */
+    pthread_t sampler;
+    _Atomic uint8_t stop;
+    uint8_t started;
+} LC3Profile_t;
+
+/**
+ * @brief Loads the labels of a symbol file written by lc3as or the LC3 tools
+ * 
+ * @param profile profile instance
+ * @param filename path/filename of the symbol file
+ * @return uint8_t EXIT_FAILURE if the file can't be read
+ */
+uint8_t LC3ProfileLoadSymbols(LC3Profile_t *profile, const char *filename);
+
+/**
+ * @brief Starts the sampler thread
+ * 
+ * @param profile profile instance
+ * @param pending flag word checked by the engines at block boundaries
+ * @param mask bit raised in the flag word on every sample
+ * @param hz samples per second
+ * @return uint8_t EXIT_FAILURE if the thread can't be started
+ */
+uint8_t LC3ProfileStart(LC3Profile_t *profile, _Atomic uint16_t *pending, uint16_t mask, uint32_t hz);
+
+/**
+ * @brief Stops the sampler thread
+ * 
+ * @param profile profile instance
+ */
+void LC3ProfileStop(LC3Profile_t *profile);
+
+/**
+ * @brief Records a sample, called by the cpu when the sample flag is raised
+ * 
+ * @param profile profile instance
+ * @param pc address of the next instruction
+ */
+void LC3ProfileSample(LC3Profile_t *profile, uint16_t pc);
+
+/**
+ * @brief Writes the samples as folded stacks, one line per sampled address
+ * with their label and the offset inside it as frames
+ * 
+ * @param profile profile instance
+ * @param out output stream
+ */
+void LC3ProfileWriteFolded(const LC3Profile_t *profile, FILE *out);
+
+/**
+ * @brief Stops the sampler if it's running and releases the symbols
+ * 
+ * @param profile profile instance
+ */
+void LC3ProfileEnd(LC3Profile_t *profile);
+
+#endif  // __PROFILE_H__
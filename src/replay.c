@@ -0,0 +1,184 @@
+#include "replay.h"
+
+#include <stdlib.h>
+
+#include "log.h"
+
+/**
+ * @brief First line of every log
+ * 
+ */
+#define REPLAY_HEADER "# lc3vm input log: instructions key kind"
+
+/**
+ * @brief Reads the next event of the log, lines starting with # are ignored
+ * 
+ * @param replay replay instance
+ */
+static void LC3ReplayReadEvent(LC3Replay_t *replay)
+{
+    char line[128];
+    replay->next.kind = 0;
+    while (fgets(line, sizeof(line), replay->file))
+    {
+        unsigned long long instructions;
+        int key;
+        char kind;
+        if (line[0] == '#' || sscanf(line, "%llu %d %c", &instructions, &key, &kind) != 3)
+        {
+            continue;
+        }
+        replay->next.instructions = instructions;
+        replay->next.key = key;
+        replay->next.kind = kind;
+        return;
+    }
+}
+
+/**
+ * @brief Writes an event to the log, it's flushed so a run that is killed
+ * keeps their keys
+ * 
+ * @param replay replay instance
+ * @param key key
+ * @param kind Lc3ReplayEvent_e kind of event
+ */
+static void LC3ReplayWriteEvent(LC3Replay_t *replay, int key, uint8_t kind)
+{
+    fprintf(replay->file, "%llu %d %c\n", (unsigned long long)replay->instructions, key, kind);
+    fflush(replay->file);
+    replay->events++;
+}
+
+/**
+ * @brief Takes the next event of a replay, counting it if it's not what the
+ * guest does now
+ * 
+ * @param replay replay instance
+ * @param kind Lc3ReplayEvent_e kind the guest expects
+ * @return int key of the event
+ */
+static int LC3ReplayTakeEvent(LC3Replay_t *replay, uint8_t kind)
+{
+    int key = replay->next.key;
+    if (replay->next.kind != kind || replay->next.instructions != replay->instructions)
+    {
+        if (!replay->mismatches)
+        {
+            LOG_WARN("Replay diverged at event %llu, recorded '%c' after %llu instructions, now '%c' after %llu",
+                     (unsigned long long)replay->events, replay->next.kind, (unsigned long long)replay->next.instructions,
+                     kind, (unsigned long long)replay->instructions);
+        }
+        replay->mismatches++;
+    }
+    replay->events++;
+    LC3ReplayReadEvent(replay);
+    return key;
+}
+
+uint8_t LC3ReplayOpen(LC3Replay_t *replay, const char *filename, uint8_t mode)
+{
+    replay->mode = mode;
+    replay->instructions = 0;
+    replay->head = 0;
+    replay->tail = 0;
+    replay->events = 0;
+    replay->mismatches = 0;
+    replay->file = fopen(filename, mode == REPLAY_RECORD ? "w" : "r");
+    if (!replay->file)
+    {
+        return EXIT_FAILURE;
+    }
+    if (mode == REPLAY_RECORD)
+    {
+        fprintf(replay->file, "%s\n", REPLAY_HEADER);
+    }
+    else
+    {
+        LC3ReplayReadEvent(replay);
+    }
+    return EXIT_SUCCESS;
+}
+
+void LC3ReplayClose(LC3Replay_t *replay)
+{
+    if (!replay->file)
+    {
+        return;
+    }
+    if (replay->mode == REPLAY_PLAY)
+    {
+        // Events left mean the guest ended earlier than the recording
+        while (replay->next.kind)
+        {
+            replay->mismatches++;
+            LC3ReplayReadEvent(replay);
+        }
+    }
+    LOG_LN("%s %llu input events, %llu of them at another point", replay->mode == REPLAY_RECORD ? "Recorded" : "Replayed",
+           (unsigned long long)replay->events, (unsigned long long)replay->mismatches);
+    fclose(replay->file);
+    replay->file = NULL;
+}
+
+uint8_t LC3ReplayArrive(LC3Replay_t *replay, LC3Console_t *console, uint64_t instructions)
+{
+    uint32_t head = replay->head;
+    replay->instructions = instructions;
+    while (replay->head - replay->tail < REPLAY_QUEUE_SIZE)
+    {
+        int key;
+        if (replay->mode == REPLAY_RECORD)
+        {
+            if (!OSKeyboardIsKeyPressed(console))
+            {
+                break;
+            }
+            key = OSKeyboardGetChar(console);
+            LC3ReplayWriteEvent(replay, key, REPLAY_EVENT_KEY);
+        }
+        else
+        {
+            // A key recorded earlier than now arrives as soon as possible
+            if (replay->next.kind != REPLAY_EVENT_KEY || replay->next.instructions > instructions)
+            {
+                break;
+            }
+            key = LC3ReplayTakeEvent(replay, REPLAY_EVENT_KEY);
+        }
+        replay->queue[replay->head++ & REPLAY_QUEUE_MASK] = (uint16_t)key;
+    }
+    return replay->head != head;
+}
+
+uint16_t LC3ReplayIsKeyPressed(LC3Replay_t *replay, LC3Console_t *console)
+{
+    if (replay->head != replay->tail)
+    {
+        return 1;
+    }
+    OSDisplayFlushBeforeInput(console);
+    return 0;
+}
+
+int LC3ReplayGetChar(LC3Replay_t *replay, LC3Console_t *console)
+{
+    if (replay->head != replay->tail)
+    {
+        return replay->queue[replay->tail++ & REPLAY_QUEUE_MASK];
+    }
+    if (replay->mode == REPLAY_RECORD)
+    {
+        int key = OSKeyboardGetChar(console);
+        LC3ReplayWriteEvent(replay, key, REPLAY_EVENT_WAIT);
+        return key;
+    }
+    OSDisplayFlushBeforeInput(console);
+    if (!replay->next.kind)
+    {
+        // The recording ended before, the keyboard ends too
+        replay->mismatches++;
+        return EOF;
+    }
+    return LC3ReplayTakeEvent(replay, REPLAY_EVENT_WAIT);
+}
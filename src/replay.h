@@ -0,0 +1,173 @@
+/**
+ * @file replay.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Record and replay of the keyboard input. The guest only sees a queue
+ * of keys that is filled between slices of REPLAY_SLICE_INSTRUCTIONS, so the
+ * instruction at which every key arrives doesn't depend on the time. A
+ * recording logs every key with the count of retired instructions when it
+ * arrived, a replay fills the queue from the log at the same counts without
+ * reading the keyboard.
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__REPLAY_H__)
+#define __REPLAY_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "console.h"
+
+/**
+ * @brief Instructions run between two arrivals of keys, the latency of the
+ * keyboard while recording
+ * 
+ */
+#define REPLAY_SLICE_INSTRUCTIONS (1 << 14)
+
+/**
+ * @brief Keys waiting to be read by the guest, more keys are left in the
+ * keyboard until the next slice
+ * 
+ */
+#define REPLAY_QUEUE_SIZE 256U
+#define REPLAY_QUEUE_MASK (REPLAY_QUEUE_SIZE - 1U)
+
+/**
+ * @brief What is done with the log
+ * 
+ */
+typedef enum
+{
+    REPLAY_RECORD,  // Keys are read from the keyboard and written to the log
+    REPLAY_PLAY,    // Keys are read from the log
+    REPLAY_COUNT
+} Lc3ReplayMode_e;
+
+/**
+ * @brief Kinds of events of the log
+ * 
+ */
+typedef enum
+{
+    REPLAY_EVENT_KEY = 'k',   // The key arrived between two slices
+    REPLAY_EVENT_WAIT = 'w'   // The guest waited for the key with an empty queue
+} Lc3ReplayEvent_e;
+
+/**
+ * @brief Event of the log
+ * 
+ */
+typedef struct LC3ReplayEvent_t
+{
+    /**
+     * @brief instructions retired when the key arrived, for waits the ones
+     * retired when their slice started
+     * 
+     */
+    uint64_t instructions;
+    /**
+     * @brief key, EOF if the keyboard ended while the guest waited
+     * 
+     */
+    int key;
+    /**
+     * @brief Lc3ReplayEvent_e kind of event, 0 when the log has ended
+     * 
+     */
+    uint8_t kind;
+} LC3ReplayEvent_t;
+
+/**
+ * @brief Recorder or player of the input of a vm
+ * 
+ */
+typedef struct LC3Replay_t
+{
+    /**
+     * @brief Lc3ReplayMode_e mode
+     * 
+     */
+    uint8_t mode;
+    /**
+     * @brief log written or read
+     * 
+     */
+    FILE *file;
+    /**
+     * @brief instructions retired when the current slice started
+     * 
+     */
+    uint64_t instructions;
+    /**
+     * @brief keys the guest can read
+     * 
+     */
+    uint16_t queue[REPLAY_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    /**
+     * @brief next event of the log, only used by replays
+     * 
+     */
+    LC3ReplayEvent_t next;
+    /**
+     * @brief count of events written or read, and of the events read at
+     * another point than the one recorded
+     * 
+     */
+    uint64_t events;
+    uint64_t mismatches;
+} LC3Replay_t;
+
+/**
+ * @brief Opens the log
+ * 
+ * @param replay replay instance
+ * @param filename path/filename of the log
+ * @param mode Lc3ReplayMode_e mode
+ * @return uint8_t EXIT_FAILURE if the log can't be opened
+ */
+uint8_t LC3ReplayOpen(LC3Replay_t *replay, const char *filename, uint8_t mode);
+
+/**
+ * @brief Closes the log, a recording is complete once it's closed
+ * 
+ * @param replay replay instance
+ */
+void LC3ReplayClose(LC3Replay_t *replay);
+
+/**
+ * @brief Adds the keys that arrived to the queue, called before every slice
+ * 
+ * @param replay replay instance
+ * @param console keyboard read while recording
+ * @param instructions instructions retired before the slice
+ * @return uint8_t 1 if any key was added
+ */
+uint8_t LC3ReplayArrive(LC3Replay_t *replay, LC3Console_t *console, uint64_t instructions);
+
+/**
+ * @brief Checks if the guest has a key to read, their output is written if
+ * the policy asks for it when there is none
+ * 
+ * @param replay replay instance
+ * @param console console of the guest
+ * @return uint16_t 1 if there is a key
+ */
+uint16_t LC3ReplayIsKeyPressed(LC3Replay_t *replay, LC3Console_t *console);
+
+/**
+ * @brief Takes the next key of the queue. When it's empty a recording waits
+ * for the keyboard and a replay takes the key the recording waited for.
+ * 
+ * @param replay replay instance
+ * @param console console of the guest
+ * @return int key, EOF if there are no more keys
+ */
+int LC3ReplayGetChar(LC3Replay_t *replay, LC3Console_t *console);
+
+#endif  // __REPLAY_H__
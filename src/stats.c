@@ -0,0 +1,208 @@
+#include "stats.h"
+
+#include <string.h>
+
+#include "cpu.h"
+#include "fusion.h"
+
+/**
+ * @brief Names of the trap vectors of the LC3 OS
+ * 
+ */
+static const char *LC3StatsTrapNames[] = {"GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT"};
+
+/**
+ * @brief Seconds elapsed since a time
+ * 
+ * @param since start time
+ * @return double seconds
+ */
+static double LC3StatsElapsed(const struct timespec *since)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double)(now.tv_sec - since->tv_sec) + (double)(now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Length of an opcode name without the padding of LC3Opcodes
+ * 
+ * @param name opcode name
+ * @return int length
+ */
+static int LC3StatsNameLength(const char *name)
+{
+    int length = strlen(name);
+    while (length > 0 && name[length - 1] == ' ')
+    {
+        length--;
+    }
+    return length;
+}
+
+/**
+ * @brief Name of a trap vector
+ * 
+ * @param vector trap vector
+ * @param buffer storage for the name of vectors without one
+ * @return const char* name
+ */
+static const char *LC3StatsTrapName(uint16_t vector, char buffer[8])
+{
+    if (vector >= TRAP_GETC && vector <= TRAP_HALT)
+    {
+        return LC3StatsTrapNames[vector - TRAP_GETC];
+    }
+    snprintf(buffer, 8U, "x%02X", vector);
+    return buffer;
+}
+
+/**
+ * @brief Guest instructions per microsecond of wall time
+ * 
+ * @param stats stats instance
+ * @return double MIPS, 0 if the run took no measurable time
+ */
+static double LC3StatsMips(const LC3Stats_t *stats)
+{
+    return stats->seconds > 0 ? LC3StatsInstructions(stats) / stats->seconds / 1e6 : 0;
+}
+
+/**
+ * @brief Memory words loaded by the load instructions and the pointer of
+ * STI, from the opcode counts
+ * 
+ * @param stats stats instance
+ * @return uint64_t words loaded
+ */
+static uint64_t LC3StatsLoads(const LC3Stats_t *stats)
+{
+    return stats->opcodes[OP_LD] + stats->opcodes[OP_LDR] + 2U * stats->opcodes[OP_LDI] + stats->opcodes[OP_STI];
+}
+
+/**
+ * @brief Memory words stored by the store instructions, from the opcode
+ * counts
+ * 
+ * @param stats stats instance
+ * @return uint64_t words stored
+ */
+static uint64_t LC3StatsStores(const LC3Stats_t *stats)
+{
+    return stats->opcodes[OP_ST] + stats->opcodes[OP_STR] + stats->opcodes[OP_STI];
+}
+
+/**
+ * @brief JMP, RET, JSR and JSRR executed, they always jump
+ * 
+ * @param stats stats instance
+ * @return uint64_t jumps
+ */
+static uint64_t LC3StatsJumps(const LC3Stats_t *stats)
+{
+    return stats->opcodes[OP_JMP] + stats->opcodes[OP_JSR];
+}
+
+void LC3StatsStart(LC3Stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    timespec_get(&stats->start, TIME_UTC);
+}
+
+void LC3StatsStop(LC3Stats_t *stats)
+{
+    stats->seconds = LC3StatsElapsed(&stats->start);
+}
+
+void LC3StatsRetire(LC3Stats_t *stats, const LC3DecodedInst_t *inst)
+{
+    uint8_t opcode = inst->word >> 12;
+    stats->opcodes[opcode]++;
+    if (inst->action == LC3Opcodes[opcode].action)
+    {
+        return;
+    }
+    // Superinstruction, the replaced instructions follow it in the cache
+    for (uint8_t fusion = 0; fusion < FUSION_COUNT; fusion++)
+    {
+        if (inst->action == LC3Fusions[fusion].action)
+        {
+            for (uint8_t i = 1; i < LC3Fusions[fusion].length; i++)
+            {
+                stats->opcodes[inst[i].word >> 12]++;
+            }
+            break;
+        }
+    }
+}
+
+uint64_t LC3StatsInstructions(const LC3Stats_t *stats)
+{
+    uint64_t total = 0;
+    for (uint8_t opcode = 0; opcode < OP_COUNT; opcode++)
+    {
+        total += stats->opcodes[opcode];
+    }
+    return total;
+}
+
+void LC3StatsPrint(const LC3Stats_t *stats, FILE *out)
+{
+    char buffer[8];
+    fprintf(out, "Instructions   %14llu\n", (unsigned long long)LC3StatsInstructions(stats));
+    fprintf(out, "Wall time      %14.6f s\n", stats->seconds);
+    fprintf(out, "Guest MIPS     %14.2f\n", LC3StatsMips(stats));
+    fprintf(out, "BR taken       %14llu\n", (unsigned long long)stats->brTaken);
+    fprintf(out, "BR not taken   %14llu\n", (unsigned long long)stats->brNotTaken);
+    fprintf(out, "Jumps          %14llu\n", (unsigned long long)LC3StatsJumps(stats));
+    fprintf(out, "Load words     %14llu\n", (unsigned long long)LC3StatsLoads(stats));
+    fprintf(out, "Store words    %14llu\n", (unsigned long long)LC3StatsStores(stats));
+    fprintf(out, "Opcodes:\n");
+    for (uint8_t opcode = 0; opcode < OP_COUNT; opcode++)
+    {
+        if (stats->opcodes[opcode])
+        {
+            fprintf(out, "  %s %14llu\n", LC3Opcodes[opcode].name, (unsigned long long)stats->opcodes[opcode]);
+        }
+    }
+    fprintf(out, "Traps:\n");
+    for (uint16_t vector = 0; vector <= UINT8_MAX; vector++)
+    {
+        if (stats->traps[vector])
+        {
+            fprintf(out, "  %-5s %12llu\n", LC3StatsTrapName(vector, buffer), (unsigned long long)stats->traps[vector]);
+        }
+    }
+}
+
+void LC3StatsPrintJson(const LC3Stats_t *stats, FILE *out)
+{
+    char buffer[8];
+    const char *separator = "";
+    fprintf(out, "{\"instructions\": %llu, \"seconds\": %.6f, \"mips\": %.2f,\n",
+            (unsigned long long)LC3StatsInstructions(stats), stats->seconds, LC3StatsMips(stats));
+    fprintf(out, " \"branches\": {\"brTaken\": %llu, \"brNotTaken\": %llu, \"jumps\": %llu},\n",
+            (unsigned long long)stats->brTaken, (unsigned long long)stats->brNotTaken,
+            (unsigned long long)LC3StatsJumps(stats));
+    fprintf(out, " \"instructionMemory\": {\"loadWords\": %llu, \"storeWords\": %llu},\n",
+            (unsigned long long)LC3StatsLoads(stats), (unsigned long long)LC3StatsStores(stats));
+    fprintf(out, " \"opcodes\": {");
+    for (uint8_t opcode = 0; opcode < OP_COUNT; opcode++)
+    {
+        fprintf(out, "%s\"%.*s\": %llu", separator, LC3StatsNameLength(LC3Opcodes[opcode].name),
+                LC3Opcodes[opcode].name, (unsigned long long)stats->opcodes[opcode]);
+        separator = ", ";
+    }
+    fprintf(out, "},\n \"traps\": {");
+    separator = "";
+    for (uint16_t vector = 0; vector <= UINT8_MAX; vector++)
+    {
+        if (stats->traps[vector])
+        {
+            fprintf(out, "%s\"%s\": %llu", separator, LC3StatsTrapName(vector, buffer),
+                    (unsigned long long)stats->traps[vector]);
+            separator = ", ";
+        }
+    }
+    fprintf(out, "}}\n");
+}
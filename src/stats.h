@@ -0,0 +1,154 @@
+/**
+ * @file stats.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Execution statistics of the guest program, counted by every engine
+ * when the cpu has a stats instance. Building with LC3_STATS=0 removes the
+ * counters from the engines.
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__STATS_H__)
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "defs.h"
+#include "firmware.h"
+
+#if !defined(LC3_STATS)
+#define LC3_STATS 1
+#endif
+
+/**
+ * @brief Counters of a run. The words loaded and stored by the instructions
+ * are derived from the opcode counts, they don't include the stack of traps
+ * and interrupts nor the accesses of the devices
+ * 
+ */
+typedef struct LC3Stats_t
+{
+    /**
+     * @brief retired instructions by opcode, indexed like LC3Opcodes
+     * 
+     */
+    uint64_t opcodes[OP_COUNT];
+    /**
+     * @brief BR instructions that jumped, JMP, JSR and JSRR always jump and
+     * are only counted by opcode
+     * 
+     */
+    uint64_t brTaken;
+    /**
+     * @brief BR instructions that fell through
+     * 
+     */
+    uint64_t brNotTaken;
+    /**
+     * @brief executed traps by vector
+     * 
+     */
+    uint64_t traps[UINT8_MAX + 1];
+    /**
+     * @brief wall time when the run started
+     * 
+     */
+    struct timespec start;
+    /**
+     * @brief wall time of the run in seconds
+     * 
+     */
+    double seconds;
+} LC3Stats_t;
+
+#if LC3_STATS
+/**
+ * @brief Increments a counter of the stats, if there are stats
+ * 
+ */
+#define STATS(__stats, __counter)       \
+    do                                  \
+    {                                   \
+        if (__stats)                    \
+        {                               \
+            (__stats)->__counter++;     \
+        }                               \
+    } while (0)
+
+/**
+ * @brief Counts the opcodes of a decoded entry, if there are stats
+ * 
+ */
+#define STATS_RETIRE(__stats, __inst)           \
+    do                                          \
+    {                                           \
+        if (__stats)                            \
+        {                                       \
+            LC3StatsRetire((__stats), (__inst)); \
+        }                                       \
+    } while (0)
+#else
+#define STATS(__stats, __counter) \
+    do                            \
+    {                             \
+        (void)(__stats);          \
+    } while (0)
+#define STATS_RETIRE(__stats, __inst) \
+    do                                \
+    {                                 \
+        (void)(__stats);              \
+    } while (0)
+#endif
+
+/**
+ * @brief Clears the counters and takes the start time
+ * 
+ * @param stats stats instance
+ */
+void LC3StatsStart(LC3Stats_t *stats);
+
+/**
+ * @brief Takes the wall time of the run
+ * 
+ * @param stats stats instance
+ */
+void LC3StatsStop(LC3Stats_t *stats);
+
+/**
+ * @brief Counts the opcode of a decoded entry, and of the instructions
+ * replaced if it's a superinstruction
+ * 
+ * @param stats stats instance
+ * @param inst decoded entry about to be executed
+ */
+void LC3StatsRetire(LC3Stats_t *stats, const LC3DecodedInst_t *inst);
+
+/**
+ * @brief Total of retired instructions
+ * 
+ * @param stats stats instance
+ * @return uint64_t instructions
+ */
+uint64_t LC3StatsInstructions(const LC3Stats_t *stats);
+
+/**
+ * @brief Writes a human readable report
+ * 
+ * @param stats stats instance
+ * @param out output stream
+ */
+void LC3StatsPrint(const LC3Stats_t *stats, FILE *out);
+
+/**
+ * @brief Writes the report as a JSON object
+ * 
+ * @param stats stats instance
+ * @param out output stream
+ */
+void LC3StatsPrintJson(const LC3Stats_t *stats, FILE *out);
+
+#endif  // __STATS_H__
@@ -0,0 +1,287 @@
+#include "threaded.h"
+
+#include <string.h>
+
+#include "firmware.h"
+
+#if defined(__GNUC__)
+#define USE_COMPUTED_GOTO 1
+#else
+#define USE_COMPUTED_GOTO 0
+#endif
+
+/**
+ * @brief Condition codes for a value written to a register
+ * 
+ */
+#define CC_OF(__v) ((__v) == 0 ? CC_Z : (((__v) >> 15) ? CC_N : CC_P))
+
+void LC3CpuExecuteThreaded(LC3Cpu_t *cpu)
+{
+    LC3DecodedInst_t uncached;
+    LC3DecodedInst_t *const *decoded = cpu->firmware->decoded;
+    // Cache page of the last fetch, looked up again only when the pc leaves it
+    const LC3DecodedInst_t *page = NULL;
+    uint32_t pageIndex = MEMORY_PAGES;
+    const LC3DecodedInst_t *inst;
+    uint16_t pc = cpu->PC;
+    uint16_t cc = cpu->CC;
+    uint16_t regs[REG_COUNT];
+    uint16_t addr;
+    LC3Stats_t *const stats = cpu->stats;
+    // Without limits the budget never runs out
+    int64_t budget = cpu->stat.limited ? cpu->budget : INT64_MAX;
+    memcpy(regs, cpu->regs, sizeof(regs));
+
+// Locals are written back only when a handler from LC3Opcodes needs the cpu
+#define SYNC_OUT()                                \
+    cpu->PC = pc;                                 \
+    cpu->CC = cc;                                 \
+    memcpy(cpu->regs, regs, sizeof(regs))
+#define SYNC_IN()                                 \
+    pc = cpu->PC;                                 \
+    cc = cpu->CC;                                 \
+    memcpy(regs, cpu->regs, sizeof(regs))
+#define RETURN()                                  \
+    if (cpu->stat.limited)                        \
+    {                                             \
+        cpu->budget = budget;                     \
+    }                                             \
+    return
+// The IO page has no cache page, their words always go through LC3CpuFetch, that can allocate the page
+#define FETCH()                                          \
+    if ((uint32_t)(pc >> MEMORY_PAGE_SHIFT) != pageIndex) \
+    {                                                    \
+        pageIndex = pc >> MEMORY_PAGE_SHIFT;             \
+        page = decoded[pageIndex];                       \
+    }                                                    \
+    if (page && page[pc & MEMORY_PAGE_MASK].action)      \
+    {                                                    \
+        inst = &page[pc & MEMORY_PAGE_MASK];             \
+    }                                                    \
+    else                                                 \
+    {                                                    \
+        cpu->PC = pc;                                    \
+        inst = LC3CpuFetch(cpu, &uncached);              \
+        pageIndex = MEMORY_PAGES;                        \
+    }
+
+// Interrupts and samples are taken after the instructions that end a block, like the other engines
+#define CHECK_PENDING()                                             \
+    if (atomic_load_explicit(&cpu->pending, memory_order_relaxed))  \
+    {                                                               \
+        SYNC_OUT();                                                 \
+        LC3CpuCheckPending(cpu);                                    \
+        SYNC_IN();                                                  \
+        if (!cpu->stat.running)                                     \
+        {                                                           \
+            RETURN();                                               \
+        }                                                           \
+    }
+
+// Devices read and write the condition codes through PSR, only the IO page pays for the sync
+#define LOAD(__addr)                             \
+    addr = (__addr);                             \
+    if (addr >= IO_PAGE_ADDRESS)                 \
+    {                                            \
+        cpu->CC = cc;                            \
+    }                                            \
+    addr = LC3CpuReadMemory(cpu, addr)
+
+// Stores can also reach the machine control register, or fail to copy a shared page, and stop the cpu
+#define STORE(__addr, __value)                   \
+    addr = (__addr);                             \
+    if (addr < IO_PAGE_ADDRESS)                  \
+    {                                            \
+        LC3CpuWriteMemory(cpu, addr, __value);   \
+    }                                            \
+    else                                         \
+    {                                            \
+        cpu->CC = cc;                            \
+        LC3CpuWriteMemory(cpu, addr, __value);   \
+        cc = cpu->CC;                            \
+    }                                            \
+    if (!cpu->stat.running)                      \
+    {                                            \
+        pc++;                                    \
+        SYNC_OUT();                              \
+        RETURN();                                \
+    }
+
+#if USE_COMPUTED_GOTO
+    static const void *const labels[OP_COUNT] = {
+        [OP_BR] = &&op_br,
+        [OP_ADD] = &&op_add,
+        [OP_LD] = &&op_ld,
+        [OP_ST] = &&op_st,
+        [OP_JSR] = &&op_jsr,
+        [OP_AND] = &&op_and,
+        [OP_LDR] = &&op_ldr,
+        [OP_STR] = &&op_str,
+        [OP_RTI] = &&op_native,
+        [OP_NOT] = &&op_not,
+        [OP_LDI] = &&op_ldi,
+        [OP_STI] = &&op_sti,
+        [OP_JMP] = &&op_jmp,
+        [OP_RES] = &&op_native,
+        [OP_LEA] = &&op_lea,
+        [OP_TRAP] = &&op_native};
+// Each handler has their own indirect jump, so the branch predictor learns
+// which opcode usually follows each one
+#define DISPATCH()                           \
+    if (--budget < 0)                        \
+    {                                        \
+        goto exhausted;                      \
+    }                                        \
+    FETCH();                                 \
+    STATS(stats, opcodes[inst->word >> 12]); \
+    goto *labels[inst->word >> 12]
+#define OPCODE(__label, __op) __label:
+#else
+#define DISPATCH() goto dispatch
+#define OPCODE(__label, __op) case __op:
+#endif
+
+    DISPATCH();
+#if !USE_COMPUTED_GOTO
+dispatch:
+    if (--budget < 0)
+    {
+        goto exhausted;
+    }
+    FETCH();
+    STATS(stats, opcodes[inst->word >> 12]);
+    switch (inst->word >> 12)
+    {
+#endif
+    OPCODE(op_br, OP_BR)
+    {
+        if (inst->flags & cc)
+        {
+            pc += inst->offset;
+            STATS(stats, brTaken);
+        }
+        else
+        {
+            STATS(stats, brNotTaken);
+        }
+        pc++;
+        CHECK_PENDING();
+        DISPATCH();
+    }
+    OPCODE(op_add, OP_ADD)
+    {
+        regs[inst->dr] = regs[inst->sr1] + (inst->flags ? inst->offset : regs[inst->sr2]);
+        cc = CC_OF(regs[inst->dr]);
+        pc++;
+        DISPATCH();
+    }
+    OPCODE(op_ld, OP_LD)
+    {
+        LOAD(pc + 1U + inst->offset);
+        regs[inst->dr] = addr;
+        cc = CC_OF(regs[inst->dr]);
+        pc++;
+        DISPATCH();
+    }
+    OPCODE(op_st, OP_ST)
+    {
+        STORE(pc + 1U + inst->offset, regs[inst->dr]);
+        pc++;
+        DISPATCH();
+    }
+    OPCODE(op_jsr, OP_JSR)
+    {
+        addr = regs[inst->sr1];
+        regs[REG_R7] = pc + 1U;
+        pc = inst->flags ? pc + 1U + inst->offset : addr;
+        CHECK_PENDING();
+        DISPATCH();
+    }
+    OPCODE(op_and, OP_AND)
+    {
+        regs[inst->dr] = regs[inst->sr1] & (inst->flags ? inst->offset : regs[inst->sr2]);
+        cc = CC_OF(regs[inst->dr]);
+        pc++;
+        DISPATCH();
+    }
+    OPCODE(op_ldr, OP_LDR)
+    {
+        LOAD(regs[inst->sr1] + inst->offset);
+        regs[inst->dr] = addr;
+        cc = CC_OF(regs[inst->dr]);
+        pc++;
+        DISPATCH();
+    }
+    OPCODE(op_str, OP_STR)
+    {
+        STORE(regs[inst->sr1] + inst->offset, regs[inst->dr]);
+        pc++;
+        DISPATCH();
+    }
+    OPCODE(op_not, OP_NOT)
+    {
+        regs[inst->dr] = ~regs[inst->sr1];
+        cc = CC_OF(regs[inst->dr]);
+        pc++;
+        DISPATCH();
+    }
+    OPCODE(op_ldi, OP_LDI)
+    {
+        LOAD(pc + 1U + inst->offset);
+        LOAD(addr);
+        regs[inst->dr] = addr;
+        cc = CC_OF(regs[inst->dr]);
+        pc++;
+        DISPATCH();
+    }
+    OPCODE(op_sti, OP_STI)
+    {
+        LOAD(pc + 1U + inst->offset);
+        STORE(addr, regs[inst->dr]);
+        pc++;
+        DISPATCH();
+    }
+    OPCODE(op_jmp, OP_JMP)
+    {
+        pc = regs[inst->sr1];
+        CHECK_PENDING();
+        DISPATCH();
+    }
+    OPCODE(op_lea, OP_LEA)
+    {
+        regs[inst->dr] = pc + 1U + inst->offset;
+        cc = CC_OF(regs[inst->dr]);
+        pc++;
+        DISPATCH();
+    }
+    OPCODE(op_native, OP_TRAP)
+#if !USE_COMPUTED_GOTO
+    case OP_RTI:
+    case OP_RES:
+#endif
+    {
+        // Traps talk with the console and can stop the cpu, RTI and the reserved opcode change the
+        // privilege, run the same handler than LC3CpuExecute
+        SYNC_OUT();
+        inst->action(cpu, inst);
+        if (cpu->stat.incrementPC)
+        {
+            cpu->PC++;
+        }
+        SYNC_IN();
+        if (!cpu->stat.running)
+        {
+            RETURN();
+        }
+        CHECK_PENDING();
+        DISPATCH();
+    }
+#if !USE_COMPUTED_GOTO
+    }
+#endif
+exhausted:
+    budget = 0;
+    SYNC_OUT();
+    RETURN();
+}
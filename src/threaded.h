@@ -0,0 +1,25 @@
+/**
+ * @file threaded.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Threaded dispatch engine, uses computed goto when the compiler
+ * supports it or a switch loop otherwise
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__THREADED_H__)
+#define __THREADED_H__
+
+#include "cpu.h"
+
+/**
+ * @brief Executes the cpu until it stops, keeping PC, registers and CC in
+ * locals while running. Has the same semantics than LC3CpuExecute.
+ * 
+ * @param cpu pointer to the cpu instance
+ */
+void LC3CpuExecuteThreaded(LC3Cpu_t *cpu);
+
+#endif  // __THREADED_H__
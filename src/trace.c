@@ -0,0 +1,257 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "log.h"
+#include "tracefile.h"
+
+const char *LC3TraceLevels[TRACE_COUNT] = {"off", "sampled", "full"};
+
+uint8_t LC3TraceFindLevel(const char *name)
+{
+    uint8_t level;
+    for (level = 0; level < TRACE_COUNT; level++)
+    {
+        if (strcmp(LC3TraceLevels[level], name) == 0)
+        {
+            break;
+        }
+    }
+    return level;
+}
+
+uint8_t LC3TraceInit(LC3Trace_t *trace, uint8_t level, uint32_t records, uint32_t sampleRate)
+{
+    uint32_t capacity = 1U;
+    while (capacity < records)
+    {
+        capacity <<= 1;
+    }
+    trace->level = TRACE_OFF;
+    trace->current = NULL;
+    trace->head = 0;
+    trace->records = NULL;
+    trace->file = NULL;
+    trace->capacity = 0;
+    trace->sampleRate = sampleRate ? sampleRate : 1U;
+    trace->countdown = trace->sampleRate;
+    if (level == TRACE_OFF)
+    {
+        return EXIT_SUCCESS;
+    }
+    trace->records = malloc(capacity * sizeof(LC3TraceRecord_t));
+    if (!trace->records)
+    {
+        return EXIT_FAILURE;
+    }
+    trace->capacity = capacity;
+    trace->level = level;
+    LOG_LN("Trace level %s, %u records", LC3TraceLevels[level], capacity);
+    return EXIT_SUCCESS;
+}
+
+uint8_t LC3TraceOpenFile(LC3Trace_t *trace, const char *filename, const uint16_t *regs)
+{
+    if (trace->level != TRACE_FULL)
+    {
+        return EXIT_FAILURE;
+    }
+    trace->file = LC3TraceFileCreate(filename, regs);
+    if (!trace->file)
+    {
+        return EXIT_FAILURE;
+    }
+    LOG_LN("Writing binary trace to %s", filename);
+    return EXIT_SUCCESS;
+}
+
+void LC3TraceEnd(LC3Trace_t *trace)
+{
+    if (trace->file)
+    {
+        if (trace->current)
+        {
+            LC3TraceFileWrite(trace->file, trace->current);
+        }
+        LC3TraceFileClose(trace->file);
+        trace->file = NULL;
+    }
+    free(trace->records);
+    trace->records = NULL;
+    trace->current = NULL;
+    trace->capacity = 0;
+    trace->level = TRACE_OFF;
+}
+
+void LC3TraceBegin(LC3Trace_t *trace, uint16_t pc, uint16_t word)
+{
+    if (trace->file && trace->current)
+    {
+        // Previous instruction is completed now, registers have their new values
+        LC3TraceFileWrite(trace->file, trace->current);
+    }
+    trace->current = NULL;
+    if (trace->level == TRACE_SAMPLED && --trace->countdown)
+    {
+        return;
+    }
+    trace->countdown = trace->sampleRate;
+    LC3TraceRecord_t *rec = &trace->records[trace->head++ & (trace->capacity - 1U)];
+    rec->pc = pc;
+    rec->word = word;
+    rec->addr = 0;
+    rec->value = 0;
+    trace->current = rec;
+}
+
+/**
+ * @brief Writes the string printed by PUTS/PUTSP, memory is read as it's now
+ * so it can differ from what was printed if the program modified it
+ * 
+ * @param cpu cpu instance
+ * @param out stream to write
+ * @param addr address of the string
+ * @param packed 1 for PUTSP, two chars by word
+ */
+static void LC3TraceFormatString(LC3Cpu_t *cpu, FILE *out, uint16_t addr, uint8_t packed)
+{
+    for (; addr < IO_PAGE_ADDRESS; addr++)
+    {
+        uint16_t mem = MEMORY_READ(&cpu->firmware->memory, addr);
+        if ((mem & 0xFF) == 0x00)
+        {
+            break;
+        }
+        putc((char)(mem & 0xFF), out);
+        if (packed)
+        {
+            // An odd length string ends in the high byte of their last word
+            if ((mem >> 8) == 0x00)
+            {
+                break;
+            }
+            putc((char)(mem >> 8), out);
+        }
+    }
+}
+
+/**
+ * @brief Writes a record with the same format used by the log file
+ * 
+ * @param cpu cpu instance
+ * @param out stream to write
+ * @param rec record to write
+ */
+static void LC3TraceFormatRecord(LC3Cpu_t *cpu, FILE *out, const LC3TraceRecord_t *rec)
+{
+    LC3DecodedInst_t inst;
+    LC3Instruction_t raw;
+    memcpy(&raw, &rec->word, sizeof(raw));
+    LC3CpuDecode(raw, &inst);
+
+    fprintf(out, " -> PC: 0x%04X [0x%04X] -> %s ", rec->pc, rec->word, LC3Opcodes[raw.opcode].name);
+    switch (raw.opcode)
+    {
+    case OP_BR:
+        if (rec->value)
+        {
+            fprintf(out, "# BR $0x%04X\n", rec->addr);
+        }
+        else
+        {
+            fprintf(out, "# BR $0x%04X xxx\n", rec->pc);
+        }
+        break;
+    case OP_ADD:
+    case OP_AND:
+        if (inst.flags)
+        {
+            fprintf(out, "# R%u <- R%u %c 0x%04X = 0x%04X\n",
+                    inst.dr, inst.sr1, raw.opcode == OP_ADD ? '+' : '&', inst.offset, rec->value);
+        }
+        else
+        {
+            fprintf(out, "# R%u <- R%u %c R%u = 0x%04X\n",
+                    inst.dr, inst.sr1, raw.opcode == OP_ADD ? '+' : '&', inst.sr2, rec->value);
+        }
+        break;
+    case OP_LD:
+    case OP_LDR:
+        fprintf(out, "# R%u <- $0x%04X = 0x%04X\n", inst.dr, rec->addr, rec->value);
+        break;
+    case OP_ST:
+        fprintf(out, "# (R%u + offset) -> $0x%04X = 0x%04X\n", inst.dr, rec->addr, rec->value);
+        break;
+    case OP_STR:
+        fprintf(out, "# R%u -> $0x%04X = 0x%04X\n", inst.dr, rec->addr, rec->value);
+        break;
+    case OP_JSR:
+        fprintf(out, "# PC <- $0x%04X, R7 <- $0x%04X\n", rec->addr, rec->value);
+        break;
+    case OP_RTI:
+        fprintf(out, "# PC <- $0x%04X, PSR <- 0x%04X\n", rec->addr, rec->value);
+        break;
+    case OP_NOT:
+    case OP_LEA:
+        fprintf(out, "# R%u <- 0x%04X\n", inst.dr, rec->value);
+        break;
+    case OP_LDI:
+        fprintf(out, "# R%u <- $0x%04X (0x%04X)\n", inst.dr, rec->addr, rec->value);
+        break;
+    case OP_STI:
+        fprintf(out, "# (R%u + 0x%04X) -> $0x%04X = 0x%04X\n",
+                inst.dr, (uint16_t)(rec->pc + 1U + inst.offset), rec->addr, rec->value);
+        break;
+    case OP_JMP:
+        fprintf(out, inst.sr1 == REG_R7 ? "# PC <- $0x%04X <- R7\n" : "# PC <- $0x%04X\n", rec->addr);
+        break;
+    case OP_TRAP:
+        switch (inst.offset)
+        {
+        case TRAP_GETC:
+            fprintf(out, "# GETC key: %u\n", rec->value);
+            break;
+        case TRAP_OUT:
+            fprintf(out, "# OUT key: %u\n", rec->value);
+            break;
+        case TRAP_PUTS:
+        case TRAP_PUTSP:
+            fprintf(out, inst.offset == TRAP_PUTS ? "# PUTS: " : "# PUTSP: ");
+            LC3TraceFormatString(cpu, out, rec->addr, inst.offset == TRAP_PUTSP);
+            fprintf(out, "\n");
+            break;
+        case TRAP_IN:
+            fprintf(out, "# IN key: %u\n", rec->value);
+            break;
+        case TRAP_HALT:
+            fprintf(out, "# HALT\n");
+            break;
+        default:
+            fprintf(out, "# 0x%02X\n", inst.offset);
+            break;
+        }
+        break;
+    default:
+        fprintf(out, "\n");
+        break;
+    }
+}
+
+void LC3TraceFormat(LC3Cpu_t *cpu, FILE *out)
+{
+    LC3Trace_t *trace = &cpu->trace;
+    if (!out || trace->level == TRACE_OFF)
+    {
+        return;
+    }
+    uint64_t first = trace->head > trace->capacity ? trace->head - trace->capacity : 0;
+    fprintf(out, " -> Trace: %llu records, showing last %llu\n",
+            (unsigned long long)trace->head, (unsigned long long)(trace->head - first));
+    for (uint64_t i = first; i < trace->head; i++)
+    {
+        LC3TraceFormatRecord(cpu, out, &trace->records[i & (trace->capacity - 1U)]);
+    }
+    fflush(out);
+}
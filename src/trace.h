@@ -0,0 +1,197 @@
+/**
+ * @file trace.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Execution tracer, keeps fixed size binary records in a ring buffer
+ * and formats them to text only when they are requested
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__TRACE_H__)
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct LC3Cpu_t;
+struct LC3TraceFile_t;
+
+/**
+ * @brief Default number of records in the ring buffer, must be power of 2
+ * 
+ */
+#define TRACE_DEFAULT_RECORDS 0x10000
+
+/**
+ * @brief Default rate for sampled level, one of every N instructions
+ * 
+ */
+#define TRACE_DEFAULT_SAMPLE_RATE 1000
+
+/**
+ * @brief Available trace levels
+ * 
+ */
+typedef enum
+{
+    TRACE_OFF,      // Nothing is recorded
+    TRACE_SAMPLED,  // Records one of every sampleRate instructions
+    TRACE_FULL,     // Records every instruction
+    TRACE_COUNT
+} Lc3TraceLevels_e;
+
+/**
+ * @brief Record of an executed instruction, what is stored in addr and value
+ * depends on the opcode
+ * 
+ */
+typedef struct LC3TraceRecord_t
+{
+    /**
+     * @brief address of the instruction
+     * 
+     */
+    uint16_t pc;
+    /**
+     * @brief instruction word
+     * 
+     */
+    uint16_t word;
+    /**
+     * @brief effective address of the memory access or jump target
+     * 
+     */
+    uint16_t addr;
+    /**
+     * @brief value written to register or memory
+     * 
+     */
+    uint16_t value;
+} LC3TraceRecord_t;
+
+/**
+ * @brief Tracer state, one per cpu
+ * 
+ */
+typedef struct LC3Trace_t
+{
+    /**
+     * @brief current level, Lc3TraceLevels_e
+     * 
+     */
+    uint8_t level;
+    /**
+     * @brief in sampled level records one of every sampleRate instructions
+     * 
+     */
+    uint32_t sampleRate;
+    /**
+     * @brief instructions left to the next sample
+     * 
+     */
+    uint32_t countdown;
+    /**
+     * @brief ring buffer of records
+     * 
+     */
+    LC3TraceRecord_t *records;
+    /**
+     * @brief size of the ring buffer in records, power of 2
+     * 
+     */
+    uint32_t capacity;
+    /**
+     * @brief total of records written, the ring buffer index is head % capacity
+     * 
+     */
+    uint64_t head;
+    /**
+     * @brief record of the instruction in execution, NULL if it's not traced
+     * 
+     */
+    LC3TraceRecord_t *current;
+    /**
+     * @brief binary trace file where every record is also encoded, NULL if
+     * records are only kept in the ring buffer
+     * 
+     */
+    struct LC3TraceFile_t *file;
+} LC3Trace_t;
+
+/**
+ * @brief Fills the operands of the instruction in execution, if it's traced
+ * 
+ */
+#define TRACE(__trace, __addr, __value)            \
+    do                                             \
+    {                                              \
+        if ((__trace)->current)                    \
+        {                                          \
+            (__trace)->current->addr = (__addr);   \
+            (__trace)->current->value = (__value); \
+        }                                          \
+    } while (0)
+
+/**
+ * @brief Array of level names indexed by Lc3TraceLevels_e
+ * 
+ */
+extern const char *LC3TraceLevels[TRACE_COUNT];
+
+/**
+ * @brief Search a trace level by their name
+ * 
+ * @param name name of the level
+ * @return uint8_t level, TRACE_COUNT if it doesn't exists
+ */
+uint8_t LC3TraceFindLevel(const char *name);
+
+/**
+ * @brief Allocates the ring buffer and sets the level
+ * 
+ * @param trace tracer instance
+ * @param level Lc3TraceLevels_e
+ * @param records size of the ring buffer, rounded up to a power of 2
+ * @param sampleRate one of every N instructions for sampled level
+ * @return uint8_t success value
+ */
+uint8_t LC3TraceInit(LC3Trace_t *trace, uint8_t level, uint32_t records, uint32_t sampleRate);
+
+/**
+ * @brief Encodes every record also to a binary trace file, needs full level
+ * 
+ * @param trace tracer instance
+ * @param filename path/filename of the trace file
+ * @param regs registers of the traced cpu
+ * @return uint8_t success value
+ */
+uint8_t LC3TraceOpenFile(LC3Trace_t *trace, const char *filename, const uint16_t *regs);
+
+/**
+ * @brief Releases the ring buffer and closes the trace file, the tracer ends
+ * with level off
+ * 
+ * @param trace tracer instance
+ */
+void LC3TraceEnd(LC3Trace_t *trace);
+
+/**
+ * @brief Starts the record of an instruction, called before executing it
+ * 
+ * @param trace tracer instance
+ * @param pc address of the instruction
+ * @param word instruction word
+ */
+void LC3TraceBegin(LC3Trace_t *trace, uint16_t pc, uint16_t word);
+
+/**
+ * @brief Writes the records in the ring buffer as text, oldest first
+ * 
+ * @param cpu cpu instance that owns the tracer, used to read strings of PUTS
+ * @param out stream to write
+ */
+void LC3TraceFormat(struct LC3Cpu_t *cpu, FILE *out);
+
+#endif  // __TRACE_H__
@@ -0,0 +1,342 @@
+#include "tracefile.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+
+/**
+ * @brief Writes the buffered bytes to the file
+ * 
+ * @param tf trace file instance
+ */
+static void LC3TraceFileFlush(LC3TraceFile_t *tf)
+{
+    fwrite(tf->buffer, 1U, tf->used, tf->f);
+    tf->used = 0;
+}
+
+/**
+ * @brief Appends a byte to the buffer
+ * 
+ * @param tf trace file instance
+ * @param v byte to write
+ */
+static void LC3TraceFilePut8(LC3TraceFile_t *tf, uint8_t v)
+{
+    if (tf->used == TRACE_FILE_BUFFER)
+    {
+        LC3TraceFileFlush(tf);
+    }
+    tf->buffer[tf->used++] = v;
+}
+
+/**
+ * @brief Appends a little endian word to the buffer
+ * 
+ * @param tf trace file instance
+ * @param v word to write
+ */
+static void LC3TraceFilePut16(LC3TraceFile_t *tf, uint16_t v)
+{
+    LC3TraceFilePut8(tf, v & 0xFF);
+    LC3TraceFilePut8(tf, v >> 8);
+}
+
+/**
+ * @brief Appends a signed 16 bits difference as zigzag varint, small
+ * differences take one byte
+ * 
+ * @param tf trace file instance
+ * @param delta difference to write
+ */
+static void LC3TraceFilePutDelta(LC3TraceFile_t *tf, uint16_t delta)
+{
+    int16_t d = (int16_t)delta;
+    uint32_t z = ((uint32_t)d << 1) ^ (uint32_t)(d >> 15);
+    z &= 0x1FFFF;
+    while (z >= 0x80)
+    {
+        LC3TraceFilePut8(tf, (z & 0x7F) | 0x80);
+        z >>= 7;
+    }
+    LC3TraceFilePut8(tf, z);
+}
+
+/**
+ * @brief Reads a byte from the file
+ * 
+ * @param tf trace file instance
+ * @param v output byte
+ * @return uint8_t 1 if the byte was read, 0 at end of file
+ */
+static uint8_t LC3TraceFileGet8(LC3TraceFile_t *tf, uint8_t *v)
+{
+    if (tf->used == tf->length)
+    {
+        tf->length = fread(tf->buffer, 1U, TRACE_FILE_BUFFER, tf->f);
+        tf->used = 0;
+        if (!tf->length)
+        {
+            return 0;
+        }
+    }
+    *v = tf->buffer[tf->used++];
+    return 1;
+}
+
+/**
+ * @brief Reads a little endian word from the file
+ * 
+ * @param tf trace file instance
+ * @param v output word
+ * @return uint8_t 1 if the word was read, 0 at end of file
+ */
+static uint8_t LC3TraceFileGet16(LC3TraceFile_t *tf, uint16_t *v)
+{
+    uint8_t lo, hi;
+    if (!LC3TraceFileGet8(tf, &lo) || !LC3TraceFileGet8(tf, &hi))
+    {
+        return 0;
+    }
+    *v = lo | (hi << 8);
+    return 1;
+}
+
+/**
+ * @brief Reads a zigzag varint difference
+ * 
+ * @param tf trace file instance
+ * @param delta output difference
+ * @return uint8_t 1 if the difference was read, 0 at end of file
+ */
+static uint8_t LC3TraceFileGetDelta(LC3TraceFile_t *tf, uint16_t *delta)
+{
+    uint32_t z = 0;
+    uint8_t v;
+    for (uint8_t shift = 0; shift < 21; shift += 7)
+    {
+        if (!LC3TraceFileGet8(tf, &v))
+        {
+            return 0;
+        }
+        z |= (uint32_t)(v & 0x7F) << shift;
+        if (!(v & 0x80))
+        {
+            break;
+        }
+    }
+    *delta = (uint16_t)((z >> 1) ^ -(z & 1));
+    return 1;
+}
+
+LC3TraceFile_t *LC3TraceFileCreate(const char *filename, const uint16_t *regs)
+{
+    LC3TraceFile_t *tf = calloc(1U, sizeof(LC3TraceFile_t));
+    if (!tf)
+    {
+        return NULL;
+    }
+    tf->f = fopen(filename, "wb");
+    if (!tf->f)
+    {
+        free(tf);
+        return NULL;
+    }
+    tf->live = regs;
+    memcpy(tf->buffer, TRACE_FILE_MAGIC, 4U);
+    tf->used = 4U;
+    LC3TraceFilePut16(tf, TRACE_FILE_VERSION);
+    LC3TraceFilePut16(tf, TRACE_FILE_REGS);
+    for (uint8_t r = 0; r < TRACE_FILE_REGS; r++)
+    {
+        tf->regs[r] = regs[r];
+        LC3TraceFilePut16(tf, regs[r]);
+    }
+    return tf;
+}
+
+void LC3TraceFileWrite(LC3TraceFile_t *tf, const LC3TraceRecord_t *rec)
+{
+    uint8_t changed[TRACE_FILE_REGS];
+    uint8_t count = 0;
+    uint8_t opcode = rec->word >> 12;
+    uint8_t tag = 0;
+    uint16_t rel = rec->pc - tf->pc - 1U;
+
+    if (!tf->records)
+    {
+        tag = TRACE_PC_ABS;
+    }
+    else if (rel == 0)
+    {
+        tag = TRACE_PC_NEXT;
+    }
+    else if ((int16_t)rel >= INT8_MIN && (int16_t)rel <= INT8_MAX)
+    {
+        tag = TRACE_PC_REL8;
+    }
+    else
+    {
+        tag = TRACE_PC_ABS;
+    }
+    if (tf->words[rec->pc] != (0x10000U | rec->word))
+    {
+        tag |= TRACE_TAG_WORD;
+    }
+    for (uint8_t r = 0; r < TRACE_FILE_REGS; r++)
+    {
+        if (tf->live[r] != tf->regs[r])
+        {
+            changed[count++] = r;
+        }
+    }
+    tag |= count << TRACE_TAG_REGS_SHIFT;
+    if (opcode == OP_ST || opcode == OP_STR || opcode == OP_STI)
+    {
+        tag |= TRACE_TAG_MEM;
+    }
+
+    LC3TraceFilePut8(tf, tag);
+    if ((tag & TRACE_PC_MASK) == TRACE_PC_REL8)
+    {
+        LC3TraceFilePut8(tf, rel & 0xFF);
+    }
+    else if ((tag & TRACE_PC_MASK) == TRACE_PC_ABS)
+    {
+        LC3TraceFilePut16(tf, rec->pc);
+    }
+    if (tag & TRACE_TAG_WORD)
+    {
+        LC3TraceFilePut16(tf, rec->word);
+        tf->words[rec->pc] = 0x10000U | rec->word;
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint8_t r = changed[i];
+        LC3TraceFilePut8(tf, r);
+        LC3TraceFilePutDelta(tf, tf->live[r] - tf->regs[r]);
+        tf->regs[r] = tf->live[r];
+    }
+    if (tag & TRACE_TAG_MEM)
+    {
+        LC3TraceFilePutDelta(tf, rec->addr - tf->memAddr);
+        LC3TraceFilePut16(tf, rec->value);
+        tf->memAddr = rec->addr;
+    }
+    tf->pc = rec->pc;
+    tf->records++;
+}
+
+LC3TraceFile_t *LC3TraceFileOpen(const char *filename)
+{
+    char magic[4];
+    uint16_t version, regs;
+    LC3TraceFile_t *tf = calloc(1U, sizeof(LC3TraceFile_t));
+    if (!tf)
+    {
+        return NULL;
+    }
+    tf->f = fopen(filename, "rb");
+    if (!tf->f)
+    {
+        free(tf);
+        return NULL;
+    }
+    if (fread(magic, 1U, 4U, tf->f) != 4U || memcmp(magic, TRACE_FILE_MAGIC, 4U) != 0 ||
+        !LC3TraceFileGet16(tf, &version) || version != TRACE_FILE_VERSION ||
+        !LC3TraceFileGet16(tf, &regs) || regs != TRACE_FILE_REGS)
+    {
+        LC3TraceFileClose(tf);
+        return NULL;
+    }
+    for (uint8_t r = 0; r < TRACE_FILE_REGS; r++)
+    {
+        if (!LC3TraceFileGet16(tf, &tf->regs[r]))
+        {
+            LC3TraceFileClose(tf);
+            return NULL;
+        }
+    }
+    return tf;
+}
+
+uint8_t LC3TraceFileRead(LC3TraceFile_t *tf, LC3TraceFileEntry_t *entry)
+{
+    uint8_t tag, rel, r;
+    uint16_t v;
+    if (!LC3TraceFileGet8(tf, &tag))
+    {
+        return 0;
+    }
+    switch (tag & TRACE_PC_MASK)
+    {
+    case TRACE_PC_NEXT:
+        entry->pc = tf->pc + 1U;
+        break;
+    case TRACE_PC_REL8:
+        if (!LC3TraceFileGet8(tf, &rel))
+        {
+            return 0;
+        }
+        entry->pc = tf->pc + 1U + (int8_t)rel;
+        break;
+    default:
+        if (!LC3TraceFileGet16(tf, &entry->pc))
+        {
+            return 0;
+        }
+        break;
+    }
+    if (tag & TRACE_TAG_WORD)
+    {
+        if (!LC3TraceFileGet16(tf, &v))
+        {
+            return 0;
+        }
+        tf->words[entry->pc] = 0x10000U | v;
+    }
+    entry->word = tf->words[entry->pc] & 0xFFFF;
+    entry->regCount = (tag & TRACE_TAG_REGS_MASK) >> TRACE_TAG_REGS_SHIFT;
+    if (entry->regCount > TRACE_FILE_REGS)
+    {
+        return 0;
+    }
+    for (uint8_t i = 0; i < entry->regCount; i++)
+    {
+        if (!LC3TraceFileGet8(tf, &r) || r >= TRACE_FILE_REGS || !LC3TraceFileGetDelta(tf, &v))
+        {
+            return 0;
+        }
+        tf->regs[r] += v;
+        entry->reg[i] = r;
+        entry->regValue[i] = tf->regs[r];
+    }
+    entry->memWrite = (tag & TRACE_TAG_MEM) != 0;
+    if (entry->memWrite)
+    {
+        if (!LC3TraceFileGetDelta(tf, &v) || !LC3TraceFileGet16(tf, &entry->memValue))
+        {
+            return 0;
+        }
+        tf->memAddr += v;
+        entry->memAddr = tf->memAddr;
+    }
+    tf->pc = entry->pc;
+    tf->records++;
+    return 1;
+}
+
+void LC3TraceFileClose(LC3TraceFile_t *tf)
+{
+    if (!tf)
+    {
+        return;
+    }
+    if (tf->live && tf->used)
+    {
+        LC3TraceFileFlush(tf);
+    }
+    fclose(tf->f);
+    free(tf);
+}
@@ -0,0 +1,227 @@
+/**
+ * @file tracefile.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Compact binary trace file, written by the tracer and read by lc3trace
+ * 
+ * File layout (all the words are little endian):
+ * 
+ *   Header: "LC3T" | version (u16) | register count (u16) | R0...R7 (u16 each)
+ * 
+ *   Record: tag (u8) | pc | word | register deltas | memory write
+ * 
+ *   tag bits 0-1: how the pc is encoded
+ *       TRACE_PC_NEXT  nothing follows, pc = previous pc + 1
+ *       TRACE_PC_REL8  int8 follows, pc = previous pc + 1 + value
+ *       TRACE_PC_ABS   u16 follows with the pc
+ *   tag bit 2: u16 instruction word follows, only when the word at this pc
+ *       was never written before or it changed (self modifying code)
+ *   tag bits 3-6: count of register deltas that follows, up to every
+ *       register, each one is the register index (u8) and the zigzag varint
+ *       of (new - old) value
+ *   tag bit 7: memory write follows, zigzag varint of (address - previous
+ *       written address) and the u16 written value
+ * 
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__TRACEFILE_H__)
+#define __TRACEFILE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "trace.h"
+
+/**
+ * @brief File signature
+ * 
+ */
+#define TRACE_FILE_MAGIC "LC3T"
+
+/**
+ * @brief Current version of the format, readers refuse other versions
+ * 
+ */
+#define TRACE_FILE_VERSION 2
+
+/**
+ * @brief Registers stored in the header and tracked by deltas
+ * 
+ */
+#define TRACE_FILE_REGS 8
+
+/**
+ * @brief Bytes buffered before writing them to the file
+ * 
+ */
+#define TRACE_FILE_BUFFER 0x10000
+
+/**
+ * @brief Record tag fields
+ * 
+ */
+typedef enum
+{
+    TRACE_PC_NEXT = 0,
+    TRACE_PC_REL8 = 1,
+    TRACE_PC_ABS = 2,
+    TRACE_PC_MASK = 0x3,
+    TRACE_TAG_WORD = 1 << 2,
+    TRACE_TAG_REGS_SHIFT = 3,
+    TRACE_TAG_REGS_MASK = 0xF << 3,
+    TRACE_TAG_MEM = 1 << 7,
+} Lc3TraceFileTags_e;
+
+/**
+ * @brief State of the encoder/decoder, both sides keep the same state so
+ * only the differences are stored
+ * 
+ */
+typedef struct LC3TraceFile_t
+{
+    /**
+     * @brief file pointer
+     * 
+     */
+    FILE *f;
+    /**
+     * @brief registers of the cpu being traced, NULL when reading
+     * 
+     */
+    const uint16_t *live;
+    /**
+     * @brief records written or read, the first one has absolute pc
+     * 
+     */
+    uint64_t records;
+    /**
+     * @brief pc of the last record
+     * 
+     */
+    uint16_t pc;
+    /**
+     * @brief address of the last memory write
+     * 
+     */
+    uint16_t memAddr;
+    /**
+     * @brief registers value after the last record
+     * 
+     */
+    uint16_t regs[TRACE_FILE_REGS];
+    /**
+     * @brief last word seen at each pc, bit 16 is set when it's known
+     * 
+     */
+    uint32_t words[UINT16_MAX + 1];
+    /**
+     * @brief bytes used of the buffer when writing, or read position
+     * 
+     */
+    uint32_t used;
+    /**
+     * @brief bytes available in the buffer when reading
+     * 
+     */
+    uint32_t length;
+    /**
+     * @brief io buffer
+     * 
+     */
+    uint8_t buffer[TRACE_FILE_BUFFER];
+} LC3TraceFile_t;
+
+/**
+ * @brief Entry decoded from a trace file
+ * 
+ */
+typedef struct LC3TraceFileEntry_t
+{
+    /**
+     * @brief address of the instruction
+     * 
+     */
+    uint16_t pc;
+    /**
+     * @brief instruction word
+     * 
+     */
+    uint16_t word;
+    /**
+     * @brief count of registers written
+     * 
+     */
+    uint8_t regCount;
+    /**
+     * @brief index of the registers written
+     * 
+     */
+    uint8_t reg[TRACE_FILE_REGS];
+    /**
+     * @brief value of the registers written
+     * 
+     */
+    uint16_t regValue[TRACE_FILE_REGS];
+    /**
+     * @brief 1 if the instruction wrote the memory
+     * 
+     */
+    uint8_t memWrite;
+    /**
+     * @brief written address
+     * 
+     */
+    uint16_t memAddr;
+    /**
+     * @brief written value
+     * 
+     */
+    uint16_t memValue;
+} LC3TraceFileEntry_t;
+
+/**
+ * @brief Creates a trace file and writes the header
+ * 
+ * @param filename path/filename of the trace file
+ * @param regs registers of the cpu, read after every instruction
+ * @return LC3TraceFile_t* NULL if the file can't be created
+ */
+LC3TraceFile_t *LC3TraceFileCreate(const char *filename, const uint16_t *regs);
+
+/**
+ * @brief Encodes a completed instruction, registers are compared with the
+ * values after the previous one
+ * 
+ * @param tf trace file instance
+ * @param rec record of the instruction
+ */
+void LC3TraceFileWrite(LC3TraceFile_t *tf, const LC3TraceRecord_t *rec);
+
+/**
+ * @brief Opens a trace file and checks the header
+ * 
+ * @param filename path/filename of the trace file
+ * @return LC3TraceFile_t* NULL if the file can't be read or it's not valid
+ */
+LC3TraceFile_t *LC3TraceFileOpen(const char *filename);
+
+/**
+ * @brief Decodes the next entry
+ * 
+ * @param tf trace file instance
+ * @param entry output entry
+ * @return uint8_t 1 if an entry was read, 0 at end of file
+ */
+uint8_t LC3TraceFileRead(LC3TraceFile_t *tf, LC3TraceFileEntry_t *entry);
+
+/**
+ * @brief Writes the pending bytes and closes the file
+ * 
+ * @param tf trace file instance
+ */
+void LC3TraceFileClose(LC3TraceFile_t *tf);
+
+#endif  // __TRACEFILE_H__
@@ -1,10 +1,32 @@
 #include "utils.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 uint16_t swap_16(uint16_t v)
 {
     return (v << 8) | (v >> 8);
 }
 
+void swap_16_block(uint16_t *dst, const void *src, size_t count)
+{
+    const uint8_t *in = src;
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 8U <= count; i += 8U)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i * 2U));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        dst[i] = (in[i * 2U] << 8) | in[i * 2U + 1U];
+    }
+}
+
 uint16_t sign_extend(uint16_t x, int bit_count)
 {
     if ((x >> (bit_count - 1)) & 1)
@@ -11,6 +11,7 @@
 #if !defined(__UTILS_H__)
 #define __UTILS_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -24,6 +25,16 @@
  */
 extern uint16_t swap_16(uint16_t v);
 
+/**
+ * @brief Swaps a block of big endian words, 8 words at once when the host
+ * has SSE2. The source doesn't need to be aligned.
+ * 
+ * @param dst output words
+ * @param src input words, can be the same than dst
+ * @param count count of words
+ */
+extern void swap_16_block(uint16_t *dst, const void *src, size_t count);
+
 /**
  * @brief Is the operation, in computer arithmetic, of increasing the number of
  * bits of a binary number while preserving the number's sign (positive/negative) and value
@@ -0,0 +1,255 @@
+#include "vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "assembler.h"
+#include "jit.h"
+#include "log.h"
+
+/**
+ * @brief Checks if a file is an assembler source by their extension
+ * 
+ * @param filename path/filename of the program
+ * @return uint8_t 1 if it ends with .asm
+ */
+static uint8_t LC3VmIsSource(const char *filename)
+{
+    size_t length = strlen(filename);
+    return length > 4U && strcasecmp(filename + length - 4U, ".asm") == 0;
+}
+
+/**
+ * @brief Attaches the console and the cpu to a vm with a loaded program
+ * 
+ * @param vm vm instance
+ * @param in stream read by the keyboard
+ * @param out stream written by the display
+ * @param options settings of the vm
+ * @return LC3Vm_t* the vm instance
+ */
+static LC3Vm_t *LC3VmStart(LC3Vm_t *vm, FILE *in, FILE *out, const LC3VmOptions_t *options)
+{
+    if (!options->headless)
+    {
+        dumpFirmware(&vm->firmware);
+    }
+    vm->console.flush = options->flush;
+    vm->console.headless = options->headless;
+    vm->console.notify = &vm->cpu.pending;
+    OSKeyboardInit(&vm->console, in, out);
+    LC3CpuInit(&vm->cpu, &vm->firmware, &vm->console);
+    vm->cpu.stat.limited = (options->maxInstructions || options->timeLimit > 0);
+    // Superinstructions retire many instructions at once, limited runs count them one by one
+    vm->cpu.stat.fusion = options->fusion && !vm->cpu.stat.limited;
+    // Sleeping in a polling loop would stop counting the time of limited runs
+    vm->cpu.stat.idle = !vm->cpu.stat.limited;
+    vm->cpu.stats = options->stats ? &vm->stats : NULL;
+    return vm;
+}
+
+/**
+ * @brief Assembles a source file into the firmware of a vm
+ * 
+ * @param filename path/filename of the source
+ * @param firmware firmware that receives the program
+ * @return uint8_t EXIT_FAILURE if the source has errors, they are reported
+ * on stderr
+ */
+static uint8_t LC3VmAssemble(const char *filename, LC3Firmware_t *firmware)
+{
+    LC3Asm_t as;
+    uint8_t status = LC3AsmAssembleFile(&as, filename, firmware);
+    if (status)
+    {
+        fprintf(stderr, "%s:%u: %s\n", filename, as.errorLine, as.error);
+    }
+    LC3AsmFree(&as);
+    return status;
+}
+
+uint8_t LC3VmLoad(const char *filename, LC3Firmware_t *firmware, const LC3VmOptions_t *options)
+{
+    if (LC3VmIsSource(filename))
+    {
+        return LC3VmAssemble(filename, firmware);
+    }
+    return options->imageCache ? loadFirmwareCached(filename, firmware) : loadFirmwareFromFile(filename, firmware);
+}
+
+LC3Vm_t *LC3VmCreate(const char *filename, FILE *in, FILE *out, const LC3VmOptions_t *options)
+{
+    LC3Vm_t *vm = calloc(1U, sizeof(LC3Vm_t));
+    if (!vm)
+    {
+        return NULL;
+    }
+    vm->options = *options;
+    initFirmware(&vm->firmware);
+    if (LC3VmLoad(filename, &vm->firmware, options))
+    {
+        releaseFirmware(&vm->firmware);
+        free(vm);
+        return NULL;
+    }
+    return LC3VmStart(vm, in, out, options);
+}
+
+LC3Vm_t *LC3VmCreateFromSource(const char *source, size_t length, FILE *in, FILE *out, const LC3VmOptions_t *options)
+{
+    LC3Vm_t *vm = calloc(1U, sizeof(LC3Vm_t));
+    if (!vm)
+    {
+        return NULL;
+    }
+    vm->options = *options;
+    initFirmware(&vm->firmware);
+    LC3Asm_t as;
+    uint8_t status = LC3AsmAssemble(&as, source, length, &vm->firmware);
+    if (status)
+    {
+        LOG_WARN("Assembler error at line %u: %s", as.errorLine, as.error);
+    }
+    LC3AsmFree(&as);
+    if (status)
+    {
+        releaseFirmware(&vm->firmware);
+        free(vm);
+        return NULL;
+    }
+    vm->firmware.filename = "<source>";
+    return LC3VmStart(vm, in, out, options);
+}
+
+LC3Vm_t *LC3VmCreateFromImage(const LC3Firmware_t *image, FILE *in, FILE *out, const LC3VmOptions_t *options)
+{
+    LC3Vm_t *vm = calloc(1U, sizeof(LC3Vm_t));
+    if (!vm)
+    {
+        return NULL;
+    }
+    vm->options = *options;
+    initFirmware(&vm->firmware);
+    vm->firmware.filename = image->filename;
+    vm->firmware.size = image->size;
+    vm->firmware.isLoaded = image->isLoaded;
+    vm->firmware.memOrig = image->memOrig;
+    LC3MemoryShare(&vm->firmware.memory, &image->memory);
+    return LC3VmStart(vm, in, out, options);
+}
+
+/**
+ * @brief Runs the engine in slices of instructions until the cpu stops or a
+ * limit is reached
+ * 
+ * @param vm vm instance
+ */
+static void LC3VmRunLimited(LC3Vm_t *vm)
+{
+    const LC3VmOptions_t *options = &vm->options;
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    while (vm->cpu.stat.running)
+    {
+        int64_t slice = vm->cpu.replay ? REPLAY_SLICE_INSTRUCTIONS : VM_SLICE_INSTRUCTIONS;
+        if (options->maxInstructions && options->maxInstructions - vm->instructions < (uint64_t)slice)
+        {
+            slice = options->maxInstructions - vm->instructions;
+        }
+        if (!slice)
+        {
+            LOG_LN("Stopped after %llu instructions", (unsigned long long)vm->instructions);
+            vm->stop = VM_STOP_INSTRUCTIONS;
+            return;
+        }
+        // The keys are seen at the first boundary of the slice
+        if (vm->cpu.replay && LC3ReplayArrive(vm->cpu.replay, &vm->console, vm->instructions))
+        {
+            LC3CpuRequestInterrupt(&vm->cpu);
+        }
+        vm->cpu.budget = slice;
+        LC3Engines[options->engine].execute(&vm->cpu);
+        vm->instructions += slice - vm->cpu.budget;
+        struct timespec now;
+        timespec_get(&now, TIME_UTC);
+        double elapsed = (double)(now.tv_sec - start.tv_sec) + (double)(now.tv_nsec - start.tv_nsec) / 1e9;
+        if (options->timeLimit > 0 && elapsed >= options->timeLimit && vm->cpu.stat.running)
+        {
+            LOG_LN("Stopped after %.3f seconds", elapsed);
+            vm->stop = VM_STOP_TIMEOUT;
+            return;
+        }
+    }
+}
+
+void LC3VmSetReplay(LC3Vm_t *vm, LC3Replay_t *replay)
+{
+    vm->cpu.replay = replay;
+    vm->cpu.stat.limited = 0b1;
+    vm->cpu.stat.fusion = 0b0;
+    vm->cpu.stat.idle = 0b0;
+}
+
+void LC3VmRun(LC3Vm_t *vm)
+{
+    LOG_LN("Running %s engine", LC3Engines[vm->options.engine].name);
+    if (vm->cpu.stats)
+    {
+        LC3StatsStart(vm->cpu.stats);
+    }
+    vm->stop = VM_STOP_HALT;
+    vm->instructions = 0;
+    if (vm->cpu.stat.limited)
+    {
+        LC3VmRunLimited(vm);
+    }
+    else
+    {
+        LC3Engines[vm->options.engine].execute(&vm->cpu);
+    }
+    if (vm->cpu.stats)
+    {
+        LC3StatsStop(vm->cpu.stats);
+    }
+}
+
+int LC3VmExitCode(const LC3Vm_t *vm)
+{
+    switch (vm->stop)
+    {
+    case VM_STOP_INSTRUCTIONS:
+        return VM_EXIT_INSTRUCTIONS;
+    case VM_STOP_TIMEOUT:
+        return VM_EXIT_TIMEOUT;
+    default:
+        return vm->cpu.regs[REG_R0] & 0xFF;
+    }
+}
+
+int LC3VmExitStatus(const LC3Vm_t *vm)
+{
+    // Interactive runs stopped by the guest keep exiting with success
+    if (vm->options.headless || vm->stop != VM_STOP_HALT)
+    {
+        return LC3VmExitCode(vm);
+    }
+    return EXIT_SUCCESS;
+}
+
+void LC3VmDestroy(LC3Vm_t *vm)
+{
+    if (!vm)
+    {
+        return;
+    }
+    uint32_t owned;
+    uint32_t pages = LC3MemoryCountPages(&vm->firmware.memory, &owned);
+    LOG_LN("Memory of %u pages, %u of them not shared", pages, owned);
+    LC3TraceEnd(&vm->cpu.trace);
+    LC3JitDestroy(vm->cpu.jit);
+    OSKeyboardEnd(&vm->console);
+    releaseFirmware(&vm->firmware);
+    free(vm);
+}
@@ -0,0 +1,241 @@
+/**
+ * @file vm.h
+ * @author Daniel Polanco (jdanypa@gmail.com)
+ * @brief Virtual machine instance, owns all the state needed to run a program
+ * so many instances can run at the same time in different threads
+ * @version 1.0
+ * @date 2021-01-27
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#if !defined(__VM_H__)
+#define __VM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "console.h"
+#include "cpu.h"
+#include "firmware.h"
+#include "replay.h"
+
+/**
+ * @brief Settings of a virtual machine, chosen when it's created
+ * 
+ */
+typedef struct LC3VmOptions_t
+{
+    /**
+     * @brief Lc3Engines_e that runs the program
+     * 
+     */
+    uint8_t engine;
+    /**
+     * @brief flag indicating if superinstructions are enabled
+     * 
+     */
+    uint8_t fusion;
+    /**
+     * @brief flag indicating if the program is loaded through their native
+     * image, see loadFirmwareCached
+     * 
+     */
+    uint8_t imageCache;
+    /**
+     * @brief Lc3DisplayFlush_e policy of the guest output
+     * 
+     */
+    uint8_t flush;
+    /**
+     * @brief flag indicating if execution statistics are counted
+     * 
+     */
+    uint8_t stats;
+    /**
+     * @brief flag indicating if the vm runs without terminal, it doesn't
+     * take the terminal even if the keyboard is stdin and doesn't dump the
+     * firmware to the log
+     * 
+     */
+    uint8_t headless;
+    /**
+     * @brief max instructions of a run, 0 without limit
+     * 
+     */
+    uint64_t maxInstructions;
+    /**
+     * @brief max wall time of a run in seconds, 0 without limit
+     * 
+     */
+    double timeLimit;
+} LC3VmOptions_t;
+
+/**
+ * @brief Reasons of the end of a run
+ * 
+ */
+typedef enum
+{
+    VM_STOP_HALT,          // The guest stopped the cpu
+    VM_STOP_INSTRUCTIONS,  // The run reached maxInstructions
+    VM_STOP_TIMEOUT,       // The run reached timeLimit
+    VM_STOP_COUNT
+} Lc3VmStop_e;
+
+/**
+ * @brief Process exit codes of the runs stopped by a limit, the runs
+ * stopped by the guest exit with the low byte of R0
+ * 
+ */
+#define VM_EXIT_INSTRUCTIONS 125
+#define VM_EXIT_TIMEOUT 124
+
+/**
+ * @brief Instructions run between two checks of the limits
+ * 
+ */
+#define VM_SLICE_INSTRUCTIONS (1 << 20)
+
+/**
+ * @brief State of a virtual machine
+ * 
+ */
+typedef struct LC3Vm_t
+{
+    /**
+     * @brief settings given at creation
+     * 
+     */
+    LC3VmOptions_t options;
+    /**
+     * @brief memory and decoded instructions
+     * 
+     */
+    LC3Firmware_t firmware;
+    /**
+     * @brief keyboard and display
+     * 
+     */
+    LC3Console_t console;
+    /**
+     * @brief cpu attached to firmware and console
+     * 
+     */
+    LC3Cpu_t cpu;
+    /**
+     * @brief statistics of the last run, used if the options ask for them
+     * 
+     */
+    LC3Stats_t stats;
+    /**
+     * @brief Lc3VmStop_e reason of the end of the last run
+     * 
+     */
+    uint8_t stop;
+    /**
+     * @brief instructions of the last run, only counted if it's limited
+     * 
+     */
+    uint64_t instructions;
+} LC3Vm_t;
+
+/**
+ * @brief Allocates a vm and loads an objfile on it, files ending with .asm
+ * are assembled and their errors reported on stderr
+ * 
+ * @param filename path/filename to the objfile or source
+ * @param in stream read by the keyboard, stdin takes the terminal
+ * @param out stream written by the display
+ * @param options settings of the vm
+ * @return LC3Vm_t* NULL if the objfile can't be loaded
+ */
+LC3Vm_t *LC3VmCreate(const char *filename, FILE *in, FILE *out, const LC3VmOptions_t *options);
+
+/**
+ * @brief Allocates a vm and assembles a program on it, so generated programs
+ * don't need a file
+ * 
+ * @param source text of the program
+ * @param length length of the source in bytes
+ * @param in stream read by the keyboard, stdin takes the terminal
+ * @param out stream written by the display
+ * @param options settings of the vm
+ * @return LC3Vm_t* NULL if the source has errors
+ */
+LC3Vm_t *LC3VmCreateFromSource(const char *source, size_t length, FILE *in, FILE *out, const LC3VmOptions_t *options);
+
+/**
+ * @brief Loads an objfile into an empty firmware the same way LC3VmCreate
+ * does, so it can be used as image of many vms
+ * 
+ * @param filename path/filename to the objfile or source
+ * @param firmware firmware prepared by initFirmware
+ * @param options settings of the vms, chooses the native image cache
+ * @return uint8_t EXIT_FAILURE if the objfile can't be loaded
+ */
+uint8_t LC3VmLoad(const char *filename, LC3Firmware_t *firmware, const LC3VmOptions_t *options);
+
+/**
+ * @brief Allocates a vm that shares the memory pages of a loaded firmware,
+ * every vm copies a page when it writes it first, so many vms can start from
+ * the same image without reading it again and only own what they write
+ * 
+ * @param image loaded firmware, their decoded instructions are not shared.
+ * It can be released or written once the vm exists, not while vms are being
+ * created from it
+ * @param in stream read by the keyboard, stdin takes the terminal
+ * @param out stream written by the display
+ * @param options settings of the vm
+ * @return LC3Vm_t* NULL if it can't be allocated
+ */
+LC3Vm_t *LC3VmCreateFromImage(const LC3Firmware_t *image, FILE *in, FILE *out, const LC3VmOptions_t *options);
+
+/**
+ * @brief Records or replays the keyboard input of the vm. Their runs are
+ * limited runs in slices of REPLAY_SLICE_INSTRUCTIONS and the keys arrive
+ * between the slices, so a replay with the engine that recorded it retires
+ * the same instructions. Other engines take the interrupts at their own
+ * block boundaries.
+ * @param vm vm instance, not run yet
+ * @param replay opened replay, it must live while the vm runs
+ */
+void LC3VmSetReplay(LC3Vm_t *vm, LC3Replay_t *replay);
+
+/**
+ * @brief Runs the vm with the engine of their options until the cpu stops or
+ * a limit is reached, counting the statistics of the run if the options ask
+ * for them
+ * 
+ * @param vm vm instance
+ */
+void LC3VmRun(LC3Vm_t *vm);
+
+/**
+ * @brief Process exit code of the last run, the low byte of R0 if the guest
+ * stopped, VM_EXIT_INSTRUCTIONS or VM_EXIT_TIMEOUT if a limit stopped it
+ * 
+ * @param vm vm instance
+ * @return int exit code
+ */
+int LC3VmExitCode(const LC3Vm_t *vm);
+
+/**
+ * @brief Process exit status of the last run: headless runs and runs stopped
+ * by a limit exit with LC3VmExitCode, interactive runs halted by the guest
+ * exit with success
+ * 
+ * @param vm vm instance
+ * @return int exit status
+ */
+int LC3VmExitStatus(const LC3Vm_t *vm);
+
+/**
+ * @brief Releases the vm, the tracer and the jit, and restores the terminal
+ * 
+ * @param vm vm instance
+ */
+void LC3VmDestroy(LC3Vm_t *vm);
+
+#endif  // __VM_H__